@@ -4,7 +4,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <netdb.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <event.h>
 #include "buffered_socket.h"
 
@@ -14,10 +15,28 @@
 #define _DEBUG(...) do {;} while (0)
 #endif
 
+// iovecs handed to one writev()
+#define BS_IOV_MAX 64
+// how long to give each address before racing the next one (RFC 8305)
+#define BS_CONNECT_STAGGER_MS 250
+// to connect to any of them
+#define BS_CONNECT_TIMEOUT 2
+
 static void buffered_socket_readcb(struct bufferevent *bev, void *arg);
 static void buffered_socket_writecb(struct bufferevent *bev, void *arg);
 static void buffered_socket_errorcb(struct bufferevent *bev, short what, void *arg);
-static void buffered_socket_connectcb(int fd, short what, void *arg);
+static void buffered_socket_resolvedcb(struct simplehttp_addrs *addrs, void *arg);
+static void buffered_socket_start_attempt(struct BufferedSocket *buffsock);
+static void buffered_socket_attemptcb(int fd, short what, void *arg);
+static void buffered_socket_staggercb(int fd, short what, void *arg);
+static void buffered_socket_connect_timeoutcb(int fd, short what, void *arg);
+static void buffered_socket_connect_failed(struct BufferedSocket *buffsock);
+static void buffered_socket_cancel_attempts(struct BufferedSocket *buffsock);
+static void buffered_socket_connected(struct BufferedSocket *buffsock);
+static void buffered_socket_flush_writes(struct BufferedSocket *buffsock);
+static void buffered_socket_check_watermarks(struct BufferedSocket *buffsock);
+static void buffered_socket_release_writes(struct BufferedSocket *buffsock, struct BufferedSocketWrite *done);
+static void buffered_socket_write_evcb(int fd, short what, void *arg);
 
 struct BufferedSocket *new_buffered_socket(const char *address, int port,
         void (*connect_callback)(struct BufferedSocket *buffsock, void *arg),
@@ -28,8 +47,9 @@ struct BufferedSocket *new_buffered_socket(const char *address, int port,
         void *cbarg)
 {
     struct BufferedSocket *buffsock;
+    int i;
     
-    buffsock = malloc(sizeof(struct BufferedSocket));
+    buffsock = calloc(1, sizeof(struct BufferedSocket));
     buffsock->address = strdup(address);
     buffsock->port = port;
     buffsock->bev = NULL;
@@ -41,6 +61,9 @@ struct BufferedSocket *new_buffered_socket(const char *address, int port,
     buffsock->write_callback = write_callback;
     buffsock->error_callback = error_callback;
     buffsock->cbarg = cbarg;
+    for (i = 0; i < SIMPLEHTTP_RESOLVE_MAX_ADDRS; i++) {
+        buffsock->attempt_fds[i] = -1;
+    }
     
     return buffsock;
 }
@@ -54,85 +77,186 @@ void free_buffered_socket(struct BufferedSocket *buffsock)
     }
 }
 
+/*
+ * resolves the address without blocking (simplehttp_resolve(), cached for
+ * the record's TTL) then races a connect() per address, IPv6 first, starting
+ * the next one BS_CONNECT_STAGGER_MS after the last or as soon as it fails.
+ * the first to connect wins. if none has in BS_CONNECT_TIMEOUT seconds
+ * close_callback is called. returns 0, or -1 if already connected/connecting
+ */
 int buffered_socket_connect(struct BufferedSocket *buffsock)
 {
-    struct addrinfo ai, *aitop;
-    char strport[32];
-    struct sockaddr *sa;
-    int slen;
+    struct timeval tv = { BS_CONNECT_TIMEOUT, 0 };
     
     if ((buffsock->state == BS_CONNECTED) || (buffsock->state == BS_CONNECTING)) {
-        return 0;
-    }
-    
-    memset(&ai, 0, sizeof(struct addrinfo));
-    ai.ai_family = AF_INET;
-    ai.ai_socktype = SOCK_STREAM;
-    snprintf(strport, sizeof(strport), "%d", buffsock->port);
-    if (getaddrinfo(buffsock->address, strport, &ai, &aitop) != 0) {
-        _DEBUG("%s: getaddrinfo() failed\n", __FUNCTION__);
         return -1;
     }
-    sa = aitop->ai_addr;
-    slen = aitop->ai_addrlen;
     
-    if ((buffsock->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        _DEBUG("%s: socket() failed\n", __FUNCTION__);
-        return -1;
-    }
+    buffsock->state = BS_CONNECTING;
+    buffsock->attempts = 0;
+    buffsock->attempts_failed = 0;
+    buffsock->addrs.count = 0;
+    evtimer_set(&buffsock->conn_ev, buffered_socket_connect_timeoutcb, buffsock);
+    evtimer_add(&buffsock->conn_ev, &tv);
     
-    if (evutil_make_socket_nonblocking(buffsock->fd) == -1) {
-        close(buffsock->fd);
-        _DEBUG("%s: evutil_make_socket_nonblocking() failed\n");
-        return -1;
+    simplehttp_resolve(buffsock->address, buffered_socket_resolvedcb, buffsock);
+    
+    return 0;
+}
+
+static void buffered_socket_resolvedcb(struct simplehttp_addrs *addrs, void *arg)
+{
+    struct BufferedSocket *buffsock = (struct BufferedSocket *)arg;
+    int i;
+    
+    if (!addrs->count) {
+        _DEBUG("%s: failed to resolve \"%s\"\n", __FUNCTION__, buffsock->address);
+        buffered_socket_connect_failed(buffsock);
+        return;
     }
     
-    if (connect(buffsock->fd, sa, slen) == -1) {
-        if (errno != EINPROGRESS) {
-            close(buffsock->fd);
-            _DEBUG("%s: connect() failed\n");
-            return -1;
+    memcpy(&buffsock->addrs, addrs, sizeof(struct simplehttp_addrs));
+    for (i = 0; i < buffsock->addrs.count; i++) {
+        if (buffsock->addrs.addrs[i].ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *)&buffsock->addrs.addrs[i])->sin6_port = htons(buffsock->port);
+        } else {
+            ((struct sockaddr_in *)&buffsock->addrs.addrs[i])->sin_port = htons(buffsock->port);
         }
     }
     
-    freeaddrinfo(aitop);
-    
-    struct timeval tv = { 2, 0 };
-    event_set(&buffsock->conn_ev, buffsock->fd, EV_WRITE, buffered_socket_connectcb, buffsock);
-    event_add(&buffsock->conn_ev, &tv);
+    buffered_socket_start_attempt(buffsock);
+}
+
+static void buffered_socket_start_attempt(struct BufferedSocket *buffsock)
+{
+    struct timeval tv = { 0, BS_CONNECT_STAGGER_MS * 1000 };
+    struct sockaddr *sa;
+    int i, fd;
     
-    buffsock->state = BS_CONNECTING;
+    while (buffsock->attempts < buffsock->addrs.count) {
+        i = buffsock->attempts++;
+        sa = (struct sockaddr *)&buffsock->addrs.addrs[i];
+        
+        if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) == -1) {
+            _DEBUG("%s: socket() failed\n", __FUNCTION__);
+            buffsock->attempts_failed++;
+            continue;
+        }
+        
+        if (evutil_make_socket_nonblocking(fd) == -1) {
+            _DEBUG("%s: evutil_make_socket_nonblocking() failed\n", __FUNCTION__);
+            close(fd);
+            buffsock->attempts_failed++;
+            continue;
+        }
+        
+        if (connect(fd, sa, buffsock->addrs.lens[i]) == -1 && errno != EINPROGRESS) {
+            _DEBUG("%s: connect() failed (%s)\n", __FUNCTION__, strerror(errno));
+            close(fd);
+            buffsock->attempts_failed++;
+            continue;
+        }
+        
+        _DEBUG("%s: attempt %d for \"%s:%d\" on %d\n", __FUNCTION__, i, buffsock->address, buffsock->port, fd);
+        
+        buffsock->attempt_fds[i] = fd;
+        event_set(&buffsock->attempt_evs[i], fd, EV_WRITE, buffered_socket_attemptcb, buffsock);
+        event_add(&buffsock->attempt_evs[i], NULL);
+        
+        if (buffsock->attempts < buffsock->addrs.count) {
+            evtimer_set(&buffsock->stagger_ev, buffered_socket_staggercb, buffsock);
+            evtimer_add(&buffsock->stagger_ev, &tv);
+        }
+        return;
+    }
     
-    return buffsock->fd;
+    if (buffsock->attempts_failed == buffsock->attempts) {
+        buffered_socket_connect_failed(buffsock);
+    }
+}
+
+static void buffered_socket_staggercb(int fd, short what, void *arg)
+{
+    buffered_socket_start_attempt((struct BufferedSocket *)arg);
 }
 
-static void buffered_socket_connectcb(int fd, short what, void *arg)
+static void buffered_socket_attemptcb(int fd, short what, void *arg)
 {
     struct BufferedSocket *buffsock = (struct BufferedSocket *)arg;
-    int error;
+    int i, error;
     socklen_t errsz = sizeof(error);
     
-    if (what == EV_TIMEOUT) {
-        _DEBUG("%s: connection timeout for \"%s:%d\" on %d\n",
-               __FUNCTION__, buffsock->address, buffsock->port, buffsock->fd);
-        buffered_socket_close(buffsock);
+    for (i = 0; i < buffsock->attempts && buffsock->attempt_fds[i] != fd; i++);
+    if (i == buffsock->attempts) {
         return;
     }
     
-    if (getsockopt(buffsock->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errsz) == -1) {
-        _DEBUG("%s: getsockopt failed for \"%s:%d\" on %d\n",
-               __FUNCTION__, buffsock->address, buffsock->port, buffsock->fd);
-        buffered_socket_close(buffsock);
-        return;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errsz) == -1) {
+        error = errno;
     }
-    
     if (error) {
         _DEBUG("%s: \"%s\" for \"%s:%d\" on %d\n",
-               __FUNCTION__, strerror(error), buffsock->address, buffsock->port, buffsock->fd);
-        buffered_socket_close(buffsock);
+               __FUNCTION__, strerror(error), buffsock->address, buffsock->port, fd);
+        close(fd);
+        buffsock->attempt_fds[i] = -1;
+        buffsock->attempts_failed++;
+        // don't wait out the stagger, try the next address now
+        if (event_initialized(&buffsock->stagger_ev)) {
+            evtimer_del(&buffsock->stagger_ev);
+        }
+        buffered_socket_start_attempt(buffsock);
         return;
     }
     
+    // the winner, the rest are abandoned
+    buffsock->attempt_fds[i] = -1;
+    buffered_socket_cancel_attempts(buffsock);
+    buffsock->fd = fd;
+    buffered_socket_connected(buffsock);
+}
+
+static void buffered_socket_connect_timeoutcb(int fd, short what, void *arg)
+{
+    struct BufferedSocket *buffsock = (struct BufferedSocket *)arg;
+    
+    _DEBUG("%s: connection timeout for \"%s:%d\"\n", __FUNCTION__, buffsock->address, buffsock->port);
+    buffered_socket_connect_failed(buffsock);
+}
+
+static void buffered_socket_connect_failed(struct BufferedSocket *buffsock)
+{
+    buffered_socket_cancel_attempts(buffsock);
+    if (buffsock->close_callback) {
+        (*buffsock->close_callback)(buffsock, buffsock->cbarg);
+    }
+    buffered_socket_close(buffsock);
+}
+
+/*
+ * stop resolving and close every connect() still in flight
+ */
+static void buffered_socket_cancel_attempts(struct BufferedSocket *buffsock)
+{
+    int i;
+    
+    simplehttp_resolve_cancel(buffered_socket_resolvedcb, buffsock);
+    if (event_initialized(&buffsock->conn_ev)) {
+        event_del(&buffsock->conn_ev);
+    }
+    if (event_initialized(&buffsock->stagger_ev)) {
+        evtimer_del(&buffsock->stagger_ev);
+    }
+    for (i = 0; i < SIMPLEHTTP_RESOLVE_MAX_ADDRS; i++) {
+        if (buffsock->attempt_fds[i] != -1) {
+            event_del(&buffsock->attempt_evs[i]);
+            close(buffsock->attempt_fds[i]);
+            buffsock->attempt_fds[i] = -1;
+        }
+    }
+}
+
+static void buffered_socket_connected(struct BufferedSocket *buffsock)
+{
     _DEBUG("%s: connected to \"%s:%d\" on %d\n",
            __FUNCTION__, buffsock->address, buffsock->port, buffsock->fd);
            
@@ -141,6 +265,9 @@ static void buffered_socket_connectcb(int fd, short what, void *arg)
                                     buffered_socket_readcb, buffered_socket_writecb, buffered_socket_errorcb,
                                     (void *)buffsock);
     bufferevent_enable(buffsock->bev, EV_READ);
+    // the write callback then fires when the output drains to the low watermark
+    bufferevent_setwatermark(buffsock->bev, EV_WRITE, buffsock->low_watermark, 0);
+    event_set(&buffsock->write_ev, buffsock->fd, EV_WRITE, buffered_socket_write_evcb, buffsock);
     
     if (buffsock->connect_callback) {
         (*buffsock->connect_callback)(buffsock, buffsock->cbarg);
@@ -149,15 +276,27 @@ static void buffered_socket_connectcb(int fd, short what, void *arg)
 
 void buffered_socket_close(struct BufferedSocket *buffsock)
 {
+    struct BufferedSocketWrite *done;
+    
     _DEBUG("%s: closing \"%s:%d\" on %d\n",
            __FUNCTION__, buffsock->address, buffsock->port, buffsock->fd);
            
     buffsock->state = BS_DISCONNECTED;
     
-    if (event_initialized(&buffsock->conn_ev)) {
-        event_del(&buffsock->conn_ev);
+    buffered_socket_cancel_attempts(buffsock);
+    
+    if (event_initialized(&buffsock->write_ev)) {
+        event_del(&buffsock->write_ev);
     }
     
+    // anything not written yet is dropped, hand the memory back
+    done = buffsock->write_queue;
+    buffsock->write_queue = NULL;
+    buffsock->write_queue_tail = NULL;
+    buffsock->write_queue_len = 0;
+    buffsock->write_paused = 0;
+    buffered_socket_release_writes(buffsock, done);
+    
     if (buffsock->fd != -1) {
         if (buffsock->close_callback) {
             (*buffsock->close_callback)(buffsock, buffsock->cbarg);
@@ -172,20 +311,257 @@ void buffered_socket_close(struct BufferedSocket *buffsock)
     }
 }
 
+/*
+ * call release_callback for a list of writes already taken off the queue.
+ * it may queue more (or close the socket), so the queue has to be
+ * consistent before this is called
+ */
+static void buffered_socket_release_writes(struct BufferedSocket *buffsock, struct BufferedSocketWrite *done)
+{
+    struct BufferedSocketWrite *w;
+    
+    while ((w = done) != NULL) {
+        done = w->next;
+        if (w->release_callback) {
+            (*w->release_callback)(buffsock, w->arg);
+        }
+        free(w);
+    }
+}
+
+static struct BufferedSocketWrite *buffered_socket_queue_write(struct BufferedSocket *buffsock, int iovcnt, size_t extra)
+{
+    struct BufferedSocketWrite *w;
+    
+    w = malloc(sizeof(struct BufferedSocketWrite) + iovcnt * sizeof(struct iovec) + extra);
+    w->iov = (struct iovec *)(w + 1);
+    w->iovcnt = iovcnt;
+    w->index = 0;
+    w->offset = 0;
+    w->release_callback = NULL;
+    w->arg = NULL;
+    w->next = NULL;
+    if (buffsock->write_queue_tail) {
+        buffsock->write_queue_tail->next = w;
+    } else {
+        buffsock->write_queue = w;
+    }
+    buffsock->write_queue_tail = w;
+    
+    return w;
+}
+
+/*
+ * bytes written by the caller that haven't gone out on the socket yet
+ */
+size_t buffered_socket_pending(struct BufferedSocket *buffsock)
+{
+    return (buffsock->bev ? EVBUFFER_LENGTH(EVBUFFER_OUTPUT(buffsock->bev)) : 0) + buffsock->write_queue_len;
+}
+
+/*
+ * once more than high bytes are pending watermark_callback is called with
+ * paused = 1, and once it's back down to low with paused = 0. a high of 0
+ * turns it off.
+ */
+void buffered_socket_set_watermarks(struct BufferedSocket *buffsock, size_t low, size_t high,
+                                    void (*watermark_callback)(struct BufferedSocket *buffsock, int paused, void *arg))
+{
+    buffsock->low_watermark = low;
+    buffsock->high_watermark = high;
+    buffsock->watermark_callback = watermark_callback;
+    if (buffsock->bev) {
+        bufferevent_setwatermark(buffsock->bev, EV_WRITE, low, 0);
+    }
+}
+
+static void buffered_socket_check_watermarks(struct BufferedSocket *buffsock)
+{
+    size_t pending;
+    
+    if (!buffsock->high_watermark || !buffsock->watermark_callback) {
+        return;
+    }
+    
+    pending = buffered_socket_pending(buffsock);
+    if (!buffsock->write_paused && pending >= buffsock->high_watermark) {
+        _DEBUG("%s: %lu bytes pending, pausing\n", __FUNCTION__, pending);
+        buffsock->write_paused = 1;
+        (*buffsock->watermark_callback)(buffsock, 1, buffsock->cbarg);
+    } else if (buffsock->write_paused && pending <= buffsock->low_watermark) {
+        _DEBUG("%s: %lu bytes pending, resuming\n", __FUNCTION__, pending);
+        buffsock->write_paused = 0;
+        (*buffsock->watermark_callback)(buffsock, 0, buffsock->cbarg);
+    }
+}
+
 size_t buffered_socket_write(struct BufferedSocket *buffsock, void *data, size_t len)
 {
+    struct BufferedSocketWrite *w;
+    
     if (buffsock->state != BS_CONNECTED) {
         return -1;
     }
     
     _DEBUG("%s: writing %lu bytes starting at %p\n", __FUNCTION__, len, data);
     
-    bufferevent_write(buffsock->bev, data, len);
-    bufferevent_enable(buffsock->bev, EV_WRITE);
+    if (buffsock->write_queue) {
+        // keep it behind what buffered_socket_writev() has queued
+        w = buffered_socket_queue_write(buffsock, 1, len);
+        w->iov[0].iov_base = (char *)(w->iov + 1);
+        w->iov[0].iov_len = len;
+        memcpy(w->iov[0].iov_base, data, len);
+        buffsock->write_queue_len += len;
+    } else {
+        bufferevent_write(buffsock->bev, data, len);
+        bufferevent_enable(buffsock->bev, EV_WRITE);
+    }
+    
+    buffered_socket_check_watermarks(buffsock);
     
     return len;
 }
 
+/*
+ * write iovcnt buffers without copying them. the memory has to stay valid
+ * until release_callback(buffsock, arg) is called, once it has all been
+ * written or the socket closed (which may be before this returns). returns
+ * -1 without keeping a reference if the socket isn't connected.
+ */
+size_t buffered_socket_writev(struct BufferedSocket *buffsock, const struct iovec *iov, int iovcnt,
+                              void (*release_callback)(struct BufferedSocket *buffsock, void *arg), void *arg)
+{
+    struct BufferedSocketWrite *w;
+    size_t len = 0;
+    int i;
+    
+    if (buffsock->state != BS_CONNECTED) {
+        return -1;
+    }
+    
+    w = buffered_socket_queue_write(buffsock, iovcnt, 0);
+    memcpy(w->iov, iov, iovcnt * sizeof(struct iovec));
+    w->release_callback = release_callback;
+    w->arg = arg;
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    buffsock->write_queue_len += len;
+    
+    _DEBUG("%s: queued %lu bytes in %d buffers\n", __FUNCTION__, len, iovcnt);
+    
+    buffered_socket_flush_writes(buffsock);
+    if (buffsock->state == BS_CONNECTED) {
+        buffered_socket_check_watermarks(buffsock);
+    }
+    
+    return len;
+}
+
+/*
+ * writev() as much of the queue as the socket takes. waits for the
+ * bufferevent's output to go first so bytes stay in the order they were
+ * written.
+ */
+static void buffered_socket_flush_writes(struct BufferedSocket *buffsock)
+{
+    struct iovec iov[BS_IOV_MAX];
+    struct BufferedSocketWrite *w, *done, **done_tail;
+    size_t want, left;
+    ssize_t n;
+    int i, cnt;
+    
+    if (buffsock->flushing) {
+        // a release callback queued more, the loop below picks it up
+        return;
+    }
+    
+    while (buffsock->write_queue && buffsock->state == BS_CONNECTED) {
+        if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(buffsock->bev))) {
+            // buffered_socket_writecb() picks this up once it's empty
+            return;
+        }
+        
+        cnt = 0;
+        want = 0;
+        for (w = buffsock->write_queue; w && cnt < BS_IOV_MAX; w = w->next) {
+            for (i = w->index; i < w->iovcnt && cnt < BS_IOV_MAX; i++) {
+                iov[cnt].iov_base = (char *)w->iov[i].iov_base + (i == w->index ? w->offset : 0);
+                iov[cnt].iov_len = w->iov[i].iov_len - (i == w->index ? w->offset : 0);
+                want += iov[cnt].iov_len;
+                cnt++;
+            }
+        }
+        
+        n = want ? writev(buffsock->fd, iov, cnt) : 0;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                event_add(&buffsock->write_ev, NULL);
+                return;
+            }
+            _DEBUG("%s: writev() failed for \"%s:%d\" on %d (%s)\n",
+                   __FUNCTION__, buffsock->address, buffsock->port, buffsock->fd, strerror(errno));
+            if (buffsock->error_callback) {
+                (*buffsock->error_callback)(buffsock, buffsock->cbarg);
+            }
+            buffered_socket_close(buffsock);
+            return;
+        }
+        buffsock->write_queue_len -= n;
+        
+        // advance past what was written, unlinking finished writes
+        left = n;
+        done = NULL;
+        done_tail = &done;
+        while ((w = buffsock->write_queue) != NULL) {
+            while (w->index < w->iovcnt && left >= w->iov[w->index].iov_len - w->offset) {
+                left -= w->iov[w->index].iov_len - w->offset;
+                w->index++;
+                w->offset = 0;
+            }
+            if (w->index < w->iovcnt) {
+                w->offset += left;
+                break;
+            }
+            buffsock->write_queue = w->next;
+            if (!buffsock->write_queue) {
+                buffsock->write_queue_tail = NULL;
+            }
+            w->next = NULL;
+            *done_tail = w;
+            done_tail = &w->next;
+        }
+        // only once the queue is settled, release callbacks commonly queue
+        // the next write or close the socket
+        buffsock->flushing = 1;
+        buffered_socket_release_writes(buffsock, done);
+        buffsock->flushing = 0;
+        if (buffsock->state != BS_CONNECTED) {
+            return;
+        }
+        
+        if ((size_t)n < want) {
+            event_add(&buffsock->write_ev, NULL);
+            return;
+        }
+    }
+}
+
+static void buffered_socket_write_evcb(int fd, short what, void *arg)
+{
+    struct BufferedSocket *buffsock = (struct BufferedSocket *)arg;
+    
+    buffered_socket_flush_writes(buffsock);
+    if (buffsock->state != BS_CONNECTED) {
+        return;
+    }
+    
+    buffered_socket_check_watermarks(buffsock);
+    if (!buffered_socket_pending(buffsock) && buffsock->write_callback) {
+        (*buffsock->write_callback)(buffsock, buffsock->cbarg);
+    }
+}
+
 void buffered_socket_readcb(struct bufferevent *bev, void *arg)
 {
     struct BufferedSocket *buffsock = (struct BufferedSocket *)arg;
@@ -208,11 +584,16 @@ void buffered_socket_writecb(struct bufferevent *bev, void *arg)
     evb = EVBUFFER_OUTPUT(bev);
     if (EVBUFFER_LENGTH(evb) == 0) {
         bufferevent_disable(bev, EV_WRITE);
+        buffered_socket_flush_writes(buffsock);
+        if (buffsock->state != BS_CONNECTED) {
+            return;
+        }
     }
     
     _DEBUG("%s: left to write %lu\n", __FUNCTION__, EVBUFFER_LENGTH(evb));
     
-    if (buffsock->write_callback) {
+    buffered_socket_check_watermarks(buffsock);
+    if (!buffered_socket_pending(buffsock) && buffsock->write_callback) {
         (*buffsock->write_callback)(buffsock, buffsock->cbarg);
     }
 }
@@ -1,7 +1,11 @@
 #ifndef __buffered_socket_h
 #define __buffered_socket_h
 
-#define BUFFERED_SOCKET_VERSION "0.1"
+#include <stddef.h>
+#include <sys/uio.h>
+#include <simplehttp/simplehttp.h>
+
+#define BUFFERED_SOCKET_VERSION "0.3"
 
 enum BufferedSocketStates {
     BS_INIT,
@@ -10,12 +14,35 @@ enum BufferedSocketStates {
     BS_DISCONNECTED
 };
 
+struct BufferedSocket;
+
+/*
+ * memory queued by buffered_socket_writev(), referenced rather than copied
+ * until it's written
+ */
+struct BufferedSocketWrite {
+    struct iovec *iov;
+    int iovcnt;
+    int index;
+    size_t offset;
+    void (*release_callback)(struct BufferedSocket *buffsock, void *arg);
+    void *arg;
+    struct BufferedSocketWrite *next;
+};
+
 struct BufferedSocket {
     char *address;
     int port;
     int fd;
     int state;
     struct event conn_ev;
+    // happy eyeballs, one connect() per resolved address racing the others
+    struct simplehttp_addrs addrs;
+    int attempt_fds[SIMPLEHTTP_RESOLVE_MAX_ADDRS];
+    struct event attempt_evs[SIMPLEHTTP_RESOLVE_MAX_ADDRS];
+    int attempts;
+    int attempts_failed;
+    struct event stagger_ev;
     struct bufferevent *bev;
     void (*connect_callback)(struct BufferedSocket *buffsock, void *arg);
     void (*close_callback)(struct BufferedSocket *buffsock, void *arg);
@@ -23,6 +50,15 @@ struct BufferedSocket {
     void (*write_callback)(struct BufferedSocket *buffsock, void *arg);
     void (*error_callback)(struct BufferedSocket *buffsock, void *arg);
     void *cbarg;
+    struct event write_ev;
+    struct BufferedSocketWrite *write_queue;
+    struct BufferedSocketWrite *write_queue_tail;
+    size_t write_queue_len;
+    size_t low_watermark;
+    size_t high_watermark;
+    int write_paused;
+    int flushing;
+    void (*watermark_callback)(struct BufferedSocket *buffsock, int paused, void *arg);
 };
 
 struct BufferedSocket *new_buffered_socket(const char *address, int port,
@@ -36,5 +72,10 @@ void free_buffered_socket(struct BufferedSocket *socket);
 int buffered_socket_connect(struct BufferedSocket *buffsock);
 void buffered_socket_close(struct BufferedSocket *socket);
 size_t buffered_socket_write(struct BufferedSocket *buffsock, void *data, size_t len);
+size_t buffered_socket_writev(struct BufferedSocket *buffsock, const struct iovec *iov, int iovcnt,
+                              void (*release_callback)(struct BufferedSocket *buffsock, void *arg), void *arg);
+void buffered_socket_set_watermarks(struct BufferedSocket *buffsock, size_t low, size_t high,
+                                    void (*watermark_callback)(struct BufferedSocket *buffsock, int paused, void *arg));
+size_t buffered_socket_pending(struct BufferedSocket *buffsock);
 
 #endif
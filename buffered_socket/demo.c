@@ -3,6 +3,12 @@
 #include <string.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <event.h>
 #include "buffered_socket.h"
 
@@ -11,12 +17,16 @@
 // $ nc -l 5150 (in another window)
 // $ make
 // $ ./demo
+//
+// or benchmark writing to a slow local reader
+//
+// $ ./demo bench [MB]
 
 static struct BufferedSocket *buffsock;
 static struct event reconnect_ev;
 static struct event pipe_ev;
 
-static void connect(int sig, short what, void *arg)
+static void reconnect(int sig, short what, void *arg)
 {
     buffered_socket_connect(buffsock);
     fprintf(stdout, "%s: attempting to connect\n", __FUNCTION__);
@@ -27,7 +37,7 @@ static void set_reconnect_timer()
     struct timeval tv = { 5, 0 };
     
     evtimer_del(&reconnect_ev);
-    evtimer_set(&reconnect_ev, connect, NULL);
+    evtimer_set(&reconnect_ev, reconnect, NULL);
     evtimer_add(&reconnect_ev, &tv);
 }
 
@@ -71,8 +81,231 @@ static void error_cb(struct BufferedSocket *buffsock, void *arg)
     // track errors, make reconnect decisions
 }
 
+/*
+ * the benchmark: a producer with data always ready writes [MB] in 64KB
+ * chunks to a local reader draining 100MB/s, in three ways
+ *
+ * copy: buffered_socket_write() as fast as it can, with nothing stopping it
+ * copy+watermarks: buffered_socket_write(), pausing between watermarks
+ * writev+watermarks: buffered_socket_writev() from a fixed set of chunks,
+ *   each one reused once it's released, pausing between watermarks
+ *
+ * each runs in its own process so maxrss is its own
+ */
+#define BENCH_CHUNK (64 * 1024)
+#define BENCH_LOW_WATERMARK (1024 * 1024)
+#define BENCH_HIGH_WATERMARK (4 * 1024 * 1024)
+#define BENCH_CHUNKS (BENCH_HIGH_WATERMARK / BENCH_CHUNK + 2)
+#define BENCH_READ_RATE (100 * 1024 * 1024)
+
+enum bench_mode { BENCH_COPY, BENCH_COPY_WATERMARKS, BENCH_WRITEV };
+
+struct bench {
+    enum bench_mode mode;
+    size_t total;
+    size_t produced;
+    size_t max_pending;
+    int paused;
+    char *chunks[BENCH_CHUNKS];
+    int free_chunks[BENCH_CHUNKS];
+    int num_free;
+    struct timeval start;
+    struct event produce_ev;
+};
+
+static void bench_produce(int fd, short what, void *arg);
+
+static void bench_schedule(struct bench *b)
+{
+    struct timeval tv = { 0, 0 };
+    
+    if (!event_pending(&b->produce_ev, EV_TIMEOUT, NULL)) {
+        evtimer_add(&b->produce_ev, &tv);
+    }
+}
+
+static void bench_release_cb(struct BufferedSocket *buffsock, void *arg)
+{
+    struct bench *b = (struct bench *)buffsock->cbarg;
+    
+    b->free_chunks[b->num_free++] = (int)(intptr_t)arg;
+    bench_schedule(b);
+}
+
+/*
+ * produce until the socket pushes back (or, for writev, we run out of chunks),
+ * a batch at a time so the event loop gets to write in between
+ */
+static void bench_produce(int fd, short what, void *arg)
+{
+    struct bench *b = (struct bench *)arg;
+    struct iovec iov;
+    size_t pending;
+    int i, chunk;
+    
+    for (i = 0; i < 64 && !b->paused && b->produced < b->total; i++) {
+        if (b->mode == BENCH_WRITEV) {
+            if (!b->num_free) {
+                return;
+            }
+            chunk = b->free_chunks[--b->num_free];
+            iov.iov_base = b->chunks[chunk];
+            iov.iov_len = BENCH_CHUNK;
+            buffered_socket_writev(buffsock, &iov, 1, bench_release_cb, (void *)(intptr_t)chunk);
+        } else {
+            buffered_socket_write(buffsock, b->chunks[0], BENCH_CHUNK);
+        }
+        b->produced += BENCH_CHUNK;
+        pending = buffered_socket_pending(buffsock);
+        if (pending > b->max_pending) {
+            b->max_pending = pending;
+        }
+    }
+    
+    if (!b->paused && b->produced < b->total) {
+        bench_schedule(b);
+    }
+}
+
+static void bench_watermark_cb(struct BufferedSocket *buffsock, int paused, void *arg)
+{
+    struct bench *b = (struct bench *)arg;
+    
+    b->paused = paused;
+    if (!paused) {
+        bench_schedule(b);
+    }
+}
+
+static void bench_connect_cb(struct BufferedSocket *buffsock, void *arg)
+{
+    struct bench *b = (struct bench *)arg;
+    
+    gettimeofday(&b->start, NULL);
+    bench_schedule(b);
+}
+
+static void bench_write_cb(struct BufferedSocket *buffsock, void *arg)
+{
+    struct bench *b = (struct bench *)arg;
+    
+    if (b->produced >= b->total) {
+        event_loopexit(NULL);
+    }
+}
+
+static void bench_run(enum bench_mode mode, const char *name, int port, size_t total)
+{
+    struct bench b;
+    struct timeval end;
+    struct rusage usage;
+    double elapsed;
+    int i;
+    
+    memset(&b, 0, sizeof(b));
+    b.mode = mode;
+    b.total = total;
+    for (i = 0; i < BENCH_CHUNKS; i++) {
+        b.chunks[i] = malloc(BENCH_CHUNK);
+        memset(b.chunks[i], 'a' + i % 26, BENCH_CHUNK);
+        b.free_chunks[b.num_free++] = i;
+    }
+    
+    event_init();
+    evtimer_set(&b.produce_ev, bench_produce, &b);
+    buffsock = new_buffered_socket("127.0.0.1", port, bench_connect_cb, NULL, NULL, bench_write_cb, NULL, &b);
+    if (mode != BENCH_COPY) {
+        buffered_socket_set_watermarks(buffsock, BENCH_LOW_WATERMARK, BENCH_HIGH_WATERMARK, bench_watermark_cb);
+    }
+    buffered_socket_connect(buffsock);
+    event_dispatch();
+    
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - b.start.tv_sec) + (end.tv_usec - b.start.tv_usec) / 1000000.0;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stdout, "%-18s %8.1f MB/s %10.1f MB %10.1f MB\n", name, total / elapsed / (1024 * 1024),
+            b.max_pending / (1024.0 * 1024), usage.ru_maxrss / 1024.0);
+    
+    free_buffered_socket(buffsock);
+    for (i = 0; i < BENCH_CHUNKS; i++) {
+        free(b.chunks[i]);
+    }
+}
+
+/*
+ * read one connection at BENCH_READ_RATE until it closes
+ */
+static void bench_reader(int listen_fd)
+{
+    char buf[BENCH_CHUNK];
+    struct timeval start, now;
+    double elapsed, due;
+    size_t total = 0;
+    ssize_t n;
+    int fd;
+    
+    fd = accept(listen_fd, NULL, NULL);
+    gettimeofday(&start, NULL);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        total += n;
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+        due = (double)total / BENCH_READ_RATE;
+        if (due > elapsed) {
+            usleep((due - elapsed) * 1000000);
+        }
+    }
+    close(fd);
+}
+
+static int bench(size_t total)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    const char *names[] = { "copy", "copy+watermarks", "writev+watermarks" };
+    int listen_fd, mode;
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 || listen(listen_fd, 8) == -1) {
+        fprintf(stderr, "ERROR: failed to listen on 127.0.0.1\n");
+        return 1;
+    }
+    getsockname(listen_fd, (struct sockaddr *)&sin, &sinlen);
+    
+    fprintf(stdout, "writing %lu MB in %d KB chunks to a slow reader\n",
+            (unsigned long)(total / (1024 * 1024)), BENCH_CHUNK / 1024);
+    fprintf(stdout, "%-18s %13s %13s %13s\n", "mode", "throughput", "max pending", "maxrss");
+    fflush(stdout);
+    for (mode = BENCH_COPY; mode <= BENCH_WRITEV; mode++) {
+        if (fork() == 0) {
+            bench_reader(listen_fd);
+            exit(0);
+        }
+        if (fork() == 0) {
+            close(listen_fd);
+            bench_run(mode, names[mode], ntohs(sin.sin_port), total);
+            fflush(stdout);
+            exit(0);
+        }
+        wait(NULL);
+        wait(NULL);
+    }
+    close(listen_fd);
+    
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench((size_t)(argc > 2 ? atoi(argv[2]) : 256) * 1024 * 1024);
+    }
+    
     event_init();
     
     buffsock = new_buffered_socket("127.0.0.1", 5150,
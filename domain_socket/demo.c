@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <signal.h>
 #include <event.h>
 #include "domain_socket.h"
@@ -16,6 +20,11 @@ s.connect("/tmp/domain_socket_test"); \
 s.send("hi\n"); \
 o = s.recv(4096); \
 print o'
+
+or benchmark local IPC, a sender process writing [messages] of [size] bytes
+to the demo as fast as it can
+
+$ ./demo bench [messages] [size]
 */
 
 static struct DomainSocket *uds;
@@ -55,8 +64,190 @@ static void uds_on_write(struct DSClient *client)
 static void uds_on_error(struct DSClient *client)
 {}
 
+/*
+ * the benchmark, in four modes
+ *
+ * stream: SOCK_STREAM, each message framed with a 4 byte length, written
+ *   64KB at a time and split up again in the read callback
+ * seqpacket: SOCK_SEQPACKET, sent DS_BATCH at a time with sendmmsg()
+ * seqpacket unbatched: the same, one sendmsg() per message
+ * seqpacket+fd: SOCK_SEQPACKET batched, each message passing a descriptor
+ *   that the receiver closes
+ *
+ * the receiver always reads DS_BATCH at a time
+ */
+#define BENCH_PATH "/tmp/domain_socket_bench"
+#define BENCH_WRITE_SIZE (64 * 1024)
+
+enum bench_mode { BENCH_STREAM, BENCH_SEQPACKET, BENCH_SEQPACKET_UNBATCHED, BENCH_SEQPACKET_FD };
+
+static uint64_t bench_total;
+static uint64_t bench_received;
+static uint64_t bench_fds;
+static struct timeval bench_start;
+
+static void bench_count(uint64_t n)
+{
+    if (!bench_received) {
+        gettimeofday(&bench_start, NULL);
+    }
+    bench_received += n;
+    if (bench_received >= bench_total) {
+        event_loopexit(NULL);
+    }
+}
+
+static void bench_on_read(struct DSClient *client)
+{
+    struct evbuffer *evb = client->bev->input;
+    uint32_t len;
+    uint64_t n = 0;
+    
+    while (EVBUFFER_LENGTH(evb) >= sizeof(len)) {
+        memcpy(&len, EVBUFFER_DATA(evb), sizeof(len));
+        if (EVBUFFER_LENGTH(evb) < sizeof(len) + len) {
+            break;
+        }
+        evbuffer_drain(evb, sizeof(len) + len);
+        n++;
+    }
+    if (n) {
+        bench_count(n);
+    }
+}
+
+static void bench_on_message(struct DSClient *client, struct DSMessage *msg)
+{
+    while (msg->nfds) {
+        if (close(msg->fds[--msg->nfds]) == 0) {
+            bench_fds++;
+        }
+    }
+    bench_count(1);
+}
+
+static void bench_on_error(struct DSClient *client)
+{
+    event_loopexit(NULL);
+}
+
+static void bench_send(enum bench_mode mode, uint64_t total, size_t size)
+{
+    struct DSMessage msgs[DS_BATCH];
+    char *buf, *p;
+    uint64_t sent = 0;
+    uint32_t len = size;
+    ssize_t n;
+    int fd, pipe_fds[2], i, batch;
+    
+    if ((fd = domain_socket_connect(BENCH_PATH, mode == BENCH_STREAM ? SOCK_STREAM : SOCK_SEQPACKET)) == -1) {
+        fprintf(stderr, "ERROR: failed to connect to %s\n", BENCH_PATH);
+        return;
+    }
+    buf = malloc(BENCH_WRITE_SIZE + sizeof(len) + size);
+    memset(buf, 'a', BENCH_WRITE_SIZE + sizeof(len) + size);
+    
+    if (mode == BENCH_STREAM) {
+        while (sent < total) {
+            for (p = buf; sent < total && p - buf < BENCH_WRITE_SIZE; sent++) {
+                memcpy(p, &len, sizeof(len));
+                p += sizeof(len) + size;
+            }
+            for (i = 0; i < p - buf; i += n) {
+                if ((n = write(fd, buf + i, p - buf - i)) == -1) {
+                    break;
+                }
+            }
+        }
+    } else {
+        pipe(pipe_fds);
+        for (i = 0; i < DS_BATCH; i++) {
+            msgs[i].data = buf;
+            msgs[i].len = size;
+            msgs[i].fds[0] = pipe_fds[0];
+            msgs[i].nfds = mode == BENCH_SEQPACKET_FD ? 1 : 0;
+        }
+        batch = mode == BENCH_SEQPACKET_UNBATCHED ? 1 : DS_BATCH;
+        while (sent < total) {
+            if ((n = domain_socket_send_messages(fd, msgs, total - sent < batch ? total - sent : batch)) == -1) {
+                break;
+            }
+            sent += n;
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    
+    free(buf);
+    close(fd);
+}
+
+static void bench_run(enum bench_mode mode, const char *name, uint64_t total, size_t size)
+{
+    struct timeval end;
+    double elapsed;
+    pid_t pid;
+    
+    bench_total = total;
+    event_init();
+    if (mode == BENCH_STREAM) {
+        uds = new_domain_socket(BENCH_PATH, S_IRUSR | S_IWUSR, bench_on_read, NULL, bench_on_error, 64);
+    } else {
+        uds = new_domain_socket_seqpacket(BENCH_PATH, S_IRUSR | S_IWUSR, bench_on_message, NULL, bench_on_error,
+                                          64, size);
+    }
+    if (!uds) {
+        fprintf(stderr, "ERROR: new_domain_socket() failed\n");
+        return;
+    }
+    
+    if ((pid = fork()) == 0) {
+        bench_send(mode, total, size);
+        exit(0);
+    }
+    event_dispatch();
+    gettimeofday(&end, NULL);
+    waitpid(pid, NULL, 0);
+    
+    elapsed = (end.tv_sec - bench_start.tv_sec) + (end.tv_usec - bench_start.tv_usec) / 1000000.0;
+    fprintf(stdout, "%-20s %10.0f msg/s %9.1f MB/s", name, bench_received / elapsed,
+            bench_received * size / elapsed / (1024 * 1024));
+    if (mode == BENCH_SEQPACKET_FD) {
+        fprintf(stdout, " %10"PRIu64" fds", bench_fds);
+    }
+    fprintf(stdout, "\n");
+    
+    free_domain_socket(uds);
+}
+
+static int bench(uint64_t total, size_t size)
+{
+    const char *names[] = { "stream", "seqpacket", "seqpacket unbatched", "seqpacket+fd" };
+    int mode;
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    fprintf(stdout, "sending %"PRIu64" messages of %lu bytes\n", total, (unsigned long)size);
+    fflush(stdout);
+    for (mode = BENCH_STREAM; mode <= BENCH_SEQPACKET_FD; mode++) {
+        // each in a process of its own, for a fresh event base
+        if (fork() == 0) {
+            bench_run(mode, names[mode], total, size);
+            fflush(stdout);
+            exit(0);
+        }
+        wait(NULL);
+    }
+    
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench(argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000, argc > 3 ? atoi(argv[3]) : 256);
+    }
+    
     event_init();
     
     if (!(uds = new_domain_socket("/tmp/domain_socket_test",
@@ -1,11 +1,16 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for recvmmsg(), sendmmsg()
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <assert.h>
 #include <event.h>
 #include "domain_socket.h"
@@ -20,12 +25,12 @@ static struct DSClient *new_domain_socket_client(struct DomainSocket *uds,
         int client_fd, struct sockaddr *sa, socklen_t salen);
 static void free_domain_socket_client(struct DSClient *client);
 static void accept_socket(int fd, short what, void *arg);
+static void seqpacket_on_read(int fd, short what, void *arg);
+static void seqpacket_on_write(int fd, short what, void *arg);
+static void domain_socket_flush(struct DSClient *client);
 
-struct DomainSocket *new_domain_socket(const char *path, int access_mask,
-                                       void (*read_callback)(struct DSClient *client),
-                                       void (*write_callback)(struct DSClient *client),
-                                       void (*error_callback)(struct DSClient *client),
-                                       int listen_backlog)
+static struct DomainSocket *domain_socket_listen(const char *path, int access_mask, int type,
+        int listen_backlog, size_t max_message)
 {
     struct linger ling = {0, 0};
     struct sockaddr_un addr;
@@ -36,14 +41,16 @@ struct DomainSocket *new_domain_socket(const char *path, int access_mask,
     
     assert(path != NULL);
     
-    uds = malloc(sizeof(struct DomainSocket));
+    uds = calloc(1, sizeof(struct DomainSocket));
     uds->path = strdup(path);
     uds->fd = -1;
-    uds->read_callback = read_callback;
-    uds->write_callback = write_callback;
-    uds->error_callback = error_callback;
+    uds->type = type;
+    uds->max_message = max_message;
+    if (max_message) {
+        uds->recv_buf = malloc(max_message * DS_BATCH);
+    }
     
-    if ((uds->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((uds->fd = socket(AF_UNIX, type, 0)) == -1) {
         _DEBUG("%s: socket() failed\n", __FUNCTION__);
         free_domain_socket(uds);
         return NULL;
@@ -99,6 +106,49 @@ struct DomainSocket *new_domain_socket(const char *path, int access_mask,
     return uds;
 }
 
+struct DomainSocket *new_domain_socket(const char *path, int access_mask,
+                                       void (*read_callback)(struct DSClient *client),
+                                       void (*write_callback)(struct DSClient *client),
+                                       void (*error_callback)(struct DSClient *client),
+                                       int listen_backlog)
+{
+    struct DomainSocket *uds;
+    
+    if ((uds = domain_socket_listen(path, access_mask, SOCK_STREAM, listen_backlog, 0))) {
+        uds->read_callback = read_callback;
+        uds->write_callback = write_callback;
+        uds->error_callback = error_callback;
+    }
+    
+    return uds;
+}
+
+/*
+ * message oriented, each send arrives as exactly one message_callback, so
+ * there's no framing to do. messages can carry file descriptors (up to
+ * DS_MAX_FDS) and are read and written DS_BATCH at a time. messages longer
+ * than max_message (DS_DEFAULT_MAX_MESSAGE if 0) are truncated.
+ */
+struct DomainSocket *new_domain_socket_seqpacket(const char *path, int access_mask,
+        void (*message_callback)(struct DSClient *client, struct DSMessage *msg),
+        void (*write_callback)(struct DSClient *client),
+        void (*error_callback)(struct DSClient *client),
+        int listen_backlog, size_t max_message)
+{
+    struct DomainSocket *uds;
+    
+    if (!max_message) {
+        max_message = DS_DEFAULT_MAX_MESSAGE;
+    }
+    if ((uds = domain_socket_listen(path, access_mask, SOCK_SEQPACKET, listen_backlog, max_message))) {
+        uds->message_callback = message_callback;
+        uds->write_callback = write_callback;
+        uds->error_callback = error_callback;
+    }
+    
+    return uds;
+}
+
 void free_domain_socket(struct DomainSocket *uds)
 {
     struct stat tstat;
@@ -117,6 +167,7 @@ void free_domain_socket(struct DomainSocket *uds)
         }
         
         free(uds->path);
+        free(uds->recv_buf);
         free(uds);
     }
 }
@@ -193,20 +244,347 @@ static void buffered_on_error(struct bufferevent *bev, short what, void *arg)
 
 void domain_socket_client_write(struct DSClient *client, void *data, size_t len)
 {
+    if (!client->bev) {
+        domain_socket_client_send(client, data, len, NULL, 0);
+        return;
+    }
     bufferevent_write(client->bev, data, len);
     bufferevent_enable(client->bev, EV_WRITE);
 }
 
+/*
+ * SOCK_SEQPACKET: queue one message, with nfds descriptors to pass along.
+ * the data and descriptors are copied (dup()) so the caller can free and
+ * close theirs straight away. returns 0, or -1 (nothing queued) if the
+ * message is empty, has too many descriptors or one can't be dup()ed.
+ */
+int domain_socket_client_send(struct DSClient *client, void *data, size_t len, int *fds, int nfds)
+{
+    struct DSMessage *msg;
+    
+    if (len == 0 || nfds > DS_MAX_FDS) {
+        return -1;
+    }
+    
+    msg = malloc(sizeof(struct DSMessage) + len);
+    msg->data = (char *)(msg + 1);
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    for (msg->nfds = 0; msg->nfds < nfds; msg->nfds++) {
+        if ((msg->fds[msg->nfds] = fcntl(fds[msg->nfds], F_DUPFD_CLOEXEC, 0)) == -1) {
+            _DEBUG("%s: dup of fd %d failed (%s)\n", __FUNCTION__, fds[msg->nfds], strerror(errno));
+            while (msg->nfds) {
+                close(msg->fds[--msg->nfds]);
+            }
+            free(msg);
+            return -1;
+        }
+    }
+    msg->next = NULL;
+    if (client->send_queue_tail) {
+        client->send_queue_tail->next = msg;
+    } else {
+        client->send_queue = msg;
+    }
+    client->send_queue_tail = msg;
+    
+    if (!event_pending(&client->write_ev, EV_WRITE, NULL)) {
+        domain_socket_flush(client);
+    }
+    
+    return 0;
+}
+
+/*
+ * sendmmsg() as much of the send queue as the socket takes
+ */
+static void domain_socket_flush(struct DSClient *client)
+{
+    struct DSMessage msgs[DS_BATCH];
+    struct DSMessage *msg;
+    int i, n, sent;
+    
+    while (client->send_queue) {
+        for (n = 0, msg = client->send_queue; msg && n < DS_BATCH; msg = msg->next) {
+            msgs[n++] = *msg;
+        }
+        
+        if ((sent = domain_socket_send_messages(client->fd, msgs, n)) == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                event_add(&client->write_ev, NULL);
+                return;
+            }
+            _DEBUG("%s: sendmmsg() failed (%s)\n", __FUNCTION__, strerror(errno));
+            // the read side sees the close and cleans up
+            shutdown(client->fd, SHUT_RDWR);
+            return;
+        }
+        
+        for (i = 0; i < sent; i++) {
+            msg = client->send_queue;
+            client->send_queue = msg->next;
+            while (msg->nfds) {
+                close(msg->fds[--msg->nfds]);
+            }
+            free(msg);
+        }
+        if (!client->send_queue) {
+            client->send_queue_tail = NULL;
+        }
+        
+        if (sent < n) {
+            event_add(&client->write_ev, NULL);
+            return;
+        }
+    }
+}
+
+// called by libevent when a backed up send queue can be written.
+static void seqpacket_on_write(int fd, short what, void *arg)
+{
+    struct DSClient *client = (struct DSClient *)arg;
+    
+    domain_socket_flush(client);
+    if (!client->send_queue && client->uds->write_callback) {
+        (*client->uds->write_callback)(client);
+    }
+}
+
+// called by libevent when there are messages to read.
+/*
+ * a read of 0 bytes is either an empty message or the other end closing
+ * (which fills the rest of the batch with them). it's the end once the peer
+ * has hung up and nothing but empty reads are left. empty messages a peer
+ * sent right before closing are lost with it.
+ */
+static int seqpacket_eof(int fd, struct DSMessage *msgs, int n)
+{
+    struct pollfd pfd;
+    char c;
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        if (msgs[i].len || msgs[i].nfds) {
+            return 0;
+        }
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLHUP)) {
+        return 0;
+    }
+    // the batch may have ended on an empty message with more queued behind it
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+static void seqpacket_on_read(int fd, short what, void *arg)
+{
+    struct DSClient *client = (struct DSClient *)arg;
+    struct DomainSocket *uds = client->uds;
+    struct DSMessage msgs[DS_BATCH];
+    int i, n;
+    
+    // one batch, the event fires again if there's more
+    n = domain_socket_recv_messages(fd, uds->recv_buf, uds->max_message, msgs, DS_BATCH);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    
+    for (i = 0; i < n; i++) {
+        if (msgs[i].len == 0 && msgs[i].nfds == 0 && seqpacket_eof(fd, &msgs[i], n - i)) {
+            break;
+        }
+        if (uds->message_callback) {
+            (*uds->message_callback)(client, &msgs[i]);
+        } else {
+            while (msgs[i].nfds) {
+                close(msgs[i].fds[--msgs[i].nfds]);
+            }
+        }
+    }
+    
+    if (n == -1 || i < n) {
+        _DEBUG("%s: client socket closed, disconnecting\n", __FUNCTION__);
+        if (uds->error_callback) {
+            (*uds->error_callback)(client);
+        }
+        free_domain_socket_client(client);
+    }
+}
+
+/*
+ * the messages' data goes into buf, max_message bytes apiece. returns the
+ * number of messages read (at least 1 on a blocking socket), or -1
+ */
+int domain_socket_recv_messages(int fd, char *buf, size_t max_message, struct DSMessage *msgs, int count)
+{
+    char control[DS_BATCH][CMSG_SPACE(sizeof(int) * DS_MAX_FDS)];
+    struct iovec iov[DS_BATCH];
+    struct msghdr *hdr;
+    struct cmsghdr *cmsg;
+    size_t len;
+    int i, j, n, nfds;
+#ifdef __linux__
+    struct mmsghdr hdrs[DS_BATCH];
+#else
+    struct { struct msghdr msg_hdr; unsigned int msg_len; } hdrs[DS_BATCH];
+    ssize_t ret;
+#endif
+    
+    if (count > DS_BATCH) {
+        count = DS_BATCH;
+    }
+    memset(hdrs, 0, sizeof(hdrs[0]) * count);
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = buf + i * max_message;
+        iov[i].iov_len = max_message;
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_control = control[i];
+        hdrs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+    
+#ifdef __linux__
+    if ((n = recvmmsg(fd, hdrs, count, MSG_WAITFORONE | MSG_CMSG_CLOEXEC, NULL)) == -1) {
+        return -1;
+    }
+#else
+    for (n = 0; n < count; n++) {
+        if ((ret = recvmsg(fd, &hdrs[n].msg_hdr, n ? MSG_DONTWAIT : 0)) == -1) {
+            if (n) {
+                break;
+            }
+            return -1;
+        }
+        hdrs[n].msg_len = ret;
+        if (ret == 0) {
+            n++;
+            break;
+        }
+    }
+#endif
+    
+    for (i = 0; i < n; i++) {
+        hdr = &hdrs[i].msg_hdr;
+        len = hdrs[i].msg_len;
+        if (hdr->msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            fprintf(stderr, "ERROR: message truncated (%lu bytes max, %d descriptors)\n",
+                    (unsigned long)max_message, DS_MAX_FDS);
+        }
+        msgs[i].data = iov[i].iov_base;
+        msgs[i].len = len < max_message ? len : max_message;
+        msgs[i].nfds = 0;
+        msgs[i].next = NULL;
+        for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (j = 0; j < nfds; j++) {
+                if (msgs[i].nfds < DS_MAX_FDS) {
+                    memcpy(&msgs[i].fds[msgs[i].nfds++], CMSG_DATA(cmsg) + j * sizeof(int), sizeof(int));
+                }
+            }
+        }
+    }
+    
+    return n;
+}
+
+/*
+ * returns the number of messages sent, each one whole, or -1
+ */
+int domain_socket_send_messages(int fd, struct DSMessage *msgs, int count)
+{
+    char control[DS_BATCH][CMSG_SPACE(sizeof(int) * DS_MAX_FDS)];
+    struct iovec iov[DS_BATCH];
+    struct cmsghdr *cmsg;
+    int i, n;
+#ifdef __linux__
+    struct mmsghdr hdrs[DS_BATCH];
+#else
+    struct { struct msghdr msg_hdr; } hdrs[DS_BATCH];
+#endif
+    
+    if (count > DS_BATCH) {
+        count = DS_BATCH;
+    }
+    memset(hdrs, 0, sizeof(hdrs[0]) * count);
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = msgs[i].data;
+        iov[i].iov_len = msgs[i].len;
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        if (msgs[i].nfds) {
+            memset(control[i], 0, sizeof(control[i]));
+            hdrs[i].msg_hdr.msg_control = control[i];
+            hdrs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int) * msgs[i].nfds);
+            cmsg = CMSG_FIRSTHDR(&hdrs[i].msg_hdr);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * msgs[i].nfds);
+            memcpy(CMSG_DATA(cmsg), msgs[i].fds, sizeof(int) * msgs[i].nfds);
+        }
+    }
+    
+#ifdef __linux__
+    n = sendmmsg(fd, hdrs, count, MSG_NOSIGNAL);
+#else
+    for (n = 0; n < count; n++) {
+        if (sendmsg(fd, &hdrs[n].msg_hdr, n ? MSG_DONTWAIT : 0) == -1) {
+            if (n) {
+                break;
+            }
+            return -1;
+        }
+    }
+#endif
+    
+    return n;
+}
+
+/*
+ * connect to a domain socket (type SOCK_STREAM or SOCK_SEQPACKET), for the
+ * other end of new_domain_socket*(). returns a blocking fd or -1
+ */
+int domain_socket_connect(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    int fd;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    
+    if ((fd = socket(AF_UNIX, type, 0)) == -1) {
+        _DEBUG("%s: socket() failed\n", __FUNCTION__);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        _DEBUG("%s: connect() failed\n", __FUNCTION__);
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
 static struct DSClient *new_domain_socket_client(struct DomainSocket *uds,
         int client_fd, struct sockaddr *sa, socklen_t salen)
 {
     struct DSClient *client;
     
-    client = malloc(sizeof(struct DSClient));
+    client = calloc(1, sizeof(struct DSClient));
     client->uds = uds;
     client->fd = client_fd;
-    client->bev = bufferevent_new(client_fd, buffered_on_read, buffered_on_write, buffered_on_error, client);
-    bufferevent_enable(client->bev, EV_READ);
+    if (uds->type == SOCK_SEQPACKET) {
+        event_set(&client->read_ev, client_fd, EV_READ | EV_PERSIST, seqpacket_on_read, client);
+        event_set(&client->write_ev, client_fd, EV_WRITE, seqpacket_on_write, client);
+        event_add(&client->read_ev, NULL);
+    } else {
+        client->bev = bufferevent_new(client_fd, buffered_on_read, buffered_on_write, buffered_on_error, client);
+        bufferevent_enable(client->bev, EV_READ);
+    }
     
     _DEBUG("%s: %d\n", __FUNCTION__, client->fd);
     
@@ -215,8 +593,22 @@ static struct DSClient *new_domain_socket_client(struct DomainSocket *uds,
 
 static void free_domain_socket_client(struct DSClient *client)
 {
+    struct DSMessage *msg;
+    
     if (client) {
-        bufferevent_free(client->bev);
+        if (client->bev) {
+            bufferevent_free(client->bev);
+        } else {
+            event_del(&client->read_ev);
+            event_del(&client->write_ev);
+        }
+        while ((msg = client->send_queue)) {
+            client->send_queue = msg->next;
+            while (msg->nfds) {
+                close(msg->fds[--msg->nfds]);
+            }
+            free(msg);
+        }
         if (client->fd != -1) {
             close(client->fd);
         }
@@ -1,21 +1,51 @@
 #ifndef __domain_socket_h
 #define __domain_socket_h
 
+#include <stddef.h>
+
+// descriptors carried by one message (SCM_RIGHTS)
+#define DS_MAX_FDS 8
+// messages per recvmmsg()/sendmmsg()
+#define DS_BATCH 32
+// max_message when new_domain_socket_seqpacket() is given 0
+#define DS_DEFAULT_MAX_MESSAGE 4096
+
 struct DSClient;
 
+/*
+ * one SOCK_SEQPACKET message. when received, data is only valid during the
+ * callback and the callback owns fds (it has to close them or keep them)
+ */
+struct DSMessage {
+    char *data;
+    size_t len;
+    int fds[DS_MAX_FDS];
+    int nfds;
+    struct DSMessage *next;
+};
+
 struct DomainSocket {
     int fd;
     char *path;
+    int type;
     void (*read_callback)(struct DSClient *client);
+    void (*message_callback)(struct DSClient *client, struct DSMessage *msg);
     void (*write_callback)(struct DSClient *client);
     void (*error_callback)(struct DSClient *client);
     struct event ev;
+    size_t max_message;
+    char *recv_buf;
 };
 
 struct DSClient {
     int fd;
     struct bufferevent *bev;
     struct DomainSocket *uds;
+    // SOCK_SEQPACKET
+    struct event read_ev;
+    struct event write_ev;
+    struct DSMessage *send_queue;
+    struct DSMessage *send_queue_tail;
 };
 
 struct DomainSocket *new_domain_socket(const char *path, int access_mask,
@@ -23,7 +53,17 @@ struct DomainSocket *new_domain_socket(const char *path, int access_mask,
                                        void (*write_callback)(struct DSClient *client),
                                        void (*error_callback)(struct DSClient *client),
                                        int listen_backlog);
+struct DomainSocket *new_domain_socket_seqpacket(const char *path, int access_mask,
+        void (*message_callback)(struct DSClient *client, struct DSMessage *msg),
+        void (*write_callback)(struct DSClient *client),
+        void (*error_callback)(struct DSClient *client),
+        int listen_backlog, size_t max_message);
 void free_domain_socket(struct DomainSocket *uds);
 void domain_socket_client_write(struct DSClient *client, void *data, size_t len);
+int domain_socket_client_send(struct DSClient *client, void *data, size_t len, int *fds, int nfds);
+
+int domain_socket_connect(const char *path, int type);
+int domain_socket_send_messages(int fd, struct DSMessage *msgs, int count);
+int domain_socket_recv_messages(int fd, char *buf, size_t max_message, struct DSMessage *msgs, int count);
 
 #endif
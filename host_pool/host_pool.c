@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
+#include <sys/time.h>
 #include <uthash.h>
 #include <json/json.h>
 #include <simplehttp/simplehttp.h>
@@ -13,6 +15,14 @@
 #define _DEBUG(...) do {;} while (0)
 #endif
 
+// weight of the newest response in an endpoint's averages
+#define HOST_POOL_EWMA_ALPHA 0.2
+// an endpoint that fails every request scores as this many times slower
+#define HOST_POOL_ERROR_PENALTY 10
+#define HOST_POOL_DECAY_MS 10000
+// virtual nodes per endpoint on the HOST_POOL_CONSISTENT_HASH ring
+#define HOST_POOL_RING_POINTS 160
+
 /*
  * retry_failed_hosts - the number of times to retry a failed host. set to -1 for indefinite retries
  * retry_interval - seconds between retries. set to -1 for exponential backoff (ie: 1, 2, 4, 8, ...)
@@ -26,6 +36,7 @@ struct HostPool *new_host_pool(int retry_failed_hosts, int retry_interval,
     
     host_pool = malloc(sizeof(struct HostPool));
     host_pool->count = 0;
+    host_pool->next_id = 0;
     host_pool->retry_failed_hosts = retry_failed_hosts;
     host_pool->retry_interval = retry_interval;
     host_pool->max_retry_interval = max_retry_interval;
@@ -33,6 +44,12 @@ struct HostPool *new_host_pool(int retry_failed_hosts, int retry_interval,
     host_pool->endpoints = NULL;
     host_pool->current_endpoint = NULL;
     host_pool->checkpoint = -1;
+    host_pool->decay_ms = HOST_POOL_DECAY_MS;
+    host_pool->clock = host_pool_clock_ms;
+    host_pool->ring_points = HOST_POOL_RING_POINTS;
+    host_pool->ring_count = 0;
+    host_pool->ring = NULL;
+    host_pool->list = NULL;
     
     return host_pool;
 }
@@ -47,10 +64,29 @@ void free_host_pool(struct HostPool *host_pool)
             free_host_pool_endpoint(endpoint);
         }
         
+        free(host_pool->ring);
+        free(host_pool->list);
         free(host_pool);
     }
 }
 
+/*
+ * drop the ring and list so they're rebuilt with the new set of endpoints
+ * on the next selection
+ */
+static void host_pool_endpoints_changed(struct HostPool *host_pool)
+{
+    free(host_pool->ring);
+    free(host_pool->list);
+    host_pool->ring = NULL;
+    host_pool->ring_count = 0;
+    host_pool->list = NULL;
+}
+
+/*
+ * ids aren't reused, so a response for an endpoint that has since been
+ * removed can't be credited to a different one
+ */
 struct HostPoolEndpoint *new_host_pool_endpoint(struct HostPool *host_pool,
         const char *address, int port, char *path)
 {
@@ -60,17 +96,50 @@ struct HostPoolEndpoint *new_host_pool_endpoint(struct HostPool *host_pool,
     host_pool_endpoint->address = strdup(address);
     host_pool_endpoint->port = port;
     host_pool_endpoint->path = strdup(path);
-    host_pool_endpoint->id = host_pool->count++;
+    host_pool_endpoint->id = host_pool->next_id++;
     host_pool_endpoint->alive = 1;
     host_pool_endpoint->retry_count = 0;
     host_pool_endpoint->retry_delay = 0;
     host_pool_endpoint->next_retry = 0;
+    host_pool_endpoint->latency_ms = 0;
+    host_pool_endpoint->error_rate = 0;
+    host_pool_endpoint->scored_at = 0;
     
     HASH_ADD_INT(host_pool->endpoints, id, host_pool_endpoint);
+    host_pool->count++;
+    host_pool_endpoints_changed(host_pool);
     
     return host_pool_endpoint;
 }
 
+void host_pool_remove_endpoint(struct HostPool *host_pool, struct HostPoolEndpoint *host_pool_endpoint)
+{
+    _DEBUG("HOST_POOL: removing endpoint #%d (%s:%d%s)\n", host_pool_endpoint->id,
+           host_pool_endpoint->address, host_pool_endpoint->port, host_pool_endpoint->path);
+    
+    if (host_pool->current_endpoint == host_pool_endpoint) {
+        host_pool->current_endpoint = NULL;
+    }
+    HASH_DELETE(hh, host_pool->endpoints, host_pool_endpoint);
+    host_pool->count--;
+    host_pool_endpoints_changed(host_pool);
+    free_host_pool_endpoint(host_pool_endpoint);
+}
+
+struct HostPoolEndpoint *host_pool_find_endpoint(struct HostPool *host_pool,
+        const char *address, int port, const char *path)
+{
+    struct HostPoolEndpoint *endpoint, *tmp;
+    
+    HASH_ITER(hh, host_pool->endpoints, endpoint, tmp) {
+        if (endpoint->port == port && strcmp(endpoint->address, address) == 0 && strcmp(endpoint->path, path) == 0) {
+            return endpoint;
+        }
+    }
+    
+    return NULL;
+}
+
 void free_host_pool_endpoint(struct HostPoolEndpoint *host_pool_endpoint)
 {
     if (host_pool_endpoint) {
@@ -100,6 +169,202 @@ void host_pool_from_json(struct HostPool *host_pool, json_object *host_pool_endp
     }
 }
 
+/*
+ * make the pool match a new list of endpoint urls. endpoints that are in
+ * both keep their id, health and scores, the rest are added or removed.
+ * returns the number of endpoints added and removed, or -1 (leaving the
+ * pool as it was) when a url doesn't parse.
+ */
+int host_pool_update_from_json(struct HostPool *host_pool, json_object *host_pool_endpoint_list)
+{
+    struct HostPoolEndpoint *endpoint, *tmp;
+    char *endpoint_url;
+    char **addresses, **paths;
+    int *ports;
+    int i, n, changes = 0;
+    
+    n = json_object_array_length(host_pool_endpoint_list);
+    addresses = calloc(n, sizeof(char *));
+    paths = calloc(n, sizeof(char *));
+    ports = calloc(n, sizeof(int));
+    
+    for (i = 0; i < n; i++) {
+        endpoint_url = (char *)json_object_get_string(json_object_array_get_idx(host_pool_endpoint_list, i));
+        if (!endpoint_url || !simplehttp_parse_url(endpoint_url, strlen(endpoint_url), &addresses[i], &ports[i], &paths[i])) {
+            fprintf(stderr, "ERROR: failed to parse host pool endpoint (%s)\n", endpoint_url ? endpoint_url : "null");
+            changes = -1;
+            break;
+        }
+    }
+    
+    if (changes == 0) {
+        HASH_ITER(hh, host_pool->endpoints, endpoint, tmp) {
+            for (i = 0; i < n; i++) {
+                if (endpoint->port == ports[i] && strcmp(endpoint->address, addresses[i]) == 0 &&
+                        strcmp(endpoint->path, paths[i]) == 0) {
+                    break;
+                }
+            }
+            if (i == n) {
+                host_pool_remove_endpoint(host_pool, endpoint);
+                changes++;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            if (!host_pool_find_endpoint(host_pool, addresses[i], ports[i], paths[i])) {
+                new_host_pool_endpoint(host_pool, addresses[i], ports[i], paths[i]);
+                changes++;
+            }
+        }
+    }
+    
+    for (i = 0; i < n; i++) {
+        free(addresses[i]);
+        free(paths[i]);
+    }
+    free(addresses);
+    free(paths);
+    free(ports);
+    
+    return changes;
+}
+
+/*
+ * 64 bit FNV-1a with a final mix so that similar keys (host:port#1, #2, ...)
+ * still spread evenly around the ring
+ */
+uint64_t host_pool_hash(const char *data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    
+    return h;
+}
+
+static int host_pool_ring_point_cmp(const void *a, const void *b)
+{
+    const struct HostPoolRingPoint *pa = a, *pb = b;
+    
+    if (pa->hash < pb->hash) {
+        return -1;
+    }
+    return pa->hash > pb->hash;
+}
+
+/*
+ * every endpoint gets ring_points points on the ring, placed by hashing
+ * "address:port/path#n". the points depend only on the endpoint itself (not
+ * its id or the order endpoints were added), so adding or removing one only
+ * moves the keys it owns, ~1/n of them.
+ */
+static void host_pool_build_ring(struct HostPool *host_pool)
+{
+    struct HostPoolEndpoint *endpoint, *tmp;
+    char *buf;
+    size_t size;
+    int i, len;
+    
+    free(host_pool->ring);
+    host_pool->ring = malloc(host_pool->count * host_pool->ring_points * sizeof(struct HostPoolRingPoint));
+    host_pool->ring_count = 0;
+    HASH_ITER(hh, host_pool->endpoints, endpoint, tmp) {
+        // the whole key is hashed, however long the path is (plus room for
+        // ":<port>#<point>")
+        size = strlen(endpoint->address) + strlen(endpoint->path) + 32;
+        buf = malloc(size);
+        for (i = 0; i < host_pool->ring_points; i++) {
+            len = snprintf(buf, size, "%s:%d%s#%d", endpoint->address, endpoint->port, endpoint->path, i);
+            host_pool->ring[host_pool->ring_count].hash = host_pool_hash(buf, len);
+            host_pool->ring[host_pool->ring_count].endpoint = endpoint;
+            host_pool->ring_count++;
+        }
+        free(buf);
+    }
+    qsort(host_pool->ring, host_pool->ring_count, sizeof(struct HostPoolRingPoint), host_pool_ring_point_cmp);
+}
+
+/*
+ * the index of the first point clockwise from hash
+ */
+static int host_pool_ring_index(struct HostPool *host_pool, uint64_t hash)
+{
+    int lo = 0, hi, mid;
+    
+    if (!host_pool->ring) {
+        host_pool_build_ring(host_pool);
+    }
+    
+    hi = host_pool->ring_count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (host_pool->ring[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo % host_pool->ring_count;
+}
+
+/*
+ * the endpoint owning hash, or when it's down the next one clockwise that is
+ * up or due a retry. keys only move off an endpoint while it's down.
+ */
+static struct HostPoolEndpoint *host_pool_get_ring_endpoint(struct HostPool *host_pool, uint64_t hash)
+{
+    struct HostPoolEndpoint *endpoint;
+    int i, index;
+    time_t now;
+    
+    time(&now);
+    index = host_pool_ring_index(host_pool, hash);
+    for (i = 0; i < host_pool->ring_count; i++) {
+        endpoint = host_pool->ring[(index + i) % host_pool->ring_count].endpoint;
+        
+        _DEBUG("HOST_POOL: trying #%d (%s:%d%s)\n", endpoint->id, endpoint->address, endpoint->port, endpoint->path);
+        
+        if (endpoint->alive) {
+            return host_pool->current_endpoint = endpoint;
+        }
+        if (host_pool_endpoint_can_retry(host_pool, endpoint, now)) {
+            host_pool_endpoint_retry(host_pool, endpoint, now);
+            return host_pool->current_endpoint = endpoint;
+        }
+    }
+    
+    if (host_pool->reset_on_all_failed) {
+        host_pool_reset(host_pool);
+        return host_pool->current_endpoint = host_pool->ring[index].endpoint;
+    }
+    
+    return NULL;
+}
+
+/*
+ * HOST_POOL_CONSISTENT_HASH for a key, so the same key keeps going to the
+ * same endpoint
+ */
+struct HostPoolEndpoint *host_pool_get_endpoint_by_key(struct HostPool *host_pool, const char *key, size_t len)
+{
+    return host_pool_get_endpoint(host_pool, HOST_POOL_CONSISTENT_HASH, (int64_t)host_pool_hash(key, len));
+}
+
+/*
+ * for HOST_POOL_SINGLE state identifies the message (the same endpoint is
+ * returned until it changes), for HOST_POOL_CONSISTENT_HASH it's the key's
+ * hash (see host_pool_hash())
+ */
 struct HostPoolEndpoint *host_pool_get_endpoint(struct HostPool *host_pool,
         enum HostPoolEndpointSelectionMode mode, int64_t state)
 {
@@ -107,6 +372,14 @@ struct HostPoolEndpoint *host_pool_get_endpoint(struct HostPool *host_pool,
     int c;
     time_t now;
     
+    if (host_pool->count == 0) {
+        return NULL;
+    }
+    
+    if (mode == HOST_POOL_CONSISTENT_HASH) {
+        return host_pool_get_ring_endpoint(host_pool, (uint64_t)state);
+    }
+    
     c = host_pool->count;
     while (c--) {
         endpoint = host_pool_next_endpoint(host_pool, mode, state);
@@ -117,22 +390,10 @@ struct HostPoolEndpoint *host_pool_get_endpoint(struct HostPool *host_pool,
             return endpoint;
         }
         
-        if ((host_pool->retry_failed_hosts == -1) ||
-                (endpoint->retry_count <= host_pool->retry_failed_hosts)) {
-            time(&now);
-            if (endpoint->next_retry < now) {
-                endpoint->retry_count++;
-                if (host_pool->retry_interval == -1) {
-                    endpoint->retry_delay = endpoint->retry_delay * 2;
-                    if (endpoint->retry_delay > host_pool->max_retry_interval) {
-                        endpoint->retry_delay = host_pool->max_retry_interval;
-                    }
-                } else {
-                    endpoint->retry_delay = host_pool->retry_interval;
-                }
-                endpoint->next_retry = now + endpoint->retry_delay;
-                return endpoint;
-            }
+        time(&now);
+        if (host_pool_endpoint_can_retry(host_pool, endpoint, now)) {
+            host_pool_endpoint_retry(host_pool, endpoint, now);
+            return endpoint;
         }
         
         // if any of the modes fail default to round robin in order
@@ -143,7 +404,7 @@ struct HostPoolEndpoint *host_pool_get_endpoint(struct HostPool *host_pool,
         // however, if we were asked to find a random endpoint, randomize once
         // more so that the endpoint following the failed endpoint won't get a
         // disproportionate number of additional requests
-        if (mode == HOST_POOL_RANDOM) {
+        if (mode == HOST_POOL_RANDOM || mode == HOST_POOL_POWER_OF_TWO) {
             host_pool_next_endpoint(host_pool, mode, state);
         }
         mode = HOST_POOL_ROUND_ROBIN;
@@ -157,9 +418,55 @@ struct HostPoolEndpoint *host_pool_get_endpoint(struct HostPool *host_pool,
     return NULL;
 }
 
+/*
+ * whether a failed endpoint is due for another attempt. doesn't change any state,
+ * so callers with their own selection logic can check several endpoints
+ */
+int host_pool_endpoint_can_retry(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint, time_t now)
+{
+    if ((host_pool->retry_failed_hosts == -1) ||
+            (endpoint->retry_count <= host_pool->retry_failed_hosts)) {
+        return endpoint->next_retry < now;
+    }
+    return 0;
+}
+
+/*
+ * record an attempt on a failed endpoint and push back its next retry
+ */
+void host_pool_endpoint_retry(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint, time_t now)
+{
+    endpoint->retry_count++;
+    if (host_pool->retry_interval == -1) {
+        endpoint->retry_delay = endpoint->retry_delay * 2;
+        if (endpoint->retry_delay > host_pool->max_retry_interval) {
+            endpoint->retry_delay = host_pool->max_retry_interval;
+        }
+    } else {
+        endpoint->retry_delay = host_pool->retry_interval;
+    }
+    endpoint->next_retry = now + endpoint->retry_delay;
+}
+
+static struct HostPoolEndpoint *host_pool_endpoint_at(struct HostPool *host_pool, int index)
+{
+    struct HostPoolEndpoint *endpoint, *tmp;
+    int i = 0;
+    
+    if (!host_pool->list) {
+        host_pool->list = malloc(host_pool->count * sizeof(struct HostPoolEndpoint *));
+        HASH_ITER(hh, host_pool->endpoints, endpoint, tmp) {
+            host_pool->list[i++] = endpoint;
+        }
+    }
+    
+    return host_pool->list[index];
+}
+
 struct HostPoolEndpoint *host_pool_next_endpoint(struct HostPool *host_pool,
         enum HostPoolEndpointSelectionMode mode, int64_t state)
 {
+    struct HostPoolEndpoint *other;
     int index;
     
     switch (mode) {
@@ -167,7 +474,7 @@ struct HostPoolEndpoint *host_pool_next_endpoint(struct HostPool *host_pool,
         case HOST_POOL_RANDOM:
             // choose HOST_POOL_RANDOMly
             index = rand() % host_pool->count;
-            HASH_FIND_INT(host_pool->endpoints, &index, host_pool->current_endpoint);
+            host_pool->current_endpoint = host_pool_endpoint_at(host_pool, index);
             break;
         case HOST_POOL_ROUND_ROBIN:
             // round-robin through the endpoints for each request
@@ -184,6 +491,27 @@ struct HostPoolEndpoint *host_pool_next_endpoint(struct HostPool *host_pool,
                                                host_pool->endpoints) : host_pool->endpoints;
             }
             break;
+        case HOST_POOL_CONSISTENT_HASH:
+            // the owner of the hash, whether or not it's up
+            host_pool->current_endpoint = host_pool->ring[host_pool_ring_index(host_pool, (uint64_t)state)].endpoint;
+            break;
+        case HOST_POOL_POWER_OF_TWO:
+            // the better scored of two different endpoints chosen at random
+            index = rand() % host_pool->count;
+            host_pool->current_endpoint = host_pool_endpoint_at(host_pool, index);
+            if (host_pool->count > 1) {
+                index = (index + 1 + rand() % (host_pool->count - 1)) % host_pool->count;
+                other = host_pool_endpoint_at(host_pool, index);
+                if (other->alive != host_pool->current_endpoint->alive) {
+                    if (other->alive) {
+                        host_pool->current_endpoint = other;
+                    }
+                } else if (host_pool_endpoint_score(host_pool, other) <
+                           host_pool_endpoint_score(host_pool, host_pool->current_endpoint)) {
+                    host_pool->current_endpoint = other;
+                }
+            }
+            break;
     }
     
     assert(host_pool->current_endpoint != NULL);
@@ -196,7 +524,10 @@ void host_pool_mark_success(struct HostPool *host_pool, int id)
     struct HostPoolEndpoint *endpoint;
     
     HASH_FIND_INT(host_pool->endpoints, &id, endpoint);
-    assert(endpoint != NULL);
+    if (!endpoint) {
+        // removed while the request was in flight
+        return;
+    }
     
     _DEBUG("HOST_POOL: marking endpoint #%d (%s:%d%s) as SUCCESS\n",
            endpoint->id, endpoint->address, endpoint->port, endpoint->path);
@@ -210,7 +541,9 @@ void host_pool_mark_failed(struct HostPool *host_pool, int id)
     time_t now;
     
     HASH_FIND_INT(host_pool->endpoints, &id, endpoint);
-    assert(endpoint != NULL);
+    if (!endpoint) {
+        return;
+    }
     
     _DEBUG("HOST_POOL: marking endpoint #%d (%s:%d%s) as FAILED\n",
            endpoint->id, endpoint->address, endpoint->port, endpoint->path);
@@ -228,6 +561,77 @@ void host_pool_mark_failed(struct HostPool *host_pool, int id)
     }
 }
 
+double host_pool_clock_ms(void)
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/*
+ * fade an endpoint's averages towards 0 for the time since they were last
+ * updated, so an endpoint that stopped getting requests for being slow is
+ * tried again once its score drops below the others
+ */
+static void host_pool_endpoint_decay(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint, double now)
+{
+    double weight;
+    
+    if (endpoint->scored_at && now > endpoint->scored_at) {
+        weight = exp(-(now - endpoint->scored_at) / host_pool->decay_ms);
+        endpoint->latency_ms *= weight;
+        endpoint->error_rate *= weight;
+    }
+    endpoint->scored_at = now;
+}
+
+/*
+ * an endpoint's cost for HOST_POOL_POWER_OF_TWO, lower is better: its
+ * average response time, scaled up by its recent failures
+ */
+double host_pool_endpoint_score(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint)
+{
+    host_pool_endpoint_decay(host_pool, endpoint, host_pool->clock());
+    
+    return (endpoint->latency_ms + 1) * (1 + HOST_POOL_ERROR_PENALTY * endpoint->error_rate);
+}
+
+/*
+ * a response slower than the average takes its place straight away, so
+ * an endpoint that starts struggling stops being chosen on the next
+ * request rather than after several. faster ones pull it down gradually.
+ */
+static void host_pool_endpoint_observe(struct HostPool *host_pool, int id, double duration_ms, int failed)
+{
+    struct HostPoolEndpoint *endpoint;
+    
+    HASH_FIND_INT(host_pool->endpoints, &id, endpoint);
+    if (!endpoint) {
+        return;
+    }
+    
+    host_pool_endpoint_decay(host_pool, endpoint, host_pool->clock());
+    if (duration_ms > endpoint->latency_ms) {
+        endpoint->latency_ms = duration_ms;
+    } else {
+        endpoint->latency_ms = endpoint->latency_ms * (1 - HOST_POOL_EWMA_ALPHA) + duration_ms * HOST_POOL_EWMA_ALPHA;
+    }
+    endpoint->error_rate = endpoint->error_rate * (1 - HOST_POOL_EWMA_ALPHA) + (failed ? HOST_POOL_EWMA_ALPHA : 0);
+}
+
+void host_pool_mark_success_duration(struct HostPool *host_pool, int id, double duration_ms)
+{
+    host_pool_endpoint_observe(host_pool, id, duration_ms, 0);
+    host_pool_mark_success(host_pool, id);
+}
+
+void host_pool_mark_failed_duration(struct HostPool *host_pool, int id, double duration_ms)
+{
+    host_pool_endpoint_observe(host_pool, id, duration_ms, 1);
+    host_pool_mark_failed(host_pool, id);
+}
+
 void host_pool_reset(struct HostPool *host_pool)
 {
     struct HostPoolEndpoint *endpoint, *tmp;
@@ -3,6 +3,7 @@
 
 #include <uthash.h>
 #include <time.h>
+#include <stdint.h>
 
 struct HostPoolEndpoint {
     int id;
@@ -13,11 +14,21 @@ struct HostPoolEndpoint {
     char *address;
     int port;
     char *path;
+    // decaying averages of response time and failures, see host_pool_endpoint_score()
+    double latency_ms;
+    double error_rate;
+    double scored_at;
     UT_hash_handle hh;
 };
 
+struct HostPoolRingPoint {
+    uint64_t hash;
+    struct HostPoolEndpoint *endpoint;
+};
+
 struct HostPool {
     int count;
+    int next_id;
     int retry_failed_hosts;
     int retry_interval;
     time_t max_retry_interval;
@@ -25,12 +36,23 @@ struct HostPool {
     struct HostPoolEndpoint *endpoints;
     struct HostPoolEndpoint *current_endpoint;
     int64_t checkpoint;
+    // milliseconds for an idle endpoint's score to decay by 1/e
+    double decay_ms;
+    double (*clock)(void);
+    // HOST_POOL_CONSISTENT_HASH, built on first use after the endpoints change
+    int ring_points;
+    int ring_count;
+    struct HostPoolRingPoint *ring;
+    // the endpoints in an array for random selection, rebuilt with the ring
+    struct HostPoolEndpoint **list;
 };
 
 enum HostPoolEndpointSelectionMode {
     HOST_POOL_RANDOM,
     HOST_POOL_ROUND_ROBIN,
-    HOST_POOL_SINGLE
+    HOST_POOL_SINGLE,
+    HOST_POOL_POWER_OF_TWO,
+    HOST_POOL_CONSISTENT_HASH
 };
 
 struct HostPool *new_host_pool(int retry_failed_hosts, int retry_interval,
@@ -39,13 +61,25 @@ void free_host_pool(struct HostPool *host_pool);
 struct HostPoolEndpoint *new_host_pool_endpoint(struct HostPool *host_pool,
         const char *address, int port, char *path);
 void free_host_pool_endpoint(struct HostPoolEndpoint *host_pool_endpoint);
+struct HostPoolEndpoint *host_pool_find_endpoint(struct HostPool *host_pool,
+        const char *address, int port, const char *path);
+void host_pool_remove_endpoint(struct HostPool *host_pool, struct HostPoolEndpoint *host_pool_endpoint);
 void host_pool_from_json(struct HostPool *host_pool, json_object *host_pool_endpoint_list);
+int host_pool_update_from_json(struct HostPool *host_pool, json_object *host_pool_endpoint_list);
 struct HostPoolEndpoint *host_pool_get_endpoint(struct HostPool *host_pool,
         enum HostPoolEndpointSelectionMode mode, int64_t state);
+struct HostPoolEndpoint *host_pool_get_endpoint_by_key(struct HostPool *host_pool, const char *key, size_t len);
+uint64_t host_pool_hash(const char *data, size_t len);
 struct HostPoolEndpoint *host_pool_next_endpoint(struct HostPool *host_pool,
         enum HostPoolEndpointSelectionMode mode, int64_t state);
+int host_pool_endpoint_can_retry(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint, time_t now);
+void host_pool_endpoint_retry(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint, time_t now);
 void host_pool_mark_success(struct HostPool *host_pool, int id);
 void host_pool_mark_failed(struct HostPool *host_pool, int id);
+void host_pool_mark_success_duration(struct HostPool *host_pool, int id, double duration_ms);
+void host_pool_mark_failed_duration(struct HostPool *host_pool, int id, double duration_ms);
+double host_pool_endpoint_score(struct HostPool *host_pool, struct HostPoolEndpoint *endpoint);
+double host_pool_clock_ms(void);
 void host_pool_reset(struct HostPool *host_pool);
 
 #endif
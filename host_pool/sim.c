@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <json/json.h>
+#include "host_pool.h"
+
+/*
+ * simulates a client spreading requests over a host pool where one backend
+ * is degraded (slow, not failing), comparing HOST_POOL_RANDOM,
+ * HOST_POOL_ROUND_ROBIN and HOST_POOL_POWER_OF_TWO.
+ *
+ * load: poisson arrivals at 600 req/s, over 10 backends
+ * backends: 4 requests at a time each (the rest queue), service times
+ *   exponential around 5ms; backend #0 takes 10x as long
+ * the client reports each response's duration (queueing included) with
+ * host_pool_mark_success_duration(), on a simulated clock
+ *
+ * usage: sim [seconds] [slowdown] [backends]
+ */
+
+#define RATE            600
+#define SERVICE_MS      5.0
+#define CONCURRENCY     4
+#define MAX_BACKENDS    64
+#define MAX_LATENCY_MS  100000
+
+struct backend {
+    double free_at[CONCURRENCY];
+    double service_ms;
+    int requests;
+};
+
+struct completion {
+    double at;
+    double duration_ms;
+    int id;
+};
+
+struct sim {
+    double now;
+    unsigned int seed;
+    struct backend backends[MAX_BACKENDS];
+    int num_backends;
+    // pending completions, a min heap on at
+    struct completion *heap;
+    int heap_len;
+    int heap_size;
+    // results
+    int requests;
+    int *latency_histogram;
+    double latency_total;
+};
+
+static struct sim *sim;
+
+static double sim_clock()
+{
+    return sim->now;
+}
+
+static double sim_rand(struct sim *s)
+{
+    s->seed = s->seed * 1103515245 + 12345;
+    return (((s->seed >> 16) & 0x7fff) + 0.5) / 32768.0;
+}
+
+static void heap_push(struct sim *s, struct completion *c)
+{
+    struct completion tmp;
+    int i, parent;
+    
+    if (s->heap_len == s->heap_size) {
+        s->heap_size = s->heap_size ? s->heap_size * 2 : 1024;
+        s->heap = realloc(s->heap, s->heap_size * sizeof(struct completion));
+    }
+    i = s->heap_len++;
+    s->heap[i] = *c;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (s->heap[parent].at <= s->heap[i].at) {
+            break;
+        }
+        tmp = s->heap[parent];
+        s->heap[parent] = s->heap[i];
+        s->heap[i] = tmp;
+        i = parent;
+    }
+}
+
+static void heap_pop(struct sim *s, struct completion *c)
+{
+    struct completion tmp;
+    int i = 0, child;
+    
+    *c = s->heap[0];
+    s->heap[0] = s->heap[--s->heap_len];
+    while ((child = i * 2 + 1) < s->heap_len) {
+        if (child + 1 < s->heap_len && s->heap[child + 1].at < s->heap[child].at) {
+            child++;
+        }
+        if (s->heap[i].at <= s->heap[child].at) {
+            break;
+        }
+        tmp = s->heap[child];
+        s->heap[child] = s->heap[i];
+        s->heap[i] = tmp;
+        i = child;
+    }
+}
+
+/*
+ * the request queues for the backend's first free slot
+ */
+static double backend_request(struct sim *s, struct backend *b)
+{
+    double start, done;
+    int i, slot = 0;
+    
+    for (i = 1; i < CONCURRENCY; i++) {
+        if (b->free_at[i] < b->free_at[slot]) {
+            slot = i;
+        }
+    }
+    start = b->free_at[slot] > s->now ? b->free_at[slot] : s->now;
+    done = start - log(sim_rand(s)) * b->service_ms;
+    b->free_at[slot] = done;
+    b->requests++;
+    
+    return done;
+}
+
+static void run(struct sim *s, struct HostPool *host_pool, enum HostPoolEndpointSelectionMode mode, double duration_ms)
+{
+    struct HostPoolEndpoint *endpoint;
+    struct completion c;
+    double next_arrival = 0;
+    int latency;
+    
+    while (next_arrival < duration_ms) {
+        while (s->heap_len && s->heap[0].at <= next_arrival) {
+            heap_pop(s, &c);
+            s->now = c.at;
+            host_pool_mark_success_duration(host_pool, c.id, c.duration_ms);
+        }
+        s->now = next_arrival;
+        
+        endpoint = host_pool_get_endpoint(host_pool, mode, 0);
+        c.id = endpoint->id;
+        c.at = backend_request(s, &s->backends[endpoint->id]);
+        c.duration_ms = c.at - s->now;
+        heap_push(s, &c);
+        
+        s->requests++;
+        s->latency_total += c.duration_ms;
+        latency = (int)(c.duration_ms * 10);
+        s->latency_histogram[latency < MAX_LATENCY_MS ? latency : MAX_LATENCY_MS - 1]++;
+        
+        next_arrival -= log(sim_rand(s)) * 1000.0 / RATE;
+    }
+}
+
+static double percentile(struct sim *s, double p)
+{
+    int i, n = 0;
+    
+    for (i = 0; i < MAX_LATENCY_MS; i++) {
+        n += s->latency_histogram[i];
+        if (n >= s->requests * p) {
+            return i / 10.0;
+        }
+    }
+    return MAX_LATENCY_MS / 10.0;
+}
+
+static void report(const char *name, struct sim *s)
+{
+    fprintf(stdout, "%-14s %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f%%\n", name,
+            s->latency_total / s->requests, percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999),
+            percentile(s, 1), s->backends[0].requests * 100.0 / s->requests);
+}
+
+static void simulate(const char *name, enum HostPoolEndpointSelectionMode mode, int num_backends,
+                     double slowdown, double duration_ms)
+{
+    struct HostPool *host_pool;
+    int i;
+    
+    sim = calloc(1, sizeof(struct sim));
+    sim->seed = 1;
+    sim->num_backends = num_backends;
+    sim->latency_histogram = calloc(MAX_LATENCY_MS, sizeof(int));
+    srand(1);
+    
+    host_pool = new_host_pool(-1, -1, 30, 1);
+    host_pool->clock = sim_clock;
+    for (i = 0; i < num_backends; i++) {
+        new_host_pool_endpoint(host_pool, "127.0.0.1", 8000 + i, "/");
+        sim->backends[i].service_ms = i == 0 ? SERVICE_MS * slowdown : SERVICE_MS;
+    }
+    
+    run(sim, host_pool, mode, duration_ms);
+    report(name, sim);
+    
+    free_host_pool(host_pool);
+    free(sim->latency_histogram);
+    free(sim->heap);
+    free(sim);
+}
+
+int main(int argc, char **argv)
+{
+    double duration_ms = (argc > 1 ? atoi(argv[1]) : 60) * 1000.0;
+    double slowdown = argc > 2 ? atof(argv[2]) : 10;
+    int num_backends = argc > 3 ? atoi(argv[3]) : 10;
+    
+    if (num_backends < 2 || num_backends > MAX_BACKENDS) {
+        fprintf(stderr, "ERROR: backends must be between 2 and %d\n", MAX_BACKENDS);
+        return 1;
+    }
+    
+    fprintf(stdout, "%d seconds, %d backends, %d req/s, backend #0 %.0fx slower\n",
+            (int)(duration_ms / 1000), num_backends, RATE, slowdown);
+    fprintf(stdout, "%-14s %8s %8s %8s %8s %8s %10s\n", "mode",
+            "mean ms", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "to slow");
+    
+    simulate("random", HOST_POOL_RANDOM, num_backends, slowdown, duration_ms);
+    simulate("round_robin", HOST_POOL_ROUND_ROBIN, num_backends, slowdown, duration_ms);
+    simulate("power_of_two", HOST_POOL_POWER_OF_TWO, num_backends, slowdown, duration_ms);
+    
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <json/json.h>
+#include "watcher.h"
+
+#ifdef DEBUG
+#define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
+#else
+#define _DEBUG(...) do {;} while (0)
+#endif
+
+/*
+ * keeps a host pool in step with a file holding a JSON list of endpoint
+ * urls (the same as host_pool_from_json() takes). the file is re-read when
+ * it's written or replaced (inotify, linux only) and on SIGHUP.
+ *
+ * the reload runs from the event loop, between callbacks, so a selection
+ * never sees the pool half updated and nothing needs to lock. endpoints
+ * that stay keep their health; responses still in flight for a removed
+ * endpoint are ignored by host_pool_mark_*().
+ */
+
+static char *read_file(const char *filename)
+{
+    struct stat st;
+    char *data;
+    FILE *fp;
+    size_t len;
+    
+    fp = fopen(filename, "r");
+    if (!fp) {
+        return NULL;
+    }
+    if (fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    data = malloc(st.st_size + 1);
+    len = fread(data, 1, st.st_size, fp);
+    data[len] = '\0';
+    fclose(fp);
+    
+    return data;
+}
+
+/*
+ * re-read the file and update the pool. returns the number of endpoints
+ * added and removed, or -1 when the file can't be read or parsed (the pool
+ * is left as it was)
+ */
+int host_pool_watcher_reload(struct HostPoolWatcher *watcher)
+{
+    struct json_object *endpoints;
+    char *data;
+    int changes;
+    
+    data = read_file(watcher->filename);
+    if (!data) {
+        fprintf(stderr, "ERROR: failed to read host pool file %s\n", watcher->filename);
+        watcher->reload_errors++;
+        return -1;
+    }
+    endpoints = json_tokener_parse(data);
+    free(data);
+    if (!endpoints || !json_object_is_type(endpoints, json_type_array)) {
+        fprintf(stderr, "ERROR: host pool file %s is not a JSON list\n", watcher->filename);
+        if (endpoints) {
+            json_object_put(endpoints);
+        }
+        watcher->reload_errors++;
+        return -1;
+    }
+    
+    changes = host_pool_update_from_json(watcher->host_pool, endpoints);
+    json_object_put(endpoints);
+    if (changes == -1) {
+        watcher->reload_errors++;
+        return -1;
+    }
+    
+    watcher->reloads++;
+    _DEBUG("HOST_POOL: reloaded %s, %d changes, %d endpoints\n", watcher->filename, changes, watcher->host_pool->count);
+    if (changes && watcher->cb) {
+        (*watcher->cb)(watcher->host_pool, changes, watcher->arg);
+    }
+    
+    return changes;
+}
+
+static void host_pool_watcher_hup_cb(int sig, short what, void *arg)
+{
+    host_pool_watcher_reload((struct HostPoolWatcher *)arg);
+}
+
+#ifdef __linux__
+/*
+ * the directory is watched rather than the file so that replacing it
+ * with a rename (as most editors and config management do) is seen
+ */
+static void host_pool_watcher_inotify_cb(int fd, short what, void *arg)
+{
+    struct HostPoolWatcher *watcher = (struct HostPoolWatcher *)arg;
+    struct inotify_event *event;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len, i;
+    int changed = 0;
+    
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < len; i += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)(buf + i);
+            if (event->len && strcmp(event->name, watcher->basename) == 0) {
+                changed = 1;
+            }
+        }
+    }
+    
+    if (changed) {
+        host_pool_watcher_reload(watcher);
+    }
+}
+
+static int host_pool_watcher_inotify(struct HostPoolWatcher *watcher)
+{
+    char *filename, *dir;
+    int wd;
+    
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->inotify_fd == -1) {
+        return 0;
+    }
+    
+    filename = strdup(watcher->filename);
+    dir = dirname(filename);
+    wd = inotify_add_watch(watcher->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(filename);
+    if (wd == -1) {
+        close(watcher->inotify_fd);
+        watcher->inotify_fd = -1;
+        return 0;
+    }
+    
+    event_set(&watcher->inotify_ev, watcher->inotify_fd, EV_READ | EV_PERSIST, host_pool_watcher_inotify_cb, watcher);
+    event_add(&watcher->inotify_ev, NULL);
+    
+    return 1;
+}
+#endif
+
+/*
+ * load filename into host_pool and keep it up to date. cb (optional) is
+ * called after a reload that changed the pool. returns NULL if the file
+ * can't be loaded the first time.
+ */
+struct HostPoolWatcher *new_host_pool_watcher(struct HostPool *host_pool, const char *filename,
+        void (*cb)(struct HostPool *host_pool, int changes, void *arg), void *arg)
+{
+    struct HostPoolWatcher *watcher;
+    char *tmp;
+    
+    watcher = calloc(1, sizeof(struct HostPoolWatcher));
+    watcher->host_pool = host_pool;
+    watcher->filename = strdup(filename);
+    tmp = strdup(filename);
+    watcher->basename = strdup(basename(tmp));
+    free(tmp);
+    watcher->inotify_fd = -1;
+    
+    if (host_pool_watcher_reload(watcher) == -1) {
+        free(watcher->filename);
+        free(watcher->basename);
+        free(watcher);
+        return NULL;
+    }
+    watcher->cb = cb;
+    watcher->arg = arg;
+    
+#ifdef __linux__
+    if (!host_pool_watcher_inotify(watcher)) {
+        fprintf(stderr, "ERROR: failed to watch %s, reloading on SIGHUP only\n", watcher->filename);
+    }
+#endif
+    signal_set(&watcher->hup_ev, SIGHUP, host_pool_watcher_hup_cb, watcher);
+    signal_add(&watcher->hup_ev, NULL);
+    
+    return watcher;
+}
+
+void free_host_pool_watcher(struct HostPoolWatcher *watcher)
+{
+    if (watcher) {
+        if (watcher->inotify_fd != -1) {
+            event_del(&watcher->inotify_ev);
+            close(watcher->inotify_fd);
+        }
+        signal_del(&watcher->hup_ev);
+        free(watcher->filename);
+        free(watcher->basename);
+        free(watcher);
+    }
+}
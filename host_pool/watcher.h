@@ -0,0 +1,26 @@
+#ifndef __host_pool_watcher_h
+#define __host_pool_watcher_h
+
+#include <stdint.h>
+#include <event.h>
+#include "host_pool.h"
+
+struct HostPoolWatcher {
+    struct HostPool *host_pool;
+    char *filename;
+    char *basename;
+    int inotify_fd;
+    struct event inotify_ev;
+    struct event hup_ev;
+    void (*cb)(struct HostPool *host_pool, int changes, void *arg);
+    void *arg;
+    uint64_t reloads;
+    uint64_t reload_errors;
+};
+
+struct HostPoolWatcher *new_host_pool_watcher(struct HostPool *host_pool, const char *filename,
+        void (*cb)(struct HostPool *host_pool, int changes, void *arg), void *arg);
+int host_pool_watcher_reload(struct HostPoolWatcher *watcher);
+void free_host_pool_watcher(struct HostPoolWatcher *watcher);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "segment_writer.h"
+
+/*
+ * messages/s and MB/s writing N messages the way ps_to_file used to (a
+ * strftime() and filename compare per message, stdio writes, no sync) vs.
+ * through segment_writer (roll checked once a second, one large buffer,
+ * fdatasync when done), plain and gzip compressed
+ *
+ * usage: bench_ps_to_file [directory] [messages] [message size]
+ */
+
+double now()
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void fill_message(char *message, int size, int i)
+{
+    int len;
+    
+    len = snprintf(message, size, "{\"id\": %d, \"user\": \"user%d\", \"ip\": \"10.0.%d.%d\", \"desc\": \"", i, i % 1000, (i >> 8) & 0xff, i & 0xff);
+    while (len < size - 2) {
+        message[len] = 'a' + (i + len) % 26;
+        len++;
+    }
+    message[len++] = '"';
+    message[len] = '}';
+}
+
+double bench_stdio(const char *format, char *message, int size, int num_messages)
+{
+    char current_filename[255] = "", temp_filename[255];
+    FILE *output_file = NULL;
+    struct tm *time_struct;
+    time_t timer;
+    double start;
+    int i;
+    
+    start = now();
+    for (i = 0; i < num_messages; i++) {
+        fill_message(message, size, i);
+        timer = time(NULL);
+        time_struct = gmtime(&timer);
+        strftime(temp_filename, 255, format, time_struct);
+        if (strcmp(temp_filename, current_filename) != 0) {
+            if (output_file) {
+                fclose(output_file);
+            }
+            strcpy(current_filename, temp_filename);
+            output_file = fopen(current_filename, "ab");
+        }
+        fwrite(message, 1, size, output_file);
+        putc('\n', output_file);
+    }
+    fclose(output_file);
+    
+    return now() - start;
+}
+
+double bench_segment_writer(const char *format, char *message, int size, int num_messages, int gzip_level, uint64_t *bytes_out)
+{
+    struct segment_writer *w;
+    double start, last_check;
+    int i;
+    
+    start = last_check = now();
+    w = new_segment_writer(format, 1024 * 1024, gzip_level);
+    for (i = 0; i < num_messages; i++) {
+        fill_message(message, size, i);
+        // stands in for ps_to_file's one second roll timer
+        if ((i & 1023) == 0 && now() - last_check >= 1) {
+            segment_writer_check_roll(w, time(NULL));
+            last_check = now();
+        }
+        segment_writer_write(w, message, size);
+        segment_writer_write(w, "\n", 1);
+    }
+    *bytes_out = segment_writer_bytes_out(w);
+    free_segment_writer(w);
+    
+    return now() - start;
+}
+
+void report(const char *name, int num_messages, double mb, double elapsed)
+{
+    fprintf(stdout, "%-24s %12.0f %10.1f\n", name, num_messages / elapsed, mb / elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    int num_messages = argc > 2 ? atoi(argv[2]) : 1000000;
+    int size = argc > 3 ? atoi(argv[3]) : 200;
+    char format[1024];
+    char *message;
+    uint64_t bytes_out;
+    double mb, elapsed;
+    
+    if (size < 64) {
+        size = 64;
+    }
+    message = malloc(size);
+    mb = (double)num_messages * (size + 1) / (1024 * 1024);
+    snprintf(format, sizeof(format), "%s/bench_ps_to_file.%%Y%%m%%d%%H%%M%%S.log", dir);
+    
+    fprintf(stdout, "%d messages of %d bytes (%.1f MB)\n", num_messages, size, mb);
+    fprintf(stdout, "%-24s %12s %10s\n", "", "msg/s", "MB/s");
+    report("stdio per message", num_messages, mb, bench_stdio(format, message, size, num_messages));
+    report("segment_writer", num_messages, mb, bench_segment_writer(format, message, size, num_messages, 0, &bytes_out));
+    elapsed = bench_segment_writer(format, message, size, num_messages, 1, &bytes_out);
+    report("segment_writer gzip -1", num_messages, mb, elapsed);
+    fprintf(stdout, "(gzip -1 wrote %.1f MB)\n", (double)bytes_out / (1024 * 1024));
+    fprintf(stdout, "output files are left in %s/bench_ps_to_file.*\n", dir);
+    
+    free(message);
+    return 0;
+}
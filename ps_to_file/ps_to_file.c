@@ -4,8 +4,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 #include <simplehttp/simplehttp.h>
 #include <pubsubclient/pubsubclient.h>
+#include "segment_writer.h"
 
 #ifdef DEBUG
 #define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
@@ -15,48 +17,65 @@
 
 #define VERSION "1.3"
 
-struct output_metadata {
-    char *filename_format;
-    char current_filename[255];
-    char temp_filename[255];
-    FILE *output_file;
-};
+static struct segment_writer *writer = NULL;
+static struct event roll_ev;
+static struct event sync_ev;
+static struct timeval sync_interval = {1, 0};
 
-void process_message_cb(char *message, void *cbarg)
+/*
+ * called with every complete message from a read, as views into the receive buffer
+ */
+void process_messages_cb(int source_id, struct pubsubclient_message *messages, int count, void *cbarg)
 {
-    struct output_metadata *data;
-    time_t timer;
-    struct tm *time_struct;
+    int i;
     
-    _DEBUG("process_message_cb()\n");
+    _DEBUG("process_messages_cb() %d messages\n", count);
     
-    if (message == NULL || strlen(message) < 3) {
-        return;
-    }
-    
-    data = (struct output_metadata *)cbarg;
-    
-    timer = time(NULL);
-    time_struct = gmtime(&timer);
-    _DEBUG("strftime format %s\n", data->filename_format);
-    strftime(data->temp_filename, 255, data->filename_format, time_struct);
-    _DEBUG("after strftime %s\n", data->temp_filename);
-    if (strcmp(data->temp_filename, data->current_filename) != 0) {
-        _DEBUG("rolling file\n");
-        // roll file or open file
-        if (data->output_file) {
-            _DEBUG("closing file %s\n", data->current_filename);
-            fclose(data->output_file);
+    for (i = 0; i < count; i++) {
+        if (messages[i].len < 3) {
+            continue;
+        }
+        if (!segment_writer_write(writer, messages[i].data, messages[i].len) ||
+                !segment_writer_write(writer, "\n", 1)) {
+            event_loopbreak();
+            return;
         }
-        _DEBUG("opening file %s\n", data->temp_filename);
-        strcpy(data->current_filename, data->temp_filename);
-        data->output_file = fopen(data->current_filename, "ab");
     }
+}
+
+/*
+ * once a second, start a new file when --filename-format says so. messages
+ * are never checked individually.
+ */
+void roll_cb(int fd, short what, void *arg)
+{
+    struct timeval tv = {1, 0};
     
-    fprintf(data->output_file, "%s\n", message);
+    if (!segment_writer_check_roll(writer, time(NULL))) {
+        event_loopbreak();
+        return;
+    }
+    evtimer_add(&roll_ev, &tv);
+}
+
+void sync_cb(int fd, short what, void *arg)
+{
+    if (!segment_writer_sync(writer)) {
+        event_loopbreak();
+        return;
+    }
+    evtimer_add(&sync_ev, &sync_interval);
 }
 
-void error_cb(int status_code, void *cb_arg)
+void error_cb(int source_id, int status_code, void *cb_arg)
+{
+    // with --reconnect-min-ms the client reconnects on its own
+    if (option_get_int("reconnect_min_ms") <= 0) {
+        event_loopbreak();
+    }
+}
+
+void termination_handler(int signum)
 {
     event_loopbreak();
 }
@@ -74,29 +93,51 @@ int main(int argc, char **argv)
     int port;
     char *path;
     char *filename_format = NULL;
-    struct output_metadata *data;
+    struct pubsubclient *client;
+    int sync_interval_ms;
     
     define_simplehttp_options();
     option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
     option_define_str("pubsub_url", OPT_REQUIRED, "http://127.0.0.1:80/sub?multipart=0", &pubsub_url, NULL, "url of pubsub to read from");
     option_define_str("filename_format", OPT_REQUIRED, NULL, &filename_format, NULL, "/var/log/pubsub.%%Y-%%m-%%d_%%H.log");
+    option_define_int("reconnect_min_ms", OPT_OPTIONAL, 250, NULL, NULL, "first delay before reconnecting to the pubsub, doubled on each failure (0 to exit on disconnect)");
+    option_define_int("reconnect_max_ms", OPT_OPTIONAL, 30000, NULL, NULL, "longest delay between reconnect attempts");
+    option_define_int("buffer_size", OPT_OPTIONAL, 1024 * 1024, NULL, NULL, "bytes buffered before a write()");
+    option_define_int("sync_interval_ms", OPT_OPTIONAL, 1000, NULL, NULL, "how often buffered data is written out and fdatasync()'d (0 to only sync when a file is closed)");
+    option_define_int("gzip_level", OPT_OPTIONAL, 0, NULL, NULL, "gzip compress each file at this level, 1-9 (0 to write plain text)");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
     
-    data = calloc(1, sizeof(struct output_metadata));
-    data->filename_format = filename_format;
-    data->current_filename[0] = '\0';
-    data->temp_filename[0] = '\0';
-    data->output_file = NULL;
+    writer = new_segment_writer(filename_format, option_get_int("buffer_size"), option_get_int("gzip_level"));
+    if (!writer) {
+        return 1;
+    }
+    sync_interval_ms = option_get_int("sync_interval_ms");
+    sync_interval.tv_sec = sync_interval_ms / 1000;
+    sync_interval.tv_usec = (sync_interval_ms % 1000) * 1000;
     
     if (simplehttp_parse_url(pubsub_url, strlen(pubsub_url), &address, &port, &path)) {
-        pubsubclient_main(address, port, path, process_message_cb, error_cb, data);
+        signal(SIGINT, termination_handler);
+        signal(SIGQUIT, termination_handler);
+        signal(SIGTERM, termination_handler);
+        signal(SIGHUP, termination_handler);
         
-        if (data->output_file) {
-            fclose(data->output_file);
+        client = new_pubsubclient(0, address, port, path, process_messages_cb, error_cb, NULL);
+        pubsubclient_set_backoff(client, option_get_int("reconnect_min_ms"), option_get_int("reconnect_max_ms"));
+        evtimer_set(&roll_ev, roll_cb, NULL);
+        evtimer_set(&sync_ev, sync_cb, NULL);
+        roll_cb(-1, EV_TIMEOUT, NULL);
+        if (sync_interval_ms > 0) {
+            evtimer_add(&sync_ev, &sync_interval);
+        }
+        if (pubsubclient_start(client)) {
+            event_dispatch();
         }
+        evtimer_del(&roll_ev);
+        evtimer_del(&sync_ev);
+        free_pubsubclient(client);
         
         free(address);
         free(path);
@@ -104,7 +145,8 @@ int main(int argc, char **argv)
         fprintf(stderr, "ERROR: failed to parse pubsub_url\n");
     }
     
-    free(data);
+    // the last file is completed and renamed into place
+    free_segment_writer(writer);
     free_options();
     free(pubsub_url);
     free(filename_format);
@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "segment_writer.h"
+
+#ifdef DEBUG
+#define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
+#else
+#define _DEBUG(...) do {;} while (0)
+#endif
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+#define SEGMENT_BUFFER_ALIGN 4096
+
+/*
+ * writes time rolled files. data goes through one large aligned buffer
+ * (optionally gzip compressed on the way in) into <filename>.tmp, which is
+ * renamed to <filename> once the segment is complete. callers decide when to
+ * check for a roll and when to sync, typically from timers.
+ */
+struct segment_writer {
+    char *filename_format;
+    char filename[255];
+    char temp_filename[260];
+    int fd;
+    int gzip_level;
+    z_stream zs;
+    char *buf;
+    size_t buf_size;
+    size_t buf_len;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+struct segment_writer *new_segment_writer(const char *filename_format, size_t buffer_size, int gzip_level)
+{
+    struct segment_writer *w;
+    void *buf;
+    
+    buffer_size = (buffer_size + SEGMENT_BUFFER_ALIGN - 1) / SEGMENT_BUFFER_ALIGN * SEGMENT_BUFFER_ALIGN;
+    if (buffer_size == 0) {
+        buffer_size = SEGMENT_BUFFER_ALIGN;
+    }
+    if (posix_memalign(&buf, SEGMENT_BUFFER_ALIGN, buffer_size) != 0) {
+        fprintf(stderr, "ERROR: failed to allocate %lu byte write buffer\n", (unsigned long)buffer_size);
+        return NULL;
+    }
+    
+    w = calloc(1, sizeof(struct segment_writer));
+    w->filename_format = strdup(filename_format);
+    w->fd = -1;
+    w->gzip_level = gzip_level;
+    w->buf = buf;
+    w->buf_size = buffer_size;
+    
+    return w;
+}
+
+static int write_all(struct segment_writer *w, const char *data, size_t len)
+{
+    ssize_t n;
+    
+    while (len) {
+        n = write(w->fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: write() failed for %s (%s)\n", w->temp_filename, strerror(errno));
+            return 0;
+        }
+        data += n;
+        len -= n;
+        w->bytes_out += n;
+    }
+    
+    return 1;
+}
+
+static int segment_writer_flush(struct segment_writer *w)
+{
+    int ret = 1;
+    
+    if (w->buf_len) {
+        ret = write_all(w, w->buf, w->buf_len);
+        w->buf_len = 0;
+    }
+    
+    return ret;
+}
+
+/*
+ * run the compressor until it has taken all of its input (or finished),
+ * writing out the buffer each time it fills
+ */
+static int segment_writer_deflate(struct segment_writer *w, int flush)
+{
+    int ret;
+    
+    do {
+        w->zs.next_out = (Bytef *)w->buf + w->buf_len;
+        w->zs.avail_out = w->buf_size - w->buf_len;
+        ret = deflate(&w->zs, flush);
+        w->buf_len = w->buf_size - w->zs.avail_out;
+        if (ret == Z_STREAM_ERROR) {
+            fprintf(stderr, "ERROR: deflate() failed for %s\n", w->temp_filename);
+            return 0;
+        }
+        if (w->buf_len == w->buf_size && !segment_writer_flush(w)) {
+            return 0;
+        }
+    } while (w->zs.avail_in || (flush != Z_NO_FLUSH && w->zs.avail_out == 0) || (flush == Z_FINISH && ret != Z_STREAM_END));
+    
+    return 1;
+}
+
+/*
+ * the first of <filename>, <filename>.1, .2, ... that doesn't exist yet
+ */
+static void segment_writer_final_filename(struct segment_writer *w, char *final_filename, size_t size)
+{
+    int i;
+    
+    snprintf(final_filename, size, "%s", w->filename);
+    for (i = 1; access(final_filename, F_OK) == 0; i++) {
+        snprintf(final_filename, size, "%s.%d", w->filename, i);
+    }
+}
+
+/*
+ * a <filename>.tmp left over from a run that didn't exit cleanly holds
+ * whatever it synced; it's moved into place like a finished segment before
+ * the new one is started.
+ */
+static int segment_writer_open(struct segment_writer *w, const char *filename)
+{
+    char final_filename[270];
+    
+    strcpy(w->filename, filename);
+    snprintf(w->temp_filename, sizeof(w->temp_filename), "%s.tmp", filename);
+    
+    if (access(w->temp_filename, F_OK) == 0) {
+        segment_writer_final_filename(w, final_filename, sizeof(final_filename));
+        fprintf(stderr, "NOTICE: recovering %s as %s\n", w->temp_filename, final_filename);
+        if (rename(w->temp_filename, final_filename) == -1) {
+            fprintf(stderr, "ERROR: rename(%s, %s) failed (%s)\n", w->temp_filename, final_filename, strerror(errno));
+            return 0;
+        }
+    }
+    
+    _DEBUG("opening file %s\n", w->temp_filename);
+    w->fd = open(w->temp_filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (w->fd == -1) {
+        fprintf(stderr, "ERROR: failed to open %s (%s)\n", w->temp_filename, strerror(errno));
+        return 0;
+    }
+    
+    if (w->gzip_level) {
+        memset(&w->zs, 0, sizeof(w->zs));
+        // 15 + 16 writes a gzip header and trailer instead of a zlib one
+        if (deflateInit2(&w->zs, w->gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "ERROR: deflateInit2() failed\n");
+            close(w->fd);
+            w->fd = -1;
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/*
+ * finish the current segment and move it into place. a file already at the
+ * final name (from an earlier run in the same period) is left alone and the
+ * segment is renamed to <filename>.1, .2, ...
+ */
+int segment_writer_close(struct segment_writer *w)
+{
+    char final_filename[270];
+    int ret = 1;
+    
+    if (w->fd == -1) {
+        return 1;
+    }
+    
+    if (w->gzip_level) {
+        w->zs.next_in = NULL;
+        w->zs.avail_in = 0;
+        ret = segment_writer_deflate(w, Z_FINISH);
+        deflateEnd(&w->zs);
+    }
+    ret = segment_writer_flush(w) && ret;
+    if (fdatasync(w->fd) == -1) {
+        fprintf(stderr, "ERROR: fdatasync() failed for %s (%s)\n", w->temp_filename, strerror(errno));
+        ret = 0;
+    }
+    close(w->fd);
+    w->fd = -1;
+    
+    segment_writer_final_filename(w, final_filename, sizeof(final_filename));
+    _DEBUG("closing file %s -> %s\n", w->temp_filename, final_filename);
+    if (rename(w->temp_filename, final_filename) == -1) {
+        fprintf(stderr, "ERROR: rename(%s, %s) failed (%s)\n", w->temp_filename, final_filename, strerror(errno));
+        ret = 0;
+    }
+    
+    return ret;
+}
+
+/*
+ * start a new segment if the filename for now differs from the current one
+ */
+int segment_writer_check_roll(struct segment_writer *w, time_t now)
+{
+    struct tm time_struct;
+    char filename[255];
+    
+    gmtime_r(&now, &time_struct);
+    strftime(filename, sizeof(filename), w->filename_format, &time_struct);
+    if (w->fd != -1 && strcmp(filename, w->filename) == 0) {
+        return 1;
+    }
+    
+    _DEBUG("rolling file\n");
+    segment_writer_close(w);
+    return segment_writer_open(w, filename);
+}
+
+int segment_writer_write(struct segment_writer *w, const char *data, size_t len)
+{
+    size_t n;
+    
+    if (w->fd == -1 && !segment_writer_check_roll(w, time(NULL))) {
+        return 0;
+    }
+    w->bytes_in += len;
+    
+    if (w->gzip_level) {
+        w->zs.next_in = (Bytef *)data;
+        w->zs.avail_in = len;
+        return segment_writer_deflate(w, Z_NO_FLUSH);
+    }
+    
+    // large writes skip the buffer when there's nothing ahead of them
+    if (w->buf_len == 0 && len >= w->buf_size) {
+        return write_all(w, data, len);
+    }
+    while (len) {
+        n = w->buf_size - w->buf_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->buf + w->buf_len, data, n);
+        w->buf_len += n;
+        data += n;
+        len -= n;
+        if (w->buf_len == w->buf_size && !segment_writer_flush(w)) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/*
+ * push everything written so far to disk. compressed segments are sync
+ * flushed so the temp file can be decompressed up to this point.
+ */
+int segment_writer_sync(struct segment_writer *w)
+{
+    if (w->fd == -1) {
+        return 1;
+    }
+    
+    if (w->gzip_level) {
+        w->zs.next_in = NULL;
+        w->zs.avail_in = 0;
+        if (!segment_writer_deflate(w, Z_SYNC_FLUSH)) {
+            return 0;
+        }
+    }
+    if (!segment_writer_flush(w)) {
+        return 0;
+    }
+    if (fdatasync(w->fd) == -1) {
+        fprintf(stderr, "ERROR: fdatasync() failed for %s (%s)\n", w->temp_filename, strerror(errno));
+        return 0;
+    }
+    
+    return 1;
+}
+
+const char *segment_writer_filename(struct segment_writer *w)
+{
+    return w->filename;
+}
+
+uint64_t segment_writer_bytes_in(struct segment_writer *w)
+{
+    return w->bytes_in;
+}
+
+uint64_t segment_writer_bytes_out(struct segment_writer *w)
+{
+    return w->bytes_out;
+}
+
+void free_segment_writer(struct segment_writer *w)
+{
+    if (w) {
+        segment_writer_close(w);
+        free(w->filename_format);
+        free(w->buf);
+        free(w);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef __segment_writer_h
+#define __segment_writer_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct segment_writer;
+
+struct segment_writer *new_segment_writer(const char *filename_format, size_t buffer_size, int gzip_level);
+int segment_writer_write(struct segment_writer *w, const char *data, size_t len);
+int segment_writer_check_roll(struct segment_writer *w, time_t now);
+int segment_writer_sync(struct segment_writer *w);
+int segment_writer_close(struct segment_writer *w);
+void free_segment_writer(struct segment_writer *w);
+const char *segment_writer_filename(struct segment_writer *w);
+uint64_t segment_writer_bytes_in(struct segment_writer *w);
+uint64_t segment_writer_bytes_out(struct segment_writer *w);
+
+#endif
@@ -3,9 +3,14 @@
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <regex.h>
+#include <json/json.h>
 #include <simplehttp/simplehttp.h>
 #include <pubsubclient/pubsubclient.h>
 #include <simplehttp/utlist.h>
+#include <host_pool/host_pool.h>
+#include "route.h"
 
 #ifdef DEBUG
 #define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
@@ -15,21 +20,79 @@
 
 #define VERSION "0.5.2"
 
+// seconds, failed destinations are retried with backoff up to this
+#define DESTINATION_MAX_RETRY_INTERVAL 30
+// weight of the newest response time in a destination's latency average
+#define LATENCY_EWMA_ALPHA 0.2
+
+enum route_mode {
+    ROUTE_BROADCAST,
+    ROUTE_ROUND_ROBIN,
+    ROUTE_HASH,
+    ROUTE_LEAST_OUTSTANDING
+};
+
 struct destination_url {
+    int id;
     char *address;
     int port;
     int method;
     char *path;
+    struct HostPoolEndpoint *endpoint;
+    int outstanding;
+    double latency_ms;
+    uint64_t requests_failed;
+    // --destination-mput-url, messages are buffered and POSTed newline separated
+    int batch;
+    struct evbuffer *buf;
+    int buf_count;
+    int in_flight;
+    struct event flush_ev;
+    int flush_pending;
+    uint64_t batches_sent;
+    uint64_t messages_sent;
+    uint64_t batches_failed;
     struct destination_url *next;
 };
 
 struct destination_url *destinations = NULL;
 struct destination_url *current_destination = NULL;
+int num_destinations = 0;
 int round_robin = 0;
+enum route_mode route = ROUTE_BROADCAST;
+char *route_key_field = NULL;
+char *route_key_regex = NULL;
+regex_t route_key_re;
+struct HostPool *destination_pool = NULL;
+struct destination_url **destination_index = NULL;
 time_t last_message_timestamp = 0;
 struct timeval max_silence_time = {0, 0};
 struct event silence_ev;
 
+struct source {
+    char *url;
+    char *address;
+    int port;
+    char *path;
+    int connected;
+    struct pubsubclient *client;
+};
+
+#define MAX_SOURCES 2
+
+struct source sources[MAX_SOURCES];
+int num_sources = 0;
+int num_connected = 0;
+char *message_buf = NULL;
+size_t message_buf_size = 0;
+int batch_items = 100;
+int batch_bytes = 1024 * 64;
+int batch_ms = 50;
+int max_in_flight = 4;
+int sources_paused = 0;
+
+void destination_flush(struct destination_url *destination);
+
 struct destination_url *new_destination_url(char *url)
 {
     struct destination_url *sq_dest;
@@ -48,6 +111,19 @@ struct destination_url *new_destination_url(char *url)
     sq_dest->path = path;
     sq_dest->next = NULL;
     sq_dest->method = EVHTTP_REQ_GET;
+    sq_dest->id = num_destinations++;
+    sq_dest->endpoint = NULL;
+    sq_dest->outstanding = 0;
+    sq_dest->latency_ms = 0;
+    sq_dest->requests_failed = 0;
+    sq_dest->batch = 0;
+    sq_dest->buf = NULL;
+    sq_dest->buf_count = 0;
+    sq_dest->in_flight = 0;
+    sq_dest->flush_pending = 0;
+    sq_dest->batches_sent = 0;
+    sq_dest->messages_sent = 0;
+    sq_dest->batches_failed = 0;
     
     return sq_dest;
 }
@@ -55,20 +131,93 @@ struct destination_url *new_destination_url(char *url)
 void free_destination_url(struct destination_url *sq_dest)
 {
     if (sq_dest) {
+        if (sq_dest->buf) {
+            if (sq_dest->flush_pending) {
+                evtimer_del(&sq_dest->flush_ev);
+            }
+            evbuffer_free(sq_dest->buf);
+        }
         free(sq_dest->address);
         free(sq_dest->path);
         free(sq_dest);
     }
 }
 
+/*
+ * a request to a destination is outstanding from here until destination_request_done()
+ */
+struct destination_request {
+    struct destination_url *destination;
+    simplehttp_ts start_ts;
+};
+
+struct destination_request *new_destination_request(struct destination_url *destination)
+{
+    struct destination_request *dest_req;
+    
+    dest_req = malloc(sizeof(struct destination_request));
+    dest_req->destination = destination;
+    simplehttp_ts_get(&dest_req->start_ts);
+    destination->outstanding++;
+    
+    return dest_req;
+}
+
+/*
+ * update the destination's latency average and health from a response.
+ * failed requests mark the destination down in the host pool, which then
+ * lets a request through now and then (with backoff) until one succeeds.
+ */
+int destination_request_done(struct destination_request *dest_req, struct evhttp_request *req)
+{
+    struct destination_url *destination = dest_req->destination;
+    simplehttp_ts end_ts;
+    double latency_ms;
+    int success;
+    
+    simplehttp_ts_get(&end_ts);
+    latency_ms = simplehttp_ts_diff(dest_req->start_ts, end_ts) / 1000.0;
+    destination->outstanding--;
+    free(dest_req);
+    
+    success = req && req->response_code >= 200 && req->response_code < 300;
+    if (success) {
+        destination->latency_ms = destination->latency_ms == 0 ? latency_ms :
+                                  destination->latency_ms * (1 - LATENCY_EWMA_ALPHA) + latency_ms * LATENCY_EWMA_ALPHA;
+        host_pool_mark_success_duration(destination_pool, destination->id, latency_ms);
+    } else {
+        destination->requests_failed++;
+        host_pool_mark_failed_duration(destination_pool, destination->id, latency_ms);
+    }
+    
+    return success;
+}
+
 void finish_destination_cb(struct evhttp_request *req, void *cb_arg)
 {
-    //_DEBUG("finish_destination_cb()\n");
+    destination_request_done((struct destination_request *)cb_arg, req);
 }
 
-void error_cb(int status_code, void *cb_arg)
+/*
+ * a source went away; keep running on the others and only stop once
+ * every source is down. with --reconnect-min-ms sources reconnect on
+ * their own and we keep going
+ */
+void error_cb(int source_id, int status_code, void *cb_arg)
 {
-    event_loopbreak();
+    struct source *source = &sources[source_id];
+    
+    if (source->connected) {
+        source->connected = 0;
+        num_connected--;
+    }
+    fprintf(stderr, "ERROR: source %d (%s) disconnected (%d), %d source(s) left\n", source_id, source->url, status_code, num_connected);
+    if (option_get_int("reconnect_min_ms") > 0) {
+        return;
+    }
+    if (num_connected <= 0) {
+        event_loopbreak();
+    }
 }
 
 void silence_cb(int fd, short what, void *ctx)
@@ -77,7 +226,7 @@ void silence_cb(int fd, short what, void *ctx)
     if ( time(NULL) - last_message_timestamp > max_silence_time.tv_sec ) {
         _DEBUG("Things are too quiet... time to quit!\n");
         fprintf(stderr, "Exiting: No messages recieved for %lu seconds (limit: %lu seconds)\n", (time(NULL) - last_message_timestamp), max_silence_time.tv_sec);
-        error_cb(-127, (void *)NULL);
+        event_loopbreak();
     } else {
         evtimer_del(&silence_ev);
         evtimer_set(&silence_ev, silence_cb, NULL);
@@ -85,15 +234,280 @@ void silence_cb(int fd, short what, void *ctx)
     }
 }
 
-void process_message_cb(char *message, void *cb_arg)
+/*
+ * a batch destination is blocked when its in-flight window is full and it
+ * already has a complete batch waiting
+ */
+int destination_blocked(struct destination_url *destination)
+{
+    return destination->batch && destination->in_flight >= max_in_flight &&
+           (destination->buf_count >= batch_items || EVBUFFER_LENGTH(destination->buf) >= batch_bytes);
+}
+
+/*
+ * stop reading from pubsub while every destination a message could go to is
+ * blocked (round robin, least outstanding) or while any of them is
+ * (broadcasting, or hashing where keys can't move). reading picks back up as
+ * responses come in.
+ */
+void update_backpressure()
+{
+    struct destination_url *destination;
+    int blocked = 0, total = 0, i;
+    int pause;
+    
+    LL_FOREACH(destinations, destination) {
+        total++;
+        blocked += destination_blocked(destination);
+    }
+    if (route == ROUTE_BROADCAST || route == ROUTE_HASH) {
+        pause = blocked > 0;
+    } else {
+        pause = blocked == total;
+    }
+    if (pause == sources_paused) {
+        return;
+    }
+    _DEBUG("%s sources (%d/%d destinations blocked)\n", pause ? "pausing" : "resuming", blocked, total);
+    sources_paused = pause;
+    for (i = 0; i < num_sources && sources_paused == pause; i++) {
+        // resuming delivers buffered messages, which can pause us again
+        if (pause) {
+            pubsubclient_pause(sources[i].client);
+        } else {
+            pubsubclient_resume(sources[i].client);
+        }
+    }
+}
+
+void finish_batch_cb(struct evhttp_request *req, void *cb_arg)
+{
+    struct destination_request *dest_req = (struct destination_request *)cb_arg;
+    struct destination_url *destination = dest_req->destination;
+    struct timeval tv = {0, 0};
+    
+    destination->in_flight--;
+    if (!destination_request_done(dest_req, req)) {
+        fprintf(stderr, "ERROR: batch to %s:%d%s failed (%d)\n", destination->address, destination->port,
+                destination->path, req ? req->response_code : -1);
+        destination->batches_failed++;
+    }
+    
+    // send whatever has built up from the next turn of the loop, not from
+    // inside this callback (which can run from within the request that failed)
+    if (destination->buf_count) {
+        if (destination->flush_pending) {
+            evtimer_del(&destination->flush_ev);
+        }
+        destination->flush_pending = 1;
+        evtimer_add(&destination->flush_ev, &tv);
+    }
+    update_backpressure();
+}
+
+/*
+ * POST everything buffered for destination as one request, if the window allows
+ */
+void destination_flush(struct destination_url *destination)
+{
+    if (destination->buf_count == 0 || destination->in_flight >= max_in_flight) {
+        return;
+    }
+    if (destination->flush_pending) {
+        evtimer_del(&destination->flush_ev);
+        destination->flush_pending = 0;
+    }
+    
+    _DEBUG("destination_flush() %d messages to %s:%d%s\n", destination->buf_count,
+           destination->address, destination->port, destination->path);
+    
+    destination->batches_sent++;
+    destination->messages_sent += destination->buf_count;
+    destination->in_flight++;
+    destination->buf_count = 0;
+    // new_async_request_with_body() takes a string
+    evbuffer_add(destination->buf, "", 1);
+    new_async_request_with_body(EVHTTP_REQ_POST, destination->address, destination->port, destination->path,
+                                NULL, (char *)EVBUFFER_DATA(destination->buf), finish_batch_cb,
+                                new_destination_request(destination));
+    evbuffer_drain(destination->buf, EVBUFFER_LENGTH(destination->buf));
+}
+
+void destination_flush_cb(int fd, short what, void *arg)
+{
+    struct destination_url *destination = (struct destination_url *)arg;
+    
+    destination->flush_pending = 0;
+    destination_flush(destination);
+}
+
+/*
+ * buffer a message for a batch destination. the batch goes out once it has
+ * --batch-items messages or --batch-bytes bytes, or --batch-ms after its first message
+ */
+void destination_add(struct destination_url *destination, const char *message, size_t len)
+{
+    struct timeval tv;
+    
+    if (destination->buf_count) {
+        evbuffer_add(destination->buf, "\n", 1);
+    }
+    evbuffer_add(destination->buf, message, len);
+    destination->buf_count++;
+    
+    if (destination->buf_count >= batch_items || EVBUFFER_LENGTH(destination->buf) >= batch_bytes) {
+        destination_flush(destination);
+    } else if (!destination->flush_pending) {
+        tv.tv_sec = batch_ms / 1000;
+        tv.tv_usec = (batch_ms % 1000) * 1000;
+        destination->flush_pending = 1;
+        evtimer_add(&destination->flush_ev, &tv);
+    }
+}
+
+void init_destinations()
+{
+    struct destination_url *destination;
+    
+    destination_pool = new_host_pool(-1, -1, DESTINATION_MAX_RETRY_INTERVAL, 1);
+    destination_index = calloc(num_destinations, sizeof(struct destination_url *));
+    LL_FOREACH(destinations, destination) {
+        destination->endpoint = new_host_pool_endpoint(destination_pool, destination->address, destination->port, destination->path);
+        destination_index[destination->id] = destination;
+        if (destination->batch) {
+            destination->buf = evbuffer_new();
+            evtimer_set(&destination->flush_ev, destination_flush_cb, destination);
+        }
+    }
+}
+
+/*
+ * a destination is usable while it's up, or when it's down but due a retry
+ */
+int destination_usable(int id, void *arg)
+{
+    struct destination_url *destination = destination_index[id];
+    
+    return destination->endpoint->alive ||
+           host_pool_endpoint_can_retry(destination_pool, destination->endpoint, *(time_t *)arg);
+}
+
+/*
+ * the key a message is hashed on with --route=hash: --route-key-field from a
+ * JSON message, the first capture group (or the whole match) of
+ * --route-key-regex, and otherwise the whole message
+ */
+uint64_t message_route_hash(const char *message, size_t len)
+{
+    regmatch_t match[2];
+    const char *key;
+    size_t key_len;
+    
+    if (route_key_field && route_json_field(message, len, route_key_field, &key, &key_len)) {
+        return host_pool_hash(key, key_len);
+    }
+    if (route_key_regex && regexec(&route_key_re, message, 2, match, 0) == 0) {
+        if (match[1].rm_so != -1) {
+            return host_pool_hash(message + match[1].rm_so, match[1].rm_eo - match[1].rm_so);
+        }
+        return host_pool_hash(message + match[0].rm_so, match[0].rm_eo - match[0].rm_so);
+    }
+    return host_pool_hash(message, len);
+}
+
+/*
+ * pick the destination for a message when not broadcasting. destinations
+ * that are down are skipped; if every one is down they are all reset.
+ */
+struct destination_url *select_destination(const char *message, size_t len)
+{
+    struct destination_url *destination = NULL, *candidate;
+    struct HostPoolEndpoint *endpoint;
+    double score, best_score = 0;
+    time_t now;
+    int i;
+    
+    time(&now);
+    switch (route) {
+        case ROUTE_HASH:
+            // the host pool fails over around the ring, and resets when every destination is down
+            endpoint = host_pool_get_endpoint(destination_pool, HOST_POOL_CONSISTENT_HASH,
+                                              (int64_t)message_route_hash(message, len));
+            return destination_index[endpoint->id];
+        case ROUTE_LEAST_OUTSTANDING:
+            // fewest requests outstanding, weighted by recent response times
+            LL_FOREACH(destinations, candidate) {
+                if (!destination_usable(candidate->id, &now)) {
+                    continue;
+                }
+                score = (candidate->outstanding + 1 + (candidate->batch ? (double)candidate->buf_count / batch_items : 0)) *
+                        (candidate->latency_ms > 0 ? candidate->latency_ms : 1);
+                if (!destination || score < best_score) {
+                    destination = candidate;
+                    best_score = score;
+                }
+            }
+            break;
+        default:
+        case ROUTE_ROUND_ROBIN:
+            // skip over destinations that are down or can't take more right now
+            for (i = 0; i < num_destinations * 2 && !destination; i++) {
+                if (!current_destination) {
+                    current_destination = destinations;
+                }
+                candidate = current_destination;
+                current_destination = current_destination->next;
+                if (destination_usable(candidate->id, &now) && (i >= num_destinations || !destination_blocked(candidate))) {
+                    destination = candidate;
+                }
+            }
+            break;
+    }
+    
+    if (!destination) {
+        _DEBUG("every destination is down, resetting\n");
+        host_pool_reset(destination_pool);
+        destination = current_destination ? current_destination : destinations;
+    }
+    if (!destination->endpoint->alive) {
+        // this message is the retry
+        host_pool_endpoint_retry(destination_pool, destination->endpoint, now);
+    }
+    
+    return destination;
+}
+
+void send_to_destination(struct destination_url *destination, char *message)
 {
     struct evbuffer *evb;
     char *encoded_message;
+    
+    if (destination->batch) {
+        destination_add(destination, message, strlen(message));
+    } else if (destination->method == EVHTTP_REQ_GET) {
+        evb = evbuffer_new();
+        encoded_message = simplehttp_encode_uri(message);
+        evbuffer_add_printf(evb, destination->path, encoded_message);
+        //_DEBUG("process_message_cb(GET %s)\n", (char *)EVBUFFER_DATA(evb));
+        new_async_request(destination->address, destination->port, (char *)EVBUFFER_DATA(evb),
+                          finish_destination_cb, new_destination_request(destination));
+        evbuffer_free(evb);
+        free(encoded_message);
+    } else {
+        //_DEBUG("process_message_cb(POST %s:%d%s)\n", destination->address, destination->port, destination->path);
+        new_async_request_with_body(EVHTTP_REQ_POST, destination->address, destination->port, destination->path,
+                                    NULL, message, finish_destination_cb, new_destination_request(destination));
+    }
+}
+
+void process_message(char *message)
+{
     struct destination_url *destination;
+    size_t len;
     
-    _DEBUG("process_message_cb()\n");
+    _DEBUG("process_message()\n");
     
-    if (message == NULL || strlen(message) < 3) {
+    if (message == NULL || (len = strlen(message)) < 3) {
         return;
     }
     
@@ -101,32 +515,101 @@ void process_message_cb(char *message, void *cb_arg)
         last_message_timestamp = time(NULL);
     }
     
-    if (!current_destination) {
-        // start loop over again for round-robin
-        current_destination = destinations;
-    }
-    LL_FOREACH(current_destination, destination) {
-        if (destination->method == EVHTTP_REQ_GET) {
-            evb = evbuffer_new();
-            encoded_message = simplehttp_encode_uri(message);
-            evbuffer_add_printf(evb, destination->path, encoded_message);
-            //_DEBUG("process_message_cb(GET %s)\n", (char *)EVBUFFER_DATA(evb));
-            new_async_request(destination->address, destination->port, (char *)EVBUFFER_DATA(evb),
-                              finish_destination_cb, NULL);
-            evbuffer_free(evb);
-            free(encoded_message);
-        } else {
-            //_DEBUG("process_message_cb(POST %s:%d%s)\n", destination->address, destination->port, destination->path);
-            new_async_request_with_body(EVHTTP_REQ_POST, destination->address, destination->port, destination->path,
-                                        NULL, message, finish_destination_cb, NULL);
+    if (route == ROUTE_BROADCAST) {
+        LL_FOREACH(destinations, destination) {
+            send_to_destination(destination, message);
         }
-        
-        if (round_robin) {
-            // break and set the next loop to start at the next destination
-            current_destination = destination->next;
-            break;
+    } else {
+        send_to_destination(select_destination(message, len), message);
+    }
+}
+
+/*
+ * messages from every source arrive here; each one is copied out of the
+ * stream buffer so it can be NUL terminated for the destination requests
+ */
+void process_messages_cb(int source_id, struct pubsubclient_message *messages, int count, void *cb_arg)
+{
+    int i;
+    
+    if (!sources[source_id].connected) {
+        sources[source_id].connected = 1;
+        num_connected++;
+    }
+    for (i = 0; i < count; i++) {
+        if (messages[i].len + 1 > message_buf_size) {
+            message_buf_size = messages[i].len + 1;
+            message_buf = realloc(message_buf, message_buf_size);
         }
+        memcpy(message_buf, messages[i].data, messages[i].len);
+        message_buf[messages[i].len] = '\0';
+        process_message(message_buf);
+    }
+    update_backpressure();
+}
+
+int add_source(char *url)
+{
+    struct source *source = &sources[num_sources];
+    
+    if (!simplehttp_parse_url(url, strlen(url), &source->address, &source->port, &source->path)) {
+        fprintf(stderr, "ERROR: failed to parse pubsub url %s\n", url);
+        return 0;
+    }
+    source->url = url;
+    source->client = new_pubsubclient(num_sources, source->address, source->port, source->path,
+                                      process_messages_cb, error_cb, NULL);
+    pubsubclient_set_backoff(source->client, option_get_int("reconnect_min_ms"), option_get_int("reconnect_max_ms"));
+    if (!pubsubclient_start(source->client)) {
+        free_pubsubclient(source->client);
+        return 0;
+    }
+    source->connected = 1;
+    num_sources++;
+    num_connected++;
+    
+    return 1;
+}
+
+void free_sources()
+{
+    struct pubsubclient_stats stats;
+    int i;
+    
+    for (i = 0; i < num_sources; i++) {
+        pubsubclient_get_stats(sources[i].client, &stats);
+        fprintf(stdout, "source %d %s: %llu messages, %llu bytes, %llu connects, %llu errors\n", i, sources[i].url,
+                (long long unsigned int)stats.messages, (long long unsigned int)stats.bytes,
+                (long long unsigned int)stats.connects, (long long unsigned int)stats.errors);
+        free_pubsubclient(sources[i].client);
+        free(sources[i].address);
+        free(sources[i].path);
+        free(sources[i].url);
+    }
+    num_sources = 0;
+    free(message_buf);
+}
+
+void termination_handler(int signum)
+{
+    event_loopbreak();
+}
+
+int route_cb(char *value)
+{
+    if (strcmp(value, "broadcast") == 0) {
+        route = ROUTE_BROADCAST;
+    } else if (strcmp(value, "round_robin") == 0) {
+        route = ROUTE_ROUND_ROBIN;
+    } else if (strcmp(value, "hash") == 0) {
+        route = ROUTE_HASH;
+    } else if (strcmp(value, "least_outstanding") == 0) {
+        route = ROUTE_LEAST_OUTSTANDING;
+    } else {
+        fprintf(stderr, "ERROR: unknown --route=\"%s\"\n", value);
+        return 0;
     }
+    return 1;
 }
 
 int version_cb(int value)
@@ -151,6 +634,18 @@ int destination_get_url_cb(char *value)
     return 1;
 }
 
+int destination_mput_url_cb(char *value)
+{
+    struct destination_url *sq_dest;
+    
+    sq_dest = new_destination_url(value);
+    sq_dest->method = EVHTTP_REQ_POST;
+    sq_dest->batch = 1;
+    LL_APPEND(destinations, sq_dest);
+    
+    return 1;
+}
+
 int destination_post_url_cb(char *value)
 {
     struct destination_url *sq_dest;
@@ -167,77 +662,97 @@ void free_destination_urls()
     struct destination_url *destination, *tmp;
     
     LL_FOREACH_SAFE(destinations, destination, tmp) {
+        if (destination->batch) {
+            fprintf(stdout, "destination %s:%d%s: %llu batches, %llu messages, %llu failed batches\n",
+                    destination->address, destination->port, destination->path,
+                    (long long unsigned int)destination->batches_sent, (long long unsigned int)destination->messages_sent,
+                    (long long unsigned int)destination->batches_failed);
+        } else {
+            fprintf(stdout, "destination %s:%d%s: %llu failed requests, %.1fms average latency\n",
+                    destination->address, destination->port, destination->path,
+                    (long long unsigned int)destination->requests_failed, destination->latency_ms);
+        }
         LL_DELETE(destinations, destination);
         free_destination_url(destination);
     }
+    free(destination_index);
+    free_host_pool(destination_pool);
+    if (route_key_regex) {
+        regfree(&route_key_re);
+    }
 }
 
 int main(int argc, char **argv)
 {
     char *pubsub_url;
     char *secondary_pubsub_url = NULL;
-    char *address;
-    int port;
-    char *path;
     
     option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
     option_define_str("pubsub_url", OPT_REQUIRED, "http://127.0.0.1:80/sub?multipart=0", &pubsub_url, NULL, "url of pubsub to read from");
-    option_define_str("secondary_pubsub_url", OPT_OPTIONAL, NULL, &secondary_pubsub_url, NULL, "url of pubsub to read from");
-    option_define_bool("round_robin", OPT_OPTIONAL, 0, &round_robin, NULL, "write round-robin to destination urls");
+    option_define_str("secondary_pubsub_url", OPT_OPTIONAL, NULL, &secondary_pubsub_url, NULL, "url of a second pubsub to read from at the same time");
+    option_define_bool("round_robin", OPT_OPTIONAL, 0, &round_robin, NULL, "write round-robin to destination urls (same as --route=round_robin)");
+    option_define_str("route", OPT_OPTIONAL, "broadcast", NULL, route_cb, "how messages are spread over destinations\n\t\t\t (broadcast, round_robin, hash, least_outstanding)");
+    option_define_str("route_key_field", OPT_OPTIONAL, NULL, &route_key_field, NULL, "with --route=hash, hash on this field of JSON messages");
+    option_define_str("route_key_regex", OPT_OPTIONAL, NULL, &route_key_regex, NULL, "with --route=hash, hash on the first capture group of this (extended) regex");
     option_define_str("destination_get_url", OPT_OPTIONAL, NULL, NULL, destination_get_url_cb, "(multiple) url(s) to HTTP GET to\n\t\t\t This URL must contain a %s for the message data\n\t\t\t for a simplequeue use \"http://127.0.0.1:8080/put?data=%s\"");
     option_define_str("destination_post_url", OPT_OPTIONAL, NULL, NULL, destination_post_url_cb, "(multiple) url(s) to HTTP POST to\n\t\t\t For a pubsub endpoint use \"http://127.0.0.1:8080/pub\"");
+    option_define_str("destination_mput_url", OPT_OPTIONAL, NULL, NULL, destination_mput_url_cb, "(multiple) url(s) to HTTP POST batches of newline separated messages to\n\t\t\t for a simplequeue use \"http://127.0.0.1:8080/mput\"");
+    option_define_int("batch_items", OPT_OPTIONAL, 100, &batch_items, NULL, "with --destination-mput-url, send a batch once it has this many messages");
+    option_define_int("batch_bytes", OPT_OPTIONAL, 1024 * 64, &batch_bytes, NULL, "with --destination-mput-url, send a batch once it has this many bytes");
+    option_define_int("batch_ms", OPT_OPTIONAL, 50, &batch_ms, NULL, "with --destination-mput-url, send a batch at most this long after its first message");
+    option_define_int("max_in_flight", OPT_OPTIONAL, 4, &max_in_flight, NULL, "with --destination-mput-url, batches outstanding per destination before reading from pubsub is paused");
     option_define_int("max_silence", OPT_OPTIONAL, -1, NULL, NULL, "Maximum time between pubsub messages before we disconnect and quit");
+    option_define_int("reconnect_min_ms", OPT_OPTIONAL, 250, NULL, NULL, "first delay before reconnecting to a pubsub, doubled on each failure (0 to exit on disconnect)");
+    option_define_int("reconnect_max_ms", OPT_OPTIONAL, 30000, NULL, NULL, "longest delay between reconnect attempts");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
     if (destinations == NULL) {
-        fprintf(stderr, "ERROR: --destination-get-url or --destination-post-url required\n");
+        fprintf(stderr, "ERROR: --destination-get-url, --destination-post-url or --destination-mput-url required\n");
+        return 1;
+    }
+    if (round_robin && route == ROUTE_BROADCAST) {
+        route = ROUTE_ROUND_ROBIN;
+    }
+    if (route_key_regex && regcomp(&route_key_re, route_key_regex, REG_EXTENDED) != 0) {
+        fprintf(stderr, "ERROR: failed to compile --route-key-regex=\"%s\"\n", route_key_regex);
         return 1;
     }
+    if (batch_items < 1) {
+        batch_items = 1;
+    }
+    if (max_in_flight < 1) {
+        max_in_flight = 1;
+    }
     init_async_connection_pool(1);
     
-    if (simplehttp_parse_url(pubsub_url, strlen(pubsub_url), &address, &port, &path)) {
-        pubsubclient_init(address, port, path, process_message_cb, error_cb, NULL);
-        
-        if (option_get_int("max_silence") > 0) {
-            _DEBUG("Registering timer.\n");
-            max_silence_time.tv_sec = option_get_int("max_silence");
-            evtimer_set(&silence_ev, silence_cb, NULL);
-            evtimer_add(&silence_ev, &max_silence_time);
-        }
-        
-        pubsubclient_run();
-        
-        free(address);
-        free(path);
-        free(pubsub_url);
-    } else {
-        fprintf(stderr, "ERROR: failed to parse pubsub_url\n");
+    // follow every source from the same event loop
+    if (!add_source(pubsub_url)) {
+        return 1;
     }
-    if (secondary_pubsub_url && simplehttp_parse_url(secondary_pubsub_url, strlen(secondary_pubsub_url), &address, &port, &path)) {
-	    pubsubclient_init(address, port, path, process_message_cb, error_cb, NULL);
-
-        if (option_get_int("max_silence") > 0) {
-            _DEBUG("Registering timer.\n");
-            max_silence_time.tv_sec = option_get_int("max_silence");
-            evtimer_set(&silence_ev, silence_cb, NULL);
-            evtimer_add(&silence_ev, &max_silence_time);
-        }
-
-        pubsubclient_run();
-
-        free(address);
-        free(path);
-        free(secondary_pubsub_url);
-    } else {
-        fprintf(stderr, "ERROR: failed to parse secondary_pubsub_url\n");
+    if (secondary_pubsub_url && !add_source(secondary_pubsub_url)) {
+        return 1;
     }
+    init_destinations();
+    
+    if (option_get_int("max_silence") > 0) {
+        _DEBUG("Registering timer.\n");
+        max_silence_time.tv_sec = option_get_int("max_silence");
+        evtimer_set(&silence_ev, silence_cb, NULL);
+        evtimer_add(&silence_ev, &max_silence_time);
+    }
+    
+    signal(SIGINT, termination_handler);
+    signal(SIGQUIT, termination_handler);
+    signal(SIGTERM, termination_handler);
+    
+    event_dispatch();
     
+    free_sources();
     free_destination_urls();
     free_async_connection_pool();
     free_options();
-    pubsubclient_free();
     
     return 0;
 }
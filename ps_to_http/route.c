@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "route.h"
+
+/*
+ * find the value of the first "field": in a JSON message without parsing it.
+ * for a string value key points inside the quotes (escapes are left as is),
+ * otherwise at the bare value. returns 0 if the field isn't there.
+ */
+int route_json_field(const char *json, size_t len, const char *field, const char **key, size_t *key_len)
+{
+    const char *p = json, *end = json + len, *q;
+    size_t field_len = strlen(field);
+    
+    while (p < end && (p = memchr(p, '"', end - p)) != NULL) {
+        q = p + 1;
+        if ((size_t)(end - q) > field_len && memcmp(q, field, field_len) == 0 && q[field_len] == '"') {
+            q += field_len + 1;
+            while (q < end && (*q == ' ' || *q == '\t')) {
+                q++;
+            }
+            if (q < end && *q == ':') {
+                q++;
+                while (q < end && (*q == ' ' || *q == '\t')) {
+                    q++;
+                }
+                if (q < end && *q == '"') {
+                    *key = ++q;
+                    while (q < end && *q != '"') {
+                        q += (*q == '\\') ? 2 : 1;
+                    }
+                } else {
+                    *key = q;
+                    while (q < end && *q != ',' && *q != '}' && *q != ' ') {
+                        q++;
+                    }
+                }
+                if (q > end) {
+                    q = end;
+                }
+                *key_len = q - *key;
+                return 1;
+            }
+        }
+        // skip to the end of this string
+        for (p++; p < end && *p != '"'; p++) {
+            if (*p == '\\') {
+                p++;
+            }
+        }
+        p++;
+    }
+    
+    return 0;
+}
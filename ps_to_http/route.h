@@ -0,0 +1,9 @@
+#ifndef __route_h
+#define __route_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+int route_json_field(const char *json, size_t len, const char *field, const char **key, size_t *key_len);
+
+#endif
@@ -2,17 +2,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <simplehttp/queue.h>
 #include <simplehttp/simplehttp.h>
+#include <simplehttp/uthash.h>
+#include <simplehttp/utlist.h>
 #include "http-internal.h"
 
-#include <openssl/sha.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
-
 #define BOUNDARY "xXPubSubXx"
 #define MAX_PENDING_DATA 1024*1024*50
-#define VERSION "1.2"
+#define MAX_OUTPUT_WINDOW 1024*256
+#define INITIAL_QUEUE_SIZE 64
+#define RECONNECT_SECS 5
+#define VERSION "1.3"
 
 int ps_debug = 0;
 
@@ -21,14 +23,76 @@ enum kick_client_enum {
     KICK_CLIENT = 1,
 };
 
+enum slow_client_policy {
+    POLICY_KICK = 0,
+    POLICY_DROP_OLDEST,
+    POLICY_DROP_NEWEST,
+    POLICY_SAMPLE
+};
+
+static const char *policy_names[] = {"kick", "drop_oldest", "drop_newest", "sample"};
+
+/*
+ * a published message. it is shared (by reference) between every
+ * client queue that is holding on to it.
+ */
+struct msg {
+    int refcount;
+    simplehttp_ts ts;
+    uint64_t origin;
+    uint64_t seq;
+    // position in this pubsub's own stream, for ?since=
+    uint64_t stream_seq;
+    size_t len;
+    char data[1];
+};
+
+/* an upstream pubsub we re-broadcast messages from (--upstream-url) */
+struct upstream {
+    char *address;
+    int port;
+    char *path;
+    struct evhttp_connection *evcon;
+    struct evbuffer *buf;
+    struct event reconnect_ev;
+    uint64_t messages;
+    uint64_t reconnects;
+    struct upstream *next;
+};
+
+/* a recently seen message id, to drop messages that reach us over more than one path */
+struct msg_id {
+    uint64_t origin;
+    uint64_t seq;
+};
+
+struct seen_msg {
+    struct msg_id id;
+    UT_hash_handle hh;
+};
+
 typedef struct cli {
     int multipart;
     int websocket;
+    int sse;
+    int relay;
+    int sequence;
     enum kick_client_enum kick_client;
+    enum slow_client_policy policy;
     uint64_t connection_id;
     time_t connect_time;
-    struct evbuffer *buf;
     struct evhttp_request *req;
+    // ring buffer of messages not yet handed to the connection
+    struct msg **queue;
+    int queue_size;
+    int queue_head;
+    int queue_count;
+    size_t pending_bytes;
+    int max_pending_bytes;
+    int max_pending_messages;
+    int sample_rate;
+    uint64_t sample_counter;
+    uint64_t dropped;
     TAILQ_ENTRY(cli) entries;
 } cli;
 TAILQ_HEAD(, cli) clients;
@@ -38,50 +102,352 @@ uint64_t currentConns = 0;
 uint64_t kickedClients = 0;
 uint64_t msgRecv = 0;
 uint64_t msgSent = 0;
+uint64_t msgDropped = 0;
+uint64_t pendingBytes = 0;
+uint64_t msgRelayed = 0;
+uint64_t msgDuplicate = 0;
+
+static int max_pending_bytes = MAX_PENDING_DATA;
+static int max_pending_messages = 0;
+static int max_pending_total_bytes = 0;
+static int sample_rate = 10;
+static enum slow_client_policy slow_client_policy = POLICY_KICK;
+static int flush_interval_ms = 0;
+static int max_batch_messages = 0;
+static int max_batch_bytes = 1024*64;
+static int flush_pending = 0;
+static struct event flush_ev;
+// shared buffer messages are formatted into before being handed to a connection
+static struct evbuffer *scratch = NULL;
+static uint64_t node_id = 0;
+static uint64_t sequence = 0;
+static int dedup_window = 10000;
+static struct seen_msg *seen_msgs = NULL;
+static struct seen_msg **seen_ring = NULL;
+static int seen_ring_pos = 0;
+static struct upstream *upstreams = NULL;
+static uint64_t stream_sequence = 0;
+static int replay_size = 0;
+static struct msg **replay_ring = NULL;
+static int replay_pos = 0;
+
+void client_flush(struct cli *client);
+
+int parse_policy(const char *str)
+{
+    int i;
+    
+    for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+        if (strcmp(str, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * a per client limit from the /sub query string. a client can only lower
+ * the server's limit (or pick one when the server has none, 0). returns -1
+ * for anything that isn't a positive number
+ */
+int client_limit_argument(struct evkeyvalq *args, const char *key, int server_limit)
+{
+    const char *tmp;
+    int value;
+    
+    if ((tmp = evhttp_find_header(args, key)) == NULL) {
+        return server_limit;
+    }
+    value = atoi(tmp);
+    if (value <= 0) {
+        return -1;
+    }
+    if (server_limit && value > server_limit) {
+        return server_limit;
+    }
+    return value;
+}
+
+int slow_client_policy_cb(char *value)
+{
+    int policy;
+    
+    if ((policy = parse_policy(value)) == -1) {
+        fprintf(stderr, "ERROR: --slow-client-policy must be one of kick, drop_oldest, drop_newest, sample\n");
+        return 0;
+    }
+    slow_client_policy = policy;
+    return 1;
+}
 
-char *base64(const unsigned char *input, int length)
+struct msg *msg_new(const char *data, size_t len, uint64_t origin, uint64_t seq)
 {
-    BIO *bmem, *b64;
-    BUF_MEM *bptr;
+    struct msg *m;
     
-    b64 = BIO_new(BIO_f_base64());
-    bmem = BIO_new(BIO_s_mem());
-    b64 = BIO_push(b64, bmem);
-    BIO_write(b64, input, length);
-    BIO_flush(b64);
-    BIO_get_mem_ptr(b64, &bptr);
+    m = malloc(sizeof(struct msg) + len);
+    m->refcount = 0;
+    m->origin = origin;
+    m->seq = seq;
+    m->stream_seq = 0;
+    m->len = len;
+    memcpy(m->data, data, len);
+    simplehttp_ts_get(&m->ts);
     
-    char *buff = (char *)malloc(bptr->length);
-    memcpy(buff, bptr->data, bptr->length - 1);
-    buff[bptr->length - 1] = 0;
+    return m;
+}
+
+void msg_retain(struct msg *m)
+{
+    if (m->refcount++ == 0) {
+        pendingBytes += m->len;
+    }
+}
+
+void msg_release(struct msg *m)
+{
+    if (--m->refcount == 0) {
+        pendingBytes -= m->len;
+        free(m);
+    }
+}
+
+void client_queue_push(struct cli *client, struct msg *m)
+{
+    struct msg **queue;
+    int size, i;
     
-    BIO_free_all(b64);
+    if (client->queue_count == client->queue_size) {
+        // grow the ring, unwrapping it into the new allocation
+        size = client->queue_size ? client->queue_size * 2 : INITIAL_QUEUE_SIZE;
+        queue = malloc(size * sizeof(struct msg *));
+        for (i = 0; i < client->queue_count; i++) {
+            queue[i] = client->queue[(client->queue_head + i) % client->queue_size];
+        }
+        free(client->queue);
+        client->queue = queue;
+        client->queue_size = size;
+        client->queue_head = 0;
+    }
     
-    return buff;
+    msg_retain(m);
+    client->queue[(client->queue_head + client->queue_count) % client->queue_size] = m;
+    client->queue_count++;
+    client->pending_bytes += m->len;
 }
 
-int is_slow(struct cli *client)
+struct msg *client_queue_pop(struct cli *client)
 {
-    if (client->kick_client == KICK_CLIENT) {
+    struct msg *m;
+    
+    if (!client->queue_count) {
+        return NULL;
+    }
+    m = client->queue[client->queue_head];
+    client->queue_head = (client->queue_head + 1) % client->queue_size;
+    client->queue_count--;
+    client->pending_bytes -= m->len;
+    
+    // caller is responsible for msg_release()
+    return m;
+}
+
+void client_queue_clear(struct cli *client)
+{
+    struct msg *m;
+    
+    while ((m = client_queue_pop(client)) != NULL) {
+        msg_release(m);
+    }
+}
+
+int client_over_limit(struct cli *client, struct msg *m)
+{
+    if (client->max_pending_messages && client->queue_count >= client->max_pending_messages) {
+        return 1;
+    }
+    if (client->max_pending_bytes && client->pending_bytes + m->len > client->max_pending_bytes) {
         return 1;
     }
+    // a message already held by another client costs no additional memory. one
+    // that isn't (only publish_message() holds it) is already in pendingBytes
+    if (max_pending_total_bytes && m->refcount == 1 && pendingBytes > max_pending_total_bytes) {
+        return 1;
+    }
+    return 0;
+}
+
+void client_drained_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct cli *client = (struct cli *)arg;
+    
+    if (client->kick_client == KICK_CLIENT) {
+        // our error notice has been pushed to the client
+        evhttp_connection_free(evcon);
+        return;
+    }
+    client_flush(client);
+}
+
+void client_kick(struct cli *client)
+{
     struct evhttp_connection *evcon;
-    unsigned long output_buffer_length;
+    unsigned long pending;
+    
+    evcon = (struct evhttp_connection *)client->req->evcon;
+    pending = (unsigned long)(client->pending_bytes + EVBUFFER_LENGTH(evcon->output_buffer));
+    
+    kickedClients += 1;
+    fprintf(stdout, "%llu >> kicking client with %lu pending data\n", client->connection_id, pending);
+    client->kick_client = KICK_CLIENT;
+    // clear the clients queue and output buffer
+    client_queue_clear(client);
+    evbuffer_drain(evcon->output_buffer, EVBUFFER_LENGTH(evcon->output_buffer));
+    evbuffer_add_printf(evcon->output_buffer, "ERROR_TOO_SLOW. kicked for having %lu pending bytes\n", pending);
+    evhttp_write_buffer(evcon, client_drained_cb, client);
+}
+
+/*
+ * queue a message for a client, applying the clients slow client policy
+ * when it is over its pending limits (or we are over the global budget)
+ */
+void client_enqueue(struct cli *client, struct msg *m)
+{
+    struct evhttp_connection *evcon;
+    
+    evcon = (struct evhttp_connection *)client->req->evcon;
+    
+    // fast path, this message is going straight to the connection
+    if (client->queue_count == 0 && EVBUFFER_LENGTH(evcon->output_buffer) < MAX_OUTPUT_WINDOW) {
+        client_queue_push(client, m);
+        return;
+    }
+    
+    if (!client_over_limit(client, m)) {
+        client_queue_push(client, m);
+        return;
+    }
+    
+    switch (client->policy) {
+        case POLICY_KICK:
+            client_kick(client);
+            return;
+        case POLICY_DROP_NEWEST:
+            break;
+        case POLICY_SAMPLE:
+            // while over the limit only every Nth message is queued
+            if (client->sample_counter++ % client->sample_rate != 0) {
+                break;
+            }
+            // fall through and make room for the sampled message
+        case POLICY_DROP_OLDEST:
+            while (client->queue_count && client_over_limit(client, m)) {
+                msg_release(client_queue_pop(client));
+                client->dropped++;
+                msgDropped++;
+            }
+            if (!client_over_limit(client, m)) {
+                client_queue_push(client, m);
+                return;
+            }
+            break;
+    }
+    
+    client->dropped++;
+    msgDropped++;
+}
+
+void client_format_message(struct cli *client, struct evbuffer *evb, struct msg *m)
+{
+    unsigned char ws_header[SIMPLEHTTP_WEBSOCKET_MAX_HEADER_LEN];
+    const char *data = m->data;
+    size_t len = m->len;
+    
+    if (client->relay) {
+        /* origin:sequence<tab>message */
+        evbuffer_add_printf(evb, "%llu:%llu\t", (unsigned long long)m->origin, (unsigned long long)m->seq);
+        evbuffer_add(evb, m->data, m->len);
+        evbuffer_add(evb, "\n", 1);
+    } else if (client->sequence) {
+        /* sequence<tab>message */
+        evbuffer_add_printf(evb, "%llu\t", (unsigned long long)m->stream_seq);
+        evbuffer_add(evb, m->data, m->len);
+        evbuffer_add(evb, "\n", 1);
+    } else if (client->websocket) {
+        // set to non-chunked so that send_reply_chunked doesn't add \r\n before/after this block
+        client->req->chunked = 0;
+        evbuffer_add(evb, ws_header, simplehttp_websocket_frame_header(SIMPLEHTTP_WEBSOCKET_OPCODE_TEXT, len, ws_header));
+        evbuffer_add(evb, data, len);
+    } else if (client->sse) {
+        /* text/event-stream */
+        evbuffer_add(evb, "data: ", 6);
+        evbuffer_add(evb, data, len);
+        evbuffer_add(evb, "\n\n", 2);
+    } else if (client->multipart) {
+        /* chunked */
+        evbuffer_add_printf(evb,
+                            "content-type: %s\r\ncontent-length: %d\r\n\r\n",
+                            "*/*",
+                            (int)len);
+        evbuffer_add(evb, data, len);
+        evbuffer_add(evb, "\r\n--" BOUNDARY "\r\n", sizeof("\r\n--" BOUNDARY "\r\n") - 1);
+    } else {
+        /* new line terminated */
+        evbuffer_add(evb, data, len);
+        evbuffer_add(evb, "\n", 1);
+    }
+}
+
+/*
+ * move queued messages to the connection. only MAX_OUTPUT_WINDOW bytes are
+ * handed to libevent at a time, the rest stays in our queue where the slow
+ * client policy can act on it. once the connection drains we get called again.
+ *
+ * queued messages are coalesced (up to --max-batch-messages/--max-batch-bytes)
+ * into a single chunk so a burst costs one chunk header and one write.
+ */
+void client_flush(struct cli *client)
+{
+    struct evhttp_connection *evcon;
+    struct msg *m;
+    int n;
     
     evcon = (struct evhttp_connection *)client->req->evcon;
-    output_buffer_length = evcon->output_buffer ? (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer) : 0;
-    if (output_buffer_length > MAX_PENDING_DATA) {
-        kickedClients += 1;
-        fprintf(stdout, "%llu >> kicking client with %lu pending data\n", client->connection_id, output_buffer_length);
-        client->kick_client = KICK_CLIENT;
-        // clear the clients output buffer
-        evbuffer_drain(evcon->output_buffer, EVBUFFER_LENGTH(evcon->output_buffer));
-        evbuffer_add_printf(evcon->output_buffer, "ERROR_TOO_SLOW. kicked for having %lu pending bytes\n", output_buffer_length);
+    while (client->queue_count && EVBUFFER_LENGTH(evcon->output_buffer) < MAX_OUTPUT_WINDOW) {
+        evbuffer_drain(scratch, EVBUFFER_LENGTH(scratch));
+        n = 0;
+        while (client->queue_count &&
+                (!max_batch_messages || n < max_batch_messages) &&
+                (!max_batch_bytes || EVBUFFER_LENGTH(scratch) < max_batch_bytes)) {
+            m = client_queue_pop(client);
+            client_format_message(client, scratch, m);
+            msg_release(m);
+            n++;
+        }
+        evhttp_send_reply_chunk(client->req, scratch);
+        msgSent += n;
+    }
+    
+    if (client->queue_count) {
+        evhttp_write_buffer(evcon, client_drained_cb, client);
+    }
+}
+
+int client_batch_full(struct cli *client)
+{
+    if (max_batch_messages && client->queue_count >= max_batch_messages) {
+        return 1;
+    }
+    if (max_batch_bytes && client->pending_bytes >= max_batch_bytes) {
         return 1;
     }
     return 0;
 }
 
+int is_slow(struct cli *client)
+{
+    return client->kick_client == KICK_CLIENT;
+}
+
 int can_kick(struct cli *client)
 {
     if (client->kick_client == CLIENT_OK) {
@@ -97,6 +463,47 @@ int can_kick(struct cli *client)
     return 0;
 }
 
+unsigned int client_lag_ms(struct cli *client)
+{
+    simplehttp_ts now;
+    
+    if (!client->queue_count) {
+        return 0;
+    }
+    simplehttp_ts_get(&now);
+    return simplehttp_ts_diff(client->queue[client->queue_head]->ts, now) / 1000;
+}
+
+void flush_cb(int fd, short what, void *arg)
+{
+    struct cli *client;
+    
+    flush_pending = 0;
+    TAILQ_FOREACH(client, &clients, entries) {
+        if (client->queue_count && !is_slow(client)) {
+            client_flush(client);
+        }
+    }
+}
+
+/*
+ * with --flush-interval-ms messages are held for at most that long
+ * so they can be written to each client in a single chunk
+ */
+void schedule_flush()
+{
+    struct timeval tv;
+    
+    if (flush_pending) {
+        return;
+    }
+    tv.tv_sec = flush_interval_ms / 1000;
+    tv.tv_usec = (flush_interval_ms % 1000) * 1000;
+    evtimer_set(&flush_ev, flush_cb, NULL);
+    evtimer_add(&flush_ev, &tv);
+    flush_pending = 1;
+}
+
 void clients_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
     struct cli *client;
@@ -114,12 +521,18 @@ void clients_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         time_struct = gmtime(&client->connect_time);
         strftime(buf, 248, "%Y-%m-%d %H:%M:%S", time_struct);
         output_buffer_length = (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer);
-        evbuffer_add_printf(evb, "%s:%d connected at %s. output buffer size:%lu state:%d\n",
+        evbuffer_add_printf(evb, "%s:%d connected at %s. output buffer size:%lu state:%d "
+                            "pending messages:%d pending bytes:%lu lag:%ums dropped:%llu policy:%s\n",
                             client->req->remote_host,
                             client->req->remote_port,
                             buf,
                             output_buffer_length,
-                            (int)evcon->state);
+                            (int)evcon->state,
+                            client->queue_count,
+                            (unsigned long)client->pending_bytes,
+                            client_lag_ms(client),
+                            (unsigned long long)client->dropped,
+                            policy_names[client->policy]);
     }
     
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
@@ -128,6 +541,7 @@ void clients_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
     struct evkeyvalq args;
+    struct upstream *up;
     char buf[33];
     const char *reset;
     const char *format;
@@ -142,6 +556,14 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     evhttp_add_header(req->output_headers, "X-PUBSUB-MESSAGES-SENT", buf);
     sprintf(buf, "%llu", kickedClients);
     evhttp_add_header(req->output_headers, "X-PUBSUB-KICKED-CLIENTS", buf);
+    sprintf(buf, "%llu", (unsigned long long)msgDropped);
+    evhttp_add_header(req->output_headers, "X-PUBSUB-MESSAGES-DROPPED", buf);
+    sprintf(buf, "%llu", (unsigned long long)pendingBytes);
+    evhttp_add_header(req->output_headers, "X-PUBSUB-PENDING-BYTES", buf);
+    sprintf(buf, "%llu", (unsigned long long)msgRelayed);
+    evhttp_add_header(req->output_headers, "X-PUBSUB-MESSAGES-RELAYED", buf);
+    sprintf(buf, "%llu", (unsigned long long)msgDuplicate);
+    evhttp_add_header(req->output_headers, "X-PUBSUB-MESSAGES-DUPLICATE", buf);
     
     evhttp_parse_query(req->uri, &args);
     format = (char *)evhttp_find_header(&args, "format");
@@ -153,6 +575,17 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         evbuffer_add_printf(evb, "\"messages_received\": %llu,", msgRecv);
         evbuffer_add_printf(evb, "\"messages_sent\": %llu,", msgSent);
         evbuffer_add_printf(evb, "\"kicked_clients\": %llu,", kickedClients);
+        evbuffer_add_printf(evb, "\"messages_dropped\": %llu,", (unsigned long long)msgDropped);
+        evbuffer_add_printf(evb, "\"pending_bytes\": %llu,", (unsigned long long)pendingBytes);
+        evbuffer_add_printf(evb, "\"messages_relayed\": %llu,", (unsigned long long)msgRelayed);
+        evbuffer_add_printf(evb, "\"messages_duplicate\": %llu,", (unsigned long long)msgDuplicate);
+        evbuffer_add_printf(evb, "\"upstreams\": [");
+        LL_FOREACH(upstreams, up) {
+            evbuffer_add_printf(evb, "%s{\"url\": \"http://%s:%d%s\", \"messages\": %llu, \"reconnects\": %llu}",
+                                up == upstreams ? "" : ",", up->address, up->port, up->path,
+                                (unsigned long long)up->messages, (unsigned long long)up->reconnects);
+        }
+        evbuffer_add_printf(evb, "]");
         evbuffer_add_printf(evb, "}\n");
     } else {
         evbuffer_add_printf(evb, "Active connections: %llu\n", currentConns);
@@ -160,12 +593,24 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         evbuffer_add_printf(evb, "Messages received: %llu\n", msgRecv);
         evbuffer_add_printf(evb, "Messages sent: %llu\n", msgSent);
         evbuffer_add_printf(evb, "Kicked clients: %llu\n", kickedClients);
+        evbuffer_add_printf(evb, "Messages dropped: %llu\n", (unsigned long long)msgDropped);
+        evbuffer_add_printf(evb, "Pending bytes: %llu\n", (unsigned long long)pendingBytes);
+        evbuffer_add_printf(evb, "Messages relayed: %llu\n", (unsigned long long)msgRelayed);
+        evbuffer_add_printf(evb, "Duplicate messages: %llu\n", (unsigned long long)msgDuplicate);
+        LL_FOREACH(upstreams, up) {
+            evbuffer_add_printf(evb, "Upstream http://%s:%d%s: %llu messages, %llu reconnects\n",
+                                up->address, up->port, up->path,
+                                (unsigned long long)up->messages, (unsigned long long)up->reconnects);
+        }
     }
     
     reset = (char *)evhttp_find_header(&args, "reset");
     if (reset) {
         msgRecv = 0;
         msgSent = 0;
+        msgDropped = 0;
+        msgRelayed = 0;
+        msgDuplicate = 0;
     }
     
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
@@ -180,17 +625,95 @@ void on_close(struct evhttp_connection *evcon, void *ctx)
         fprintf(stdout, "%llu >> close from  %s:%d\n", client->connection_id, evcon->address, evcon->port);
         currentConns--;
         TAILQ_REMOVE(&clients, client, entries);
-        evbuffer_free(client->buf);
+        client_queue_clear(client);
+        free(client->queue);
         free(client);
     } else {
         fprintf(stdout, "[unknown] >> close from  %s:%d\n", evcon->address, evcon->port);
     }
 }
 
+/*
+ * hand a message to every connected client. returns the number of clients
+ */
+int publish_message(struct msg *m)
+{
+    struct cli *client, *next;
+    int i = 0;
+    
+    m->stream_seq = ++stream_sequence;
+    // our own reference, a client can flush (and release) it before the next one gets it
+    msg_retain(m);
+    for (client = TAILQ_FIRST(&clients); client; client = next) {
+        // kicking a client removes it from the list
+        next = TAILQ_NEXT(client, entries);
+        if (is_slow(client)) {
+            if (can_kick(client)) {
+                evhttp_connection_free(client->req->evcon);
+            }
+            continue;
+        }
+        client_enqueue(client, m);
+        if (!is_slow(client)) {
+            if (!flush_interval_ms || client_batch_full(client)) {
+                client_flush(client);
+            } else {
+                schedule_flush();
+            }
+        }
+        i++;
+    }
+    
+    // hold on to the last --replay-size messages for clients resuming with ?since=
+    if (replay_size) {
+        if (replay_ring[replay_pos]) {
+            msg_release(replay_ring[replay_pos]);
+        }
+        msg_retain(m);
+        replay_ring[replay_pos] = m;
+        replay_pos = (replay_pos + 1) % replay_size;
+    }
+    
+    // frees it if no client queued it
+    msg_release(m);
+    
+    return i;
+}
+
+/*
+ * queue every message still in the replay ring that comes after since
+ */
+void client_replay(struct cli *client, uint64_t since)
+{
+    struct msg *m;
+    int i;
+    
+    for (i = 0; i < replay_size; i++) {
+        m = replay_ring[(replay_pos + i) % replay_size];
+        if (m && m->stream_seq > since) {
+            client_enqueue(client, m);
+        }
+    }
+    if (!is_slow(client)) {
+        client_flush(client);
+    }
+}
+
+void free_replay_ring()
+{
+    int i;
+    
+    for (i = 0; i < replay_size; i++) {
+        if (replay_ring[i]) {
+            msg_release(replay_ring[i]);
+        }
+    }
+    free(replay_ring);
+}
+
 void pub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
     int i = 0, j = 0;
-    struct cli *client;
     struct evkeyvalq args;
     int message_length = 0;
     int message_offset = 0;
@@ -207,56 +730,7 @@ void pub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
             msgRecv++;
             totalConns++;
             
-            i = 0;
-            TAILQ_FOREACH(client, &clients, entries) {
-                msgSent++;
-                evbuffer_drain(client->buf, EVBUFFER_LENGTH(client->buf));
-                if (is_slow(client)) {
-                    if (can_kick(client)) {
-                        evhttp_connection_free(client->req->evcon);
-                        continue;
-                    }
-                    continue;
-                }
-                if (client->websocket) {
-                    // set to non-chunked so that send_reply_chunked doesn't add \r\n before/after this block
-                    client->req->chunked = 0;
-                    int ws_m = 0;
-                    int ws_message_length = message_length;
-                    int ws_frame_size = 64;  // Size for data fragmentation for websocket
-                    while (ws_m < ws_message_length) {
-                        int ws_cur_size = (ws_message_length - ws_m > ws_frame_size ? ws_frame_size : ws_message_length - ws_m);
-                        
-                        int ws_code = 0;
-                        if (ws_m == 0) {
-                            ws_code += 0x01;
-                        }
-                        if (ws_m + ws_cur_size >= ws_message_length) {
-                            ws_code += 0x80;
-                        }
-                        evbuffer_add_printf(client->buf, "%c", ws_code);
-                        
-                        evbuffer_add_printf(client->buf, "%c", ws_cur_size);
-                        evbuffer_add(client->buf, current_message + ws_m, ws_cur_size);
-                        ws_m += ws_cur_size;
-                    }
-                    
-                } else if (client->multipart) {
-                    /* chunked */
-                    evbuffer_add_printf(client->buf,
-                                        "content-type: %s\r\ncontent-length: %d\r\n\r\n",
-                                        "*/*",
-                                        (int)message_length);
-                    evbuffer_add(client->buf, current_message, message_length);
-                    evbuffer_add_printf(client->buf, "\r\n--%s\r\n", BOUNDARY);
-                } else {
-                    /* new line terminated */
-                    evbuffer_add(client->buf, current_message, message_length);
-                    evbuffer_add_printf(client->buf, "\n");
-                }
-                evhttp_send_reply_chunk(client->req, client->buf);
-                i++;
-            }
+            i = publish_message(msg_new(current_message, message_length, node_id, ++sequence));
             
             message_offset = j + 1;
             num_messages ++;
@@ -265,51 +739,279 @@ void pub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     
     evbuffer_add_printf(evb, "Published %d messages to %d clients.\n", num_messages, i);
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    evhttp_clear_headers(&args);
+}
+
+/*
+ * returns 1 if this message id has been seen within the last --dedup-window
+ * messages, otherwise remembers it and returns 0
+ */
+int seen_message(uint64_t origin, uint64_t seq)
+{
+    struct seen_msg *entry;
+    struct msg_id id;
+    
+    memset(&id, 0, sizeof(id));
+    id.origin = origin;
+    id.seq = seq;
+    HASH_FIND(hh, seen_msgs, &id, sizeof(struct msg_id), entry);
+    if (entry) {
+        return 1;
+    }
+    
+    // recycle the oldest entry
+    if ((entry = seen_ring[seen_ring_pos]) != NULL) {
+        HASH_DELETE(hh, seen_msgs, entry);
+    } else {
+        entry = malloc(sizeof(struct seen_msg));
+    }
+    entry->id = id;
+    HASH_ADD(hh, seen_msgs, id, sizeof(struct msg_id), entry);
+    seen_ring[seen_ring_pos] = entry;
+    seen_ring_pos = (seen_ring_pos + 1) % dedup_window;
+    
+    return 0;
+}
+
+/*
+ * a line from an upstream is "origin:sequence<tab>message". lines from an
+ * upstream that doesn't understand ?relay=1 are published as our own.
+ */
+void upstream_process_line(struct upstream *up, const char *line, size_t len)
+{
+    const char *tab;
+    char *end;
+    uint64_t origin, seq;
+    
+    up->messages++;
+    tab = memchr(line, '\t', len);
+    if (tab) {
+        origin = strtoull(line, &end, 10);
+        if (*end == ':') {
+            seq = strtoull(end + 1, &end, 10);
+            if (end == tab) {
+                if (origin == node_id || seen_message(origin, seq)) {
+                    msgDuplicate++;
+                    return;
+                }
+                msgRelayed++;
+                tab++;
+                publish_message(msg_new(tab, len - (tab - line), origin, seq));
+                return;
+            }
+        }
+    }
+    
+    msgRelayed++;
+    publish_message(msg_new(line, len, node_id, ++sequence));
 }
 
+void upstream_chunk_cb(struct evhttp_request *req, void *arg)
+{
+    struct upstream *up = (struct upstream *)arg;
+    const char *data, *line;
+    size_t len, offset = 0;
+    
+    // a message can span chunks
+    evbuffer_add_buffer(up->buf, req->input_buffer);
+    data = (const char *)EVBUFFER_DATA(up->buf);
+    len = EVBUFFER_LENGTH(up->buf);
+    while (offset < len && (line = memchr(data + offset, '\n', len - offset)) != NULL) {
+        if (line > data + offset) {
+            upstream_process_line(up, data + offset, line - (data + offset));
+        }
+        offset = line - data + 1;
+    }
+    evbuffer_drain(up->buf, offset);
+}
+
+void upstream_reconnect_cb(int fd, short what, void *arg);
+
+void upstream_schedule_reconnect(struct upstream *up, int seconds)
+{
+    struct timeval tv = {seconds, 0};
+    
+    evtimer_del(&up->reconnect_ev);
+    evtimer_set(&up->reconnect_ev, upstream_reconnect_cb, up);
+    evtimer_add(&up->reconnect_ev, &tv);
+}
+
+void upstream_request_done(struct evhttp_request *req, void *arg)
+{
+    struct upstream *up = (struct upstream *)arg;
+    
+    fprintf(stderr, "upstream http://%s:%d%s closed (%d)\n", up->address, up->port, up->path, req ? req->response_code : -1);
+    // the connection is free'd (and re-created) from the timer, not from inside its own callback
+    upstream_schedule_reconnect(up, (req && req->response_code == HTTP_OK) ? 1 : RECONNECT_SECS);
+}
+
+void upstream_connect(struct upstream *up)
+{
+    struct evhttp_request *req;
+    
+    fprintf(stdout, "CONNECTING TO UPSTREAM http://%s:%d%s\n", up->address, up->port, up->path);
+    
+    if (up->evcon) {
+        evhttp_connection_free(up->evcon);
+    }
+    evbuffer_drain(up->buf, EVBUFFER_LENGTH(up->buf));
+    
+    up->evcon = evhttp_connection_new(up->address, up->port);
+    if (up->evcon == NULL) {
+        fprintf(stderr, "ERROR: evhttp_connection_new() failed for %s:%d\n", up->address, up->port);
+        upstream_schedule_reconnect(up, RECONNECT_SECS);
+        return;
+    }
+    
+    req = evhttp_request_new(upstream_request_done, up);
+    evhttp_add_header(req->output_headers, "Host", up->address);
+    evhttp_request_set_chunked_cb(req, upstream_chunk_cb);
+    if (evhttp_make_request(up->evcon, req, EVHTTP_REQ_GET, up->path) == -1) {
+        fprintf(stderr, "ERROR: evhttp_make_request() failed for %s\n", up->path);
+        upstream_schedule_reconnect(up, RECONNECT_SECS);
+    }
+}
+
+void upstream_reconnect_cb(int fd, short what, void *arg)
+{
+    struct upstream *up = (struct upstream *)arg;
+    
+    up->reconnects++;
+    upstream_connect(up);
+}
+
+int upstream_url_cb(char *value)
+{
+    struct upstream *up;
+    char *path;
+    
+    up = calloc(1, sizeof(struct upstream));
+    if (!simplehttp_parse_url(value, strlen(value), &up->address, &up->port, &path)) {
+        fprintf(stderr, "ERROR: failed to parse --upstream-url=\"%s\"\n", value);
+        free(up);
+        return 0;
+    }
+    // ask the upstream to tag each message with its origin
+    up->path = malloc(strlen(path) + sizeof("&relay=1"));
+    sprintf(up->path, "%s%s", path, strchr(path, '?') ? "&relay=1" : "?relay=1");
+    free(path);
+    LL_APPEND(upstreams, up);
+    
+    return 1;
+}
+
+void free_upstreams()
+{
+    struct upstream *up, *tmp;
+    struct seen_msg *entry, *tmp_entry;
+    
+    LL_FOREACH_SAFE(upstreams, up, tmp) {
+        LL_DELETE(upstreams, up);
+        evtimer_del(&up->reconnect_ev);
+        if (up->evcon) {
+            evhttp_connection_free(up->evcon);
+        }
+        evbuffer_free(up->buf);
+        free(up->address);
+        free(up->path);
+        free(up);
+    }
+    HASH_ITER(hh, seen_msgs, entry, tmp_entry) {
+        HASH_DELETE(hh, seen_msgs, entry);
+        free(entry);
+    }
+    free(seen_ring);
+}
+
+/*
+ * /sub is hit hard during reconnect storms so everything here other
+ * than the client struct itself lives on the stack.
+ */
 void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
     struct cli *client;
     struct evkeyvalq args;
-    char *uri;
-    char *ws_origin;
-    char *ws_upgrade;
-    char *ws_key;
-    char *ws_response;
-    char *host;
+    const char *policy;
+    const char *format;
+    const char *accept;
+    const char *ws_origin;
+    const char *ws_upgrade;
+    const char *ws_key;
+    const char *host;
+    char ws_accept[SIMPLEHTTP_WEBSOCKET_ACCEPT_LEN];
+    const char *since;
     char buf[248];
-    struct tm *time_struct;
+    struct tm time_struct;
+    int has_args;
+    int client_max_bytes, client_max_messages, client_sample_rate;
+    
+    TAILQ_INIT(&args);
+    has_args = strchr(req->uri, '?') != NULL;
+    if (has_args) {
+        evhttp_parse_query(req->uri, &args);
+    }
+    
+    client_max_bytes = client_limit_argument(&args, "max_pending_bytes", max_pending_bytes);
+    client_max_messages = client_limit_argument(&args, "max_pending_messages", max_pending_messages);
+    // sample_rate works the other way, a lower rate queues more messages
+    client_sample_rate = client_limit_argument(&args, "sample_rate", 0);
+    if (client_sample_rate != -1 && client_sample_rate < sample_rate) {
+        client_sample_rate = sample_rate;
+    }
+    if (client_max_bytes == -1 || client_max_messages == -1 || client_sample_rate == -1) {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "INVALID_LIMIT", evb);
+        if (has_args) {
+            evhttp_clear_headers(&args);
+        }
+        return;
+    }
     
     currentConns++;
     totalConns++;
-    evhttp_parse_query(req->uri, &args);
     client = calloc(1, sizeof(*client));
     client->multipart = get_int_argument(&args, "multipart", 1);
     client->req = req;
     client->connection_id = totalConns;
     client->connect_time = time(NULL);
-    time_struct = gmtime(&client->connect_time);
-    client->buf = evbuffer_new();
     client->kick_client = CLIENT_OK;
+    client->max_pending_bytes = client_max_bytes;
+    client->max_pending_messages = client_max_messages;
+    client->sample_rate = client_sample_rate;
+    if (client->sample_rate < 1) {
+        client->sample_rate = 1;
+    }
+    client->policy = slow_client_policy;
+    policy = evhttp_find_header(&args, "slow_client_policy");
+    if (policy && parse_policy(policy) != -1) {
+        client->policy = parse_policy(policy);
+    }
     
-    strftime(buf, 248, "%Y-%m-%d %H:%M:%S", time_struct);
+    gmtime_r(&client->connect_time, &time_struct);
+    strftime(buf, 248, "%Y-%m-%d %H:%M:%S", &time_struct);
     
     // print out info about this connection
     fprintf(stdout, "%llu >> /sub connection from %s:%d %s\n", client->connection_id, req->remote_host, req->remote_port, buf);
     
     // Connection: Upgrade
-    // Upgrade: WebSocket
-    ws_upgrade = (char *) evhttp_find_header(req->input_headers, "Upgrade");
-    ws_origin = (char *) evhttp_find_header(req->input_headers, "Origin");
-    ws_key = (char *) evhttp_find_header(req->input_headers, "Sec-WebSocket-Key");
-    host = (char *) evhttp_find_header(req->input_headers, "Host");
-    
-    if (ps_debug && ws_upgrade) {
-        fprintf(stderr, "%llu >> upgrade header is %s\n", client->connection_id, ws_upgrade);
-        fprintf(stderr, "%llu >> multipart is %d\n", client->connection_id, client->multipart);
-    }
+    // Upgrade: websocket
+    ws_upgrade = evhttp_find_header(req->input_headers, "Upgrade");
+    format = evhttp_find_header(&args, "format");
+    accept = evhttp_find_header(req->input_headers, "Accept");
     
-    if (ws_upgrade && strcasestr(ws_upgrade, "WebSocket")) {
+    if (get_int_argument(&args, "relay", 0)) {
+        // another pubsub re-broadcasting our messages (--upstream-url)
+        client->multipart = 0;
+        client->relay = 1;
+        evhttp_add_header(client->req->output_headers, "content-type", "text/plain");
+    } else if (get_int_argument(&args, "sequence", 0)) {
+        // a pubsubclient that will resume from the last sequence it saw
+        client->multipart = 0;
+        client->sequence = 1;
+        evhttp_add_header(client->req->output_headers, "content-type", "text/plain");
+    } else if (ws_upgrade && strcasecmp(ws_upgrade, "websocket") == 0) {
+        ws_origin = evhttp_find_header(req->input_headers, "Origin");
+        ws_key = evhttp_find_header(req->input_headers, "Sec-WebSocket-Key");
+        host = evhttp_find_header(req->input_headers, "Host");
         if (ps_debug) {
             fprintf(stderr, "%llu >> upgrading connection to a websocket\n", client->connection_id);
         }
@@ -318,52 +1020,58 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         client->websocket = 1;
         client->req->major = 1;
         client->req->minor = 1;
-        evhttp_add_header(client->req->output_headers, "Upgrade", "WebSocket");
+        evhttp_add_header(client->req->output_headers, "Upgrade", "websocket");
         evhttp_add_header(client->req->output_headers, "Connection", "Upgrade");
         evhttp_add_header(client->req->output_headers, "Server", "simplehttp/pubsub");
-        if (ws_origin) {
-            evhttp_add_header(client->req->output_headers, "WebSocket-Origin", ws_origin);
-        }
-        if (host) {
-            sprintf(buf, "ws://%s%s", host, req->uri);
-            if (ps_debug) {
-                fprintf(stderr, "%llu >> setting WebSocket-Location to %s\n", client->connection_id, buf);
+        if (simplehttp_websocket_accept(ws_key, ws_accept)) {
+            // RFC 6455
+            evhttp_add_header(client->req->output_headers, "Sec-WebSocket-Accept", ws_accept);
+        } else {
+            // draft-hixie-thewebsocketprotocol-75
+            if (ws_origin) {
+                evhttp_add_header(client->req->output_headers, "WebSocket-Origin", ws_origin);
+            }
+            if (host) {
+                snprintf(buf, sizeof(buf), "ws://%s%s", host, req->uri);
+                evhttp_add_header(client->req->output_headers, "WebSocket-Location", buf);
             }
-            evhttp_add_header(client->req->output_headers, "WebSocket-Location", buf);
-        }
-        if (ws_key != NULL) {
-            char ws_response_tmp[SHA_DIGEST_LENGTH];
-            char ws_buf[128];
-            
-            sprintf(ws_buf, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", ws_key);
-            SHA1(ws_buf, strlen(ws_buf), ws_response_tmp);
-            
-            ws_response = base64(ws_response_tmp, SHA_DIGEST_LENGTH);
-            evhttp_add_header(client->req->output_headers, "Sec-WebSocket-Accept", ws_response);
         }
-        
-        // evbuffer_add_printf(client->buf, "\r\n");
+    } else if ((format && strcmp(format, "sse") == 0) || (accept && strstr(accept, "text/event-stream"))) {
+        client->multipart = 0;
+        client->sse = 1;
+        evhttp_add_header(client->req->output_headers, "content-type", "text/event-stream");
+        evhttp_add_header(client->req->output_headers, "Cache-Control", "no-cache");
+        evbuffer_add(scratch, ":\n\n", 3);
     } else if (client->multipart) {
         evhttp_add_header(client->req->output_headers, "content-type",
                           "multipart/x-mixed-replace; boundary=" BOUNDARY);
-        evbuffer_add_printf(client->buf, "--%s\r\n", BOUNDARY);
+        evbuffer_add(scratch, "--" BOUNDARY "\r\n", sizeof("--" BOUNDARY "\r\n") - 1);
     } else {
         evhttp_add_header(client->req->output_headers, "content-type",
                           "application/json");
-        evbuffer_add_printf(client->buf, "\r\n");
+        evbuffer_add(scratch, "\r\n", 2);
+    }
+    if (replay_size) {
+        // lets a client know it can reconnect with ?sequence=1&since=
+        sprintf(buf, "%llu", (unsigned long long)stream_sequence);
+        evhttp_add_header(client->req->output_headers, "X-Pubsub-Sequence", buf);
     }
     if (client->websocket) {
         evhttp_send_reply_start(client->req, 101, "Switching Protocols");
     } else {
         evhttp_send_reply_start(client->req, HTTP_OK, "OK");
-    }
-    if (!client->websocket) {
-        evhttp_send_reply_chunk(client->req, client->buf);
+        evhttp_send_reply_chunk(client->req, scratch);
     }
     
     TAILQ_INSERT_TAIL(&clients, client, entries);
     evhttp_connection_set_closecb(req->evcon, on_close, (void *)client);
-    evhttp_clear_headers(&args);
+    since = evhttp_find_header(&args, "since");
+    if (since && replay_size) {
+        client_replay(client, strtoull(since, NULL, 10));
+    }
+    if (has_args) {
+        evhttp_clear_headers(&args);
+    }
 }
 
 int version_cb(int value)
@@ -374,21 +1082,58 @@ int version_cb(int value)
 
 int main(int argc, char **argv)
 {
+    struct upstream *up;
 
     define_simplehttp_options();
     option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
+    option_define_int("max_pending_bytes", OPT_OPTIONAL, MAX_PENDING_DATA, &max_pending_bytes, NULL, "maximum bytes queued per client (0 for unlimited)");
+    option_define_int("max_pending_messages", OPT_OPTIONAL, 0, &max_pending_messages, NULL, "maximum messages queued per client (0 for unlimited)");
+    option_define_int("max_pending_total_bytes", OPT_OPTIONAL, 0, &max_pending_total_bytes, NULL, "memory budget for messages queued across all clients (0 for unlimited)");
+    option_define_str("slow_client_policy", OPT_OPTIONAL, "kick", NULL, slow_client_policy_cb, "what to do with a client over its limits (kick, drop_oldest, drop_newest, sample)");
+    option_define_int("sample_rate", OPT_OPTIONAL, 10, &sample_rate, NULL, "with --slow-client-policy=sample, queue every Nth message while over the limit");
+    option_define_int("flush_interval_ms", OPT_OPTIONAL, 0, &flush_interval_ms, NULL, "hold messages up to this long to write them to clients in batches (0 to write immediately)");
+    option_define_int("max_batch_messages", OPT_OPTIONAL, 0, &max_batch_messages, NULL, "maximum messages written to a client in one chunk (0 for unlimited)");
+    option_define_int("max_batch_bytes", OPT_OPTIONAL, 1024 * 64, &max_batch_bytes, NULL, "maximum bytes written to a client in one chunk (0 for unlimited)");
+    option_define_str("upstream_url", OPT_OPTIONAL, NULL, NULL, upstream_url_cb, "(multiple) url(s) of pubsub(s) to re-broadcast messages from\n\t\t\t for example \"http://127.0.0.1:8081/sub\"");
+    option_define_int("node_id", OPT_OPTIONAL, 0, NULL, NULL, "unique id of this pubsub in a cluster (default: random)");
+    option_define_int("dedup_window", OPT_OPTIONAL, 10000, &dedup_window, NULL, "number of recent upstream message ids to remember to drop duplicates");
+    option_define_int("replay_size", OPT_OPTIONAL, 0, &replay_size, NULL, "number of recent messages kept for clients resuming with ?since= (0 to disable)");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
     
+    node_id = option_get_int("node_id");
+    if (!node_id) {
+        srand(time(NULL) ^ getpid());
+        node_id = ((uint64_t)rand() << 31) ^ rand();
+    }
+    if (dedup_window < 1) {
+        dedup_window = 1;
+    }
+    seen_ring = calloc(dedup_window, sizeof(struct seen_msg *));
+    if (replay_size < 0) {
+        replay_size = 0;
+    }
+    if (replay_size) {
+        replay_ring = calloc(replay_size, sizeof(struct msg *));
+    }
+    
     TAILQ_INIT(&clients);
     simplehttp_init();
+    scratch = evbuffer_new();
+    LL_FOREACH(upstreams, up) {
+        up->buf = evbuffer_new();
+        upstream_connect(up);
+    }
     simplehttp_set_cb("/pub*", pub_cb, NULL);
     simplehttp_set_cb("/sub*", sub_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
     simplehttp_set_cb("/clients", clients_cb, NULL);
     simplehttp_main();
+    free_upstreams();
+    free_replay_ring();
+    evbuffer_free(scratch);
     free_options();
     
     return 0;
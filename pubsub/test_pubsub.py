@@ -0,0 +1,93 @@
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(__file__), "../shared_tests"))
+
+import signal
+import socket
+import time
+import simplejson as json
+from test_shunt import SubprocessTest, http_fetch
+
+def pubsub_cmd(working_dir, port, upstream_ports):
+    cmd = [os.path.join(working_dir, "pubsub"), '--port=%d' % port, '--node-id=%d' % port]
+    for upstream_port in upstream_ports:
+        cmd.append('--upstream-url=http://127.0.0.1:%d/sub' % upstream_port)
+    return cmd
+
+class PubsubClusterTest(SubprocessTest):
+    binary_name = "pubsub"
+    working_dir = os.path.dirname(__file__)
+    test_output_dir = os.path.join(working_dir, "test_output")
+    # a full mesh; every node re-broadcasts the other two
+    process_options = [
+        pubsub_cmd(working_dir, 8080, [8081, 8082]),
+        pubsub_cmd(working_dir, 8081, [8080, 8082]),
+        pubsub_cmd(working_dir, 8082, [8080, 8081]),
+    ]
+
+    @classmethod
+    def tearDownClass(self):
+        # pubsub has no /exit endpoint
+        for process in self.processes:
+            if process.poll() is None:
+                os.kill(process.pid, signal.SIGKILL)
+                process.wait()
+
+    def test_relay(self):
+        # give the upstream connections a chance to come up
+        time.sleep(2)
+
+        sock = socket.create_connection(('127.0.0.1', 8082))
+        sock.sendall('GET /sub?multipart=0 HTTP/1.0\r\n\r\n')
+        time.sleep(.5)
+
+        http_fetch('/pub', body='test1')
+        http_fetch('/pub', body='test2\ntest3')
+        time.sleep(1)
+
+        sock.settimeout(.5)
+        data = ''
+        try:
+            while True:
+                chunk = sock.recv(4096)
+                if not chunk:
+                    break
+                data += chunk
+        except socket.timeout:
+            pass
+        sock.close()
+
+        body = data.split('\r\n\r\n', 1)[1]
+        # every message arrives exactly once even though it reaches 8082 over two paths
+        assert body.count('test1') == 1
+        assert body.count('test2') == 1
+        assert body.count('test3') == 1
+
+        data = json.loads(http_fetch('/stats', dict(format="json")))
+        assert len(data['upstreams']) == 2
+        # 8080's own messages come back to it from 8081 and 8082
+        assert data['messages_duplicate'] > 0
+
+        http_fetch('/stats', dict(reset=1))
+        data = json.loads(http_fetch('/stats', dict(format="json")))
+        assert data['messages_relayed'] == 0
+        assert data['messages_duplicate'] == 0
+
+    def test_sub_limits(self):
+        def status(query):
+            sock = socket.create_connection(('127.0.0.1', 8080))
+            sock.sendall('GET /sub?multipart=0&%s HTTP/1.0\r\n\r\n' % query)
+            sock.settimeout(.5)
+            line = sock.recv(4096).split('\r\n', 1)[0]
+            sock.close()
+            return int(line.split(' ')[1])
+
+        # a client can lower the limits but not turn them off
+        assert status('max_pending_bytes=0') == 400
+        assert status('max_pending_messages=-1') == 400
+        assert status('sample_rate=0') == 400
+        assert status('max_pending_bytes=1000&max_pending_messages=10&sample_rate=20') == 200
+
+
+if __name__ == "__main__":
+    print "usage: py.test"
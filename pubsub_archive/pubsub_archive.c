@@ -0,0 +1,668 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <simplehttp/queue.h>
+#include <simplehttp/simplehttp.h>
+#include <pubsubclient/pubsubclient.h>
+#include "http-internal.h"
+
+#ifdef DEBUG
+#define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
+#else
+#define _DEBUG(...) do {;} while (0)
+#endif
+
+#define VERSION "0.1"
+#define RECONNECT_SECS 5
+#define WRITE_BUFFER_SIZE 1024*64
+#define SENDFILE_CHUNK_SIZE 1024*256
+
+/*
+ * messages are appended (newline terminated, exactly as pubsub sends them)
+ * to <data_dir>/<epoch>.log. every --index-interval seconds that has data
+ * gets a (timestamp, offset) entry in <data_dir>/<epoch>.idx so a time range
+ * maps to a byte range without reading the segment.
+ */
+struct index_entry {
+    int64_t ts;
+    int64_t offset;
+};
+
+struct segment {
+    time_t start;
+    time_t last_ts;
+    uint64_t size;
+    int idx_fd;
+    // history requests still to send from it, it isn't removed until they're done
+    int refs;
+    TAILQ_ENTRY(segment) entries;
+};
+
+/*
+ * the byte ranges to send are fixed when the request comes in, so the body
+ * matches the Content-Length even as segments grow and roll
+ */
+struct history_range {
+    struct segment *segment;
+    off_t from;
+    off_t to;
+};
+
+struct history_req {
+    struct evhttp_request *req;
+    struct history_range *ranges;
+    int range_count;
+    int next_range;
+    int fd;
+    off_t offset;
+    off_t end_offset;
+    struct event ev;
+};
+
+static TAILQ_HEAD(segment_list, segment) segments;
+static struct segment *current = NULL;
+static int log_fd = -1;
+static struct evbuffer *write_buffer = NULL;
+static struct event flush_ev;
+static struct event reconnect_ev;
+static struct timeval reconnect_tv = {RECONNECT_SECS, 0};
+static char *data_dir = NULL;
+static int segment_seconds = 3600;
+static int index_interval = 1;
+static int max_segments = 0;
+
+static uint64_t messages_archived = 0;
+static uint64_t bytes_archived = 0;
+static uint64_t history_requests = 0;
+static uint64_t history_bytes = 0;
+static uint64_t number_reconnects = 0;
+
+void reconnect_to_source(int retryNow);
+void history_send(struct history_req *h);
+
+void segment_path(char *buf, size_t len, time_t start, const char *ext)
+{
+    snprintf(buf, len, "%s/%ld.%s", data_dir, (long)start, ext);
+}
+
+/*
+ * returns the offset of the first message at or after ts
+ */
+off_t segment_find_offset(struct segment *seg, time_t ts)
+{
+    struct index_entry entry;
+    off_t lo, hi, mid;
+    struct stat st;
+    
+    if (ts <= seg->start) {
+        return 0;
+    }
+    if (ts > seg->last_ts) {
+        return seg->size;
+    }
+    if (fstat(seg->idx_fd, &st) != 0) {
+        return 0;
+    }
+    
+    lo = 0;
+    hi = st.st_size / sizeof(struct index_entry);
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (pread(seg->idx_fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry)) {
+            return 0;
+        }
+        if (entry.ts < ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == st.st_size / sizeof(struct index_entry)) {
+        return seg->size;
+    }
+    pread(seg->idx_fd, &entry, sizeof(entry), lo * sizeof(entry));
+    return entry.offset;
+}
+
+/*
+ * the byte range of seg holding messages in [start, end). returns 0 if it's empty
+ */
+int segment_range(struct segment *seg, time_t start, time_t end, off_t *from, off_t *to)
+{
+    if (seg->start >= end || seg->last_ts + index_interval <= start) {
+        return 0;
+    }
+    *from = segment_find_offset(seg, start);
+    *to = segment_find_offset(seg, end);
+    return *from < *to;
+}
+
+struct segment *segment_open(time_t start)
+{
+    struct segment *seg;
+    struct index_entry entry;
+    struct stat st;
+    char path[1024];
+    
+    seg = calloc(1, sizeof(struct segment));
+    seg->start = start;
+    seg->last_ts = start;
+    
+    segment_path(path, sizeof(path), start, "idx");
+    seg->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (seg->idx_fd == -1) {
+        fprintf(stderr, "ERROR: failed to open %s (%s)\n", path, strerror(errno));
+        free(seg);
+        return NULL;
+    }
+    if (fstat(seg->idx_fd, &st) == 0 && st.st_size >= sizeof(entry)) {
+        if (pread(seg->idx_fd, &entry, sizeof(entry), st.st_size - sizeof(entry)) == sizeof(entry)) {
+            seg->last_ts = entry.ts;
+        }
+    }
+    
+    segment_path(path, sizeof(path), start, "log");
+    if (stat(path, &st) == 0) {
+        seg->size = st.st_size;
+    }
+    
+    return seg;
+}
+
+void segment_free(struct segment *seg)
+{
+    close(seg->idx_fd);
+    free(seg);
+}
+
+/*
+ * drop the oldest segments beyond --max-segments. one a history request is
+ * still sending from is left until it's done (history_free() calls this again)
+ */
+void enforce_retention()
+{
+    struct segment *seg;
+    char path[1024];
+    int count = 0;
+    
+    if (!max_segments) {
+        return;
+    }
+    
+    TAILQ_FOREACH(seg, &segments, entries) {
+        count++;
+    }
+    while (count > max_segments && (seg = TAILQ_FIRST(&segments)) != current && !seg->refs) {
+        fprintf(stdout, "removing segment %ld\n", (long)seg->start);
+        segment_path(path, sizeof(path), seg->start, "log");
+        unlink(path);
+        segment_path(path, sizeof(path), seg->start, "idx");
+        unlink(path);
+        TAILQ_REMOVE(&segments, seg, entries);
+        segment_free(seg);
+        count--;
+    }
+}
+
+/*
+ * load the segments already in --data-dir (in time order)
+ */
+int load_segments()
+{
+    DIR *dir;
+    struct dirent *de;
+    struct segment *seg, *tmp;
+    char *end;
+    long start;
+    
+    dir = opendir(data_dir);
+    if (!dir) {
+        fprintf(stderr, "ERROR: failed to open --data-dir %s (%s)\n", data_dir, strerror(errno));
+        return 0;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        start = strtol(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".log") != 0) {
+            continue;
+        }
+        if ((seg = segment_open(start)) == NULL) {
+            continue;
+        }
+        TAILQ_FOREACH_REVERSE(tmp, &segments, segment_list, entries) {
+            if (tmp->start < seg->start) {
+                break;
+            }
+        }
+        if (tmp) {
+            TAILQ_INSERT_AFTER(&segments, tmp, seg, entries);
+        } else {
+            TAILQ_INSERT_HEAD(&segments, seg, entries);
+        }
+    }
+    closedir(dir);
+    
+    return 1;
+}
+
+void flush_write_buffer()
+{
+    while (EVBUFFER_LENGTH(write_buffer)) {
+        if (evbuffer_write(write_buffer, log_fd) == -1) {
+            fprintf(stderr, "ERROR: write failed (%s)\n", strerror(errno));
+            evbuffer_drain(write_buffer, EVBUFFER_LENGTH(write_buffer));
+            break;
+        }
+    }
+}
+
+void flush_cb(int fd, short what, void *arg)
+{
+    struct timeval tv = {1, 0};
+    
+    flush_write_buffer();
+    evtimer_add(&flush_ev, &tv);
+}
+
+void roll_segment(time_t now)
+{
+    struct segment *seg;
+    char path[1024];
+    time_t start = now - (now % segment_seconds);
+    
+    if (current && current->start == start) {
+        return;
+    }
+    
+    if (log_fd != -1) {
+        flush_write_buffer();
+        close(log_fd);
+        log_fd = -1;
+    }
+    
+    seg = TAILQ_LAST(&segments, segment_list);
+    if (seg && seg->start == start) {
+        current = seg;
+    } else {
+        if ((current = segment_open(start)) == NULL) {
+            return;
+        }
+        TAILQ_INSERT_TAIL(&segments, current, entries);
+    }
+    
+    segment_path(path, sizeof(path), start, "log");
+    _DEBUG("opening segment %s\n", path);
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd == -1) {
+        fprintf(stderr, "ERROR: failed to open %s (%s)\n", path, strerror(errno));
+    }
+    
+    enforce_retention();
+}
+
+/*
+ * called with every complete message from a read, as views into the receive buffer
+ */
+void process_messages_cb(struct pubsubclient_message *messages, int count, void *cbarg)
+{
+    struct index_entry entry;
+    time_t now;
+    int i;
+    
+    now = time(NULL);
+    roll_segment(now);
+    if (log_fd == -1) {
+        return;
+    }
+    
+    // first message in a new index interval gets an index entry
+    if (current->size == 0 || now - (now % index_interval) > current->last_ts) {
+        entry.ts = now - (now % index_interval);
+        entry.offset = current->size;
+        if (write(current->idx_fd, &entry, sizeof(entry)) == sizeof(entry)) {
+            current->last_ts = entry.ts;
+        }
+    }
+    
+    for (i = 0; i < count; i++) {
+        evbuffer_add(write_buffer, messages[i].data, messages[i].len);
+        evbuffer_add(write_buffer, "\n", 1);
+        current->size += messages[i].len + 1;
+        bytes_archived += messages[i].len + 1;
+    }
+    messages_archived += count;
+    
+    if (EVBUFFER_LENGTH(write_buffer) >= WRITE_BUFFER_SIZE) {
+        flush_write_buffer();
+    }
+}
+
+void history_free(struct history_req *h)
+{
+    int i;
+    
+    if (event_initialized(&h->ev)) {
+        event_del(&h->ev);
+    }
+    if (h->fd != -1) {
+        close(h->fd);
+    }
+    for (i = 0; i < h->range_count; i++) {
+        h->ranges[i].segment->refs--;
+    }
+    free(h->ranges);
+    free(h);
+    
+    // segments this request held on to may be due for removal
+    enforce_retention();
+}
+
+/*
+ * open the next range to send. returns 0 when there are none left, -1 if
+ * the segment can't be opened
+ */
+int history_next_segment(struct history_req *h)
+{
+    struct history_range *range;
+    char path[1024];
+    
+    if (h->fd != -1) {
+        close(h->fd);
+        h->fd = -1;
+    }
+    
+    if (h->next_range == h->range_count) {
+        return 0;
+    }
+    range = &h->ranges[h->next_range++];
+    segment_path(path, sizeof(path), range->segment->start, "log");
+    h->fd = open(path, O_RDONLY);
+    if (h->fd == -1) {
+        fprintf(stderr, "ERROR: failed to open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    h->offset = range->from;
+    h->end_offset = range->to;
+    
+    return 1;
+}
+
+/*
+ * evhttp never sees the body, so the request can't be finished through it;
+ * the connection is closed once it's sent (or can't be)
+ */
+void history_close(struct history_req *h)
+{
+    struct evhttp_connection *evcon = h->req->evcon;
+    
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+    history_free(h);
+    evhttp_connection_free(evcon);
+}
+
+/*
+ * the client went away (or the server is shutting down) mid request
+ */
+void history_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    history_free((struct history_req *)arg);
+}
+
+void history_write_cb(int fd, short what, void *arg)
+{
+    history_send((struct history_req *)arg);
+}
+
+/*
+ * stream the byte range of each segment straight from the page cache
+ * to the client socket; evhttp only ever sees the headers
+ */
+void history_send(struct history_req *h)
+{
+    struct evhttp_connection *evcon = h->req->evcon;
+    ssize_t n;
+    size_t len;
+    int more = 0;
+    
+    while (h->fd != -1 || (more = history_next_segment(h)) == 1) {
+        while (h->offset < h->end_offset) {
+            len = h->end_offset - h->offset;
+            if (len > SENDFILE_CHUNK_SIZE) {
+                len = SENDFILE_CHUNK_SIZE;
+            }
+            n = sendfile(evcon->fd, h->fd, &h->offset, len);
+            if (n == -1 && errno == EAGAIN) {
+                event_set(&h->ev, evcon->fd, EV_WRITE, history_write_cb, h);
+                event_add(&h->ev, NULL);
+                return;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "ERROR: sendfile failed (%s)\n", n ? strerror(errno) : "short file");
+                history_close(h);
+                return;
+            }
+            history_bytes += n;
+        }
+        close(h->fd);
+        h->fd = -1;
+    }
+    
+    // when more == -1 the body is short of the Content-Length, closing
+    // tells the client as much
+    history_close(h);
+}
+
+void history_headers_sent_cb(struct evhttp_connection *evcon, void *arg)
+{
+    history_send((struct history_req *)arg);
+}
+
+/*
+ * start and end are unix timestamps (negative values are relative to now)
+ */
+void history_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct evkeyvalq args;
+    struct history_req *h;
+    struct segment *seg;
+    off_t from, to;
+    uint64_t content_length = 0;
+    time_t now = time(NULL);
+    time_t start, end;
+    int count = 0;
+    
+    evhttp_parse_query(req->uri, &args);
+    start = get_int_argument(&args, "start", 0);
+    end = get_int_argument(&args, "end", 0);
+    evhttp_clear_headers(&args);
+    
+    if (start < 0) {
+        start += now;
+    }
+    if (end <= 0) {
+        end += now + 1;
+    }
+    if (start >= end) {
+        evhttp_send_reply(req, HTTP_BADREQUEST, "INVALID_RANGE", evb);
+        return;
+    }
+    history_requests++;
+    
+    // everything written so far has to be on disk before it can be sent
+    flush_write_buffer();
+    
+    TAILQ_FOREACH(seg, &segments, entries) {
+        count++;
+    }
+    h = calloc(1, sizeof(struct history_req));
+    h->req = req;
+    h->fd = -1;
+    h->ranges = calloc(count ? count : 1, sizeof(struct history_range));
+    TAILQ_FOREACH(seg, &segments, entries) {
+        if (seg->start >= end) {
+            break;
+        }
+        if (segment_range(seg, start, end, &from, &to)) {
+            seg->refs++;
+            h->ranges[h->range_count].segment = seg;
+            h->ranges[h->range_count].from = from;
+            h->ranges[h->range_count].to = to;
+            h->range_count++;
+            content_length += to - from;
+        }
+    }
+    
+    // evhttp_send_reply_start() would make the reply chunked for HTTP/1.1
+    // clients, and the body doesn't go through evhttp to be framed
+    evbuffer_add_printf(req->evcon->output_buffer, "HTTP/%d.%d 200 OK\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %"PRIu64"\r\n"
+                        "Connection: close\r\n\r\n",
+                        req->major, req->minor, content_length);
+    evhttp_connection_set_closecb(req->evcon, history_close_cb, h);
+    // send the body once the headers are out of the output buffer
+    evhttp_write_buffer(req->evcon, history_headers_sent_cb, h);
+}
+
+void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct evkeyvalq args;
+    struct segment *seg;
+    const char *format;
+    int count = 0;
+    
+    TAILQ_FOREACH(seg, &segments, entries) {
+        count++;
+    }
+    
+    evhttp_parse_query(req->uri, &args);
+    format = (char *)evhttp_find_header(&args, "format");
+    
+    if ((format != NULL) && (strcmp(format, "json") == 0)) {
+        evbuffer_add_printf(evb, "{");
+        evbuffer_add_printf(evb, "\"messages_archived\": %"PRIu64",", messages_archived);
+        evbuffer_add_printf(evb, "\"bytes_archived\": %"PRIu64",", bytes_archived);
+        evbuffer_add_printf(evb, "\"segments\": %d,", count);
+        evbuffer_add_printf(evb, "\"history_requests\": %"PRIu64",", history_requests);
+        evbuffer_add_printf(evb, "\"history_bytes\": %"PRIu64",", history_bytes);
+        evbuffer_add_printf(evb, "\"reconnects\": %"PRIu64, number_reconnects);
+        evbuffer_add_printf(evb, "}\n");
+    } else {
+        evbuffer_add_printf(evb, "Messages archived: %"PRIu64"\n", messages_archived);
+        evbuffer_add_printf(evb, "Bytes archived: %"PRIu64"\n", bytes_archived);
+        evbuffer_add_printf(evb, "Segments: %d\n", count);
+        evbuffer_add_printf(evb, "History requests: %"PRIu64"\n", history_requests);
+        evbuffer_add_printf(evb, "History bytes: %"PRIu64"\n", history_bytes);
+        evbuffer_add_printf(evb, "Reconnects: %"PRIu64"\n", number_reconnects);
+    }
+    
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    evhttp_clear_headers(&args);
+}
+
+void source_reconnect_cb(int fd, short what, void *ctx)
+{
+    pubsubclient_connect();
+    number_reconnects++;
+}
+
+void error_cb(int status_code, void *arg)
+{
+    fprintf(stderr, "HTTP STATUS: %d\n", status_code);
+    reconnect_to_source(status_code == HTTP_OK);
+}
+
+void reconnect_to_source(int retryNow)
+{
+    if (retryNow) {
+        fprintf(stderr, "Reconnecting now\n");
+        pubsubclient_connect();
+        number_reconnects++;
+    } else {
+        fprintf(stderr, "Reconnecting in %d secs...\n", RECONNECT_SECS);
+        evtimer_del(&reconnect_ev);
+        evtimer_set(&reconnect_ev, source_reconnect_cb, NULL);
+        evtimer_add(&reconnect_ev, &reconnect_tv);
+    }
+}
+
+int version_cb(int value)
+{
+    fprintf(stdout, "Version: %s\n", VERSION);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *pubsub_url;
+    char *source_address;
+    char *source_path;
+    int source_port;
+    struct segment *seg;
+    struct timeval tv = {1, 0};
+    
+    define_simplehttp_options();
+    option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
+    option_define_str("pubsub_url", OPT_REQUIRED, "http://127.0.0.1:80/sub?multipart=0", &pubsub_url, NULL, "url of pubsub to read from");
+    option_define_str("data_dir", OPT_OPTIONAL, ".", &data_dir, NULL, "directory to write segments to");
+    option_define_int("segment_seconds", OPT_OPTIONAL, 3600, &segment_seconds, NULL, "seconds of messages per segment file");
+    option_define_int("index_interval", OPT_OPTIONAL, 1, &index_interval, NULL, "granularity (in seconds) of the time index");
+    option_define_int("max_segments", OPT_OPTIONAL, 0, &max_segments, NULL, "number of segments to keep (0 for unlimited)");
+    
+    if (!option_parse_command_line(argc, argv)) {
+        return 1;
+    }
+    
+    if (segment_seconds < 1 || index_interval < 1) {
+        fprintf(stderr, "ERROR: --segment-seconds and --index-interval must be positive\n");
+        exit(1);
+    }
+    if (!simplehttp_parse_url(pubsub_url, strlen(pubsub_url), &source_address, &source_port, &source_path)) {
+        fprintf(stderr, "ERROR: failed to parse pubsub-url\n");
+        exit(1);
+    }
+    
+    TAILQ_INIT(&segments);
+    if (!load_segments()) {
+        exit(1);
+    }
+    
+    simplehttp_init();
+    write_buffer = evbuffer_new();
+    evtimer_set(&flush_ev, flush_cb, NULL);
+    evtimer_add(&flush_ev, &tv);
+    simplehttp_set_cb("/history*", history_cb, NULL);
+    simplehttp_set_cb("/stats*", stats_cb, NULL);
+    
+    pubsubclient_init(source_address, source_port, source_path, NULL, error_cb, NULL);
+    pubsubclient_set_batch_cb(process_messages_cb);
+    simplehttp_main();
+    pubsubclient_free();
+    
+    if (log_fd != -1) {
+        flush_write_buffer();
+        close(log_fd);
+    }
+    evbuffer_free(write_buffer);
+    while ((seg = TAILQ_FIRST(&segments)) != NULL) {
+        TAILQ_REMOVE(&segments, seg, entries);
+        segment_free(seg);
+    }
+    
+    free_options();
+    free(pubsub_url);
+    free(data_dir);
+    free(source_address);
+    free(source_path);
+    
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <json/json.h>
+#include "filter_plan.h"
+
+/*
+ * messages/s for N clients spread over 100 distinct filters, parsing with
+ * json-c and evaluating each client's filter separately vs. scanning once
+ * and evaluating through the shared filter plan
+ *
+ * usage: bench_filter [messages]
+ */
+
+#define NUM_FILTERS 100
+
+static int client_counts[] = {10, 100, 1000, 10000};
+static uint64_t msg_id = 0;
+
+int scan_cb(struct json_member *member, void *arg)
+{
+    filter_scan_member(member, msg_id);
+    return 1;
+}
+
+double now()
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    struct filter *filters[NUM_FILTERS];
+    pcre *naive[NUM_FILTERS];
+    pcre_extra *naive_extra[NUM_FILTERS];
+    struct json_object *json_in, *element;
+    struct json_scratch scratch = {NULL, 0};
+    const char *error;
+    const char *value;
+    char pattern[32];
+    char message[256];
+    int num_messages = argc > 1 ? atoi(argv[1]) : 10000;
+    int i, j, c, matched, erroroffset;
+    double start, naive_rate, plan_rate;
+    
+    for (i = 0; i < NUM_FILTERS; i++) {
+        sprintf(pattern, "^user%d$", i);
+        filters[i] = filter_get("user", pattern, &error);
+        naive[i] = pcre_compile(pattern, 0, &error, &erroroffset, NULL);
+        naive_extra[i] = NULL;
+    }
+    
+    fprintf(stdout, "%8s %16s %16s\n", "clients", "per client msg/s", "filter plan msg/s");
+    for (c = 0; c < sizeof(client_counts) / sizeof(int); c++) {
+        matched = 0;
+        start = now();
+        for (i = 0; i < num_messages; i++) {
+            sprintf(message, "{\"user\": \"user%d\", \"ip\": \"127.0.0.1\", \"desc\": \"ip added\"}", i % NUM_FILTERS);
+            json_in = json_tokener_parse(message);
+            for (j = 0; j < client_counts[c]; j++) {
+                element = json_object_object_get(json_in, "user");
+                value = element ? json_object_get_string(element) : "";
+                matched += filter_exec(naive[j % NUM_FILTERS], naive_extra[j % NUM_FILTERS], value, strlen(value));
+            }
+            json_object_put(json_in);
+        }
+        naive_rate = num_messages / (now() - start);
+        
+        start = now();
+        for (i = 0; i < num_messages; i++) {
+            sprintf(message, "{\"user\": \"user%d\", \"ip\": \"127.0.0.1\", \"desc\": \"ip added\"}", i % NUM_FILTERS);
+            msg_id++;
+            json_scan(message, strlen(message), scan_cb, NULL);
+            for (j = 0; j < client_counts[c]; j++) {
+                matched -= filter_match(filters[j % NUM_FILTERS], msg_id, &scratch);
+            }
+        }
+        plan_rate = num_messages / (now() - start);
+        
+        if (matched != 0) {
+            fprintf(stderr, "ERROR: filter results differ\n");
+            return 1;
+        }
+        fprintf(stdout, "%8d %16.0f %16.0f\n", client_counts[c], naive_rate, plan_rate);
+    }
+    
+    for (i = 0; i < NUM_FILTERS; i++) {
+        filter_release(filters[i]);
+        pcre_free(naive[i]);
+    }
+    json_scratch_free(&scratch);
+    
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# throughput of stream_filter for 1..N threads over a generated input file
+#
+# usage: bench_stream_filter.sh [size in MB] [max threads]
+
+SIZE_MB=${1:-2048}
+MAX_THREADS=${2:-$(getconf _NPROCESSORS_ONLN)}
+INPUT=${TMPDIR:-/tmp}/stream_filter_bench.json
+FILTER_ARGS="--encrypted-fields=ip,user --blacklist-fields=secret"
+
+if [ ! -f "$INPUT" ] || [ $(($(wc -c < "$INPUT") / 1048576)) -lt $SIZE_MB ]; then
+    echo "generating ${SIZE_MB}MB of input in $INPUT"
+    awk -v size=$((SIZE_MB * 1048576)) 'BEGIN {
+        srand(1);
+        pad = sprintf("%1800s", ""); gsub(/ /, "x", pad);
+        while (bytes < size) {
+            line = sprintf("{\"user\": \"u%d\", \"ip\": \"10.0.%d.%d\", \"secret\": %d, \"ts\": %d, \"pad\": \"%s\"}",
+                int(rand() * 100000), n % 256, int(rand() * 256), n, 1300000000 + n, substr(pad, 1, int(rand() * 1800)));
+            print line;
+            bytes += length(line) + 1;
+            n++;
+        }
+    }' > "$INPUT"
+fi
+
+make stream_filter > /dev/null || exit 1
+BYTES=$(wc -c < "$INPUT")
+
+bench() {
+    START=$(date +%s.%N)
+    ./stream_filter $FILTER_ARGS "$@" < "$INPUT" > /dev/null 2>&1
+    END=$(date +%s.%N)
+    awk -v args="$*" -v bytes=$BYTES -v secs=$(echo "$END $START" | awk '{print $1 - $2}') 'BEGIN {printf "%-28s %8.1f MB/s\n", args, bytes / 1048576 / secs}'
+}
+
+THREADS=1
+while [ $THREADS -le $MAX_THREADS ]; do
+    bench --threads=$THREADS
+    if [ $THREADS -gt 1 ]; then
+        bench --threads=$THREADS --unordered
+    fi
+    THREADS=$((THREADS * 2))
+done
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <simplehttp/uthash.h>
+#include "md5.h"
+#include "field_hash.h"
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+static const char hex_chars[] = "0123456789abcdef";
+
+static enum field_hash_algorithm algorithm = FIELD_HASH_MD5;
+static uint64_t k0 = 0;
+static uint64_t k1 = 0;
+
+/*
+ * a recently hashed value. entries are kept in the hash table in least to
+ * most recently used order so the first one is evicted when the memo is full
+ */
+struct memo_entry {
+    char *key;
+    size_t key_len;
+    size_t key_size;
+    char out[FIELD_HASH_MAX_LEN];
+    size_t out_len;
+    UT_hash_handle hh;
+};
+
+struct field_hash_memo {
+    struct memo_entry *table;
+    struct memo_entry *entries;
+    int size;
+    int used;
+};
+
+static uint64_t read_u64_le(const unsigned char *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t siphash24(const unsigned char *in, size_t len)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t)len) << 56;
+    uint64_t m;
+    const unsigned char *end = in + len - (len % 8);
+    
+    for (; in != end; in += 8) {
+        m = read_u64_le(in);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    
+    switch (len & 7) {
+        case 7:
+            b |= ((uint64_t)in[6]) << 48;
+        case 6:
+            b |= ((uint64_t)in[5]) << 40;
+        case 5:
+            b |= ((uint64_t)in[4]) << 32;
+        case 4:
+            b |= ((uint64_t)in[3]) << 24;
+        case 3:
+            b |= ((uint64_t)in[2]) << 16;
+        case 2:
+            b |= ((uint64_t)in[1]) << 8;
+        case 1:
+            b |= ((uint64_t)in[0]);
+            break;
+    }
+    
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * algorithm is "md5" (default) or "siphash". siphash needs a 128 bit key
+ * as 32 hex characters. returns 0 on error
+ */
+int field_hash_init(const char *name, const char *key)
+{
+    unsigned char k[16];
+    unsigned int byte;
+    int i;
+    
+    if (name == NULL || strcmp(name, "md5") == 0) {
+        algorithm = FIELD_HASH_MD5;
+        return 1;
+    }
+    if (strcmp(name, "siphash") != 0) {
+        fprintf(stderr, "ERROR: unknown --hash-algorithm %s (md5, siphash)\n", name);
+        return 0;
+    }
+    
+    if (key == NULL || strlen(key) != 32) {
+        fprintf(stderr, "ERROR: --hash-algorithm=siphash needs a --hash-key of 32 hex characters\n");
+        return 0;
+    }
+    for (i = 0; i < 16; i++) {
+        if (sscanf(key + i * 2, "%2x", &byte) != 1) {
+            fprintf(stderr, "ERROR: invalid --hash-key\n");
+            return 0;
+        }
+        k[i] = (unsigned char)byte;
+    }
+    k0 = read_u64_le(k);
+    k1 = read_u64_le(k + 8);
+    algorithm = FIELD_HASH_SIPHASH;
+    
+    return 1;
+}
+
+/*
+ * hex digest of len bytes of data into out (FIELD_HASH_MAX_LEN bytes).
+ * returns the digest length
+ */
+size_t field_hash(const char *data, size_t len, char *out)
+{
+    struct cvs_MD5Context context;
+    unsigned char checksum[16];
+    uint64_t h;
+    int i;
+    
+    if (algorithm == FIELD_HASH_SIPHASH) {
+        h = siphash24((const unsigned char *)data, len);
+        for (i = 15; i >= 0; i--) {
+            out[i] = hex_chars[h & 0xf];
+            h >>= 4;
+        }
+        out[16] = '\0';
+        return 16;
+    }
+    
+    cvs_MD5Init(&context);
+    cvs_MD5Update(&context, (const unsigned char *)data, len);
+    cvs_MD5Final(checksum, &context);
+    for (i = 0; i < 16; i++) {
+        out[i * 2] = hex_chars[checksum[i] >> 4];
+        out[i * 2 + 1] = hex_chars[checksum[i] & 0xf];
+    }
+    out[32] = '\0';
+    return 32;
+}
+
+/*
+ * an LRU memo of the last size values hashed. not thread safe; use one per thread
+ */
+struct field_hash_memo *field_hash_memo_new(int size)
+{
+    struct field_hash_memo *memo;
+    
+    if (size <= 0) {
+        return NULL;
+    }
+    memo = calloc(1, sizeof(struct field_hash_memo));
+    memo->entries = calloc(size, sizeof(struct memo_entry));
+    memo->size = size;
+    
+    return memo;
+}
+
+/*
+ * field_hash() through the memo (which may be NULL)
+ */
+size_t field_hash_memo(struct field_hash_memo *memo, const char *data, size_t len, char *out)
+{
+    struct memo_entry *entry;
+    
+    if (!memo) {
+        return field_hash(data, len, out);
+    }
+    
+    HASH_FIND(hh, memo->table, data, len, entry);
+    if (entry) {
+        // move to the most recently used end
+        HASH_DELETE(hh, memo->table, entry);
+        HASH_ADD_KEYPTR(hh, memo->table, entry->key, entry->key_len, entry);
+        memcpy(out, entry->out, entry->out_len + 1);
+        return entry->out_len;
+    }
+    
+    if (memo->used < memo->size) {
+        entry = &memo->entries[memo->used++];
+    } else {
+        entry = memo->table;
+        HASH_DELETE(hh, memo->table, entry);
+    }
+    if (entry->key_size < len) {
+        entry->key_size = len;
+        entry->key = realloc(entry->key, len);
+    }
+    memcpy(entry->key, data, len);
+    entry->key_len = len;
+    entry->out_len = field_hash(data, len, entry->out);
+    HASH_ADD_KEYPTR(hh, memo->table, entry->key, entry->key_len, entry);
+    
+    memcpy(out, entry->out, entry->out_len + 1);
+    return entry->out_len;
+}
+
+void field_hash_memo_free(struct field_hash_memo *memo)
+{
+    int i;
+    
+    if (!memo) {
+        return;
+    }
+    HASH_CLEAR(hh, memo->table);
+    for (i = 0; i < memo->used; i++) {
+        free(memo->entries[i].key);
+    }
+    free(memo->entries);
+    free(memo);
+}
@@ -0,0 +1,24 @@
+#ifndef __field_hash_h
+#define __field_hash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* room for the longest hex digest plus a NUL */
+#define FIELD_HASH_MAX_LEN 33
+
+enum field_hash_algorithm {
+    FIELD_HASH_MD5 = 0,     /* unkeyed, 32 hex chars (the original output) */
+    FIELD_HASH_SIPHASH,     /* SipHash-2-4 keyed with --hash-key, 16 hex chars */
+};
+
+struct field_hash_memo;
+
+int field_hash_init(const char *algorithm, const char *key);
+size_t field_hash(const char *data, size_t len, char *out);
+
+struct field_hash_memo *field_hash_memo_new(int size);
+size_t field_hash_memo(struct field_hash_memo *memo, const char *data, size_t len, char *out);
+void field_hash_memo_free(struct field_hash_memo *memo);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "filter_plan.h"
+
+#define OVECCOUNT 30    /* should be a multiple of 3 */
+
+static struct filter *filters = NULL;
+static struct filter_subject *subjects = NULL;
+
+/*
+ * study (and JIT compile when pcre supports it) a pattern
+ */
+pcre_extra *filter_study(pcre *re)
+{
+    const char *error = NULL;
+    int options = 0;
+    
+#ifdef PCRE_STUDY_JIT_COMPILE
+    options |= PCRE_STUDY_JIT_COMPILE;
+#endif
+    return pcre_study(re, options, &error);
+}
+
+int filter_exec(pcre *re, pcre_extra *extra, const char *subject, int subject_length)
+{
+    int ovector[OVECCOUNT];
+    
+    return pcre_exec(re, extra, subject, subject_length, 0, 0, ovector, OVECCOUNT) >= 0;
+}
+
+/*
+ * returns the shared filter for (subject, pattern), compiling it the
+ * first time it's used. returns NULL (and sets error) for a bad pattern.
+ */
+struct filter *filter_get(const char *subject, const char *pattern, const char **error)
+{
+    struct filter *f;
+    size_t subject_len = strlen(subject);
+    size_t pattern_len = strlen(pattern);
+    char *key;
+    int erroroffset;
+    
+    // subject\0pattern
+    key = malloc(subject_len + pattern_len + 2);
+    memcpy(key, subject, subject_len + 1);
+    memcpy(key + subject_len + 1, pattern, pattern_len + 1);
+    
+    HASH_FIND(hh, filters, key, subject_len + pattern_len + 1, f);
+    if (f) {
+        free(key);
+        f->refcount++;
+        return f;
+    }
+    
+    f = calloc(1, sizeof(struct filter));
+    f->re = pcre_compile(pattern, 0, error, &erroroffset, NULL);
+    if (!f->re) {
+        free(key);
+        free(f);
+        return NULL;
+    }
+    f->extra = filter_study(f->re);
+    f->key = key;
+    f->pattern = key + subject_len + 1;
+    
+    HASH_FIND(hh, subjects, subject, subject_len, f->subject);
+    if (f->subject) {
+        f->subject->refcount++;
+    } else {
+        f->subject = calloc(1, sizeof(struct filter_subject));
+        f->subject->name = strdup(subject);
+        f->subject->refcount = 1;
+        HASH_ADD_KEYPTR(hh, subjects, f->subject->name, subject_len, f->subject);
+    }
+    f->refcount = 1;
+    HASH_ADD_KEYPTR(hh, filters, f->key, subject_len + pattern_len + 1, f);
+    
+    return f;
+}
+
+void filter_release(struct filter *f)
+{
+    if (--f->refcount > 0) {
+        return;
+    }
+    HASH_DEL(filters, f);
+    if (--f->subject->refcount == 0) {
+        HASH_DEL(subjects, f->subject);
+        free(f->subject->name);
+        free(f->subject->value);
+        free(f->subject);
+    }
+    if (f->extra) {
+#if PCRE_MAJOR > 8 || (PCRE_MAJOR == 8 && PCRE_MINOR >= 20)
+        pcre_free_study(f->extra);
+#else
+        // no JIT data before 8.20, the study data is a single block
+        pcre_free(f->extra);
+#endif
+    }
+    pcre_free(f->re);
+    free(f->key);
+    free(f);
+}
+
+/*
+ * call for each top level member of a message before filter_match().
+ * msg_id must be unique per message (and never 0)
+ */
+void filter_scan_member(struct json_member *member, uint64_t msg_id)
+{
+    struct filter_subject *subject;
+    
+    if (!subjects) {
+        return;
+    }
+    HASH_FIND(hh, subjects, member->key, member->key_len, subject);
+    if (subject) {
+        subject->msg_id = msg_id;
+        subject->member = *member;
+    }
+}
+
+/*
+ * like filter_scan_member() for a member whose value is replaced in the
+ * output (an encrypted field), filters see value rather than the original
+ */
+void filter_scan_value(struct json_member *member, const char *value, size_t value_len, uint64_t msg_id)
+{
+    struct filter_subject *subject;
+    
+    if (!subjects) {
+        return;
+    }
+    HASH_FIND(hh, subjects, member->key, member->key_len, subject);
+    if (subject) {
+        if (subject->value_size < value_len) {
+            subject->value_size = value_len;
+            subject->value = realloc(subject->value, subject->value_size);
+        }
+        memcpy(subject->value, value, value_len);
+        subject->value_len = value_len;
+        subject->msg_id = msg_id;
+        subject->value_msg_id = msg_id;
+    }
+}
+
+int filter_match(struct filter *f, uint64_t msg_id, struct json_scratch *scratch)
+{
+    const char *value = "";
+    size_t value_len = 0;
+    
+    if (f->last_msg_id == msg_id) {
+        return f->last_result;
+    }
+    
+    // a missing (or null) subject matches as ""
+    if (f->subject->value_msg_id == msg_id) {
+        value = f->subject->value;
+        value_len = f->subject->value_len;
+    } else if (f->subject->msg_id == msg_id && !json_member_is_null(&f->subject->member)) {
+        value = json_member_string(&f->subject->member, scratch, &value_len);
+    }
+    f->last_msg_id = msg_id;
+    f->last_result = filter_exec(f->re, f->extra, value, value_len);
+    
+    return f->last_result;
+}
+
+int filter_count()
+{
+    return HASH_COUNT(filters);
+}
@@ -0,0 +1,52 @@
+#ifndef __filter_plan_h
+#define __filter_plan_h
+
+#include <stdint.h>
+#include <simplehttp/uthash.h>
+#include "pcre.h"
+#include "json_scan.h"
+
+/*
+ * the fields filters look at. filter_scan_member() records where each one
+ * is in the current message while it is scanned, filter_scan_value() keeps
+ * a copy of the value it was rewritten to instead.
+ */
+struct filter_subject {
+    char *name;
+    int refcount;
+    uint64_t msg_id;
+    struct json_member member;
+    uint64_t value_msg_id;
+    char *value;
+    size_t value_len;
+    size_t value_size;
+    UT_hash_handle hh;
+};
+
+/*
+ * subscribers using the same (subject, pattern) share one compiled filter.
+ * the result is cached per message so each distinct filter is evaluated
+ * once per message no matter how many clients use it.
+ */
+struct filter {
+    char *key;
+    char *pattern;
+    struct filter_subject *subject;
+    pcre *re;
+    pcre_extra *extra;
+    int refcount;
+    uint64_t last_msg_id;
+    int last_result;
+    UT_hash_handle hh;
+};
+
+struct filter *filter_get(const char *subject, const char *pattern, const char **error);
+void filter_release(struct filter *f);
+void filter_scan_member(struct json_member *member, uint64_t msg_id);
+void filter_scan_value(struct json_member *member, const char *value, size_t value_len, uint64_t msg_id);
+int filter_match(struct filter *f, uint64_t msg_id, struct json_scratch *scratch);
+int filter_exec(pcre *re, pcre_extra *extra, const char *subject, int subject_length);
+pcre_extra *filter_study(pcre *re);
+int filter_count();
+
+#endif
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include "json_scan.h"
+
+/*
+ * A minimal scanner for the top level members of a JSON object. Only the
+ * structure needed to find member boundaries is checked; values are
+ * skipped over, never parsed, unless a caller asks for one.
+ */
+
+static const char *skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+/* p points at the opening quote. returns a pointer just past the closing quote */
+static const char *skip_string(const char *p, const char *end)
+{
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+static const char *skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+    
+    if (p >= end) {
+        return NULL;
+    }
+    if (*p == '"') {
+        return skip_string(p, end);
+    }
+    if (*p != '{' && *p != '[') {
+        // number, true, false, null
+        while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+                *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+            p++;
+        }
+        return p;
+    }
+    
+    while (p < end) {
+        switch (*p) {
+            case '"':
+                if ((p = skip_string(p, end)) == NULL) {
+                    return NULL;
+                }
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0) {
+                    return p + 1;
+                }
+                break;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * call cb for each top level member of the object in json. cb returns 0 to
+ * stop scanning. returns 1 if json is a well formed object (or cb stopped
+ * the scan), 0 otherwise
+ */
+int json_scan(const char *json, size_t len, json_member_cb cb, void *arg)
+{
+    const char *p = json, *end = json + len;
+    struct json_member member;
+    
+    p = skip_ws(p, end);
+    if (p >= end || *p != '{') {
+        return 0;
+    }
+    p = skip_ws(p + 1, end);
+    if (p < end && *p == '}') {
+        return skip_ws(p + 1, end) == end;
+    }
+    
+    while (p < end) {
+        if (*p != '"') {
+            return 0;
+        }
+        member.start = p;
+        member.key = p + 1;
+        if ((p = skip_string(p, end)) == NULL) {
+            return 0;
+        }
+        member.key_len = p - 1 - member.key;
+        
+        p = skip_ws(p, end);
+        if (p >= end || *p != ':') {
+            return 0;
+        }
+        p = skip_ws(p + 1, end);
+        member.value = p;
+        if ((p = skip_value(p, end)) == NULL || p == member.value) {
+            return 0;
+        }
+        member.value_len = p - member.value;
+        member.len = p - member.start;
+        
+        if (!cb(&member, arg)) {
+            return 1;
+        }
+        
+        p = skip_ws(p, end);
+        if (p >= end) {
+            return 0;
+        }
+        if (*p == '}') {
+            return skip_ws(p + 1, end) == end;
+        }
+        if (*p != ',') {
+            return 0;
+        }
+        p = skip_ws(p + 1, end);
+    }
+    
+    return 0;
+}
+
+int json_member_key_equals(struct json_member *member, const char *key)
+{
+    return strncmp(member->key, key, member->key_len) == 0 && key[member->key_len] == '\0';
+}
+
+int json_member_is_null(struct json_member *member)
+{
+    return member->value_len == 4 && memcmp(member->value, "null", 4) == 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static long read_hex4(const char *p, const char *end)
+{
+    long v = 0;
+    int i, h;
+    
+    if (end - p < 4) {
+        return -1;
+    }
+    for (i = 0; i < 4; i++) {
+        if ((h = hex_value(p[i])) < 0) {
+            return -1;
+        }
+        v = (v << 4) | h;
+    }
+    return v;
+}
+
+/* unescape a JSON string body into out (never longer than the input) */
+static size_t unescape(const char *p, const char *end, char *out)
+{
+    char *o = out;
+    long c, lo;
+    
+    while (p < end) {
+        if (*p != '\\' || p + 1 >= end) {
+            *o++ = *p++;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'b':
+                *o++ = '\b';
+                break;
+            case 'f':
+                *o++ = '\f';
+                break;
+            case 'n':
+                *o++ = '\n';
+                break;
+            case 'r':
+                *o++ = '\r';
+                break;
+            case 't':
+                *o++ = '\t';
+                break;
+            case 'u':
+                if ((c = read_hex4(p + 1, end)) < 0) {
+                    *o++ = *p;
+                    break;
+                }
+                p += 4;
+                // surrogate pair
+                if (c >= 0xd800 && c <= 0xdbff && end - p > 6 && p[1] == '\\' && p[2] == 'u' &&
+                        (lo = read_hex4(p + 3, end)) >= 0xdc00 && lo <= 0xdfff) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                    p += 6;
+                }
+                if (c < 0x80) {
+                    *o++ = (char)c;
+                } else if (c < 0x800) {
+                    *o++ = (char)(0xc0 | (c >> 6));
+                    *o++ = (char)(0x80 | (c & 0x3f));
+                } else if (c < 0x10000) {
+                    *o++ = (char)(0xe0 | (c >> 12));
+                    *o++ = (char)(0x80 | ((c >> 6) & 0x3f));
+                    *o++ = (char)(0x80 | (c & 0x3f));
+                } else {
+                    *o++ = (char)(0xf0 | (c >> 18));
+                    *o++ = (char)(0x80 | ((c >> 12) & 0x3f));
+                    *o++ = (char)(0x80 | ((c >> 6) & 0x3f));
+                    *o++ = (char)(0x80 | (c & 0x3f));
+                }
+                break;
+            default:
+                // \" \\ \/
+                *o++ = *p;
+                break;
+        }
+        p++;
+    }
+    
+    return o - out;
+}
+
+/*
+ * the value of a member as a string: string values are unescaped (into
+ * scratch, only when they contain escapes) and anything else is returned as
+ * its raw JSON text. the result is not NUL terminated.
+ */
+const char *json_member_string(struct json_member *member, struct json_scratch *scratch, size_t *len)
+{
+    const char *p = member->value;
+    const char *end = member->value + member->value_len;
+    
+    if (*p != '"') {
+        *len = member->value_len;
+        return p;
+    }
+    p++;
+    end--;
+    if (memchr(p, '\\', end - p) == NULL) {
+        *len = end - p;
+        return p;
+    }
+    
+    if (scratch->size < end - p) {
+        scratch->size = end - p;
+        scratch->buf = realloc(scratch->buf, scratch->size);
+    }
+    *len = unescape(p, end, scratch->buf);
+    return scratch->buf;
+}
+
+void json_scratch_free(struct json_scratch *scratch)
+{
+    free(scratch->buf);
+    scratch->buf = NULL;
+    scratch->size = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef __json_scan_h
+#define __json_scan_h
+
+#include <stddef.h>
+
+/*
+ * a top level "key": value member of a JSON object, pointing into the
+ * original document. nothing is copied or allocated while scanning.
+ */
+struct json_member {
+    const char *key;        /* raw key bytes, without the quotes */
+    size_t key_len;
+    const char *value;      /* raw value bytes (strings include their quotes) */
+    size_t value_len;
+    const char *start;      /* the whole member, from the key's opening quote to the end of the value */
+    size_t len;
+};
+
+/* a reusable buffer for unescaping string values */
+struct json_scratch {
+    char *buf;
+    size_t size;
+};
+
+typedef int (*json_member_cb)(struct json_member *member, void *arg);
+
+int json_scan(const char *json, size_t len, json_member_cb cb, void *arg);
+int json_member_key_equals(struct json_member *member, const char *key);
+int json_member_is_null(struct json_member *member);
+const char *json_member_string(struct json_member *member, struct json_scratch *scratch, size_t *len);
+void json_scratch_free(struct json_scratch *scratch);
+
+#endif
@@ -6,14 +6,11 @@
 #include <simplehttp/queue.h>
 #include <simplehttp/simplehttp.h>
 #include <pubsubclient/pubsubclient.h>
-#include <json/json.h>
 #include "http-internal.h"
-#include "md5.h"
 #include "pcre.h"
-
-#include <openssl/sha.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
+#include "json_scan.h"
+#include "field_hash.h"
+#include "filter_plan.h"
 
 
 #define DEBUG 1
@@ -24,7 +21,6 @@
 #define ADDR_BUFSZ 256
 #define BOUNDARY "xXPubSubXx"
 #define MAX_PENDING_DATA 1024*1024*50
-#define OVECCOUNT 30    /* should be a multiple of 3 */
 #define STRDUP(x) (x ? strdup(x) : NULL)
 
 enum kick_client_enum {
@@ -32,13 +28,11 @@ enum kick_client_enum {
     KICK_CLIENT = 1,
 };
 
-struct filter {
-    int ok;
-    char *subject;
-    char *pattern;
-    pcre *re;
-    const char *error;
-    int erroroffset;
+enum framing {
+    FRAMING_NEWLINE = 0,
+    FRAMING_MULTIPART,
+    FRAMING_WEBSOCKET,
+    FRAMING_COUNT
 };
 
 typedef struct cli {
@@ -49,19 +43,16 @@ typedef struct cli {
     time_t connect_time;
     struct evbuffer *buf;
     struct evhttp_request *req;
-    struct filter fltr;
+    struct filter *fltr;
     TAILQ_ENTRY(cli) entries;
 } cli;
 TAILQ_HEAD(, cli) clients;
 
-char *md5_hash(const char *string);
 
 void error_cb(int status_code, void *arg);
 void source_reconnect_cb(int fd, short what, void *ctx);
 void reconnect_to_source(int retryNow);
-void process_message_cb(char *source, void *arg);
-
-int filter_message(char *subject, pcre *filter, struct json_object *json_in);
+void process_messages_cb(struct pubsubclient_message *messages, int count, void *arg);
 
 int parse_encrypted_fields(char *str);
 int parse_blacklisted_fields(char *str);
@@ -85,35 +76,30 @@ static struct timeval reconnect_tv = {RECONNECT_SECS, 0};
 static struct evhttp_connection *evhttp_source_connection = NULL;
 static struct evhttp_request *evhttp_source_request = NULL;
 
+// each message is encoded at most once per framing and copied to every client using it
+static struct evbuffer *encoded[FRAMING_COUNT];
+static uint64_t encoded_msg_id[FRAMING_COUNT];
+
 static char *encrypted_fields[64];
 static int  num_encrypted_fields = 0;
 static char *blacklisted_fields[64];
 static char *expected_key = NULL;
 static char *expected_value = NULL;
+static char *hash_algorithm = NULL;
+static char *hash_key = NULL;
+static int hash_memo_size = 0;
 static pcre *expected_value_regex = NULL;
+static pcre_extra *expected_value_regex_extra = NULL;
 static int  num_blacklisted_fields = 0;
 
+// per message scan state; the filtered message is built in filtered_message
+static struct evbuffer *filtered_message = NULL;
+static struct json_scratch scratch;
+static struct field_hash_memo *hash_memo = NULL;
+static struct json_member expected_member;
+static int expected_found;
+static uint64_t scan_msg_id;
 
-char *base64(const unsigned char *input, int length)
-{
-    BIO *bmem, *b64;
-    BUF_MEM *bptr;
-    
-    b64 = BIO_new(BIO_f_base64());
-    bmem = BIO_new(BIO_s_mem());
-    b64 = BIO_push(b64, bmem);
-    BIO_write(b64, input, length);
-    BIO_flush(b64);
-    BIO_get_mem_ptr(b64, &bptr);
-    
-    char *buff = (char *)malloc(bptr->length);
-    memcpy(buff, bptr->data, bptr->length - 1);
-    buff[bptr->length - 1] = 0;
-    
-    BIO_free_all(b64);
-    
-    return buff;
-}
 
 /*
  * Parse a comma-delimited  string and populate
@@ -182,139 +168,163 @@ int parse_fields(const char *str, char **field_array)
     return i;
 }
 
-/* md5 encrypt a string */
-char *md5_hash(const char *string)
+/*
+ * the message framed for a client, encoded the first time any client needs it
+ */
+struct evbuffer *encode_message(enum framing framing, uint64_t msg_id, const char *json_out, size_t len)
 {
-    char *output = calloc(1, 33 * sizeof(char));
-    struct cvs_MD5Context context;
-    unsigned char checksum[16];
-    int i;
+    struct evbuffer *evb = encoded[framing];
+    unsigned char ws_header[2];
+    size_t ws_m = 0, ws_cur_size;
+    size_t ws_frame_size = 64;  // Size for data fragmentation for websocket
     
-    cvs_MD5Init (&context);
-    cvs_MD5Update (&context, string, strlen(string));
-    cvs_MD5Final (checksum, &context);
-    for (i = 0; i < 16; i++) {
-        sprintf(&output[i * 2], "%02x", (unsigned int) checksum[i]);
+    if (encoded_msg_id[framing] == msg_id) {
+        return evb;
     }
-    output[32] = '\0';
-    return output;
+    encoded_msg_id[framing] = msg_id;
+    evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+    
+    switch (framing) {
+        case FRAMING_WEBSOCKET:
+            while (ws_m < len) {
+                ws_cur_size = (len - ws_m > ws_frame_size ? ws_frame_size : len - ws_m);
+                ws_header[0] = 0;
+                if (ws_m == 0) {
+                    ws_header[0] += 0x01;
+                }
+                if (ws_m + ws_cur_size >= len) {
+                    ws_header[0] += 0x80;
+                }
+                ws_header[1] = (unsigned char)ws_cur_size;
+                evbuffer_add(evb, ws_header, 2);
+                evbuffer_add(evb, json_out + ws_m, ws_cur_size);
+                ws_m += ws_cur_size;
+            }
+            break;
+        case FRAMING_MULTIPART:
+            /* chunked */
+            evbuffer_add_printf(evb, "content-type: %s\r\ncontent-length: %d\r\n\r\n", "*/*", (int)len);
+            evbuffer_add(evb, json_out, len);
+            evbuffer_add_printf(evb, "\r\n--%s\r\n", BOUNDARY);
+            break;
+        default:
+            /* new line terminated */
+            evbuffer_add(evb, json_out, len);
+            evbuffer_add(evb, "\n", 1);
+            break;
+    }
+    
+    return evb;
 }
 
 /*
- * Filters a JSON object
+ * Called for each top level member of a message. Copies the member to
+ * filtered_message untouched unless it's blacklisted (dropped) or encrypted
+ * (value replaced by its hash) and notes the fields filters look at, as
+ * they are sent: filters never see a blacklisted field or an unhashed value.
  */
-int filter_message(char *subject, pcre *filter, struct json_object *json_in)
+int filter_member_cb(struct json_member *member, void *arg)
 {
-    struct json_object *element;
-    int subject_length;
-    int rc;
-    int ovector[OVECCOUNT];
-    char *obj_subject;
-    
-    if (filter != NULL && subject != NULL) {
-        element = json_object_object_get(json_in, subject);
-        if (element) {
-            obj_subject = (char *)json_object_get_string(element);
-        } else {
-            obj_subject = "";
+    const char *value;
+    size_t value_len;
+    char encrypted_string[FIELD_HASH_MAX_LEN];
+    size_t encrypted_len;
+    int i;
+    
+    if (expected_key && json_member_key_equals(member, expected_key)) {
+        expected_member = *member;
+        expected_found = 1;
+    }
+    
+    // remove the blacklisted fields
+    for (i = 0; i < num_blacklisted_fields; i++) {
+        if (json_member_key_equals(member, blacklisted_fields[i])) {
+            return 1;
         }
-        subject_length = strlen(obj_subject);
-        rc = pcre_exec(
-                 filter,               /* the compiled pattern */
-                 NULL,                 /* no extra data - we didn't study the pattern */
-                 obj_subject,          /* the subject string */
-                 subject_length,       /* the length of the subject */
-                 0,                    /* start at offset 0 in the subject */
-                 0,                    /* default options */
-                 ovector,              /* output vector for substring information */
-                 OVECCOUNT);           /* number of elements in the output vector */
-        if (rc < 0) {
-            return 0;
+    }
+    
+    if (EVBUFFER_LENGTH(filtered_message) > 1) {
+        evbuffer_add(filtered_message, ",", 1);
+    }
+    
+    // the fields we need to encrypt
+    for (i = 0; i < num_encrypted_fields; i++) {
+        if (json_member_key_equals(member, encrypted_fields[i])) {
+            if (json_member_is_null(member)) {
+                // null stays null, there's no value to hash
+                break;
+            }
+            value = json_member_string(member, &scratch, &value_len);
+            encrypted_len = field_hash_memo(hash_memo, value, value_len, encrypted_string);
+            filter_scan_value(member, encrypted_string, encrypted_len, scan_msg_id);
+            evbuffer_add(filtered_message, member->start, member->value - member->start);
+            evbuffer_add(filtered_message, "\"", 1);
+            evbuffer_add(filtered_message, encrypted_string, encrypted_len);
+            evbuffer_add(filtered_message, "\"", 1);
+            return 1;
         }
     }
+    
+    filter_scan_member(member, scan_msg_id);
+    evbuffer_add(filtered_message, member->start, member->len);
     return 1;
 }
 
-
 /*
  * Callback for each fetched pubsub message.
  */
-void process_message_cb(char *source, void *arg)
+void process_message(const char *source, size_t source_len)
 {
-    struct json_object *json_in;
-    struct json_object *element;
-    char *field_key;
     const char *raw_string;
-    char *encrypted_string;
+    size_t raw_len;
     const char *json_out;
+    size_t json_out_len;
+    struct evbuffer *evb;
     struct cli *client;
-    struct filter *fltr;
-    char *subject;
-    int subject_length;
-    int ovector[OVECCOUNT];
-    int rc, i = 0;
+    enum framing framing;
+    uint64_t msg_id;
     
     msgRecv++;
-    
-    json_in = json_tokener_parse(source);
-    
-    if (json_in == NULL) {
-        fprintf(stderr, "ERR: unable to parse json %s\n", source);
+    msg_id = msgRecv;
+    
+    scan_msg_id = msg_id;
+    expected_found = 0;
+    evbuffer_drain(filtered_message, EVBUFFER_LENGTH(filtered_message));
+    evbuffer_add(filtered_message, "{", 1);
+    if (!json_scan(source, source_len, filter_member_cb, NULL)) {
+        fprintf(stderr, "ERR: unable to parse json %.*s\n", (int)source_len, source);
         return;
     }
+    evbuffer_add(filtered_message, "}", 1);
     
     if (expected_value != NULL) {
-        element = json_object_object_get(json_in, expected_key);
-        if (element == NULL) {
-            json_object_put(json_in);
+        if (!expected_found || json_member_is_null(&expected_member)) {
             return;
         }
-        if (json_object_is_type(element, json_type_null)) {
-            json_object_put(json_in);
-            return;
-        }
-        raw_string = json_object_get_string(element);
-        if (raw_string == NULL || !strlen(raw_string) || strcmp(raw_string, expected_value) != 0) {
-            json_object_put(json_in);
+        raw_string = json_member_string(&expected_member, &scratch, &raw_len);
+        if (!raw_len || raw_len != strlen(expected_value) || memcmp(raw_string, expected_value, raw_len) != 0) {
             return;
         }
     }
     
     // filter
-    if (expected_value_regex && !filter_message(expected_key, expected_value_regex, json_in)) {
-        return;
-    }
-    
-    // loop through the fields we need to encrypt
-    for (i = 0; i < num_encrypted_fields; i++) {
-        field_key = encrypted_fields[i];
-        element = json_object_object_get(json_in, field_key);
-        if (element) {
-            raw_string = json_object_get_string(element);
-        } else {
-            continue;
+    if (expected_value_regex) {
+        raw_string = "";
+        raw_len = 0;
+        if (expected_found && !json_member_is_null(&expected_member)) {
+            raw_string = json_member_string(&expected_member, &scratch, &raw_len);
+        }
+        if (!filter_exec(expected_value_regex, expected_value_regex_extra, raw_string, raw_len)) {
+            return;
         }
-        encrypted_string = md5_hash(raw_string);
-        //if (DEBUG)fprintf(stdout, "encrypting %s \"%s\" => \"%s\"\n", field_key, raw_string, encrypted_string);
-        json_object_object_add(json_in, field_key, json_object_new_string(encrypted_string));
-        free(encrypted_string);
-    }
-    // loop through and remove the blacklisted fields
-    for (i = 0; i < num_blacklisted_fields; i++) {
-        field_key = blacklisted_fields[i];
-        //if (DEBUG)fprintf(stdout, "removing %s\n", field_key);
-        json_object_object_del(json_in, field_key);
     }
     
-    json_out = json_object_to_json_string(json_in);
-    //if (DEBUG)fprintf(stdout, "json_out = %d bytes\n" , strlen(json_out));
+    json_out = (const char *)EVBUFFER_DATA(filtered_message);
+    json_out_len = EVBUFFER_LENGTH(filtered_message);
     
     // loop over the clients and send each this message
     TAILQ_FOREACH(client, &clients, entries) {
         msgSent++;
-        // TODO: why do we need to do this?
-        // A: it just clears any old cruft from the clients buffer
-        evbuffer_drain(client->buf, EVBUFFER_LENGTH(client->buf));
         if (is_slow(client)) {
             if (can_kick(client)) {
                 evhttp_connection_free(client->req->evcon);
@@ -322,48 +332,35 @@ void process_message_cb(char *source, void *arg)
             }
             continue;
         }
-        // filter
-        if (client->fltr.ok && !filter_message(client->fltr.subject, client->fltr.re, json_in)) {
+        // filter (evaluated once per message for every client sharing it)
+        if (client->fltr && !filter_match(client->fltr, msg_id, &scratch)) {
             continue;
         }
         if (client->websocket) {
             // set to non-chunked so that send_reply_chunked doesn't add \r\n before/after this block
             client->req->chunked = 0;
-            int ws_m = 0;
-            int ws_message_length = strlen(json_out);
-            int ws_frame_size = 64;  // Size for data fragmentation for websocket
-            while (ws_m < ws_message_length) {
-                int ws_cur_size = (ws_message_length - ws_m > ws_frame_size ? ws_frame_size : ws_message_length - ws_m);
-                
-                int ws_code = 0;
-                if (ws_m == 0) {
-                    ws_code += 0x01;
-                }
-                if (ws_m + ws_cur_size >= ws_message_length) {
-                    ws_code += 0x80;
-                }
-                evbuffer_add_printf(client->buf, "%c", ws_code);
-                
-                evbuffer_add_printf(client->buf, "%c", ws_cur_size);
-                evbuffer_add(client->buf, json_out + ws_m, ws_cur_size);
-                ws_m += ws_cur_size;
-            }
+            framing = FRAMING_WEBSOCKET;
         } else if (client->multipart) {
-            /* chunked */
-            evbuffer_add_printf(client->buf,
-                                "content-type: %s\r\ncontent-length: %d\r\n\r\n",
-                                "*/*",
-                                (int)strlen(json_out));
-                                
-            evbuffer_add_printf(client->buf, "%s\r\n--%s\r\n", json_out, BOUNDARY);
+            framing = FRAMING_MULTIPART;
         } else {
-            /* new line terminated */
-            evbuffer_add_printf(client->buf, "%s\n", json_out);
+            framing = FRAMING_NEWLINE;
         }
+        evb = encode_message(framing, msg_id, json_out, json_out_len);
+        evbuffer_add(client->buf, EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb));
         evhttp_send_reply_chunk(client->req, client->buf);
-        i++;
     }
-    json_object_put(json_in);
+}
+
+/*
+ * Callback for all the messages fetched in one read.
+ */
+void process_messages_cb(struct pubsubclient_message *messages, int count, void *arg)
+{
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        process_message(messages[i].data, messages[i].len);
+    }
 }
 
 int is_slow(struct cli *client)
@@ -483,14 +480,8 @@ void on_close(struct evhttp_connection *evcon, void *ctx)
         currentConns--;
         TAILQ_REMOVE(&clients, client, entries);
         evbuffer_free(client->buf);
-        if (client->fltr.subject) {
-            free(client->fltr.subject);
-        }
-        if (client->fltr.pattern) {
-            free(client->fltr.pattern);
-        }
-        if (client->fltr.re) {
-            pcre_free(client->fltr.re);
+        if (client->fltr) {
+            filter_release(client->fltr);
         }
         free(client);
     } else {
@@ -504,12 +495,14 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     struct evkeyvalq args;
     char *uri;
     char buf[248];
-    struct filter *fltr;
+    const char *filter_subject;
+    const char *filter_pattern;
+    const char *filter_error;
     struct tm *time_struct;
     char *ws_origin;
     char *ws_upgrade;
     char *ws_key;
-    char *ws_response;
+    char ws_response[SIMPLEHTTP_WEBSOCKET_ACCEPT_LEN];
     char *host;
     
     currentConns++;
@@ -525,19 +518,10 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     client->buf = evbuffer_new();
     client->kick_client = CLIENT_OK;
     
-    fltr = &client->fltr;
-    fltr->subject = STRDUP((char *)evhttp_find_header(&args, "filter_subject"));
-    fltr->pattern = STRDUP((char *)evhttp_find_header(&args, "filter_pattern"));
-    if (fltr->subject && fltr->pattern) {
-        fltr->re = pcre_compile(
-                       fltr->pattern,
-                       0,
-                       &fltr->error,
-                       &fltr->erroroffset,
-                       NULL);
-        if (fltr->re) {
-            fltr->ok = 1;
-        }
+    filter_subject = evhttp_find_header(&args, "filter_subject");
+    filter_pattern = evhttp_find_header(&args, "filter_pattern");
+    if (filter_subject && filter_pattern) {
+        client->fltr = filter_get(filter_subject, filter_pattern, &filter_error);
     }
     
     strftime(buf, 248, "%Y-%m-%d %H:%M:%S", time_struct);
@@ -565,17 +549,10 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
             evhttp_add_header(client->req->output_headers, "WebSocket-Origin", ws_origin);
         }
         if (host) {
-            sprintf(buf, "ws://%s%s", host, req->uri);
+            snprintf(buf, sizeof(buf), "ws://%s%s", host, req->uri);
             evhttp_add_header(client->req->output_headers, "WebSocket-Location", buf);
         }
-        if (ws_key != NULL) {
-            char ws_response_tmp[SHA_DIGEST_LENGTH];
-            char ws_buf[128];
-            
-            sprintf(ws_buf, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", ws_key);
-            SHA1(ws_buf, strlen(ws_buf), ws_response_tmp);
-            
-            ws_response = base64(ws_response_tmp, SHA_DIGEST_LENGTH);
+        if (simplehttp_websocket_accept(ws_key, ws_response)) {
             evhttp_add_header(client->req->output_headers, "Sec-WebSocket-Accept", ws_response);
         }
         
@@ -672,6 +649,7 @@ int main(int argc, char **argv)
     char *source_path;
     char *expected_value_regex_raw = NULL;
     int source_port;
+    int i;
     
     define_simplehttp_options();
     option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
@@ -680,12 +658,20 @@ int main(int argc, char **argv)
     option_define_str("encrypted_fields", OPT_OPTIONAL, NULL, NULL, parse_encrypted_fields, "comma separated list of fields to encrypt");
     option_define_str("expected_key", OPT_OPTIONAL, NULL, &expected_key, NULL, "key to expect in messages before echoing to clients");
     option_define_str("expected_value", OPT_OPTIONAL, NULL, &expected_value, NULL, "value to expect in --expected-key field in messages before echoing to clients");
+    option_define_str("hash_algorithm", OPT_OPTIONAL, "md5", &hash_algorithm, NULL, "hash for --encrypted-fields (md5, siphash)");
+    option_define_str("hash_key", OPT_OPTIONAL, NULL, &hash_key, NULL, "128 bit key (32 hex characters) for --hash-algorithm=siphash");
+    option_define_int("hash_memo_size", OPT_OPTIONAL, 0, &hash_memo_size, NULL, "remember the hashes of this many recent values (0 to disable)");
     option_define_str("expected_value_regex", OPT_OPTIONAL, NULL, &expected_value_regex_raw, NULL, "regular expression matching expected value in --expected-key field before echoing to clients");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
     
+    if (!field_hash_init(hash_algorithm, hash_key)) {
+        exit(1);
+    }
+    hash_memo = field_hash_memo_new(hash_memo_size);
+    
     if (expected_value_regex_raw) {
         const char *tmp_err_s;
         int tmp_err_i;
@@ -699,6 +685,7 @@ int main(int argc, char **argv)
             fprintf(stderr, "Invalid regular expression in --expected-value-regex");
             exit(1);
         }
+        expected_value_regex_extra = filter_study(expected_value_regex);
     }
     
     if ( !!expected_key ^ !!( expected_value || expected_value_regex ) ) {
@@ -712,13 +699,24 @@ int main(int argc, char **argv)
     
     TAILQ_INIT(&clients);
     simplehttp_init();
+    filtered_message = evbuffer_new();
+    for (i = 0; i < FRAMING_COUNT; i++) {
+        encoded[i] = evbuffer_new();
+    }
     simplehttp_set_cb("/sub*", sub_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
     simplehttp_set_cb("/clients", clients_cb, NULL);
     
-    pubsubclient_init(source_address, source_port, source_path, process_message_cb, error_cb, NULL);
+    pubsubclient_init(source_address, source_port, source_path, NULL, error_cb, NULL);
+    pubsubclient_set_batch_cb(process_messages_cb);
     simplehttp_main();
     pubsubclient_free();
+    for (i = 0; i < FRAMING_COUNT; i++) {
+        evbuffer_free(encoded[i]);
+    }
+    evbuffer_free(filtered_message);
+    json_scratch_free(&scratch);
+    field_hash_memo_free(hash_memo);
     
     free_options();
     free(pubsub_url);
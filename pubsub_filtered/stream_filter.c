@@ -2,15 +2,15 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
-#include <json/json.h>
+#include <pthread.h>
 #include <simplehttp/options.h>
-#include "md5.h"
+#include "json_scan.h"
+#include "field_hash.h"
 
 #define VERSION "1.1"
 
 #define BUF_SZ (1024 * 16)
 
-char *md5_hash(const char *string);
 int parse_encrypted_fields(char *str);
 int parse_blacklisted_fields(char *str);
 int parse_fields(const char *str, char **field_array);
@@ -21,6 +21,9 @@ static char *blacklisted_fields[64];
 static int  num_blacklisted_fields = 0;
 static char *expected_key = NULL;
 static char *expected_value = NULL;
+static char *hash_algorithm = NULL;
+static char *hash_key = NULL;
+static int hash_memo_size = 0;
 static int verbose;
 
 static uint64_t msgRecv = 0;
@@ -28,6 +31,57 @@ static uint64_t msgFail = 0;
 
 static char buf[BUF_SZ];
 
+static int num_threads = 1;
+static int unordered = 0;
+static int block_size = 1024 * 1024;
+
+/*
+ * per thread filtering state. filtered messages are appended to out
+ */
+struct filter_ctx {
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    size_t msg_start;
+    struct json_scratch scratch;
+    struct field_hash_memo *hash_memo;
+    struct json_member expected_member;
+    int expected_found;
+    uint64_t fails;
+};
+
+/*
+ * with --threads > 1 the reader splits stdin into blocks of whole lines,
+ * workers filter them and the writer outputs them (in order unless --unordered)
+ */
+struct block {
+    uint64_t seq;
+    char *data;
+    size_t len;
+    size_t size;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    uint64_t lines;
+    uint64_t fails;
+    struct block *next;
+};
+
+struct block_queue {
+    struct block *head;
+    struct block *tail;
+    int count;
+    int closed;
+    pthread_cond_t cond;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct block_queue todo = {NULL, NULL, 0, 0, PTHREAD_COND_INITIALIZER};
+static struct block_queue done = {NULL, NULL, 0, 0, PTHREAD_COND_INITIALIZER};
+static struct block_queue free_blocks = {NULL, NULL, 0, 0, PTHREAD_COND_INITIALIZER};
+static int blocks_in_flight = 0;
+static pthread_cond_t in_flight_cond = PTHREAD_COND_INITIALIZER;
+
 /*
  * Parse a comma-delimited  string and populate
  * the blacklisted_fields array with the results.
@@ -94,88 +148,331 @@ int parse_fields(const char *str, char **field_array)
     return i;
 }
 
-/* md5 encrypt a string */
-char *md5_hash(const char *string)
+void out_add(struct filter_ctx *ctx, const char *data, size_t len)
 {
-    char *output = calloc(1, 33 * sizeof(char));
-    struct cvs_MD5Context context;
-    unsigned char checksum[16];
-    int i;
-    
-    cvs_MD5Init (&context);
-    cvs_MD5Update (&context, string, strlen(string));
-    cvs_MD5Final (checksum, &context);
-    for (i = 0; i < 16; i++) {
-        sprintf(&output[i * 2], "%02x", (unsigned int) checksum[i]);
+    if (ctx->out_len + len > ctx->out_size) {
+        ctx->out_size = (ctx->out_len + len) * 2;
+        ctx->out = realloc(ctx->out, ctx->out_size);
     }
-    output[32] = '\0';
-    return output;
+    memcpy(ctx->out + ctx->out_len, data, len);
+    ctx->out_len += len;
 }
 
 /*
- * for each message.
+ * Called for each top level member of a message. Copies the member to out
+ * untouched unless it's blacklisted (dropped) or encrypted (value replaced
+ * by its hash).
  */
-void process_message(const char *source)
+int filter_member_cb(struct json_member *member, void *arg)
 {
-    struct json_object *json_in, *element;
-    const char *field_key, *raw_string, *json_out;
-    char *encrypted_string;
+    struct filter_ctx *ctx = (struct filter_ctx *)arg;
+    const char *value;
+    size_t value_len;
+    char encrypted_string[FIELD_HASH_MAX_LEN];
+    size_t encrypted_len;
     int i;
     
-    json_in = json_tokener_parse(source);
+    if (expected_key && json_member_key_equals(member, expected_key)) {
+        ctx->expected_member = *member;
+        ctx->expected_found = 1;
+    }
     
-    if (json_in == NULL) {
-        msgFail++;
+    // remove the blacklisted fields
+    for (i = 0; i < num_blacklisted_fields; i++) {
+        if (json_member_key_equals(member, blacklisted_fields[i])) {
+            return 1;
+        }
+    }
+    
+    if (ctx->out_len > ctx->msg_start + 1) {
+        out_add(ctx, ",", 1);
+    }
+    
+    // the fields we need to encrypt
+    for (i = 0; i < num_encrypted_fields; i++) {
+        if (json_member_key_equals(member, encrypted_fields[i])) {
+            if (json_member_is_null(member)) {
+                // null stays null, there's no value to hash
+                break;
+            }
+            value = json_member_string(member, &ctx->scratch, &value_len);
+            encrypted_len = field_hash_memo(ctx->hash_memo, value, value_len, encrypted_string);
+            out_add(ctx, member->start, member->value - member->start);
+            out_add(ctx, "\"", 1);
+            out_add(ctx, encrypted_string, encrypted_len);
+            out_add(ctx, "\"", 1);
+            return 1;
+        }
+    }
+    
+    out_add(ctx, member->start, member->len);
+    return 1;
+}
+
+/*
+ * for each message. the filtered message (if any) is appended to ctx->out
+ */
+void process_message(struct filter_ctx *ctx, const char *source, size_t len)
+{
+    const char *raw_string;
+    size_t raw_len;
+    
+    ctx->expected_found = 0;
+    ctx->msg_start = ctx->out_len;
+    out_add(ctx, "{", 1);
+    if (!json_scan(source, len, filter_member_cb, ctx)) {
+        ctx->out_len = ctx->msg_start;
+        ctx->fails++;
         if (verbose) {
-            fprintf(stderr, "ERR: unable to parse json '%s'\n", source);
+            fprintf(stderr, "ERR: unable to parse json '%.*s'\n", (int)len, source);
         }
         return;
     }
+    /* new line terminated */
+    out_add(ctx, "}\n", 2);
     
     // filter messages
     if (expected_value != NULL) {
-        element = json_object_object_get(json_in, expected_key);
-        if (element == NULL) {
-            json_object_put(json_in);
+        if (!ctx->expected_found || json_member_is_null(&ctx->expected_member)) {
+            ctx->out_len = ctx->msg_start;
             return;
         }
-        if (json_object_is_type(element, json_type_null)) {
-            json_object_put(json_in);
+        raw_string = json_member_string(&ctx->expected_member, &ctx->scratch, &raw_len);
+        if (!raw_len || raw_len != strlen(expected_value) || memcmp(raw_string, expected_value, raw_len) != 0) {
+            ctx->out_len = ctx->msg_start;
             return;
         }
-        raw_string = json_object_get_string(element);
-        if (raw_string == NULL || !strlen(raw_string) || strcmp(raw_string, expected_value) != 0) {
-            json_object_put(json_in);
-            return;
+    }
+}
+
+void queue_push(struct block_queue *q, struct block *b)
+{
+    b->next = NULL;
+    if (q->tail) {
+        q->tail->next = b;
+    } else {
+        q->head = b;
+    }
+    q->tail = b;
+    q->count++;
+    pthread_cond_broadcast(&q->cond);
+}
+
+/*
+ * pop a block (the block numbered seq if seq != 0). waits with lock held.
+ * returns NULL once the queue is closed and empty
+ */
+struct block *queue_pop(struct block_queue *q, uint64_t seq)
+{
+    struct block *b, *prev;
+    
+    while (1) {
+        for (prev = NULL, b = q->head; b; prev = b, b = b->next) {
+            if (!seq || b->seq == seq) {
+                break;
+            }
+        }
+        if (b) {
+            if (prev) {
+                prev->next = b->next;
+            } else {
+                q->head = b->next;
+            }
+            if (q->tail == b) {
+                q->tail = prev;
+            }
+            q->count--;
+            return b;
+        }
+        if (q->closed && !q->head) {
+            return NULL;
+        }
+        pthread_cond_wait(&q->cond, &lock);
+    }
+}
+
+void *worker_thread(void *arg)
+{
+    struct filter_ctx ctx;
+    struct block *b;
+    char *p, *end, *nl, *tmp;
+    size_t tmp_size;
+    
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.hash_memo = field_hash_memo_new(hash_memo_size);
+    while (1) {
+        pthread_mutex_lock(&lock);
+        b = queue_pop(&todo, 0);
+        pthread_mutex_unlock(&lock);
+        if (!b) {
+            break;
+        }
+        
+        ctx.out_len = 0;
+        ctx.fails = 0;
+        b->lines = 0;
+        for (p = b->data, end = b->data + b->len; p < end; p = nl + 1) {
+            if ((nl = memchr(p, '\n', end - p)) == NULL) {
+                nl = end;
+            }
+            b->lines++;
+            process_message(&ctx, p, nl - p);
         }
+        b->fails = ctx.fails;
+        
+        // hand our output buffer to the block and keep its old one
+        tmp = b->out;
+        tmp_size = b->out_size;
+        b->out = ctx.out;
+        b->out_size = ctx.out_size;
+        b->out_len = ctx.out_len;
+        ctx.out = tmp;
+        ctx.out_size = tmp_size;
+        
+        pthread_mutex_lock(&lock);
+        queue_push(&done, b);
+        pthread_mutex_unlock(&lock);
     }
+    free(ctx.out);
+    json_scratch_free(&ctx.scratch);
+    field_hash_memo_free(ctx.hash_memo);
     
-    // loop through the fields we need to encrypt
-    for (i = 0; i < num_encrypted_fields; i++) {
-        field_key = encrypted_fields[i];
-        element = json_object_object_get(json_in, field_key);
-        if (element) {
-            raw_string = json_object_get_string(element);
-        } else {
-            continue;
+    return NULL;
+}
+
+void *writer_thread(void *arg)
+{
+    struct block *b;
+    uint64_t seq = 1;
+    
+    while (1) {
+        pthread_mutex_lock(&lock);
+        b = queue_pop(&done, unordered ? 0 : seq);
+        pthread_mutex_unlock(&lock);
+        if (!b) {
+            break;
         }
-        encrypted_string = md5_hash(raw_string);
-        json_object_object_add(json_in, field_key, json_object_new_string(encrypted_string));
-        free(encrypted_string);
+        seq++;
+        
+        fwrite(b->out, 1, b->out_len, stdout);
+        
+        pthread_mutex_lock(&lock);
+        msgRecv += b->lines;
+        msgFail += b->fails;
+        queue_push(&free_blocks, b);
+        blocks_in_flight--;
+        pthread_cond_signal(&in_flight_cond);
+        pthread_mutex_unlock(&lock);
     }
     
-    // loop through and remove the blacklisted fields
-    for (i = 0; i < num_blacklisted_fields; i++) {
-        field_key = blacklisted_fields[i];
-        json_object_object_del(json_in, field_key);
+    return NULL;
+}
+
+struct block *get_block()
+{
+    struct block *b;
+    
+    pthread_mutex_lock(&lock);
+    // bound memory use to a few blocks per worker
+    while (blocks_in_flight >= num_threads * 4) {
+        pthread_cond_wait(&in_flight_cond, &lock);
     }
+    blocks_in_flight++;
+    b = free_blocks.head ? queue_pop(&free_blocks, 0) : NULL;
+    pthread_mutex_unlock(&lock);
     
-    json_out = json_object_to_json_string(json_in);
+    if (!b) {
+        b = calloc(1, sizeof(struct block));
+        b->size = block_size;
+        b->data = malloc(b->size);
+    }
+    b->len = 0;
+    return b;
+}
+
+/*
+ * read stdin into blocks ending on a newline and filter them on --threads workers
+ */
+void run_threaded()
+{
+    pthread_t *workers;
+    pthread_t writer;
+    struct block *b, *next;
+    uint64_t seq = 0;
+    size_t n;
+    char *nl;
+    int i;
     
-    /* new line terminated */
-    printf("%s\n", json_out);
+    workers = calloc(num_threads, sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++) {
+        pthread_create(&workers[i], NULL, worker_thread, NULL);
+    }
+    pthread_create(&writer, NULL, writer_thread, NULL);
+    
+    b = get_block();
+    while (1) {
+        if (b->len == b->size) {
+            // a line longer than a block
+            b->size *= 2;
+            b->data = realloc(b->data, b->size);
+        }
+        n = fread(b->data + b->len, 1, b->size - b->len, stdin);
+        b->len += n;
+        if (n == 0) {
+            break;
+        }
+        for (nl = b->data + b->len - 1; nl >= b->data && *nl != '\n'; nl--) {}
+        if (nl < b->data) {
+            continue;
+        }
+        
+        // carry the partial last line over to the next block
+        next = get_block();
+        n = b->data + b->len - (nl + 1);
+        if (next->size < n) {
+            next->size = n * 2;
+            next->data = realloc(next->data, next->size);
+        }
+        memcpy(next->data, nl + 1, n);
+        next->len = n;
+        // keep the newline, the worker counts the line before it even when it's blank
+        b->len = nl + 1 - b->data;
+        
+        b->seq = ++seq;
+        pthread_mutex_lock(&lock);
+        queue_push(&todo, b);
+        pthread_mutex_unlock(&lock);
+        b = next;
+    }
+    
+    pthread_mutex_lock(&lock);
+    if (b->len) {
+        b->seq = ++seq;
+        queue_push(&todo, b);
+    } else {
+        queue_push(&free_blocks, b);
+        blocks_in_flight--;
+    }
+    todo.closed = 1;
+    pthread_cond_broadcast(&todo.cond);
+    pthread_mutex_unlock(&lock);
+    
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_lock(&lock);
+    done.closed = 1;
+    pthread_cond_broadcast(&done.cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
     
-    json_object_put(json_in);
+    while ((b = free_blocks.head) != NULL) {
+        free_blocks.head = b->next;
+        free(b->data);
+        free(b->out);
+        free(b);
+    }
+    free(workers);
 }
 
 int version_cb(int value)
@@ -186,25 +483,53 @@ int version_cb(int value)
 
 int main(int argc, char **argv)
 {
+    struct filter_ctx ctx;
+    
     option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
     option_define_bool("verbose", OPT_OPTIONAL, 0, &verbose, NULL, "verbose output (to stderr)");
     option_define_str("blacklist_fields", OPT_OPTIONAL, NULL, NULL, parse_blacklisted_fields, "comma separated list of fields to remove");
     option_define_str("encrypted_fields", OPT_OPTIONAL, NULL, NULL, parse_encrypted_fields, "comma separated list of fields to encrypt");
     option_define_str("expected_key", OPT_OPTIONAL, NULL, &expected_key, NULL, "key to expect in messages before echoing to clients");
     option_define_str("expected_value", OPT_OPTIONAL, NULL, &expected_value, NULL, "value to expect in --expected-key field in messages before echoing to clients");
+    option_define_str("hash_algorithm", OPT_OPTIONAL, "md5", &hash_algorithm, NULL, "hash for --encrypted-fields (md5, siphash)");
+    option_define_str("hash_key", OPT_OPTIONAL, NULL, &hash_key, NULL, "128 bit key (32 hex characters) for --hash-algorithm=siphash");
+    option_define_int("hash_memo_size", OPT_OPTIONAL, 0, &hash_memo_size, NULL, "remember the hashes of this many recent values (0 to disable)");
+    option_define_int("threads", OPT_OPTIONAL, 1, &num_threads, NULL, "number of worker threads");
+    option_define_bool("unordered", OPT_OPTIONAL, 0, &unordered, NULL, "with --threads, write output blocks as they finish instead of in input order");
+    option_define_int("block_size", OPT_OPTIONAL, 1024 * 1024, &block_size, NULL, "with --threads, bytes of input per work unit");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
     
+    if (!field_hash_init(hash_algorithm, hash_key)) {
+        exit(1);
+    }
+    
     if ( !!expected_key ^ !!expected_value ) {
         fprintf(stderr, "--expected-key and --expected-value must be used together\n");
         exit(1);
     }
     
-    while (fgets(buf, BUF_SZ, stdin)) {
-        msgRecv++;
-        process_message(buf);
+    if (block_size < 1) {
+        block_size = BUF_SZ;
+    }
+    
+    if (num_threads > 1) {
+        run_threaded();
+    } else {
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.hash_memo = field_hash_memo_new(hash_memo_size);
+        while (fgets(buf, BUF_SZ, stdin)) {
+            msgRecv++;
+            ctx.out_len = 0;
+            process_message(&ctx, buf, strlen(buf));
+            fwrite(ctx.out, 1, ctx.out_len, stdout);
+        }
+        msgFail = ctx.fails;
+        free(ctx.out);
+        json_scratch_free(&ctx.scratch);
+        field_hash_memo_free(ctx.hash_memo);
     }
     
     fprintf(stderr, "processed %lu lines, failed to parse %lu of them\n", msgRecv, msgFail);
@@ -0,0 +1,86 @@
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(__file__), "../shared_tests"))
+
+import signal
+import socket
+import subprocess
+import time
+import hashlib
+import urllib
+import tornado.httpclient
+from test_shunt import SubprocessTest
+
+working_dir = os.path.dirname(__file__)
+pubsub_dir = os.path.join(working_dir, "../pubsub")
+
+def subscribe(params):
+    sock = socket.create_connection(('127.0.0.1', 8080))
+    sock.sendall('GET /sub?%s HTTP/1.0\r\n\r\n' % urllib.urlencode(params))
+    return sock
+
+def read_body(sock):
+    sock.settimeout(.5)
+    data = ''
+    try:
+        while True:
+            chunk = sock.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+    except socket.timeout:
+        pass
+    sock.close()
+    return data.split('\r\n\r\n', 1)[1]
+
+class PubsubFilteredTest(SubprocessTest):
+    binary_name = "pubsub_filtered"
+    working_dir = working_dir
+    test_output_dir = os.path.join(working_dir, "test_output")
+    process_options = [
+        [os.path.join(pubsub_dir, "pubsub"), '--port=8081'],
+        [os.path.join(working_dir, "pubsub_filtered"), '--port=8080',
+         '--pubsub-url=http://127.0.0.1:8081/sub?multipart=0',
+         '--blacklist-fields=secret', '--encrypted-fields=ip'],
+    ]
+
+    @classmethod
+    def setUpClass(self):
+        pipe = subprocess.Popen(['make', '-C', pubsub_dir])
+        assert pipe.wait() == 0, "compile failed"
+        super(PubsubFilteredTest, self).setUpClass()
+
+    @classmethod
+    def tearDownClass(self):
+        # neither has an /exit endpoint
+        for process in self.processes:
+            if process.poll() is None:
+                os.kill(process.pid, signal.SIGKILL)
+                process.wait()
+
+    def test_filters_see_filtered_fields(self):
+        # give the source connection a chance to come up
+        time.sleep(1)
+
+        # blacklisted and encrypted fields can't be probed through their raw values
+        secret = subscribe(dict(filter_subject='secret', filter_pattern='hunter2'))
+        raw_ip = subscribe(dict(filter_subject='ip', filter_pattern='^10\\.0\\.0\\.1$'))
+        hashed_ip = subscribe(dict(filter_subject='ip', filter_pattern='^%s$' % hashlib.md5('10.0.0.1').hexdigest()))
+        user = subscribe(dict(filter_subject='user', filter_pattern='^bob$'))
+        time.sleep(.5)
+
+        tornado.httpclient.HTTPClient().fetch('http://127.0.0.1:8081/pub', method='POST',
+            body='{"user": "bob", "secret": "hunter2", "ip": "10.0.0.1"}')
+        time.sleep(1)
+
+        assert 'bob' not in read_body(secret)
+        assert 'bob' not in read_body(raw_ip)
+        assert 'bob' in read_body(hashed_ip)
+        body = read_body(user)
+        assert 'bob' in body
+        assert 'hunter2' not in body
+        assert '10.0.0.1' not in body
+
+
+if __name__ == "__main__":
+    print "usage: py.test"
@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <event.h>
 #include <evhttp.h>
 #include <signal.h>
+#include <sys/queue.h>
 #include "pubsubclient.h"
 #include "stream_request.h"
+#include "http-internal.h"
 
 #ifdef DEBUG
 #define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
@@ -13,125 +17,208 @@
 #define _DEBUG(...) do {;} while (0)
 #endif
 
-static int chunked = 0;
-static struct GlobalData *data = NULL;
-static struct StreamRequest *stream_request = NULL;
-static struct evhttp_connection *evhttp_source_connection = NULL;
-static struct evhttp_request *evhttp_source_request = NULL;
-static struct StreamRequest *autodetect_sr = NULL;
-extern struct event_base *current_base;
-
-struct GlobalData {
-    void (*message_cb)(char *data, void *cbarg);
-    void (*error_cb)(int status_code, void *cbarg);
-    void *cbarg;
-    const char *source_address;
+struct pubsubclient {
+    int source_id;
+    char *source_address;
     int source_port;
-    const char *path;
+    char *path;
+    int chunked;
+    int autodetected;
+    int sequence;
+    uint64_t last_sequence;
+    char *stream_path;
+    int backoff_min_ms;
+    int backoff_max_ms;
+    int backoff_attempts;
+    struct event reconnect_ev;
+    int paused;
+    struct event pause_ev;
+    struct StreamRequest *autodetect_sr;
+    struct StreamRequest *stream_request;
+    struct evhttp_connection *evhttp_source_connection;
+    struct evhttp_request *evhttp_source_request;
+    void (*batch_cb)(int source_id, struct pubsubclient_message *messages, int count, void *arg);
+    void (*message_cb)(char *data, void *arg);
+    void (*error_cb)(int source_id, int status_code, void *arg);
+    void *cbarg;
+    struct pubsubclient_message *messages;
+    int messages_size;
+    struct pubsubclient_stats stats;
 };
 
+/* the instance behind the single source pubsubclient_init() api */
+static struct pubsubclient *default_client = NULL;
+static void (*default_batch_cb)(struct pubsubclient_message *messages, int count, void *arg) = NULL;
+static void (*default_error_cb)(int status_code, void *arg) = NULL;
+static int seeded = 0;
+extern struct event_base *current_base;
+
+void pubsubclient_connection_failed(struct pubsubclient *client, int status_code);
+int pubsubclient_start(struct pubsubclient *client);
+
 void pubsubclient_termination_handler(int signum)
 {
     event_loopbreak();
 }
 
-int pubsubclient_parse_one_message(struct evbuffer *evb, void *arg)
+/*
+ * hand every complete line in evb to the batch callback (as views into
+ * evb) or, one at a time, to message_cb (NUL terminated in place). nothing
+ * is copied; the lines are drained once the callbacks return.
+ */
+void pubsubclient_parse_messages(struct evbuffer *evb, void *arg)
 {
-    char *line;
-    size_t line_len;
-    struct GlobalData *client_data;
-    char *data;
-    int has_more = 0;
+    struct pubsubclient *client = (struct pubsubclient *)arg;
+    char *start, *end, *p, *q, *nl, *line_end;
+    uint64_t seq = 0;
+    int count = 0;
     
-    _DEBUG("pubsubclient_parse_one_message()\n");
+    _DEBUG("pubsubclient_parse_messages()\n");
     
-    client_data = (struct GlobalData *)arg;
-    line = evbuffer_readline(evb);
-    if (line && (line_len = strlen(line))) {
-        _DEBUG("line (%p): %s (%d)\n", line, line, line_len);
-        (*client_data->message_cb)(line, client_data->cbarg);
-        if (EVBUFFER_LENGTH(evb)) {
-            has_more = 1;
+    start = (char *)EVBUFFER_DATA(evb);
+    end = start + EVBUFFER_LENGTH(evb);
+    for (p = start; p < end && (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+        line_end = nl;
+        if (line_end > p && *(line_end - 1) == '\r') {
+            line_end--;
+        }
+        if (line_end == p) {
+            continue;
         }
+        if (client->sequence) {
+            // "<sequence>\t<message>", remember where to resume from
+            for (q = p; q < line_end && *q >= '0' && *q <= '9'; q++) {
+                seq = seq * 10 + (*q - '0');
+            }
+            if (q > p && q < line_end && *q == '\t') {
+                client->last_sequence = seq;
+                p = q + 1;
+            }
+            seq = 0;
+        }
+        
+        client->stats.messages++;
+        if (client->batch_cb) {
+            if (count == client->messages_size) {
+                client->messages_size = client->messages_size ? client->messages_size * 2 : 64;
+                client->messages = realloc(client->messages, client->messages_size * sizeof(struct pubsubclient_message));
+            }
+            client->messages[count].data = p;
+            client->messages[count].len = line_end - p;
+            count++;
+        } else {
+            *line_end = '\0';
+            _DEBUG("line (%p): %s (%d)\n", p, p, (int)(line_end - p));
+            (*client->message_cb)(p, client->cbarg);
+        }
+    }
+    
+    client->stats.bytes += p - start;
+    if (p != start) {
+        // the connection is healthy again
+        client->backoff_attempts = 0;
+    }
+    if (count) {
+        (*client->batch_cb)(client->source_id, client->messages, count, client->cbarg);
     }
-    free(line);
-    return has_more;
+    evbuffer_drain(evb, p - start);
 }
 
 void pubsubclient_source_readcb(struct bufferevent *bev, void *arg)
 {
-    while (pubsubclient_parse_one_message(EVBUFFER_INPUT(bev), arg)) {}
+    struct pubsubclient *client = (struct pubsubclient *)arg;
+    
+    // stream_request re-enables reading once the request has been written
+    if (client->paused) {
+        bufferevent_disable(bev, EV_READ);
+        return;
+    }
+    pubsubclient_parse_messages(EVBUFFER_INPUT(bev), arg);
 }
 
 void pubsubclient_errorcb(struct bufferevent *bev, void *arg)
 {
-    struct GlobalData *client_data = (struct GlobalData *)arg;
+    struct pubsubclient *client = (struct pubsubclient *)arg;
     
-    fprintf(stderr, "ERROR: request failed\n");
+    fprintf(stderr, "ERROR: request failed for source %d (http://%s:%d%s)\n",
+            client->source_id, client->source_address, client->source_port, client->path);
     
-    if (client_data->error_cb) {
-        (*client_data->error_cb)(-1, client_data->cbarg);
-    }
+    pubsubclient_connection_failed(client, -1);
 }
 
 void pubsubclient_source_request_done(struct evhttp_request *req, void *arg)
 {
-    struct GlobalData *client_data = (struct GlobalData *)arg;
+    struct pubsubclient *client = (struct pubsubclient *)arg;
     int status_code = -1;
     
     _DEBUG("pubsubclient_source_request_done()\n");
     
-    fprintf(stderr, "ERROR: request failed\n");
+    fprintf(stderr, "ERROR: request failed for source %d (http://%s:%d%s)\n",
+            client->source_id, client->source_address, client->source_port, client->path);
     
     if (req) {
         status_code = req->response_code;
     }
     
-    if (client_data->error_cb) {
-        (*client_data->error_cb)(status_code, client_data->cbarg);
-    }
+    pubsubclient_connection_failed(client, status_code);
 }
 
 void pubsubclient_source_callback(struct evhttp_request *req, void *arg)
 {
-    // keep parsing out messages until there aren't any left
-    while (pubsubclient_parse_one_message(req->input_buffer, arg)) {}
+    pubsubclient_parse_messages(req->input_buffer, arg);
 }
 
-int pubsubclient_connect()
+/*
+ * (re)open the stream for a client whose encoding is already known
+ */
+int pubsubclient_reconnect(struct pubsubclient *client)
 {
-    fprintf(stdout, "CONNECTING TO SOURCE http://%s:%d%s\n", data->source_address, data->source_port, data->path);
-    if (chunked) {
-        if (evhttp_source_connection) {
-            evhttp_connection_free(evhttp_source_connection);
+    const char *path = client->path;
+    
+    if (client->sequence) {
+        // ask for everything after the last message we saw
+        free(client->stream_path);
+        client->stream_path = malloc(strlen(client->path) + sizeof("&sequence=1&since=18446744073709551615"));
+        sprintf(client->stream_path, "%s%csequence=1&since=%llu", client->path,
+                strchr(client->path, '?') ? '&' : '?', (long long unsigned int)client->last_sequence);
+        path = client->stream_path;
+    }
+    
+    fprintf(stdout, "CONNECTING TO SOURCE %d http://%s:%d%s\n", client->source_id,
+            client->source_address, client->source_port, path);
+    client->stats.connects++;
+    if (client->chunked) {
+        if (client->evhttp_source_connection) {
+            evhttp_connection_free(client->evhttp_source_connection);
         }
         
         // use libevent's built in evhttp methods to parse chunked responses
-        evhttp_source_connection = evhttp_connection_new(data->source_address, data->source_port);
-        if (evhttp_source_connection == NULL) {
-            fprintf(stderr, "ERROR: evhttp_connection_new() failed for %s:%d\n", data->source_address, data->source_port);
+        client->evhttp_source_connection = evhttp_connection_new(client->source_address, client->source_port);
+        if (client->evhttp_source_connection == NULL) {
+            fprintf(stderr, "ERROR: evhttp_connection_new() failed for %s:%d\n", client->source_address, client->source_port);
             return 0;
         }
         
-        evhttp_source_request = evhttp_request_new(pubsubclient_source_request_done, data);
-        evhttp_add_header(evhttp_source_request->output_headers, "Host", data->source_address);
-        evhttp_request_set_chunked_cb(evhttp_source_request, pubsubclient_source_callback);
+        client->evhttp_source_request = evhttp_request_new(pubsubclient_source_request_done, client);
+        evhttp_add_header(client->evhttp_source_request->output_headers, "Host", client->source_address);
+        evhttp_request_set_chunked_cb(client->evhttp_source_request, pubsubclient_source_callback);
         
-        if (evhttp_make_request(evhttp_source_connection, evhttp_source_request, EVHTTP_REQ_GET, data->path) == -1) {
-            fprintf(stderr, "ERROR: evhttp_make_request() failed for %s\n", data->path);
-            evhttp_connection_free(evhttp_source_connection);
+        if (evhttp_make_request(client->evhttp_source_connection, client->evhttp_source_request, EVHTTP_REQ_GET, path) == -1) {
+            fprintf(stderr, "ERROR: evhttp_make_request() failed for %s\n", path);
+            evhttp_connection_free(client->evhttp_source_connection);
+            client->evhttp_source_connection = NULL;
             return 0;
         }
     } else {
-        if (stream_request) {
-            free_stream_request(stream_request);
+        if (client->stream_request) {
+            free_stream_request(client->stream_request);
         }
         
         // use our stream_request library to handle non-chunked
-        stream_request = new_stream_request("GET", data->source_address, data->source_port, data->path,
-                                            NULL, pubsubclient_source_readcb, pubsubclient_errorcb, data);
-        if (!stream_request) {
-            fprintf(stderr, "ERROR: new_stream_request() failed for %s:%d%s\n", data->source_address, data->source_port, data->path);
+        client->stream_request = new_stream_request("GET", client->source_address, client->source_port, path,
+                                 NULL, pubsubclient_source_readcb, pubsubclient_errorcb, client);
+        if (!client->stream_request) {
+            fprintf(stderr, "ERROR: new_stream_request() failed for %s:%d%s\n", client->source_address, client->source_port, path);
             return 0;
         }
     }
@@ -139,27 +226,286 @@ int pubsubclient_connect()
     return 1;
 }
 
+void pubsubclient_reconnect_cb(int fd, short what, void *arg)
+{
+    struct pubsubclient *client = (struct pubsubclient *)arg;
+    
+    if (!client->autodetected) {
+        if (!pubsubclient_start(client)) {
+            pubsubclient_connection_failed(client, -1);
+        }
+        return;
+    }
+    // the autodetect connection is idle from here on
+    if (client->autodetect_sr) {
+        free_stream_request(client->autodetect_sr);
+        client->autodetect_sr = NULL;
+    }
+    if (!pubsubclient_reconnect(client)) {
+        pubsubclient_connection_failed(client, -1);
+    }
+}
+
+void pubsubclient_pause_cb(int fd, short what, void *arg)
+{
+    struct pubsubclient *client = (struct pubsubclient *)arg;
+    
+    if (client->paused && client->evhttp_source_connection) {
+        event_del(&client->evhttp_source_connection->ev);
+    }
+}
+
+/*
+ * stop reading from the source until pubsubclient_resume(); unread data backs
+ * up in the socket so the pubsub sees us as a slow client. safe to call from
+ * the batch callback (with chunked sources, what evhttp has already read is
+ * still delivered).
+ */
+void pubsubclient_pause(struct pubsubclient *client)
+{
+    struct timeval tv = {0, 0};
+    
+    if (client->paused) {
+        return;
+    }
+    client->paused = 1;
+    if (client->chunked) {
+        if (client->evhttp_source_connection) {
+            event_del(&client->evhttp_source_connection->ev);
+            // evhttp re-adds its read event after our chunk callback returns
+            evtimer_add(&client->pause_ev, &tv);
+        }
+    } else if (client->stream_request) {
+        bufferevent_disable(client->stream_request->bev, EV_READ);
+    }
+}
+
+void pubsubclient_resume(struct pubsubclient *client)
+{
+    if (!client->paused) {
+        return;
+    }
+    client->paused = 0;
+    evtimer_del(&client->pause_ev);
+    if (client->chunked) {
+        if (client->evhttp_source_connection && client->evhttp_source_connection->fd != -1) {
+            event_add(&client->evhttp_source_connection->ev, NULL);
+        }
+    } else if (client->stream_request) {
+        bufferevent_enable(client->stream_request->bev, EV_READ);
+        // anything already buffered won't trigger another read event
+        if (EVBUFFER_LENGTH(EVBUFFER_INPUT(client->stream_request->bev))) {
+            pubsubclient_parse_messages(EVBUFFER_INPUT(client->stream_request->bev), client);
+        }
+    }
+}
+
+/*
+ * tell the consumer and, when backoff is enabled, try again after
+ * min(max, min * 2^attempts) ms with up to half of that taken off at random
+ * so a pool of clients doesn't reconnect in lock step
+ */
+void pubsubclient_connection_failed(struct pubsubclient *client, int status_code)
+{
+    struct timeval tv;
+    uint64_t delay_ms;
+    
+    client->stats.errors++;
+    if (client->error_cb) {
+        (*client->error_cb)(client->source_id, status_code, client->cbarg);
+    }
+    
+    if (client->backoff_min_ms <= 0) {
+        return;
+    }
+    
+    delay_ms = (uint64_t)client->backoff_min_ms << (client->backoff_attempts < 16 ? client->backoff_attempts : 16);
+    if (delay_ms > client->backoff_max_ms) {
+        delay_ms = client->backoff_max_ms;
+    }
+    delay_ms -= (uint64_t)(rand() % (delay_ms / 2 + 1));
+    client->backoff_attempts++;
+    
+    fprintf(stdout, "RECONNECTING TO SOURCE %d in %llu ms\n", client->source_id, (long long unsigned int)delay_ms);
+    tv.tv_sec = delay_ms / 1000;
+    tv.tv_usec = (delay_ms % 1000) * 1000;
+    evtimer_del(&client->reconnect_ev);
+    evtimer_add(&client->reconnect_ev, &tv);
+}
+
+/*
+ * reconnect on our own after a disconnect, waiting between min_ms and
+ * max_ms (doubling each failed attempt). min_ms of 0 disables it.
+ */
+void pubsubclient_set_backoff(struct pubsubclient *client, int min_ms, int max_ms)
+{
+    client->backoff_min_ms = min_ms;
+    client->backoff_max_ms = max_ms < min_ms ? min_ms : max_ms;
+}
+
 void pubsubclient_autodetect_headercb(struct bufferevent *bev, struct evkeyvalq *headers, void *arg)
 {
+    struct pubsubclient *client = (struct pubsubclient *)arg;
     const char *encoding_header = NULL;
+    const char *sequence_header = NULL;
     
     _DEBUG("pubsubclient_autodetect_headercb() headers: %p\n", headers);
     
     if ((encoding_header = evhttp_find_header(headers, "Transfer-Encoding")) != NULL) {
         if (strncmp(encoding_header, "chunked", 7) == 0) {
-            chunked = 1;
+            client->chunked = 1;
+        }
+    }
+    // a pubsub that can replay from a sequence number tells us its current one
+    if ((sequence_header = evhttp_find_header(headers, "X-Pubsub-Sequence")) != NULL) {
+        if (!client->sequence) {
+            client->last_sequence = strtoull(sequence_header, NULL, 10);
         }
+        client->sequence = 1;
     }
+    // cached for every reconnect
+    client->autodetected = 1;
     
     // turn off the events for this buffer
     // its free'd later
     bufferevent_disable(bev, EV_READ);
     
-    _DEBUG("chunked = %d\n", chunked);
+    _DEBUG("source %d chunked = %d\n", client->source_id, client->chunked);
+    
+    if (!pubsubclient_reconnect(client)) {
+        pubsubclient_connection_failed(client, -1);
+    }
+}
+
+void pubsubclient_autodetect_errorcb(struct bufferevent *bev, void *arg)
+{
+    struct pubsubclient *client = (struct pubsubclient *)arg;
     
-    if (!pubsubclient_connect(arg)) {
-        event_loopbreak();
+    // once the headers are in, the autodetect connection no longer matters
+    if (client->autodetected) {
+        return;
     }
+    pubsubclient_errorcb(bev, arg);
+}
+
+/*
+ * a client for one pubsub source. any number of clients can share an
+ * event loop; messages are delivered to batch_cb tagged with source_id.
+ * nothing happens until pubsubclient_start()
+ */
+struct pubsubclient *new_pubsubclient(int source_id, const char *source_address, int source_port, const char *path,
+                                      void (*batch_cb)(int source_id, struct pubsubclient_message *messages, int count, void *arg),
+                                      void (*error_cb)(int source_id, int status_code, void *arg),
+                                      void *cbarg)
+{
+    struct pubsubclient *client;
+    
+    if (!current_base) {
+        event_init();
+    }
+    if (!seeded) {
+        // for reconnect jitter
+        srand(time(NULL) ^ getpid());
+        seeded = 1;
+    }
+    
+    client = calloc(1, sizeof(struct pubsubclient));
+    client->source_id = source_id;
+    client->source_address = strdup(source_address);
+    client->source_port = source_port;
+    client->path = strdup(path);
+    client->batch_cb = batch_cb;
+    client->error_cb = error_cb;
+    client->cbarg = cbarg;
+    client->backoff_min_ms = 0;
+    evtimer_set(&client->reconnect_ev, pubsubclient_reconnect_cb, client);
+    evtimer_set(&client->pause_ev, pubsubclient_pause_cb, client);
+    
+    return client;
+}
+
+/*
+ * perform a request for headers so we can autodetect whether or not we're
+ * getting a chunked response (and if the source supports resuming), then
+ * open the stream
+ */
+int pubsubclient_start(struct pubsubclient *client)
+{
+    if (client->autodetected) {
+        return pubsubclient_reconnect(client);
+    }
+    
+    fprintf(stdout, "AUTODETECTING ENCODING FOR http://%s:%d%s\n", client->source_address, client->source_port, client->path);
+    if (client->autodetect_sr) {
+        free_stream_request(client->autodetect_sr);
+    }
+    client->autodetect_sr = new_stream_request("HEAD", client->source_address, client->source_port, client->path,
+                            pubsubclient_autodetect_headercb, NULL, pubsubclient_autodetect_errorcb, client);
+    if (!client->autodetect_sr) {
+        fprintf(stderr, "ERROR: new_stream_request() failed for %s:%d%s\n", client->source_address, client->source_port, client->path);
+        return 0;
+    }
+    
+    return 1;
+}
+
+void pubsubclient_get_stats(struct pubsubclient *client, struct pubsubclient_stats *stats)
+{
+    *stats = client->stats;
+}
+
+int pubsubclient_source_id(struct pubsubclient *client)
+{
+    return client->source_id;
+}
+
+void free_pubsubclient(struct pubsubclient *client)
+{
+    if (!client) {
+        return;
+    }
+    
+    evtimer_del(&client->reconnect_ev);
+    evtimer_del(&client->pause_ev);
+    free_stream_request(client->autodetect_sr);
+    if (client->evhttp_source_connection) {
+        evhttp_connection_free(client->evhttp_source_connection);
+    }
+    free_stream_request(client->stream_request);
+    free(client->messages);
+    free(client->source_address);
+    free(client->path);
+    free(client->stream_path);
+    free(client);
+}
+
+void pubsubclient_default_batch_cb(int source_id, struct pubsubclient_message *messages, int count, void *arg)
+{
+    (*default_batch_cb)(messages, count, arg);
+}
+
+void pubsubclient_default_error_cb(int source_id, int status_code, void *arg)
+{
+    if (default_error_cb) {
+        (*default_error_cb)(status_code, arg);
+    }
+}
+
+/*
+ * deliver messages in batches of (pointer, length) views instead of calling
+ * message_cb for each one
+ */
+void pubsubclient_set_batch_cb(void (*cb)(struct pubsubclient_message *messages, int count, void *arg))
+{
+    default_batch_cb = cb;
+    if (default_client) {
+        default_client->batch_cb = cb ? pubsubclient_default_batch_cb : NULL;
+    }
+}
+
+int pubsubclient_connect()
+{
+    return pubsubclient_reconnect(default_client);
 }
 
 void pubsubclient_init(const char *source_address, int source_port, const char *path,
@@ -173,25 +519,14 @@ void pubsubclient_init(const char *source_address, int source_port, const char *
     signal(SIGTERM, pubsubclient_termination_handler);
     signal(SIGHUP, pubsubclient_termination_handler);
     
-    if (!current_base) {
-        event_init();
-    }
+    free_pubsubclient(default_client);
+    default_error_cb = error_cb;
+    default_client = new_pubsubclient(0, source_address, source_port, path,
+                                      default_batch_cb ? pubsubclient_default_batch_cb : NULL,
+                                      pubsubclient_default_error_cb, cbarg);
+    default_client->message_cb = message_cb;
     
-    data = calloc(1, sizeof(struct GlobalData));
-    data->message_cb = message_cb;
-    data->error_cb = error_cb;
-    data->cbarg = cbarg;
-    data->source_address = source_address;
-    data->source_port = source_port;
-    data->path = path;
-    
-    // perform a request for headers so we can autodetect whether or not we're
-    // getting a chunked response
-    fprintf(stdout, "AUTODETECTING ENCODING FOR http://%s:%d%s\n", source_address, source_port, path);
-    autodetect_sr = new_stream_request("HEAD", source_address, source_port, path,
-                                       pubsubclient_autodetect_headercb, NULL, pubsubclient_errorcb, data);
-    if (!autodetect_sr) {
-        fprintf(stderr, "ERROR: new_stream_request() failed for %s:%d%s\n", source_address, source_port, path);
+    if (!pubsubclient_start(default_client)) {
         exit(1);
     }
 }
@@ -214,13 +549,6 @@ void pubsubclient_run()
 
 void pubsubclient_free()
 {
-    free_stream_request(autodetect_sr);
-    
-    if (chunked) {
-        evhttp_connection_free(evhttp_source_connection);
-    } else {
-        free_stream_request(stream_request);
-    }
-    
-    free(data);
+    free_pubsubclient(default_client);
+    default_client = NULL;
 }
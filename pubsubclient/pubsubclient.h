@@ -1,9 +1,37 @@
 #ifndef __pubsubclient_h
 #define __pubsubclient_h
 
+#include <stdint.h>
 #include <event.h>
 
 struct StreamRequest;
+struct pubsubclient;
+
+/* a view of one message in the receive buffer, valid only during the callback */
+struct pubsubclient_message {
+    const char *data;
+    size_t len;
+};
+
+struct pubsubclient_stats {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t connects;
+    uint64_t errors;
+};
+
+struct pubsubclient *new_pubsubclient(int source_id, const char *source_address, int source_port, const char *path,
+                                      void (*batch_cb)(int source_id, struct pubsubclient_message *messages, int count, void *arg),
+                                      void (*error_cb)(int source_id, int status_code, void *arg),
+                                      void *cbarg);
+int pubsubclient_start(struct pubsubclient *client);
+int pubsubclient_reconnect(struct pubsubclient *client);
+void pubsubclient_set_backoff(struct pubsubclient *client, int min_ms, int max_ms);
+void pubsubclient_pause(struct pubsubclient *client);
+void pubsubclient_resume(struct pubsubclient *client);
+void pubsubclient_get_stats(struct pubsubclient *client, struct pubsubclient_stats *stats);
+int pubsubclient_source_id(struct pubsubclient *client);
+void free_pubsubclient(struct pubsubclient *client);
 
 int pubsubclient_main(const char *source_address, int source_port, const char *path,
                       void (*message_cb)(char *data, void *arg),
@@ -13,6 +41,7 @@ void pubsubclient_init(const char *source_address, int source_port, const char *
                        void (*message_cb)(char *data, void *arg),
                        void (*error_cb)(int status_code, void *arg),
                        void *cbarg);
+void pubsubclient_set_batch_cb(void (*batch_cb)(struct pubsubclient_message *messages, int count, void *arg));
 int pubsubclient_connect();
 void pubsubclient_run();
 void pubsubclient_free();
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE // for strndup()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <json/json.h>
+#include "envelope.h"
+
+/*
+ * per message cost of the queuereader envelope for 1KB and 10KB payloads:
+ *
+ * json: what queuereader did before, strndup() and parse every message, wrap
+ *   it in a {"data", "tries", "retry_on", "started", "tasks_left"} object
+ *   with a copy of the tasks, and serialize the whole thing to requeue it
+ * compact: parse the QR1 header and pass the payload bytes through
+ * compact+parse: the same, with message_cb asking for the parsed payload
+ *
+ * usage: bench_envelope [iterations]
+ */
+
+static double now()
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static char *make_payload(size_t size)
+{
+    char *payload;
+    size_t len;
+    int i;
+    
+    payload = malloc(size + 64);
+    len = sprintf(payload, "{\"id\": 12345, \"user\": \"someone\"");
+    for (i = 0; len < size - 32; i++) {
+        len += sprintf(payload + len, ", \"k%d\": \"%.*s\"", i, 20, "abcdefghijklmnopqrstuvwxyz");
+    }
+    sprintf(payload + len, "}");
+    return payload;
+}
+
+static struct json_object *make_tasks()
+{
+    struct json_object *tasks = json_object_new_array();
+    
+    json_object_array_add(tasks, json_object_new_string("index"));
+    json_object_array_add(tasks, json_object_new_string("notify"));
+    json_object_array_add(tasks, json_object_new_string("archive"));
+    return tasks;
+}
+
+static size_t json_envelope(const char *line, size_t len, struct json_object *tasks, int requeue)
+{
+    struct json_object *json_msg, *envelope, *tasks_array;
+    char *message;
+    size_t out = 0;
+    int i;
+    
+    message = strndup(line, len);
+    json_msg = json_tokener_parse(message);
+    envelope = json_object_new_object();
+    json_object_object_add(envelope, "data", json_msg);
+    json_object_object_add(envelope, "tries", json_object_new_int(0));
+    json_object_object_add(envelope, "retry_on", NULL);
+    json_object_object_add(envelope, "started", json_object_new_int(time(NULL)));
+    tasks_array = json_object_new_array();
+    for (i = 0; i < json_object_array_length(tasks); i++) {
+        json_object_array_add(tasks_array, json_object_new_string(json_object_get_string(json_object_array_get_idx(tasks, i))));
+    }
+    json_object_object_add(envelope, "tasks_left", tasks_array);
+    if (requeue) {
+        out = strlen(json_object_to_json_string(envelope));
+    }
+    json_object_put(envelope);
+    free(message);
+    return out;
+}
+
+static size_t compact_envelope(const char *line, size_t len, const char *tasks, int requeue, int parse, char *out_buf)
+{
+    struct qr_envelope env;
+    struct json_object *json_msg;
+    size_t out = 0;
+    
+    qr_envelope_parse(&env, line, len, tasks);
+    if (parse) {
+        json_msg = json_tokener_parse(env.data);
+        json_object_put(json_msg);
+    }
+    if (requeue) {
+        out = qr_envelope_header(&env, out_buf, 256);
+        memcpy(out_buf + out, env.data, env.data_len);
+        out += env.data_len;
+    }
+    qr_envelope_free(&env);
+    return out;
+}
+
+static void bench(size_t size, int iterations)
+{
+    struct json_object *tasks = make_tasks();
+    char *payload = make_payload(size);
+    char *out_buf = malloc(size + 1024);
+    size_t len = strlen(payload), total;
+    double start, json_t, json_rq_t, compact_t, compact_rq_t, parse_t;
+    int i;
+    
+    start = now();
+    for (i = 0, total = 0; i < iterations; i++) {
+        total += json_envelope(payload, len, tasks, 0);
+    }
+    json_t = now() - start;
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        total += json_envelope(payload, len, tasks, 1);
+    }
+    json_rq_t = now() - start;
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        total += compact_envelope(payload, len, "index,notify,archive", 0, 0, out_buf);
+    }
+    compact_t = now() - start;
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        total += compact_envelope(payload, len, "index,notify,archive", 1, 0, out_buf);
+    }
+    compact_rq_t = now() - start;
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        total += compact_envelope(payload, len, "index,notify,archive", 0, 1, out_buf);
+    }
+    parse_t = now() - start;
+    
+    fprintf(stdout, "%6lu bytes  %-14s %10.2f us/msg  %10.2f us/msg requeued\n", (unsigned long)len, "json",
+            json_t * 1e6 / iterations, json_rq_t * 1e6 / iterations);
+    fprintf(stdout, "%6s        %-14s %10.2f us/msg  %10.2f us/msg requeued\n", "", "compact",
+            compact_t * 1e6 / iterations, compact_rq_t * 1e6 / iterations);
+    fprintf(stdout, "%6s        %-14s %10.2f us/msg\n", "", "compact+parse", parse_t * 1e6 / iterations);
+    
+    if (total == 0) {
+        fprintf(stdout, "\n");
+    }
+    json_object_put(tasks);
+    free(payload);
+    free(out_buf);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    
+    bench(1024, iterations);
+    bench(10240, iterations / 10);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include "controller.h"
+
+#define LATENCY_EWMA_ALPHA      0.2
+#define FAILURE_DECREASE        0.5
+#define LATENCY_DECREASE        0.8
+
+/*
+ * an AIMD controller for a queue consumer. it tracks three things:
+ *
+ * delay: how long to wait before the next fetch after a message finishes.
+ *   doubles from min_delay_ms on failures (up to max_delay_ms) and halves on
+ *   each success, dropping to 0 below min_delay_ms.
+ *
+ * poll: how long to wait before fetching again when the queue came back
+ *   short. min_poll_ms once drained, doubling on each empty fetch up to
+ *   max_poll_ms, 0 while fetches come back full.
+ *
+ * window: how many messages to keep outstanding. grows by ~1 per window of
+ *   successes and is cut on failures, or when the average latency of
+ *   message_cb is above target_latency_ms.
+ *
+ * the window is cut and the delay doubled at most once per window of
+ * completions, so a batch of messages failing together counts as one event
+ * rather than collapsing the window and stalling the reader.
+ */
+struct qr_controller {
+    struct qr_controller_config config;
+    double window;
+    int delay_ms;
+    int poll_ms;
+    double latency_ms;
+    int completions_since_decrease;
+    uint64_t successes;
+    uint64_t failures;
+    uint64_t empty_fetches;
+    uint64_t window_decreases;
+};
+
+void qr_controller_default_config(struct qr_controller_config *config)
+{
+    config->min_delay_ms = QR_CONTROLLER_MIN_DELAY_MS;
+    config->max_delay_ms = QR_CONTROLLER_MAX_DELAY_MS;
+    config->min_poll_ms = QR_CONTROLLER_MIN_POLL_MS;
+    config->max_poll_ms = 500;
+    config->min_window = 1;
+    config->max_window = 1;
+    config->target_latency_ms = 0;
+}
+
+struct qr_controller *new_qr_controller(struct qr_controller_config *config)
+{
+    struct qr_controller *c;
+    
+    c = calloc(1, sizeof(struct qr_controller));
+    memcpy(&c->config, config, sizeof(struct qr_controller_config));
+    if (c->config.min_window < 1) {
+        c->config.min_window = 1;
+    }
+    if (c->config.max_window < c->config.min_window) {
+        c->config.max_window = c->config.min_window;
+    }
+    if (c->config.max_poll_ms < c->config.min_poll_ms) {
+        c->config.max_poll_ms = c->config.min_poll_ms;
+    }
+    c->window = c->config.max_window;
+    c->completions_since_decrease = c->config.max_window;
+    
+    return c;
+}
+
+static int qr_controller_decrease_window(struct qr_controller *c, double factor)
+{
+    if (c->completions_since_decrease < (int)c->window) {
+        return 0;
+    }
+    c->window *= factor;
+    if (c->window < c->config.min_window) {
+        c->window = c->config.min_window;
+    }
+    c->completions_since_decrease = 0;
+    c->window_decreases++;
+    
+    return 1;
+}
+
+void qr_controller_success(struct qr_controller *c, double latency_ms)
+{
+    c->successes++;
+    c->completions_since_decrease++;
+    
+    c->latency_ms = (c->successes == 1) ? latency_ms :
+                    (LATENCY_EWMA_ALPHA * latency_ms) + ((1 - LATENCY_EWMA_ALPHA) * c->latency_ms);
+    
+    c->delay_ms /= 2;
+    if (c->delay_ms < c->config.min_delay_ms) {
+        c->delay_ms = 0;
+    }
+    
+    if (c->config.target_latency_ms && c->latency_ms > c->config.target_latency_ms) {
+        qr_controller_decrease_window(c, LATENCY_DECREASE);
+    } else {
+        c->window += 1.0 / c->window;
+        if (c->window > c->config.max_window) {
+            c->window = c->config.max_window;
+        }
+    }
+}
+
+void qr_controller_failure(struct qr_controller *c)
+{
+    c->failures++;
+    c->completions_since_decrease++;
+    
+    if (qr_controller_decrease_window(c, FAILURE_DECREASE)) {
+        c->delay_ms = c->delay_ms ? c->delay_ms * 2 : c->config.min_delay_ms;
+        if (c->delay_ms > c->config.max_delay_ms) {
+            c->delay_ms = c->config.max_delay_ms;
+        }
+    } else if (c->delay_ms < c->config.min_delay_ms) {
+        c->delay_ms = c->config.min_delay_ms;
+    }
+}
+
+void qr_controller_fetched(struct qr_controller *c, int requested, int received)
+{
+    if (received == 0) {
+        c->empty_fetches++;
+        c->poll_ms = c->poll_ms ? c->poll_ms * 2 : c->config.min_poll_ms;
+        if (c->poll_ms > c->config.max_poll_ms) {
+            c->poll_ms = c->config.max_poll_ms;
+        }
+    } else if (received < requested) {
+        c->poll_ms = c->config.min_poll_ms;
+    } else {
+        c->poll_ms = 0;
+    }
+}
+
+int qr_controller_window(struct qr_controller *c)
+{
+    return (int)c->window;
+}
+
+int qr_controller_delay_ms(struct qr_controller *c)
+{
+    return c->delay_ms;
+}
+
+int qr_controller_poll_ms(struct qr_controller *c)
+{
+    return c->poll_ms;
+}
+
+void qr_controller_get_stats(struct qr_controller *c, struct qr_controller_stats *stats)
+{
+    stats->window = (int)c->window;
+    stats->delay_ms = c->delay_ms;
+    stats->poll_ms = c->poll_ms;
+    stats->latency_ms = c->latency_ms;
+    stats->successes = c->successes;
+    stats->failures = c->failures;
+    stats->empty_fetches = c->empty_fetches;
+    stats->window_decreases = c->window_decreases;
+}
+
+void free_qr_controller(struct qr_controller *c)
+{
+    free(c);
+}
@@ -0,0 +1,44 @@
+#ifndef __qr_controller_h
+#define __qr_controller_h
+
+#include <stdint.h>
+
+#define QR_CONTROLLER_MIN_DELAY_MS  10
+#define QR_CONTROLLER_MAX_DELAY_MS  30000
+#define QR_CONTROLLER_MIN_POLL_MS   10
+
+struct qr_controller;
+
+struct qr_controller_config {
+    int min_delay_ms;
+    int max_delay_ms;
+    int min_poll_ms;
+    int max_poll_ms;
+    int min_window;
+    int max_window;
+    int target_latency_ms;
+};
+
+struct qr_controller_stats {
+    int window;
+    int delay_ms;
+    int poll_ms;
+    double latency_ms;
+    uint64_t successes;
+    uint64_t failures;
+    uint64_t empty_fetches;
+    uint64_t window_decreases;
+};
+
+void qr_controller_default_config(struct qr_controller_config *config);
+struct qr_controller *new_qr_controller(struct qr_controller_config *config);
+void qr_controller_success(struct qr_controller *c, double latency_ms);
+void qr_controller_failure(struct qr_controller *c);
+void qr_controller_fetched(struct qr_controller *c, int requested, int received);
+int qr_controller_window(struct qr_controller *c);
+int qr_controller_delay_ms(struct qr_controller *c);
+int qr_controller_poll_ms(struct qr_controller *c);
+void qr_controller_get_stats(struct qr_controller *c, struct qr_controller_stats *stats);
+void free_qr_controller(struct qr_controller *c);
+
+#endif
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE // for memmem(), strndup()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <json/json.h>
+#include "envelope.h"
+
+#define MAGIC_LEN (sizeof(QR_ENVELOPE_MAGIC) - 1)
+
+static char *tasks_from_json(struct json_object *tasks)
+{
+    char *tasks_left;
+    const char *task;
+    size_t len = 0, task_len;
+    int i, n;
+    
+    n = tasks ? json_object_array_length(tasks) : 0;
+    for (i = 0; i < n; i++) {
+        len += strlen(json_object_get_string(json_object_array_get_idx(tasks, i))) + 1;
+    }
+    tasks_left = calloc(1, len + 1);
+    len = 0;
+    for (i = 0; i < n; i++) {
+        task = json_object_get_string(json_object_array_get_idx(tasks, i));
+        task_len = strlen(task);
+        if (len) {
+            tasks_left[len++] = ',';
+        }
+        memcpy(tasks_left + len, task, task_len);
+        len += task_len;
+    }
+    
+    return tasks_left;
+}
+
+/*
+ * messages requeued before the compact envelope were a JSON object with the
+ * payload under "data"; those still have to be parsed (once)
+ */
+static int qr_envelope_parse_json(struct qr_envelope *env, const char *line, size_t len)
+{
+    struct json_object *json_msg;
+    char *message;
+    
+    message = strndup(line, len);
+    json_msg = json_tokener_parse(message);
+    free(message);
+    if (!json_msg || !json_object_object_get(json_msg, "data")) {
+        if (json_msg) {
+            json_object_put(json_msg);
+        }
+        return 0;
+    }
+    
+    env->tries = json_object_get_int(json_object_object_get(json_msg, "tries"));
+    env->retry_on = json_object_get_int(json_object_object_get(json_msg, "retry_on"));
+    env->started = json_object_get_int(json_object_object_get(json_msg, "started"));
+    env->tasks_left = tasks_from_json(json_object_object_get(json_msg, "tasks_left"));
+    env->data_buf = strdup(json_object_to_json_string(json_object_object_get(json_msg, "data")));
+    env->data = env->data_buf;
+    env->data_len = strlen(env->data_buf);
+    json_object_put(json_msg);
+    
+    return 1;
+}
+
+/*
+ * fill env from one line off the queue. data points into line (which must
+ * outlive env) unless it came from an old JSON envelope. a line without a
+ * header starts out with all of tasks (comma separated) left to do.
+ * returns 0 for a malformed header
+ */
+int qr_envelope_parse(struct qr_envelope *env, const char *line, size_t len, const char *tasks)
+{
+    const char *p, *end = line + len, *tab;
+    char *next;
+    
+    memset(env, 0, sizeof(struct qr_envelope));
+    
+    if (len > MAGIC_LEN && memcmp(line, QR_ENVELOPE_MAGIC, MAGIC_LEN) == 0) {
+        tab = memchr(line, '\t', len);
+        if (!tab) {
+            return 0;
+        }
+        p = line + MAGIC_LEN;
+        env->tries = strtol(p, &next, 10);
+        env->retry_on = strtol(next, &next, 10);
+        env->started = strtol(next, &next, 10);
+        if (next >= tab || *next != ' ') {
+            return 0;
+        }
+        next++;
+        if (tab - next == 1 && *next == '-') {
+            env->tasks_left = strdup("");
+        } else {
+            env->tasks_left = strndup(next, tab - next);
+        }
+        env->data = tab + 1;
+        env->data_len = end - env->data;
+        return 1;
+    }
+    
+    if (len && line[0] == '{' && memmem(line, len, "\"tasks_left\"", 12)) {
+        if (qr_envelope_parse_json(env, line, len)) {
+            return 1;
+        }
+    }
+    
+    env->started = time(NULL);
+    env->tasks_left = strdup(tasks ? tasks : "");
+    env->data = line;
+    env->data_len = len;
+    
+    return 1;
+}
+
+/*
+ * write the header for env into buf. like snprintf() returns the length it
+ * needed, which may be >= size
+ */
+int qr_envelope_header(struct qr_envelope *env, char *buf, size_t size)
+{
+    return snprintf(buf, size, QR_ENVELOPE_MAGIC "%d %ld %ld %s\t", env->tries, (long)env->retry_on,
+                    (long)env->started, (env->tasks_left && *env->tasks_left) ? env->tasks_left : "-");
+}
+
+static char *find_task(struct qr_envelope *env, const char *task)
+{
+    char *p = env->tasks_left;
+    size_t task_len = strlen(task);
+    
+    while (p && *p) {
+        if (strncmp(p, task, task_len) == 0 && (p[task_len] == ',' || p[task_len] == '\0')) {
+            return p;
+        }
+        p = strchr(p, ',');
+        if (p) {
+            p++;
+        }
+    }
+    
+    return NULL;
+}
+
+int qr_envelope_has_task(struct qr_envelope *env, const char *task)
+{
+    return find_task(env, task) != NULL;
+}
+
+void qr_envelope_finish_task(struct qr_envelope *env, const char *task)
+{
+    char *p;
+    size_t task_len = strlen(task);
+    
+    while ((p = find_task(env, task)) != NULL) {
+        if (p[task_len] == ',') {
+            memmove(p, p + task_len + 1, strlen(p + task_len + 1) + 1);
+        } else if (p > env->tasks_left) {
+            // the last one, take the comma before it too
+            p[-1] = '\0';
+        } else {
+            *p = '\0';
+        }
+    }
+}
+
+void qr_envelope_free(struct qr_envelope *env)
+{
+    free(env->tasks_left);
+    free(env->data_buf);
+    env->tasks_left = NULL;
+    env->data_buf = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __qr_envelope_h
+#define __qr_envelope_h
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * a message on the queue is "QR1 <tries> <retry_on> <started> <tasks_left>\t"
+ * followed by the payload, untouched. tasks_left is comma separated, "-"
+ * when there are none left. a message without the header is a new payload.
+ */
+#define QR_ENVELOPE_MAGIC "QR1 "
+
+struct qr_envelope {
+    int tries;
+    time_t retry_on;
+    time_t started;
+    char *tasks_left;
+    const char *data;
+    size_t data_len;
+    char *data_buf;
+};
+
+int qr_envelope_parse(struct qr_envelope *env, const char *line, size_t len, const char *tasks);
+int qr_envelope_header(struct qr_envelope *env, char *buf, size_t size);
+int qr_envelope_has_task(struct qr_envelope *env, const char *task);
+void qr_envelope_finish_task(struct qr_envelope *env, const char *task);
+void qr_envelope_free(struct qr_envelope *env);
+
+#endif
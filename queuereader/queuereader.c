@@ -7,208 +7,443 @@
 #define _DEBUG(...) do {;} while (0)
 #endif
 
-#define MAX_BACKOFF_COUNTER 8
-
 void queuereader_termination_handler(int signum);
-void queuereader_trigger_source_request(int seconds, int microseconds);
-void queuereader_free(void);
+void queuereader_schedule_fetch(struct queuereader *reader, int milliseconds);
+int queuereader_next_fetch_ms(struct queuereader *reader);
 void queuereader_source_request(int fd, short what, void *cbarg);
 void queuereader_source_cb(struct evhttp_request *req, void *cbarg);
-void queuereader_requeue_message_request(int delay);
-void queuereader_requeue_message_cb(struct evhttp_request *req, void *cbarg);
-int queuereader_calculate_backoff_seconds();
-void queuereader_increment_backoff(void);
-void queuereader_decrement_backoff(void);
-
-struct GlobalData {
-    int (*message_cb)(struct json_object *json_msg, void *cbarg);
+void queuereader_dispatch(struct queuereader *reader, char *line);
+void queuereader_dispatch_backlog(struct queuereader *reader);
+void queuereader_msg_done(struct queuereader_msg *msg);
+void queuereader_requeue_message_request(struct queuereader_msg *msg, int delay);
+void queuereader_requeue_schedule(struct queuereader *reader);
+void queuereader_requeue_flush(int fd, short what, void *cbarg);
+void queuereader_requeue_flush_cb(struct evhttp_request *req, void *cbarg);
+void queuereader_requeue_put(struct queuereader *reader, struct evbuffer *message);
+void queuereader_requeue_put_cb(struct evhttp_request *req, void *cbarg);
+
+/*
+ * a reader keeps up to window messages outstanding at once. each one is
+ * handed to message_cb with its own queuereader_msg, which stays valid until
+ * queuereader_finish() is called for it. the payload is passed through as
+ * is; it's only parsed if message_cb asks for queuereader_msg_json().
+ * messages come from /mget (at least mget_items at a time) into a local
+ * backlog which is dispatched as slots free up; a single message from the
+ * configured path is dispatched as is. requeued messages are collected and
+ * sent in one /mput per requeue interval. the window, backoff and empty
+ * queue polling are driven by a qr_controller.
+ */
+struct queuereader {
+    int (*message_cb)(struct queuereader_msg *msg, void *cbarg);
     void (*error_cb)(int status_code, void *cbarg);
     void *cbarg;
-    const char *source_address;
+    char *source_address;
     int source_port;
-    const char *path;
-    struct json_object *tasks;
+    char *path;
+    char *tasks;
     int max_tries;
+    struct qr_controller_config controller_config;
+    struct qr_controller *controller;
+    int outstanding;
+    int fetching;
+    int fetch_items;
+    int mget_items;
+    int queue_empty;
+    struct evbuffer *backlog;
+    struct event fetch_ev;
+    struct evbuffer *requeue_buf;
+    struct evbuffer *requeue_in_flight;
+    size_t requeue_sending;
+    int requeue_puts;
+    int requeue_failures;
+    struct timeval requeue_interval_tv;
+    struct event requeue_ev;
+    struct queuereader_stats stats;
+};
+
+struct queuereader_msg {
+    struct queuereader *reader;
+    char *line;
+    struct qr_envelope env;
+    struct json_object *json;
+    struct json_object *legacy_json;
+    simplehttp_ts start_ts;
 };
 
-static struct json_object *json_msg = NULL;
-static int backoff_counter = 0;
-static struct GlobalData *data = NULL;
-static struct event ev;
 static int sleeptime_queue_empty_ms = 500;
+static int mget_items = 1;
+static int requeue_interval_ms = 100;
+static size_t requeue_max_bytes = 16 * 1024 * 1024;
 static int max_tries = 5;
-static struct timeval sleeptime_queue_empty_tv;
 extern struct event_base *current_base;
 
+static struct queuereader *default_reader = NULL;
+static struct queuereader_msg *default_msg = NULL;
+static int (*default_message_cb)(struct json_object *json_msg, void *cbarg) = NULL;
+
 void queuereader_termination_handler(int signum)
 {
     event_loopbreak();
 }
 
-int queuereader_calculate_backoff_seconds()
+/*
+ * (re)schedule the next source request. the most recent call wins, the
+ * request itself is skipped if the window is full or one is already in flight
+ */
+void queuereader_schedule_fetch(struct queuereader *reader, int milliseconds)
 {
-    int seconds;
-    
-    seconds = backoff_counter ? (1 << backoff_counter) : 0;
-    if (seconds > 0) {
-        fprintf(stderr, "NOTICE: backing off for %d seconds\n", seconds);
-    }
+    struct timeval tv = { milliseconds / 1000, (milliseconds % 1000) * 1000 };
     
-    return seconds;
+    evtimer_del(&reader->fetch_ev);
+    evtimer_add(&reader->fetch_ev, &tv);
 }
 
-void queuereader_trigger_source_request(int seconds, int microseconds)
+/*
+ * the controller's backoff delay, and once the backlog is used up after a
+ * short fetch, at least its empty queue poll interval
+ */
+int queuereader_next_fetch_ms(struct queuereader *reader)
 {
-    struct timeval tv = { seconds, microseconds };
+    int delay_ms, poll_ms;
     
-    evtimer_del(&ev);
-    evtimer_set(&ev, queuereader_source_request, data);
-    evtimer_add(&ev, &tv);
-}
-
-void queuereader_decrement_backoff(void)
-{
-    // bounded decrement of backoff counter
-    backoff_counter = ((backoff_counter - 1) > 0) ? (backoff_counter - 1) : 0;
+    delay_ms = qr_controller_delay_ms(reader->controller);
+    if (reader->queue_empty && !EVBUFFER_LENGTH(reader->backlog)) {
+        poll_ms = qr_controller_poll_ms(reader->controller);
+        if (poll_ms > delay_ms) {
+            return poll_ms;
+        }
+    }
+    if (delay_ms >= 1000) {
+        fprintf(stderr, "NOTICE: backing off for %d ms\n", delay_ms);
+    }
+    
+    return delay_ms;
 }
 
-void queuereader_increment_backoff(void)
+/*
+ * a message is done; it no longer counts against the window
+ */
+void queuereader_msg_done(struct queuereader_msg *msg)
 {
-    // bounded increment of backoff counter
-    backoff_counter = ((backoff_counter + 1) > MAX_BACKOFF_COUNTER) ?
-                      MAX_BACKOFF_COUNTER : (backoff_counter + 1);
+    struct queuereader *reader = msg->reader;
+    
+    if (msg == default_msg) {
+        default_msg = NULL;
+    }
+    reader->outstanding--;
+    reader->stats.finished++;
+    if (msg->json) {
+        json_object_put(msg->json);
+    }
+    if (msg->legacy_json) {
+        json_object_put(msg->legacy_json);
+    }
+    qr_envelope_free(&msg->env);
+    free(msg->line);
+    free(msg);
 }
 
-void queuereader_finish_message(int return_code)
+void queuereader_finish(struct queuereader_msg *msg, int return_code)
 {
+    struct queuereader *reader = msg->reader;
+    simplehttp_ts end_ts;
+    
     switch (return_code) {
         case QR_CONT:
-            // do nothing
+            // message_cb will finish this message later
             break;
         case QR_EMPTY:
-            queuereader_trigger_source_request(sleeptime_queue_empty_tv.tv_sec, sleeptime_queue_empty_tv.tv_usec);
+            queuereader_msg_done(msg);
+            qr_controller_fetched(reader->controller, 1, 0);
+            reader->queue_empty = 1;
+            queuereader_schedule_fetch(reader, queuereader_next_fetch_ms(reader));
             break;
         case QR_SUCCESS:
-            queuereader_decrement_backoff();
-            queuereader_trigger_source_request(queuereader_calculate_backoff_seconds(), 0);
+            simplehttp_ts_get(&end_ts);
+            qr_controller_success(reader->controller, simplehttp_ts_diff(msg->start_ts, end_ts) / 1000.0);
+            queuereader_msg_done(msg);
+            queuereader_schedule_fetch(reader, queuereader_next_fetch_ms(reader));
             break;
         case QR_FAILURE:
-            queuereader_increment_backoff();
-            queuereader_requeue_message_request(1);
+            qr_controller_failure(reader->controller);
+            queuereader_requeue_message_request(msg, 1);
             break;
         case QR_CONT_SOURCE_REQUEST:
-            queuereader_trigger_source_request(queuereader_calculate_backoff_seconds(), 0);
+            queuereader_msg_done(msg);
+            queuereader_schedule_fetch(reader, queuereader_next_fetch_ms(reader));
             break;
         case QR_REQUEUE_WITHOUT_BACKOFF:
-            queuereader_requeue_message_request(1);
+            queuereader_requeue_message_request(msg, 1);
             break;
         case QR_REQUEUE_WITHOUT_DELAY:
-            queuereader_requeue_message_request(0);
+            queuereader_requeue_message_request(msg, 0);
             break;
     }
 }
 
-void queuereader_requeue_message_cb(struct evhttp_request *req, void *cbarg)
+/*
+ * flush requeued messages after the requeue interval, doubled for each /mput
+ * that failed in a row (up to 64 times)
+ */
+void queuereader_requeue_schedule(struct queuereader *reader)
 {
-    // TODO: this should limit (and perhaps backoff) failed requeue requests
-    queuereader_finish_message((req && req->response_code == 200) ?
-                               QR_CONT_SOURCE_REQUEST : QR_REQUEUE_WITHOUT_BACKOFF);
+    struct timeval tv;
+    int shift = reader->requeue_failures;
+    
+    if (evtimer_pending(&reader->requeue_ev, NULL)) {
+        return;
+    }
+    
+    tv.tv_sec = (reader->requeue_interval_tv.tv_sec << shift) + ((reader->requeue_interval_tv.tv_usec << shift) / 1000000);
+    tv.tv_usec = (reader->requeue_interval_tv.tv_usec << shift) % 1000000;
+    evtimer_add(&reader->requeue_ev, &tv);
 }
 
-void queuereader_requeue_message_request(int delay)
+/*
+ * send everything requeued since the last flush as one /mput. a failed /mput
+ * is put back in front of the next one, unless that would hold more than
+ * requeue_max_bytes in which case it's dropped
+ */
+void queuereader_requeue_flush(int fd, short what, void *cbarg)
 {
-    struct evbuffer *evb;
-    const char *message;
-    char *encoded_message;
-    struct json_object *tmp_obj;
-    int tries;
-    time_t retry_on;
+    struct queuereader *reader = (struct queuereader *)cbarg;
     
-    tries = json_object_get_int(json_object_object_get(json_msg, "tries"));
-    if (tries > max_tries) {
-        // TODO: dump message
-        queuereader_finish_message(QR_CONT_SOURCE_REQUEST);
+    if (reader->requeue_sending || !EVBUFFER_LENGTH(reader->requeue_buf)) {
         return;
     }
     
-    tmp_obj = json_object_object_get(json_msg, "retry_on");
-    retry_on = json_object_get_int(tmp_obj);
-    if (delay) {
-        if (!retry_on) {
-            retry_on = time(NULL);
+    evbuffer_add_buffer(reader->requeue_in_flight, reader->requeue_buf);
+    reader->requeue_sending = EVBUFFER_LENGTH(reader->requeue_in_flight);
+    evbuffer_add(reader->requeue_in_flight, "", 1);
+    reader->stats.requeue_posts++;
+    new_async_request_with_body(EVHTTP_REQ_POST, reader->source_address, reader->source_port, "/mput",
+                                NULL, (const char *)EVBUFFER_DATA(reader->requeue_in_flight), queuereader_requeue_flush_cb, reader);
+}
+
+void queuereader_requeue_flush_cb(struct evhttp_request *req, void *cbarg)
+{
+    struct queuereader *reader = (struct queuereader *)cbarg;
+    struct evbuffer *evb;
+    
+    if (!req || req->response_code != 200) {
+        reader->stats.errors++;
+        if (reader->requeue_failures < 6) {
+            reader->requeue_failures++;
+        }
+        if (reader->requeue_sending + EVBUFFER_LENGTH(reader->requeue_buf) > requeue_max_bytes) {
+            fprintf(stderr, "ERROR: /mput of requeued messages failed (%d), dropping %lu bytes\n",
+                    req ? req->response_code : 0, (unsigned long)reader->requeue_sending);
+        } else {
+            fprintf(stderr, "ERROR: /mput of requeued messages failed (%d)\n", req ? req->response_code : 0);
+            evb = evbuffer_new();
+            evbuffer_add(evb, EVBUFFER_DATA(reader->requeue_in_flight), reader->requeue_sending);
+            evbuffer_add_buffer(evb, reader->requeue_buf);
+            evbuffer_free(reader->requeue_buf);
+            reader->requeue_buf = evb;
         }
-        retry_on += 90;
-        json_object_object_add(json_msg, "retry_on", json_object_new_int(retry_on));
+    } else {
+        reader->requeue_failures = 0;
     }
+    evbuffer_drain(reader->requeue_in_flight, EVBUFFER_LENGTH(reader->requeue_in_flight));
+    reader->requeue_sending = 0;
     
-    message = json_object_to_json_string(json_msg);
-    fprintf(stderr, "NOTICE: requeue message %s\n", message);
+    if (EVBUFFER_LENGTH(reader->requeue_buf)) {
+        queuereader_requeue_schedule(reader);
+    }
+}
+
+/*
+ * /mput takes one message per line, so a message with newlines in it is put
+ * back on its own with /put?data=
+ */
+void queuereader_requeue_put(struct queuereader *reader, struct evbuffer *message)
+{
+    struct evbuffer *evb;
+    char *encoded_message;
+    
+    evbuffer_add(message, "", 1);
+    encoded_message = simplehttp_encode_uri((const char *)EVBUFFER_DATA(message));
     evb = evbuffer_new();
-    encoded_message = simplehttp_encode_uri(message);
     evbuffer_add_printf(evb, "/put?data=%s", encoded_message);
-    new_async_request((char *)data->source_address, data->source_port,
-                      (char *)EVBUFFER_DATA(evb), queuereader_requeue_message_cb, (void *)NULL);
+    reader->requeue_puts++;
+    reader->stats.requeue_posts++;
+    new_async_request(reader->source_address, reader->source_port,
+                      (char *)EVBUFFER_DATA(evb), queuereader_requeue_put_cb, reader);
     evbuffer_free(evb);
     free(encoded_message);
 }
 
-void queuereader_source_cb(struct evhttp_request *req, void *cbarg)
+void queuereader_requeue_put_cb(struct evhttp_request *req, void *cbarg)
 {
-    struct GlobalData *client_data = (struct GlobalData *)cbarg;
-    char *line;
-    size_t line_len;
+    struct queuereader *reader = (struct queuereader *)cbarg;
+    
+    reader->requeue_puts--;
+    if (!req || req->response_code != 200) {
+        fprintf(stderr, "ERROR: /put of a requeued message failed (%d), dropping it\n", req ? req->response_code : 0);
+        reader->stats.errors++;
+    }
+}
+
+/*
+ * queue a message to be put back on the queue with the next /mput (or right
+ * away with /put if it has newlines in it). it no longer counts against the
+ * window
+ */
+void queuereader_requeue_message_request(struct queuereader_msg *msg, int delay)
+{
+    struct queuereader *reader = msg->reader;
     struct evbuffer *evb;
-    struct json_object *new_json_msg;
-    struct json_object *tasks_array;
-    struct json_object *tmp_obj;
-    char *message;
-    int ret = QR_EMPTY;
-    time_t retry_on;
-    
-    if (json_msg) {
-        json_object_put(json_msg);
-        json_msg = NULL;
-    }
-    
-    evb = req->input_buffer;
-    line = (char *)EVBUFFER_DATA(evb);
-    line_len = EVBUFFER_LENGTH(evb);
-    if (line_len) {
-        message = strndup(line, line_len);
-        
-        json_msg = json_tokener_parse(message);
-        if (!json_msg) {
-            fprintf(stdout, "ERROR: failed to parse JSON (%s)\n", message);
-            ret = QR_CONT_SOURCE_REQUEST;
+    char header[256], *long_header;
+    int header_len, multiline;
+    
+    if (msg->env.tries > reader->max_tries) {
+        // TODO: dump message
+        queuereader_finish(msg, QR_CONT_SOURCE_REQUEST);
+        return;
+    }
+    
+    if (delay) {
+        if (!msg->env.retry_on) {
+            msg->env.retry_on = time(NULL);
+        }
+        msg->env.retry_on += 90;
+    }
+    
+    multiline = memchr(msg->env.data, '\n', msg->env.data_len) != NULL;
+    if (!multiline && EVBUFFER_LENGTH(reader->requeue_buf) >= requeue_max_bytes) {
+        fprintf(stderr, "ERROR: %lu bytes of requeued messages waiting, dropping message\n",
+                (unsigned long)EVBUFFER_LENGTH(reader->requeue_buf));
+        reader->stats.errors++;
+        queuereader_finish(msg, QR_CONT_SOURCE_REQUEST);
+        return;
+    }
+    
+    _DEBUG("requeue message %.*s\n", (int)msg->env.data_len, msg->env.data);
+    reader->stats.requeued++;
+    evb = multiline ? evbuffer_new() : reader->requeue_buf;
+    header_len = qr_envelope_header(&msg->env, header, sizeof(header));
+    if (header_len < (int)sizeof(header)) {
+        evbuffer_add(evb, header, header_len);
+    } else {
+        // a long list of tasks
+        long_header = malloc(header_len + 1);
+        qr_envelope_header(&msg->env, long_header, header_len + 1);
+        evbuffer_add(evb, long_header, header_len);
+        free(long_header);
+    }
+    evbuffer_add(evb, msg->env.data, msg->env.data_len);
+    if (multiline) {
+        queuereader_requeue_put(reader, evb);
+        evbuffer_free(evb);
+    } else {
+        evbuffer_add(evb, "\n", 1);
+        queuereader_requeue_schedule(reader);
+    }
+    
+    queuereader_finish(msg, QR_CONT_SOURCE_REQUEST);
+}
+
+/*
+ * read the envelope of one message from the queue and hand it to
+ * message_cb. the message takes ownership of line
+ */
+void queuereader_dispatch(struct queuereader *reader, char *line)
+{
+    struct queuereader_msg *msg;
+    int ret;
+    
+    msg = calloc(1, sizeof(struct queuereader_msg));
+    if (!qr_envelope_parse(&msg->env, line, strlen(line), reader->tasks)) {
+        fprintf(stdout, "ERROR: failed to parse message envelope (%s)\n", line);
+        free(line);
+        free(msg);
+        return;
+    }
+    msg->reader = reader;
+    msg->line = line;
+    simplehttp_ts_get(&msg->start_ts);
+    reader->outstanding++;
+    reader->stats.messages++;
+    
+    if (msg->env.retry_on > time(NULL)) {
+        ret = QR_REQUEUE_WITHOUT_DELAY;
+    } else {
+        ret = (*reader->message_cb)(msg, reader->cbarg);
+    }
+    
+    queuereader_finish(msg, ret);
+}
+
+/*
+ * hand messages from the backlog to message_cb while there is room in the
+ * window. once it's empty the next source request is scheduled
+ */
+void queuereader_dispatch_backlog(struct queuereader *reader)
+{
+    char *line;
+    
+    while (reader->outstanding < qr_controller_window(reader->controller) && (line = evbuffer_readline(reader->backlog)) != NULL) {
+        if (*line) {
+            queuereader_dispatch(reader, line);
         } else {
-            tmp_obj = json_object_object_get(json_msg, "data");
-            if (!tmp_obj) {
-                new_json_msg = json_object_new_object();
-                json_object_object_add(new_json_msg, "data", json_msg);
-                json_object_object_add(new_json_msg, "tries", json_object_new_int(0));
-                json_object_object_add(new_json_msg, "retry_on", NULL);
-                json_object_object_add(new_json_msg, "started", json_object_new_int(time(NULL)));
-                json_msg = new_json_msg;
-            }
-            
-            tmp_obj = json_object_object_get(json_msg, "tasks_left");
-            if (!tmp_obj) {
-                tasks_array = queuereader_copy_tasks(client_data->tasks);
-                json_object_object_add(json_msg, "tasks_left", tasks_array);
+            free(line);
+        }
+    }
+    
+    if (!EVBUFFER_LENGTH(reader->backlog)) {
+        queuereader_schedule_fetch(reader, queuereader_next_fetch_ms(reader));
+    }
+}
+
+void queuereader_source_cb(struct evhttp_request *req, void *cbarg)
+{
+    struct queuereader *reader = (struct queuereader *)cbarg;
+    const char *line, *end, *eol;
+    int count = 0;
+    
+    reader->fetching = 0;
+    
+    if (!req || req->response_code != 200) {
+        reader->stats.errors++;
+        if (reader->error_cb) {
+            (*reader->error_cb)(req ? req->response_code : 0, reader->cbarg);
+        }
+        qr_controller_failure(reader->controller);
+        queuereader_schedule_fetch(reader, queuereader_next_fetch_ms(reader));
+        return;
+    }
+    
+    if (reader->fetch_items == 1) {
+        // the configured path answers with the whole message as the body,
+        // newlines and all
+        count = EVBUFFER_LENGTH(req->input_buffer) ? 1 : 0;
+    } else {
+        // one message per line from /mget
+        line = (const char *)EVBUFFER_DATA(req->input_buffer);
+        end = line + EVBUFFER_LENGTH(req->input_buffer);
+        while (line < end) {
+            eol = memchr(line, '\n', end - line);
+            if (!eol) {
+                eol = end;
             }
-            
-            retry_on = json_object_get_int(json_object_object_get(json_msg, "retry_on"));
-            if (retry_on > time(NULL)) {
-                ret = QR_REQUEUE_WITHOUT_DELAY;
-            } else {
-                ret = (*client_data->message_cb)(json_msg, client_data->cbarg);
+            if (eol > line) {
+                count++;
             }
+            line = eol + 1;
         }
-        
-        free(message);
     }
+    qr_controller_fetched(reader->controller, reader->fetch_items, count);
+    reader->queue_empty = (count < reader->fetch_items);
     
-    queuereader_finish_message(ret);
+    if (reader->fetch_items == 1) {
+        if (count) {
+            queuereader_dispatch(reader, strndup((const char *)EVBUFFER_DATA(req->input_buffer), EVBUFFER_LENGTH(req->input_buffer)));
+        }
+    } else if (EVBUFFER_LENGTH(req->input_buffer)) {
+        evbuffer_add(reader->backlog, EVBUFFER_DATA(req->input_buffer), EVBUFFER_LENGTH(req->input_buffer));
+        evbuffer_add(reader->backlog, "\n", 1);
+    }
+    queuereader_dispatch_backlog(reader);
 }
 
 struct json_object *queuereader_copy_tasks(struct json_object *input_array)
@@ -226,74 +461,350 @@ struct json_object *queuereader_copy_tasks(struct json_object *input_array)
     return tasks_array;
 }
 
-void queuereader_finish_task_by_name(const char *finished_task)
+/*
+ * the configured tasks as the comma separated list new messages start with
+ */
+char *queuereader_join_tasks(struct json_object *tasks)
 {
-    struct json_object *new_tasks_array;
-    struct json_object *tasks;
+    struct evbuffer *evb;
+    char *joined;
     int i;
-    const char *task;
     
-    // walk the array of tasks_left and skip the one that matches the tast string specified...
-    tasks = json_object_object_get(json_msg, "tasks_left");
-    new_tasks_array = json_object_new_array();
-    for (i = 0; i < json_object_array_length(tasks); i++) {
-        task = json_object_get_string(json_object_array_get_idx(tasks, i));
-        if (strcmp(finished_task, task) != 0) {
-            json_object_array_add(new_tasks_array, json_object_new_string(task));
+    evb = evbuffer_new();
+    for (i = 0; tasks && i < json_object_array_length(tasks); i++) {
+        evbuffer_add_printf(evb, "%s%s", i ? "," : "", json_object_get_string(json_object_array_get_idx(tasks, i)));
+    }
+    joined = strndup((const char *)EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb));
+    evbuffer_free(evb);
+    
+    return joined;
+}
+
+/*
+ * the raw payload, valid until the message is finished
+ */
+const char *queuereader_msg_data(struct queuereader_msg *msg, size_t *len)
+{
+    *len = msg->env.data_len;
+    return msg->env.data;
+}
+
+/*
+ * the payload parsed as JSON (on the first call), NULL if it isn't JSON.
+ * owned by the message
+ */
+struct json_object *queuereader_msg_json(struct queuereader_msg *msg)
+{
+    char *data;
+    
+    if (!msg->json) {
+        if (msg->env.data[msg->env.data_len] == '\0') {
+            msg->json = json_tokener_parse(msg->env.data);
+        } else {
+            data = strndup(msg->env.data, msg->env.data_len);
+            msg->json = json_tokener_parse(data);
+            free(data);
         }
     }
-    json_object_object_add(json_msg, "tasks_left", new_tasks_array);
+    
+    return msg->json;
 }
 
+int queuereader_msg_tries(struct queuereader_msg *msg)
+{
+    return msg->env.tries;
+}
+
+time_t queuereader_msg_started(struct queuereader_msg *msg)
+{
+    return msg->env.started;
+}
+
+int queuereader_msg_has_task(struct queuereader_msg *msg, const char *task)
+{
+    return qr_envelope_has_task(&msg->env, task);
+}
+
+void queuereader_msg_finish_task(struct queuereader_msg *msg, const char *finished_task)
+{
+    qr_envelope_finish_task(&msg->env, finished_task);
+}
+
+/*
+ * dispatch from the backlog, or when it's empty request enough messages to
+ * fill the window (and at least mget_items). that's the configured path when
+ * only one message is wanted, otherwise /mget?items=N
+ */
 void queuereader_source_request(int fd, short what, void *cbarg)
 {
-    struct GlobalData *client_data = (struct GlobalData *)cbarg;
+    struct queuereader *reader = (struct queuereader *)cbarg;
     struct evbuffer *evb;
+    int window;
+    
+    if (EVBUFFER_LENGTH(reader->backlog)) {
+        queuereader_dispatch_backlog(reader);
+        return;
+    }
+    
+    window = qr_controller_window(reader->controller);
+    if (reader->fetching || reader->outstanding >= window) {
+        // a finishing message schedules the next request
+        return;
+    }
+    
+    reader->fetch_items = window - reader->outstanding;
+    if (reader->fetch_items < reader->mget_items) {
+        reader->fetch_items = reader->mget_items;
+    }
+    reader->fetching = 1;
+    reader->stats.fetches++;
     
     evb = evbuffer_new();
-    evbuffer_add_printf(evb, client_data->path);
-    new_async_request((char *)client_data->source_address, client_data->source_port,
-                      (char *)EVBUFFER_DATA(evb), queuereader_source_cb, cbarg);
+    if (reader->fetch_items == 1) {
+        evbuffer_add_printf(evb, "%s", reader->path);
+    } else {
+        evbuffer_add_printf(evb, "/mget?items=%d", reader->fetch_items);
+    }
+    _DEBUG("queuereader_source_request %s\n", (char *)EVBUFFER_DATA(evb));
+    new_async_request(reader->source_address, reader->source_port,
+                      (char *)EVBUFFER_DATA(evb), queuereader_source_cb, reader);
     evbuffer_free(evb);
 }
 
+/*
+ * the longest the reader waits between polls of an empty queue (readers
+ * created after this call); it polls sooner right after the queue drains
+ */
 void queuereader_set_sleeptime_queue_empty_ms(int milliseconds)
 {
     sleeptime_queue_empty_ms = milliseconds;
 }
 
-void queuereader_init(struct json_object *tasks, 
+/*
+ * the fewest messages to ask /mget for at once (readers created after this
+ * call). 1 keeps fetching single messages from the configured path
+ */
+void queuereader_set_mget_items(int items)
+{
+    mget_items = items > 0 ? items : 1;
+}
+
+/*
+ * how long requeued messages are collected before they're sent in one /mput
+ * (readers created after this call)
+ */
+void queuereader_set_requeue_interval_ms(int milliseconds)
+{
+    requeue_interval_ms = milliseconds;
+}
+
+/*
+ * the most requeued messages (in bytes) held while /mput keeps failing;
+ * past that they're dropped with an error
+ */
+void queuereader_set_requeue_max_bytes(size_t bytes)
+{
+    requeue_max_bytes = bytes;
+}
+
+struct queuereader *new_queuereader(struct json_object *tasks,
+                                    const char *source_address, int source_port, const char *path,
+                                    int (*message_cb)(struct queuereader_msg *msg, void *arg),
+                                    void (*error_cb)(int status_code, void *arg),
+                                    void *cbarg)
+{
+    struct queuereader *reader;
+    
+    if (!current_base) {
+        event_init();
+    }
+    
+    reader = calloc(1, sizeof(struct queuereader));
+    reader->message_cb = message_cb;
+    reader->error_cb = error_cb;
+    reader->cbarg = cbarg;
+    reader->source_address = strdup(source_address);
+    reader->source_port = source_port;
+    reader->path = strdup(path);
+    reader->tasks = queuereader_join_tasks(tasks);
+    reader->max_tries = max_tries;
+    qr_controller_default_config(&reader->controller_config);
+    reader->controller_config.max_poll_ms = sleeptime_queue_empty_ms;
+    reader->controller = new_qr_controller(&reader->controller_config);
+    reader->mget_items = mget_items;
+    reader->backlog = evbuffer_new();
+    evtimer_set(&reader->fetch_ev, queuereader_source_request, reader);
+    reader->requeue_buf = evbuffer_new();
+    reader->requeue_in_flight = evbuffer_new();
+    reader->requeue_interval_tv.tv_sec = requeue_interval_ms / 1000;
+    reader->requeue_interval_tv.tv_usec = (requeue_interval_ms % 1000) * 1000;
+    evtimer_set(&reader->requeue_ev, queuereader_requeue_flush, reader);
+    
+    return reader;
+}
+
+/*
+ * the most messages that may be outstanding at once; the controller starts
+ * here and shrinks the window on failures or slow messages. above 1
+ * messages are fetched from simplequeue's /mget instead of the configured
+ * path. call before queuereader_start()
+ */
+void queuereader_set_window(struct queuereader *reader, int window)
+{
+    reader->controller_config.max_window = window > 0 ? window : 1;
+    free_qr_controller(reader->controller);
+    reader->controller = new_qr_controller(&reader->controller_config);
+}
+
+/*
+ * shrink the window while message_cb takes longer than this on average
+ * (0, the default, only shrinks it on failures). call before
+ * queuereader_start()
+ */
+void queuereader_set_target_latency_ms(struct queuereader *reader, int milliseconds)
+{
+    reader->controller_config.target_latency_ms = milliseconds;
+    free_qr_controller(reader->controller);
+    reader->controller = new_qr_controller(&reader->controller_config);
+}
+
+void queuereader_start(struct queuereader *reader)
+{
+    queuereader_schedule_fetch(reader, 0);
+}
+
+void queuereader_get_stats(struct queuereader *reader, struct queuereader_stats *stats)
+{
+    memcpy(stats, &reader->stats, sizeof(struct queuereader_stats));
+    qr_controller_get_stats(reader->controller, &stats->controller);
+}
+
+/*
+ * the reader's counters and controller state as a JSON object, for
+ * including in a consumer's /stats
+ */
+void queuereader_stats_json(struct queuereader *reader, struct evbuffer *evb)
+{
+    struct queuereader_stats stats;
+    
+    queuereader_get_stats(reader, &stats);
+    evbuffer_add_printf(evb, "{\"fetches\": %llu, \"messages\": %llu, \"finished\": %llu, "
+                        "\"requeued\": %llu, \"requeue_posts\": %llu, \"errors\": %llu, \"outstanding\": %d, "
+                        "\"window\": %d, \"delay_ms\": %d, \"poll_ms\": %d, \"latency_ms\": %.3f, "
+                        "\"successes\": %llu, \"failures\": %llu, \"empty_fetches\": %llu, \"window_decreases\": %llu}",
+                        (unsigned long long)stats.fetches, (unsigned long long)stats.messages,
+                        (unsigned long long)stats.finished, (unsigned long long)stats.requeued,
+                        (unsigned long long)stats.requeue_posts, (unsigned long long)stats.errors, reader->outstanding,
+                        stats.controller.window, stats.controller.delay_ms, stats.controller.poll_ms,
+                        stats.controller.latency_ms, (unsigned long long)stats.controller.successes,
+                        (unsigned long long)stats.controller.failures, (unsigned long long)stats.controller.empty_fetches,
+                        (unsigned long long)stats.controller.window_decreases);
+}
+
+/*
+ * call once the event loop has exited; messages still outstanding are not
+ * freed. pending requeues are sent first, giving up after a few failed tries
+ */
+void free_queuereader(struct queuereader *reader)
+{
+    int tries;
+    
+    if (reader) {
+        evtimer_del(&reader->fetch_ev);
+        evtimer_del(&reader->requeue_ev);
+        for (tries = 0; tries < 3 && (reader->requeue_sending || EVBUFFER_LENGTH(reader->requeue_buf)); tries++) {
+            queuereader_requeue_flush(-1, EV_TIMEOUT, reader);
+            while (reader->requeue_sending) {
+                event_loop(EVLOOP_ONCE);
+            }
+        }
+        while (reader->requeue_puts) {
+            event_loop(EVLOOP_ONCE);
+        }
+        evtimer_del(&reader->requeue_ev);
+        if (EVBUFFER_LENGTH(reader->requeue_buf)) {
+            fprintf(stderr, "ERROR: dropping %lu bytes of requeued messages\n", (unsigned long)EVBUFFER_LENGTH(reader->requeue_buf));
+        }
+        evbuffer_free(reader->backlog);
+        evbuffer_free(reader->requeue_buf);
+        evbuffer_free(reader->requeue_in_flight);
+        free_qr_controller(reader->controller);
+        free(reader->source_address);
+        free(reader->path);
+        free(reader->tasks);
+        free(reader);
+    }
+}
+
+/*
+ * the original single message interface, a reader with a window of 1. its
+ * message_cb gets the whole envelope as a JSON object, so that's built here
+ */
+struct json_object *queuereader_legacy_tasks_left(struct queuereader_msg *msg)
+{
+    struct json_object *tasks_array;
+    char *tasks, *task, *saveptr;
+    
+    tasks_array = json_object_new_array();
+    tasks = strdup(msg->env.tasks_left);
+    for (task = strtok_r(tasks, ",", &saveptr); task; task = strtok_r(NULL, ",", &saveptr)) {
+        json_object_array_add(tasks_array, json_object_new_string(task));
+    }
+    free(tasks);
+    
+    return tasks_array;
+}
+
+int queuereader_default_message_cb(struct queuereader_msg *msg, void *cbarg)
+{
+    struct json_object *data;
+    
+    data = queuereader_msg_json(msg);
+    if (!data) {
+        fprintf(stdout, "ERROR: failed to parse JSON (%.*s)\n", (int)msg->env.data_len, msg->env.data);
+        return QR_CONT_SOURCE_REQUEST;
+    }
+    
+    msg->legacy_json = json_object_new_object();
+    json_object_object_add(msg->legacy_json, "data", json_object_get(data));
+    json_object_object_add(msg->legacy_json, "tries", json_object_new_int(msg->env.tries));
+    json_object_object_add(msg->legacy_json, "retry_on", msg->env.retry_on ? json_object_new_int(msg->env.retry_on) : NULL);
+    json_object_object_add(msg->legacy_json, "started", json_object_new_int(msg->env.started));
+    json_object_object_add(msg->legacy_json, "tasks_left", queuereader_legacy_tasks_left(msg));
+    
+    default_msg = msg;
+    return (*default_message_cb)(msg->legacy_json, cbarg);
+}
+
+void queuereader_finish_message(int return_code)
+{
+    if (default_msg) {
+        queuereader_finish(default_msg, return_code);
+    }
+}
+
+void queuereader_finish_task_by_name(const char *finished_task)
+{
+    if (default_msg) {
+        queuereader_msg_finish_task(default_msg, finished_task);
+        json_object_object_add(default_msg->legacy_json, "tasks_left", queuereader_legacy_tasks_left(default_msg));
+    }
+}
+
+void queuereader_init(struct json_object *tasks,
                       const char *source_address, int source_port, const char *path,
                       int (*message_cb)(struct json_object *json_msg, void *arg),
                       void (*error_cb)(int status_code, void *arg),
                       void *cbarg)
 {
-    int timeout_seconds = (sleeptime_queue_empty_ms * 1000) / 1000000;
-    int timeout_microseconds = (sleeptime_queue_empty_ms * 1000) - (timeout_seconds * 1000000);
-    
-    sleeptime_queue_empty_tv.tv_sec = timeout_seconds;
-    sleeptime_queue_empty_tv.tv_usec = timeout_microseconds;
-    
     signal(SIGINT, queuereader_termination_handler);
     signal(SIGQUIT, queuereader_termination_handler);
     signal(SIGTERM, queuereader_termination_handler);
     signal(SIGHUP, queuereader_termination_handler);
     
-    if (!current_base) {
-        event_init();
-    }
-    
-    data = calloc(1, sizeof(struct GlobalData));
-    data->message_cb = message_cb;
-    data->error_cb = error_cb;
-    data->cbarg = cbarg;
-    data->source_address = source_address;
-    data->source_port = source_port;
-    data->path = path;
-    data->tasks = tasks;
-    data->max_tries = max_tries;
-    
-    queuereader_trigger_source_request(sleeptime_queue_empty_tv.tv_sec, sleeptime_queue_empty_tv.tv_usec);
+    default_message_cb = message_cb;
+    default_reader = new_queuereader(tasks, source_address, source_port, path, queuereader_default_message_cb, error_cb, cbarg);
+    queuereader_schedule_fetch(default_reader, sleeptime_queue_empty_ms);
 }
 
 int queuereader_main(struct json_object *tasks,
@@ -315,5 +826,7 @@ void queuereader_run(void)
 
 void queuereader_free(void)
 {
-    free(data);
+    free_queuereader(default_reader);
+    default_reader = NULL;
+    default_msg = NULL;
 }
@@ -10,6 +10,8 @@
 #include <time.h>
 #include <simplehttp/simplehttp.h>
 #include <json/json.h>
+#include "controller.h"
+#include "envelope.h"
 
 #define QR_CONT                     0
 #define QR_EMPTY                    1
@@ -19,6 +21,37 @@
 #define QR_REQUEUE_WITHOUT_BACKOFF  5
 #define QR_REQUEUE_WITHOUT_DELAY    6
 
+struct queuereader;
+struct queuereader_msg;
+
+struct queuereader_stats {
+    uint64_t fetches;
+    uint64_t messages;
+    uint64_t finished;
+    uint64_t requeued;
+    uint64_t requeue_posts;
+    uint64_t errors;
+    struct qr_controller_stats controller;
+};
+
+struct queuereader *new_queuereader(struct json_object *tasks,
+                                    const char *source_address, int source_port, const char *path,
+                                    int (*message_cb)(struct queuereader_msg *msg, void *arg),
+                                    void (*error_cb)(int status_code, void *arg),
+                                    void *cbarg);
+void queuereader_set_window(struct queuereader *reader, int window);
+void queuereader_set_target_latency_ms(struct queuereader *reader, int milliseconds);
+void queuereader_start(struct queuereader *reader);
+void queuereader_finish(struct queuereader_msg *msg, int return_code);
+const char *queuereader_msg_data(struct queuereader_msg *msg, size_t *len);
+struct json_object *queuereader_msg_json(struct queuereader_msg *msg);
+int queuereader_msg_tries(struct queuereader_msg *msg);
+time_t queuereader_msg_started(struct queuereader_msg *msg);
+int queuereader_msg_has_task(struct queuereader_msg *msg, const char *task);
+void queuereader_msg_finish_task(struct queuereader_msg *msg, const char *finished_task);
+void queuereader_get_stats(struct queuereader *reader, struct queuereader_stats *stats);
+void queuereader_stats_json(struct queuereader *reader, struct evbuffer *evb);
+void free_queuereader(struct queuereader *reader);
 
 int queuereader_main(struct json_object *tasks,
                      const char *source_address, int source_port, const char *path,
@@ -34,7 +67,11 @@ void queuereader_init(struct json_object *tasks,
                       void *cbarg);
 void queuereader_finish_message(int return_code);
 void queuereader_set_sleeptime_queue_empty_ms(int milliseconds);
+void queuereader_set_mget_items(int items);
+void queuereader_set_requeue_interval_ms(int milliseconds);
+void queuereader_set_requeue_max_bytes(size_t bytes);
 struct json_object *queuereader_copy_tasks(struct json_object *input_array);
+char *queuereader_join_tasks(struct json_object *tasks);
 void queuereader_finish_task_by_name(const char *finished_task);
 
 #endif
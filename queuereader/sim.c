@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "controller.h"
+
+/*
+ * simulates a queuereader against a stand-in queue and downstream, 1ms per
+ * tick, comparing the fixed policy (power of two second backoff, 500ms empty
+ * queue sleep, fixed window) with the AIMD controller.
+ *
+ * load: 2000 msg/s, with a 5000 msg/s burst from 20s to 30s
+ * downstream: 5ms per message, plus 0.5ms for every message in flight past
+ *   16 (so throughput peaks around 16 outstanding), 0.1% of messages fail,
+ *   every message fails for 50ms at 45s and for 2s at 70s
+ * fetches take 1ms (one round trip)
+ *
+ * usage: sim [seconds] [window] [target latency ms]
+ */
+
+#define FETCH_RTT_MS    1
+#define MAX_QUEUE       (1 << 22)
+#define MAX_WINDOW      1024
+
+enum policy { FIXED, AIMD };
+
+struct inflight {
+    int done_at;
+    int enqueued_at;
+    int started_at;
+};
+
+struct sim {
+    enum policy policy;
+    int now;
+    // the stand-in queue; enqueue times in a ring
+    int *queue;
+    int head;
+    int depth;
+    int max_depth;
+    double arrival_credit;
+    // the reader
+    struct qr_controller *controller;
+    int window;
+    int backoff_counter;
+    int queue_empty;
+    int next_fetch_at;
+    int fetch_done_at;
+    int fetch_items;
+    struct inflight inflight[MAX_WINDOW];
+    int outstanding;
+    // results
+    unsigned int seed;
+    int processed;
+    int failures;
+    int fetches;
+    int empty_fetches;
+    int *latency_histogram;
+    double latency_total;
+    int max_window_used;
+};
+
+static int sim_rand(struct sim *s)
+{
+    s->seed = s->seed * 1103515245 + 12345;
+    return (s->seed >> 16) & 0x7fff;
+}
+
+static void enqueue(struct sim *s, int enqueued_at)
+{
+    s->queue[(s->head + s->depth) % MAX_QUEUE] = enqueued_at;
+    s->depth++;
+    if (s->depth > s->max_depth) {
+        s->max_depth = s->depth;
+    }
+}
+
+static int dequeue(struct sim *s)
+{
+    int enqueued_at = s->queue[s->head];
+    
+    s->head = (s->head + 1) % MAX_QUEUE;
+    s->depth--;
+    return enqueued_at;
+}
+
+static int arrival_rate(int now)
+{
+    return (now >= 20000 && now < 30000) ? 5000 : 2000;
+}
+
+static int downstream_fails(struct sim *s, int now)
+{
+    if ((now >= 45000 && now < 45050) || (now >= 70000 && now < 72000)) {
+        return 1;
+    }
+    return sim_rand(s) < 33;
+}
+
+static int downstream_latency(int outstanding)
+{
+    return 5 + (outstanding > 16 ? (outstanding - 16) / 2 : 0);
+}
+
+/*
+ * when the next fetch happens, the most recent call wins like
+ * queuereader_schedule_fetch()
+ */
+static void schedule_fetch(struct sim *s)
+{
+    int delay_ms, poll_ms;
+    
+    if (s->policy == FIXED) {
+        delay_ms = s->queue_empty ? 500 : (s->backoff_counter ? (1 << s->backoff_counter) * 1000 : 0);
+    } else {
+        delay_ms = qr_controller_delay_ms(s->controller);
+        poll_ms = qr_controller_poll_ms(s->controller);
+        if (s->queue_empty && poll_ms > delay_ms) {
+            delay_ms = poll_ms;
+        }
+    }
+    s->next_fetch_at = s->now + delay_ms;
+}
+
+static int current_window(struct sim *s)
+{
+    return s->policy == FIXED ? s->window : qr_controller_window(s->controller);
+}
+
+static void finish(struct sim *s, struct inflight *m)
+{
+    int latency;
+    
+    if (downstream_fails(s, s->now)) {
+        s->failures++;
+        if (s->policy == FIXED) {
+            s->backoff_counter = s->backoff_counter < 8 ? s->backoff_counter + 1 : 8;
+        } else {
+            qr_controller_failure(s->controller);
+        }
+        enqueue(s, m->enqueued_at);
+    } else {
+        s->processed++;
+        latency = s->now - m->enqueued_at;
+        s->latency_total += latency;
+        s->latency_histogram[latency]++;
+        if (s->policy == FIXED) {
+            s->backoff_counter = s->backoff_counter > 0 ? s->backoff_counter - 1 : 0;
+        } else {
+            qr_controller_success(s->controller, s->now - m->started_at);
+        }
+    }
+    // a finished message isn't a short fetch
+    s->queue_empty = 0;
+    schedule_fetch(s);
+}
+
+static void fetched(struct sim *s)
+{
+    int i, count = 0;
+    struct inflight *m;
+    
+    while (count < s->fetch_items && s->depth) {
+        m = &s->inflight[s->outstanding++];
+        m->enqueued_at = dequeue(s);
+        m->started_at = s->now;
+        m->done_at = s->now + downstream_latency(s->outstanding);
+        count++;
+    }
+    for (i = 0; i < s->outstanding; i++) {
+        s->inflight[i].done_at = s->inflight[i].started_at + downstream_latency(s->outstanding);
+    }
+    if (s->outstanding > s->max_window_used) {
+        s->max_window_used = s->outstanding;
+    }
+    if (count == 0) {
+        s->empty_fetches++;
+    }
+    if (s->policy == AIMD) {
+        qr_controller_fetched(s->controller, s->fetch_items, count);
+    }
+    s->queue_empty = count < s->fetch_items;
+    schedule_fetch(s);
+}
+
+static void run(struct sim *s, int duration_ms)
+{
+    int i;
+    
+    for (s->now = 0; s->now < duration_ms; s->now++) {
+        s->arrival_credit += arrival_rate(s->now) / 1000.0;
+        while (s->arrival_credit >= 1) {
+            enqueue(s, s->now);
+            s->arrival_credit -= 1;
+        }
+        
+        for (i = 0; i < s->outstanding;) {
+            if (s->inflight[i].done_at <= s->now) {
+                struct inflight m = s->inflight[i];
+                s->inflight[i] = s->inflight[--s->outstanding];
+                finish(s, &m);
+            } else {
+                i++;
+            }
+        }
+        
+        if (s->fetch_done_at && s->now >= s->fetch_done_at) {
+            s->fetch_done_at = 0;
+            fetched(s);
+        }
+        
+        if (!s->fetch_done_at && s->now >= s->next_fetch_at && s->outstanding < current_window(s)) {
+            s->fetches++;
+            s->fetch_items = current_window(s) - s->outstanding;
+            s->fetch_done_at = s->now + FETCH_RTT_MS;
+        }
+    }
+}
+
+static void report(const char *name, struct sim *s, int duration_ms)
+{
+    int i, n = 0, p50 = 0, p99 = 0, max = 0;
+    
+    for (i = 0; i < duration_ms; i++) {
+        if (s->latency_histogram[i]) {
+            n += s->latency_histogram[i];
+            if (!p50 && n >= s->processed / 2) {
+                p50 = i;
+            }
+            if (!p99 && n >= s->processed * 0.99) {
+                p99 = i;
+            }
+            max = i;
+        }
+    }
+    fprintf(stdout, "%-10s %10d %8d %9.1f %8d %8d %8d %10d %8d %8d\n", name,
+            s->processed, s->failures, s->processed ? s->latency_total / s->processed : 0,
+            p50, p99, max, s->max_depth, s->depth, s->fetches);
+}
+
+static struct sim *new_sim(enum policy policy, int window, int target_latency_ms, int duration_ms)
+{
+    struct sim *s;
+    struct qr_controller_config config;
+    
+    s = calloc(1, sizeof(struct sim));
+    s->policy = policy;
+    s->window = window;
+    s->seed = 1;
+    s->queue = malloc(MAX_QUEUE * sizeof(int));
+    s->latency_histogram = calloc(duration_ms, sizeof(int));
+    qr_controller_default_config(&config);
+    config.max_window = window;
+    config.target_latency_ms = target_latency_ms;
+    s->controller = new_qr_controller(&config);
+    return s;
+}
+
+static void free_sim(struct sim *s)
+{
+    free_qr_controller(s->controller);
+    free(s->latency_histogram);
+    free(s->queue);
+    free(s);
+}
+
+int main(int argc, char **argv)
+{
+    int duration_ms = (argc > 1 ? atoi(argv[1]) : 120) * 1000;
+    int window = argc > 2 ? atoi(argv[2]) : 32;
+    int target_latency_ms = argc > 3 ? atoi(argv[3]) : 10;
+    struct sim *s;
+    
+    if (window > MAX_WINDOW) {
+        window = MAX_WINDOW;
+    }
+    
+    fprintf(stdout, "%d seconds, window %d, target latency %dms\n", duration_ms / 1000, window, target_latency_ms);
+    fprintf(stdout, "%-10s %10s %8s %9s %8s %8s %8s %10s %8s %8s\n", "policy",
+            "processed", "failed", "mean ms", "p50 ms", "p99 ms", "max ms", "max depth", "depth", "fetches");
+    
+    s = new_sim(FIXED, window, target_latency_ms, duration_ms);
+    run(s, duration_ms);
+    report("fixed", s, duration_ms);
+    free_sim(s);
+    
+    s = new_sim(AIMD, window, target_latency_ms, duration_ms);
+    run(s, duration_ms);
+    report("aimd", s, duration_ms);
+    free_sim(s);
+    
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "queuereader.h"
+
+/*
+ * a reader against a stub simplequeue (an evhttp server in the same event
+ * loop). every message is requeued once, then succeeds. a payload with
+ * newlines in it has to come back whole, so it can't go through /mput. the
+ * first /mput fails and has to be retried.
+ *
+ * usage: test_queuereader
+ */
+
+#define MULTILINE_PAYLOAD "{\"a\": 1,\n \"b\": 2}\nthird line"
+#define SINGLE_PAYLOAD "one line"
+#define MAX_QUEUED 16
+
+static char *queued[MAX_QUEUED];
+static int queued_count = 0;
+static int put_count = 0;
+static int mput_lines = 0;
+static int mput_requests = 0;
+static int multiline_seen = 0;
+static int single_seen = 0;
+
+static void queue_push(const char *data, size_t len)
+{
+    assert(queued_count < MAX_QUEUED);
+    queued[queued_count++] = strndup(data, len);
+}
+
+/*
+ * the part of a simplequeue the reader uses: /get, /put?data= and a /mput
+ * body with one message per line
+ */
+static void stub_queue_cb(struct evhttp_request *req, void *arg)
+{
+    struct evbuffer *evb;
+    struct evkeyvalq args;
+    const char *uri, *data, *line, *end, *eol;
+    
+    evb = evbuffer_new();
+    uri = evhttp_request_uri(req);
+    if (strncmp(uri, "/get", 4) == 0) {
+        if (queued_count) {
+            evbuffer_add_printf(evb, "%s", queued[0]);
+            free(queued[0]);
+            memmove(queued, queued + 1, --queued_count * sizeof(char *));
+        }
+    } else if (strncmp(uri, "/put", 4) == 0) {
+        evhttp_parse_query(uri, &args);
+        data = evhttp_find_header(&args, "data");
+        assert(data);
+        queue_push(data, strlen(data));
+        evhttp_clear_headers(&args);
+        put_count++;
+    } else if (strncmp(uri, "/mput", 5) == 0) {
+        if (mput_requests++ == 0) {
+            evhttp_send_reply(req, 500, "Internal Server Error", evb);
+            evbuffer_free(evb);
+            return;
+        }
+        line = (const char *)EVBUFFER_DATA(req->input_buffer);
+        end = line + EVBUFFER_LENGTH(req->input_buffer);
+        while (line < end) {
+            eol = memchr(line, '\n', end - line);
+            if (!eol) {
+                eol = end;
+            }
+            if (eol > line) {
+                queue_push(line, eol - line);
+                mput_lines++;
+            }
+            line = eol + 1;
+        }
+    } else {
+        evhttp_send_reply(req, 404, "Not Found", evb);
+        evbuffer_free(evb);
+        return;
+    }
+    evhttp_send_reply(req, 200, "OK", evb);
+    evbuffer_free(evb);
+}
+
+/*
+ * requeue each payload the first time it's seen
+ */
+static int message_cb(struct queuereader_msg *msg, void *arg)
+{
+    const char *data;
+    size_t len;
+    int *seen;
+    
+    data = queuereader_msg_data(msg, &len);
+    if (len == strlen(MULTILINE_PAYLOAD) && memcmp(data, MULTILINE_PAYLOAD, len) == 0) {
+        seen = &multiline_seen;
+    } else {
+        assert(len == strlen(SINGLE_PAYLOAD) && memcmp(data, SINGLE_PAYLOAD, len) == 0);
+        seen = &single_seen;
+    }
+    
+    if ((*seen)++ == 0) {
+        return QR_REQUEUE_WITHOUT_DELAY;
+    }
+    if (multiline_seen == 2 && single_seen == 2) {
+        event_loopexit(NULL);
+    }
+    return QR_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    struct queuereader *reader;
+    struct event_base *base;
+    struct evhttp *httpd;
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    struct timeval tv = {5, 0};
+    int fd;
+    
+    base = event_init();
+    init_async_connection_pool(0);
+    
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&sin, &sinlen) == 0);
+    assert(listen(fd, 16) == 0);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    httpd = evhttp_new(base);
+    assert(evhttp_accept_socket(httpd, fd) == 0);
+    evhttp_set_gencb(httpd, stub_queue_cb, NULL);
+    
+    queue_push(MULTILINE_PAYLOAD, strlen(MULTILINE_PAYLOAD));
+    queue_push(SINGLE_PAYLOAD, strlen(SINGLE_PAYLOAD));
+    
+    queuereader_set_sleeptime_queue_empty_ms(10);
+    queuereader_set_requeue_interval_ms(10);
+    reader = new_queuereader(NULL, "127.0.0.1", ntohs(sin.sin_port), "/get", message_cb, NULL, NULL);
+    queuereader_start(reader);
+    // fail rather than hang if a message never comes back
+    event_loopexit(&tv);
+    event_dispatch();
+    
+    assert(multiline_seen == 2);
+    assert(single_seen == 2);
+    // only the message without newlines went through /mput
+    assert(put_count == 1);
+    assert(mput_lines == 1);
+    assert(mput_requests == 2);
+    
+    free_queuereader(reader);
+    evhttp_free(httpd);
+    free_async_connection_pool();
+    
+    fprintf(stdout, "ok\n");
+    return 0;
+}
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "async_simplehttp.h"
 
 // this is set as a parameter to init_async_connection_pool()
@@ -10,6 +12,10 @@ static int request_logging = 0;
 
 TAILQ_HEAD(, Connection) connection_pool;
 
+static void async_resolved_cb(struct simplehttp_addrs *addrs, void *arg);
+static void async_rebuild_cb(int fd, short what, void *arg);
+static int async_make_request(struct AsyncCallback *callback);
+
 void init_async_connection_pool(int enable_request_logging)
 {
     request_logging = enable_request_logging;
@@ -20,11 +26,21 @@ void free_async_connection_pool()
 {
     int i;
     struct Connection *conn;
+    struct AsyncCallback *callback;
     
     while ((conn = TAILQ_FIRST(&connection_pool))) {
         TAILQ_REMOVE(&connection_pool, conn, next);
+        simplehttp_resolve_cancel(async_resolved_cb, conn);
+        evtimer_del(&conn->rebuild_ev);
+        while ((callback = TAILQ_FIRST(&conn->pending))) {
+            TAILQ_REMOVE(&conn->pending, callback, pending_entries);
+            evhttp_request_free(callback->request);
+            free_async_callback(callback);
+        }
         for (i = 0; i < ASYNC_PER_HOST_CONNECTION_LIMIT; i++) {
-            evhttp_connection_free(conn->evcon[i]);
+            if (conn->evcon[i]) {
+                evhttp_connection_free(conn->evcon[i]);
+            }
         }
         free(conn->address);
         free(conn);
@@ -49,29 +65,150 @@ static void async_simplehttp_log(struct evhttp_request *req, struct AsyncCallbac
     }
 }
 
+/*
+ * the connections to a host are made once its address resolves (without
+ * blocking, see simplehttp_resolve()). until then this returns NULL with
+ * conn->resolving set, and requests wait on conn->pending. if it fails to
+ * resolve, the next request tries again.
+ *
+ * once the address's TTL is up the next request looks it up again, still
+ * going out on the old connections meanwhile. if the address changed they
+ * are replaced as soon as the requests on them finish, with new requests
+ * waiting on conn->pending (conn->stale set) until then.
+ */
 struct evhttp_connection *get_connection(const char *address, int port, struct Connection **store_conn)
 {
     struct Connection *conn;
-    int i;
+    int found = 0;
     
     TAILQ_FOREACH(conn, &connection_pool, next) {
         if ((strcmp(conn->address, address) == 0) && (conn->port == port)) {
-            *store_conn = conn;
-            return conn->evcon[conn->next_evcon++ % ASYNC_PER_HOST_CONNECTION_LIMIT];
+            found = 1;
+            break;
         }
     }
-    conn = malloc(sizeof(struct Connection));
-    conn->address = strdup(address);
-    conn->port = port;
-    conn->next_evcon = 0;
+    if (!found) {
+        conn = calloc(1, sizeof(struct Connection));
+        conn->address = strdup(address);
+        conn->port = port;
+        conn->next_evcon = 0;
+        evtimer_set(&conn->rebuild_ev, async_rebuild_cb, conn);
+        TAILQ_INIT(&conn->pending);
+        TAILQ_INSERT_TAIL(&connection_pool, conn, next);
+    }
+    *store_conn = conn;
+    
+    if (!conn->resolving && !conn->stale &&
+            (!conn->evcon[0] || (conn->expires && time(NULL) >= conn->expires))) {
+        conn->resolving = 1;
+        // cached and numeric addresses resolve right away
+        simplehttp_resolve(address, async_resolved_cb, conn);
+    }
+    if (!conn->evcon[0] || conn->stale) {
+        return NULL;
+    }
+    
+    return conn->evcon[conn->next_evcon++ % ASYNC_PER_HOST_CONNECTION_LIMIT];
+}
+
+/*
+ * send the requests that waited for the address, or fail them if there are
+ * no connections to send them on
+ */
+static void async_send_pending(struct Connection *conn)
+{
+    struct AsyncCallback *callback;
+    
+    while ((callback = TAILQ_FIRST(&conn->pending))) {
+        TAILQ_REMOVE(&conn->pending, callback, pending_entries);
+        if (conn->evcon[0]) {
+            callback->evcon = conn->evcon[conn->next_evcon++ % ASYNC_PER_HOST_CONNECTION_LIMIT];
+            if (evhttp_make_request(callback->evcon, callback->request, callback->method, callback->path) == 0) {
+                conn->outstanding++;
+                continue;
+            }
+            AS_DEBUG("*** request failed for source %s:%d%s ***\n", conn->address, conn->port, callback->path);
+            callback->evcon = NULL;
+        }
+        // it never went out, finish it as a failed request
+        evhttp_request_free(callback->request);
+        finish_async_request(NULL, callback);
+    }
+}
+
+/*
+ * (re)make the connections to conn->ip. there must be no requests
+ * outstanding on the old ones, evhttp_connection_free() drops them
+ */
+static void async_rebuild_connections(struct Connection *conn)
+{
+    int i;
+    
+    AS_DEBUG("connecting to %s at %s\n", conn->address, conn->ip);
     for (i = 0; i < ASYNC_PER_HOST_CONNECTION_LIMIT; i++) {
-        conn->evcon[i] = evhttp_connection_new(address, port);
+        if (conn->evcon[i]) {
+            evhttp_connection_free(conn->evcon[i]);
+        }
+        conn->evcon[i] = evhttp_connection_new(conn->ip, conn->port);
         evhttp_connection_set_retries(conn->evcon[i], 0);
     }
-    TAILQ_INSERT_TAIL(&connection_pool, conn, next);
-    *store_conn = conn;
+    conn->stale = 0;
+    async_send_pending(conn);
+}
+
+static void async_rebuild_cb(int fd, short what, void *arg)
+{
+    async_rebuild_connections((struct Connection *)arg);
+}
+
+/*
+ * evhttp connects by itself, to a single address, so the numeric address
+ * is handed to it; IPv4 first as that's the family it was always given
+ */
+static void async_resolved_cb(struct simplehttp_addrs *addrs, void *arg)
+{
+    struct Connection *conn = (struct Connection *)arg;
+    struct sockaddr_storage *ss = NULL;
+    char ip[INET6_ADDRSTRLEN];
+    int i;
+    
+    conn->resolving = 0;
+    for (i = 0; i < addrs->count; i++) {
+        if (!ss || addrs->addrs[i].ss_family == AF_INET) {
+            ss = &addrs->addrs[i];
+            if (ss->ss_family == AF_INET) {
+                break;
+            }
+        }
+    }
+    
+    if (ss) {
+        if (ss->ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)ss)->sin_addr, ip, sizeof(ip));
+        } else {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ss)->sin6_addr, ip, sizeof(ip));
+        }
+        AS_DEBUG("resolved %s to %s\n", conn->address, ip);
+        conn->expires = addrs->expires;
+        if (!conn->evcon[0] || strcmp(ip, conn->ip) != 0) {
+            strcpy(conn->ip, ip);
+            conn->stale = 1;
+        }
+    } else {
+        fprintf(stderr, "ERROR: failed to resolve %s\n", conn->address);
+        // keep using the old address (if any) until the failure expires
+        conn->expires = addrs->expires;
+    }
     
-    return conn->evcon[conn->next_evcon % ASYNC_PER_HOST_CONNECTION_LIMIT];
+    if (conn->stale) {
+        if (conn->outstanding) {
+            AS_DEBUG("%s moved to %s, waiting for %d requests\n", conn->address, conn->ip, conn->outstanding);
+            return;
+        }
+        async_rebuild_connections(conn);
+        return;
+    }
+    async_send_pending(conn);
 }
 
 struct AsyncCallbackGroup *new_async_callback_group(struct evhttp_request *req,
@@ -126,6 +263,8 @@ struct AsyncCallback *new_async_request_with_body(int request_method, const char
     callback->callback_group = NULL;
     callback->cb = cb;
     callback->cb_arg = cb_arg;
+    callback->method = request_method;
+    callback->path = strdup(path);
     
     AS_DEBUG("new_async_callback to %s:%d (%p)\n", address, port, callback);
     
@@ -144,10 +283,27 @@ struct AsyncCallback *new_async_request_with_body(int request_method, const char
         evbuffer_add(callback->request->output_buffer, body, strlen(body));
     }
     
-    AS_DEBUG("calling evhttp_make_request to %s (%p)\n", path, callback->request);
+    if (!callback->evcon && (callback->conn->resolving || callback->conn->stale)) {
+        AS_DEBUG("waiting for %s to resolve (%p)\n", address, callback->request);
+        TAILQ_INSERT_TAIL(&callback->conn->pending, callback, pending_entries);
+        return callback;
+    }
+    
+    if (async_make_request(callback) == -1) {
+        return NULL;
+    }
+    
+    return callback;
+}
+
+static int async_make_request(struct AsyncCallback *callback)
+{
+    AS_DEBUG("calling evhttp_make_request to %s (%p)\n", callback->path, callback->request);
     
-    if (evhttp_make_request(callback->evcon, callback->request, request_method, path) == -1) {
-        AS_DEBUG("*** request failed for source %s:%d%s ***\n", address, port, path);
+    if (!callback->evcon ||
+            evhttp_make_request(callback->evcon, callback->request, callback->method, callback->path) == -1) {
+        AS_DEBUG("*** request failed for source %s:%d%s ***\n",
+                 callback->conn->address, callback->conn->port, callback->path);
         
         async_simplehttp_log(callback->request, callback);
         
@@ -157,13 +313,19 @@ struct AsyncCallback *new_async_request_with_body(int request_method, const char
             callback->cb(callback->request, callback->cb_arg);
         }
         
+        if (!callback->evcon) {
+            // evhttp never saw it
+            evhttp_request_free(callback->request);
+        }
+        
         // free the callback object
         free_async_callback(callback);
         
-        return NULL;
+        return -1;
     }
+    callback->conn->outstanding++;
     
-    return callback;
+    return 0;
 }
 
 int new_async_callback(struct AsyncCallbackGroup *callback_group, const char *address, int port,
@@ -184,6 +346,7 @@ int new_async_callback(struct AsyncCallbackGroup *callback_group, const char *ad
 void free_async_callback(struct AsyncCallback *callback)
 {
     AS_DEBUG("free_async_callback (%p)\n", callback);
+    free(callback->path);
     free(callback);
 }
 
@@ -191,6 +354,9 @@ void finish_async_request(struct evhttp_request *req, void *cb_arg)
 {
     struct AsyncCallback *callback = (struct AsyncCallback *)cb_arg;
     struct AsyncCallbackGroup *callback_group = callback->callback_group;
+    struct Connection *conn = callback->conn;
+    struct timeval tv = { 0, 0 };
+    int sent = callback->evcon != NULL;
     
     // NOTE: there's an edge case where req is NULL when libevent receives an invalid response
     // async_simplehttp_log handles this for us
@@ -220,6 +386,12 @@ void finish_async_request(struct evhttp_request *req, void *cb_arg)
     // free this object
     free_async_callback(callback);
     
+    if (sent && --conn->outstanding == 0 && conn->stale) {
+        // evhttp is still using the connection this came in on, replace
+        // them once it's done
+        evtimer_add(&conn->rebuild_ev, &tv);
+    }
+    
     if (callback_group) {
         // re-check if this callback_group needs to be freed
         free_async_callback_group(callback_group);
@@ -3,6 +3,7 @@
 
 #include <queue.h>
 #include <simplehttp.h>
+#include <netinet/in.h>
 
 #ifdef ASYNC_DEBUG
 #define AS_DEBUG(...) fprintf(stdout, __VA_ARGS__)
@@ -27,6 +28,10 @@ struct AsyncCallback {
     void *cb_arg;
     struct AsyncCallbackGroup *callback_group;
     TAILQ_ENTRY(AsyncCallback) entries;
+    // kept to send the request once the address resolves
+    int method;
+    char *path;
+    TAILQ_ENTRY(AsyncCallback) pending_entries;
 };
 
 struct AsyncCallbackGroup {
@@ -45,6 +50,15 @@ struct Connection {
     uint64_t next_evcon;
     char *address;
     int port;
+    int resolving;
+    // the address evcon connects to, and when to look it up again
+    char ip[INET6_ADDRSTRLEN];
+    time_t expires;
+    // the address changed, evcon is replaced once outstanding requests finish
+    int stale;
+    int outstanding;
+    struct event rebuild_ev;
+    TAILQ_HEAD(, AsyncCallback) pending;
     TAILQ_ENTRY(Connection) next;
 };
 
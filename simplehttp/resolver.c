@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <evdns.h>
+#include "simplehttp.h"
+#include "uthash.h"
+#include "utlist.h"
+
+#ifdef DEBUG
+#define _DEBUG(...) fprintf(stdout, __VA_ARGS__)
+#else
+#define _DEBUG(...) do {;} while (0)
+#endif
+
+// seconds
+#define RESOLVER_MIN_TTL 1
+#define RESOLVER_MAX_TTL 300
+#define RESOLVER_NEGATIVE_TTL 5
+// how long to wait for the AAAA answer once the A answer is in (RFC 8305)
+#define RESOLVER_DELAY_MS 50
+#define RESOLVER_HOSTS_FILE "/etc/hosts"
+
+struct resolver_waiter {
+    void (*cb)(struct simplehttp_addrs *addrs, void *arg);
+    void *arg;
+    struct resolver_waiter *next;
+};
+
+/*
+ * one per hostname, the cached answer and the callers waiting on it
+ */
+struct resolver_entry {
+    char *host;
+    struct in_addr v4[SIMPLEHTTP_RESOLVE_MAX_ADDRS];
+    int v4_count;
+    struct in6_addr v6[SIMPLEHTTP_RESOLVE_MAX_ADDRS];
+    int v6_count;
+    int ttl;
+    time_t expires;
+    int permanent;
+    int pending;
+    struct event delay_ev;
+    struct resolver_waiter *waiters;
+    UT_hash_handle hh;
+};
+
+static struct resolver_entry *resolver_cache = NULL;
+static int resolver_initialized = 0;
+
+static void resolver_add_address(struct simplehttp_addrs *addrs, int family, const void *addr)
+{
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    
+    if (addrs->count == SIMPLEHTTP_RESOLVE_MAX_ADDRS) {
+        return;
+    }
+    memset(&addrs->addrs[addrs->count], 0, sizeof(struct sockaddr_storage));
+    if (family == AF_INET) {
+        sin = (struct sockaddr_in *)&addrs->addrs[addrs->count];
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, addr, sizeof(struct in_addr));
+        addrs->lens[addrs->count] = sizeof(struct sockaddr_in);
+    } else {
+        sin6 = (struct sockaddr_in6 *)&addrs->addrs[addrs->count];
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, addr, sizeof(struct in6_addr));
+        addrs->lens[addrs->count] = sizeof(struct sockaddr_in6);
+    }
+    addrs->count++;
+}
+
+/*
+ * addresses alternate between families, IPv6 first, which is the order
+ * happy eyeballs wants to try them in
+ */
+static void resolver_entry_addrs(struct resolver_entry *entry, struct simplehttp_addrs *addrs)
+{
+    int i;
+    
+    addrs->count = 0;
+    addrs->expires = entry->permanent ? 0 : entry->expires;
+    for (i = 0; i < entry->v6_count || i < entry->v4_count; i++) {
+        if (i < entry->v6_count) {
+            resolver_add_address(addrs, AF_INET6, &entry->v6[i]);
+        }
+        if (i < entry->v4_count) {
+            resolver_add_address(addrs, AF_INET, &entry->v4[i]);
+        }
+    }
+}
+
+static struct resolver_entry *resolver_get_entry(const char *host)
+{
+    struct resolver_entry *entry;
+    
+    HASH_FIND_STR(resolver_cache, host, entry);
+    if (!entry) {
+        entry = calloc(1, sizeof(struct resolver_entry));
+        entry->host = strdup(host);
+        HASH_ADD_KEYPTR(hh, resolver_cache, entry->host, strlen(entry->host), entry);
+    }
+    
+    return entry;
+}
+
+/*
+ * entries from the hosts file never expire and are never looked up
+ */
+static void resolver_load_hosts(const char *filename)
+{
+    struct resolver_entry *entry;
+    struct in_addr v4;
+    struct in6_addr v6;
+    char line[1024], *p, *name, *saveptr;
+    int family;
+    FILE *fp;
+    
+    if ((fp = fopen(filename, "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strtok_r(line, " \t\r\n", &saveptr)) == NULL) {
+            continue;
+        }
+        if (inet_pton(AF_INET, p, &v4) == 1) {
+            family = AF_INET;
+        } else if (inet_pton(AF_INET6, p, &v6) == 1) {
+            family = AF_INET6;
+        } else {
+            continue;
+        }
+        while ((name = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+            entry = resolver_get_entry(name);
+            entry->permanent = 1;
+            if (family == AF_INET && entry->v4_count < SIMPLEHTTP_RESOLVE_MAX_ADDRS) {
+                entry->v4[entry->v4_count++] = v4;
+            } else if (family == AF_INET6 && entry->v6_count < SIMPLEHTTP_RESOLVE_MAX_ADDRS) {
+                entry->v6[entry->v6_count++] = v6;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * nameserver is "ip[:port]", or NULL for the ones in /etc/resolv.conf.
+ * called on first use if it hasn't been already
+ */
+void init_simplehttp_resolver(const char *nameserver)
+{
+    if (resolver_initialized) {
+        free_simplehttp_resolver();
+    }
+    
+    evdns_init();
+    if (nameserver) {
+        evdns_clear_nameservers_and_suspend();
+        if (evdns_nameserver_ip_add(nameserver) != 0) {
+            fprintf(stderr, "ERROR: invalid nameserver %s\n", nameserver);
+        }
+        evdns_resume();
+    }
+    resolver_load_hosts(RESOLVER_HOSTS_FILE);
+    resolver_initialized = 1;
+}
+
+static void resolver_deliver(struct resolver_entry *entry)
+{
+    struct resolver_waiter *waiters, *waiter, *tmp;
+    struct simplehttp_addrs addrs;
+    
+    if (event_initialized(&entry->delay_ev)) {
+        evtimer_del(&entry->delay_ev);
+    }
+    
+    waiters = entry->waiters;
+    entry->waiters = NULL;
+    resolver_entry_addrs(entry, &addrs);
+    
+    _DEBUG("%s: %s has %d addresses\n", __FUNCTION__, entry->host, addrs.count);
+    
+    LL_FOREACH_SAFE(waiters, waiter, tmp) {
+        LL_DELETE(waiters, waiter);
+        (*waiter->cb)(&addrs, waiter->arg);
+        free(waiter);
+    }
+}
+
+static void resolver_delay_cb(int fd, short what, void *arg)
+{
+    resolver_deliver((struct resolver_entry *)arg);
+}
+
+static void resolver_answer(struct resolver_entry *entry, int result, char type, int count, int ttl, void *addresses)
+{
+    struct timeval tv = { 0, RESOLVER_DELAY_MS * 1000 };
+    int i;
+    
+    entry->pending--;
+    if (result == DNS_ERR_NONE) {
+        for (i = 0; i < count && i < SIMPLEHTTP_RESOLVE_MAX_ADDRS; i++) {
+            if (type == DNS_IPv4_A) {
+                entry->v4[entry->v4_count++].s_addr = ((uint32_t *)addresses)[i];
+            } else if (type == DNS_IPv6_AAAA) {
+                memcpy(&entry->v6[entry->v6_count++], &((struct in6_addr *)addresses)[i], sizeof(struct in6_addr));
+            }
+        }
+        if (count && (!entry->ttl || ttl < entry->ttl)) {
+            entry->ttl = ttl;
+        }
+    }
+    
+    if (entry->v4_count || entry->v6_count) {
+        entry->ttl = entry->ttl < RESOLVER_MIN_TTL ? RESOLVER_MIN_TTL :
+                     (entry->ttl > RESOLVER_MAX_TTL ? RESOLVER_MAX_TTL : entry->ttl);
+    } else {
+        entry->ttl = RESOLVER_NEGATIVE_TTL;
+    }
+    entry->expires = time(NULL) + entry->ttl;
+    
+    if (!entry->waiters) {
+        return;
+    }
+    if (!entry->pending || entry->v6_count) {
+        resolver_deliver(entry);
+    } else if (entry->v4_count) {
+        // give AAAA a moment so IPv6 gets a chance to go first
+        evtimer_set(&entry->delay_ev, resolver_delay_cb, entry);
+        evtimer_add(&entry->delay_ev, &tv);
+    }
+}
+
+static void resolver_ipv4_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+    resolver_answer((struct resolver_entry *)arg, result, type, count, ttl, addresses);
+}
+
+static void resolver_ipv6_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+    resolver_answer((struct resolver_entry *)arg, result, type, count, ttl, addresses);
+}
+
+/*
+ * resolve host without blocking. cb gets the addresses (with the port left
+ * at 0) or a count of 0 when the lookup failed. numeric addresses, hosts
+ * file entries and cached answers call cb before this returns. answers are
+ * cached for their TTL (RESOLVER_MIN_TTL to RESOLVER_MAX_TTL seconds),
+ * failures for RESOLVER_NEGATIVE_TTL.
+ */
+void simplehttp_resolve(const char *host, void (*cb)(struct simplehttp_addrs *addrs, void *arg), void *arg)
+{
+    struct resolver_entry *entry;
+    struct resolver_waiter *waiter;
+    struct simplehttp_addrs addrs;
+    struct in_addr v4;
+    struct in6_addr v6;
+    
+    addrs.count = 0;
+    addrs.expires = 0;
+    if (inet_pton(AF_INET, host, &v4) == 1) {
+        resolver_add_address(&addrs, AF_INET, &v4);
+        (*cb)(&addrs, arg);
+        return;
+    }
+    if (inet_pton(AF_INET6, host, &v6) == 1) {
+        resolver_add_address(&addrs, AF_INET6, &v6);
+        (*cb)(&addrs, arg);
+        return;
+    }
+    
+    if (!resolver_initialized) {
+        init_simplehttp_resolver(NULL);
+    }
+    
+    entry = resolver_get_entry(host);
+    if (entry->permanent || (time(NULL) < entry->expires && (!entry->pending || entry->v4_count || entry->v6_count))) {
+        resolver_entry_addrs(entry, &addrs);
+        (*cb)(&addrs, arg);
+        return;
+    }
+    
+    waiter = malloc(sizeof(struct resolver_waiter));
+    waiter->cb = cb;
+    waiter->arg = arg;
+    LL_APPEND(entry->waiters, waiter);
+    
+    if (!entry->pending) {
+        _DEBUG("%s: looking up %s\n", __FUNCTION__, host);
+        entry->v4_count = 0;
+        entry->v6_count = 0;
+        entry->ttl = 0;
+        entry->pending = 2;
+        if (evdns_resolve_ipv4(host, 0, resolver_ipv4_cb, entry) != 0) {
+            resolver_answer(entry, DNS_ERR_UNKNOWN, DNS_IPv4_A, 0, 0, NULL);
+        }
+        if (evdns_resolve_ipv6(host, 0, resolver_ipv6_cb, entry) != 0) {
+            resolver_answer(entry, DNS_ERR_UNKNOWN, DNS_IPv6_AAAA, 0, 0, NULL);
+        }
+    }
+}
+
+/*
+ * forget a pending simplehttp_resolve(), cb won't be called
+ */
+void simplehttp_resolve_cancel(void (*cb)(struct simplehttp_addrs *addrs, void *arg), void *arg)
+{
+    struct resolver_entry *entry, *tmp;
+    struct resolver_waiter *waiter, *tmp_waiter;
+    
+    HASH_ITER(hh, resolver_cache, entry, tmp) {
+        LL_FOREACH_SAFE(entry->waiters, waiter, tmp_waiter) {
+            if (waiter->cb == cb && waiter->arg == arg) {
+                LL_DELETE(entry->waiters, waiter);
+                free(waiter);
+            }
+        }
+    }
+}
+
+void free_simplehttp_resolver()
+{
+    struct resolver_entry *entry, *tmp;
+    struct resolver_waiter *waiter, *tmp_waiter;
+    
+    if (!resolver_initialized) {
+        return;
+    }
+    
+    evdns_shutdown(0);
+    HASH_ITER(hh, resolver_cache, entry, tmp) {
+        HASH_DELETE(hh, resolver_cache, entry);
+        if (event_initialized(&entry->delay_ev)) {
+            evtimer_del(&entry->delay_ev);
+        }
+        LL_FOREACH_SAFE(entry->waiters, waiter, tmp_waiter) {
+            free(waiter);
+        }
+        free(entry->host);
+        free(entry);
+    }
+    resolver_initialized = 0;
+}
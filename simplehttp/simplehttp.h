@@ -3,6 +3,8 @@
 
 #include "queue.h"
 #include "options.h"
+#include <sys/socket.h>
+#include <time.h>
 #include <event.h>
 #include <evhttp.h>
 
@@ -78,6 +80,23 @@ void free_async_callback_group(struct AsyncCallbackGroup *callback_group);
 void init_async_connection_pool(int enable_request_logging);
 void free_async_connection_pool();
 
+#define SIMPLEHTTP_RESOLVE_MAX_ADDRS 8
+
+struct simplehttp_addrs {
+    int count;
+    struct sockaddr_storage addrs[SIMPLEHTTP_RESOLVE_MAX_ADDRS];
+    socklen_t lens[SIMPLEHTTP_RESOLVE_MAX_ADDRS];
+    // when the answer should be looked up again, 0 if it never changes
+    time_t expires;
+};
+
+/* non-blocking DNS with a TTL cache (evdns), shared by async requests
+    and buffered_socket */
+void init_simplehttp_resolver(const char *nameserver);
+void simplehttp_resolve(const char *host, void (*cb)(struct simplehttp_addrs *addrs, void *arg), void *arg);
+void simplehttp_resolve_cancel(void (*cb)(struct simplehttp_addrs *addrs, void *arg), void *arg);
+void free_simplehttp_resolver();
+
 enum response_formats {json_format, txt_format};
 int get_argument_format(struct evkeyvalq *args);
 int get_int_argument(struct evkeyvalq *args, const char *key, int default_value);
@@ -88,4 +107,13 @@ void define_simplehttp_options();
 int simplehttp_parse_url(const char *endpoint, size_t endpoint_len, char **address, int *port, char **path);
 char *simplehttp_encode_uri(const char *uri);
 
+#define SIMPLEHTTP_WEBSOCKET_ACCEPT_LEN 29
+#define SIMPLEHTTP_WEBSOCKET_MAX_HEADER_LEN 10
+#define SIMPLEHTTP_WEBSOCKET_OPCODE_TEXT 0x1
+
+void simplehttp_sha1(const unsigned char *data, size_t len, unsigned char digest[20]);
+size_t simplehttp_base64_encode(const unsigned char *input, size_t len, char *out);
+int simplehttp_websocket_accept(const char *key, char *out);
+size_t simplehttp_websocket_frame_header(unsigned char opcode, uint64_t payload_len, unsigned char *out);
+
 #endif
@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "simplehttp.h"
+
+/*
+ * simplehttp_resolve() against a stub nameserver (a child process) that
+ * takes STUB_DELAY_MS to answer. a 10ms timer keeps ticking the whole time,
+ * if the lookup blocked the loop there'd be a gap as long as the delay.
+ *
+ * usage: test_resolver
+ */
+
+#define STUB_DELAY_MS 200
+#define STUB_TTL 2
+#define TICK_MS 10
+
+static double last_tick, max_gap;
+static struct event tick_ev;
+static struct event step_ev;
+static int step = 0;
+static int results = 0;
+static struct simplehttp_addrs last;
+
+static double now_ms()
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/*
+ * answer A queries with 10.0.0.1, AAAA with 2001:db8::1 and anything for
+ * "missing.example" with NXDOMAIN
+ */
+static void stub_answer(int fd, unsigned char *buf, int len, struct sockaddr_in *from, socklen_t fromlen)
+{
+    unsigned char out[512];
+    int qend = 12, qtype, n;
+    
+    while (qend < len && buf[qend]) {
+        qend += buf[qend] + 1;
+    }
+    qend++;
+    qtype = (buf[qend] << 8) | buf[qend + 1];
+    qend += 4;
+    
+    memcpy(out, buf, qend);
+    out[2] = 0x81;
+    out[3] = 0x80;
+    out[6] = out[7] = out[8] = out[9] = out[10] = out[11] = 0;
+    n = qend;
+    // evdns randomizes the case of the name it asks for
+    if (strncasecmp((char *)buf + 13, "missing", 7) == 0) {
+        out[3] = 0x83;
+    } else if (qtype == 1 || qtype == 28) {
+        out[7] = 1;
+        out[n++] = 0xc0;
+        out[n++] = 12;
+        out[n++] = 0;
+        out[n++] = qtype;
+        out[n++] = 0;
+        out[n++] = 1;
+        out[n++] = 0;
+        out[n++] = 0;
+        out[n++] = 0;
+        out[n++] = STUB_TTL;
+        out[n++] = 0;
+        if (qtype == 1) {
+            out[n++] = 4;
+            inet_pton(AF_INET, "10.0.0.1", out + n);
+            n += 4;
+        } else {
+            out[n++] = 16;
+            inet_pton(AF_INET6, "2001:db8::1", out + n);
+            n += 16;
+        }
+    }
+    sendto(fd, out, n, 0, (struct sockaddr *)from, fromlen);
+}
+
+static void stub_server(int fd)
+{
+    unsigned char buf[16][512];
+    struct sockaddr_in from[16];
+    socklen_t fromlen[16];
+    int len[16], i, n;
+    
+    while (1) {
+        fromlen[0] = sizeof(from[0]);
+        len[0] = recvfrom(fd, buf[0], sizeof(buf[0]), 0, (struct sockaddr *)&from[0], &fromlen[0]);
+        if (len[0] < 12) {
+            continue;
+        }
+        usleep(STUB_DELAY_MS * 1000);
+        // the A and AAAA queries come together, answer them together
+        for (n = 1; n < 16; n++) {
+            fromlen[n] = sizeof(from[n]);
+            len[n] = recvfrom(fd, buf[n], sizeof(buf[n]), MSG_DONTWAIT, (struct sockaddr *)&from[n], &fromlen[n]);
+            if (len[n] < 12) {
+                break;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            stub_answer(fd, buf[i], len[i], &from[i], fromlen[i]);
+        }
+    }
+}
+
+static void tick_cb(int fd, short what, void *arg)
+{
+    struct timeval tv = { 0, TICK_MS * 1000 };
+    double t = now_ms();
+    
+    if (t - last_tick > max_gap) {
+        max_gap = t - last_tick;
+    }
+    last_tick = t;
+    evtimer_add(&tick_ev, &tv);
+}
+
+static void resolved_cb(struct simplehttp_addrs *addrs, void *arg)
+{
+    memcpy(&last, addrs, sizeof(last));
+    results++;
+}
+
+static void step_cb(int fd, short what, void *arg);
+
+static void next_step(int ms)
+{
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    
+    step++;
+    evtimer_set(&step_ev, step_cb, NULL);
+    evtimer_add(&step_ev, &tv);
+}
+
+static void step_cb(int fd, short what, void *arg)
+{
+    char ip[INET6_ADDRSTRLEN];
+    
+    switch (step) {
+        case 1:
+            // the lookup went out, the loop kept running
+            simplehttp_resolve("test.example", resolved_cb, NULL);
+            assert(results == 0);
+            next_step(STUB_DELAY_MS + 100);
+            break;
+        case 2:
+            assert(results == 1);
+            assert(max_gap < STUB_DELAY_MS / 2);
+            // interleaved, IPv6 first
+            assert(last.count == 2);
+            assert(last.addrs[0].ss_family == AF_INET6);
+            assert(last.addrs[1].ss_family == AF_INET);
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&last.addrs[1])->sin_addr, ip, sizeof(ip));
+            assert(strcmp(ip, "10.0.0.1") == 0);
+        
+            // cached
+            simplehttp_resolve("test.example", resolved_cb, NULL);
+            assert(results == 2);
+            assert(last.count == 2);
+            assert(last.expires > time(NULL) && last.expires <= time(NULL) + STUB_TTL);
+        
+            // numeric, never looked up
+            simplehttp_resolve("127.0.0.1", resolved_cb, NULL);
+            assert(results == 3);
+            assert(last.count == 1 && last.addrs[0].ss_family == AF_INET);
+            assert(last.expires == 0);
+        
+            simplehttp_resolve("missing.example", resolved_cb, NULL);
+            assert(results == 3);
+            next_step(STUB_DELAY_MS + 100);
+            break;
+        case 3:
+            assert(results == 4);
+            assert(last.count == 0);
+            // failures are cached too
+            simplehttp_resolve("missing.example", resolved_cb, NULL);
+            assert(results == 5);
+            assert(last.count == 0);
+        
+            // a cancelled lookup doesn't call back
+            simplehttp_resolve("other.example", resolved_cb, NULL);
+            simplehttp_resolve_cancel(resolved_cb, NULL);
+            // let the TTL run out
+            next_step(STUB_TTL * 1000 + 100);
+            break;
+        case 4:
+            assert(results == 5);
+            simplehttp_resolve("test.example", resolved_cb, NULL);
+            assert(results == 5);
+            next_step(STUB_DELAY_MS + 100);
+            break;
+        case 5:
+            assert(results == 6);
+            assert(last.count == 2);
+            assert(max_gap < STUB_DELAY_MS / 2);
+            event_loopexit(NULL);
+            break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    char nameserver[64];
+    pid_t pid;
+    int fd;
+    
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&sin, &sinlen) == 0);
+    
+    if ((pid = fork()) == 0) {
+        stub_server(fd);
+        exit(0);
+    }
+    close(fd);
+    
+    event_init();
+    sprintf(nameserver, "127.0.0.1:%d", ntohs(sin.sin_port));
+    init_simplehttp_resolver(nameserver);
+    
+    last_tick = now_ms();
+    evtimer_set(&tick_ev, tick_cb, NULL);
+    tick_cb(0, 0, NULL);
+    next_step(0);
+    event_dispatch();
+    
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    free_simplehttp_resolver();
+    
+    fprintf(stdout, "max gap between %dms ticks: %.1fms\n", TICK_MS, max_gap);
+    fprintf(stdout, "ok\n");
+    return 0;
+}
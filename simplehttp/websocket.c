@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "simplehttp.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define ROL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct sha1_ctx {
+    uint32_t h[5];
+    uint64_t len;
+    unsigned char block[64];
+    size_t used;
+};
+
+static void sha1_transform(struct sha1_ctx *ctx, const unsigned char *p)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, tmp;
+    int i;
+    
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+               ((uint32_t)p[i * 4 + 2] << 8) | (uint32_t)p[i * 4 + 3];
+    }
+    for (i = 16; i < 80; i++) {
+        w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    
+    a = ctx->h[0];
+    b = ctx->h[1];
+    c = ctx->h[2];
+    d = ctx->h[3];
+    e = ctx->h[4];
+    
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        tmp = ROL32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL32(b, 30);
+        b = a;
+        a = tmp;
+    }
+    
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+}
+
+static void sha1_init(struct sha1_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xEFCDAB89;
+    ctx->h[2] = 0x98BADCFE;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xC3D2E1F0;
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+static void sha1_update(struct sha1_ctx *ctx, const unsigned char *data, size_t len)
+{
+    size_t n;
+    
+    ctx->len += len;
+    while (len) {
+        n = 64 - ctx->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->block + ctx->used, data, n);
+        ctx->used += n;
+        data += n;
+        len -= n;
+        if (ctx->used == 64) {
+            sha1_transform(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha1_final(struct sha1_ctx *ctx, unsigned char digest[20])
+{
+    uint64_t bits = ctx->len * 8;
+    unsigned char pad = 0x80;
+    unsigned char zero = 0;
+    unsigned char length[8];
+    int i;
+    
+    sha1_update(ctx, &pad, 1);
+    while (ctx->used != 56) {
+        sha1_update(ctx, &zero, 1);
+    }
+    for (i = 0; i < 8; i++) {
+        length[i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    sha1_update(ctx, length, 8);
+    
+    for (i = 0; i < 20; i++) {
+        digest[i] = (unsigned char)(ctx->h[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+void simplehttp_sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+    struct sha1_ctx ctx;
+    
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, len);
+    sha1_final(&ctx, digest);
+}
+
+/*
+ * base64 encode len bytes of input into out, which must have room
+ * for ((len + 2) / 3) * 4 + 1 bytes. returns the encoded length.
+ */
+size_t simplehttp_base64_encode(const unsigned char *input, size_t len, char *out)
+{
+    size_t i, j = 0;
+    uint32_t v;
+    
+    for (i = 0; i + 2 < len; i += 3) {
+        v = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        out[j++] = base64_chars[(v >> 18) & 0x3f];
+        out[j++] = base64_chars[(v >> 12) & 0x3f];
+        out[j++] = base64_chars[(v >> 6) & 0x3f];
+        out[j++] = base64_chars[v & 0x3f];
+    }
+    if (i < len) {
+        v = input[i] << 16;
+        if (i + 1 < len) {
+            v |= input[i + 1] << 8;
+        }
+        out[j++] = base64_chars[(v >> 18) & 0x3f];
+        out[j++] = base64_chars[(v >> 12) & 0x3f];
+        out[j++] = (i + 1 < len) ? base64_chars[(v >> 6) & 0x3f] : '=';
+        out[j++] = '=';
+    }
+    out[j] = '\0';
+    
+    return j;
+}
+
+/*
+ * compute the Sec-WebSocket-Accept value (RFC 6455) for a Sec-WebSocket-Key
+ * into out, which must have room for SIMPLEHTTP_WEBSOCKET_ACCEPT_LEN bytes.
+ * nothing is allocated.
+ */
+int simplehttp_websocket_accept(const char *key, char *out)
+{
+    struct sha1_ctx ctx;
+    unsigned char digest[20];
+    
+    if (key == NULL) {
+        return 0;
+    }
+    
+    sha1_init(&ctx);
+    sha1_update(&ctx, (const unsigned char *)key, strlen(key));
+    sha1_update(&ctx, (const unsigned char *)WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    sha1_final(&ctx, digest);
+    simplehttp_base64_encode(digest, sizeof(digest), out);
+    
+    return 1;
+}
+
+/*
+ * write a RFC 6455 frame header for an unmasked server to client frame
+ * into out (which must have room for 10 bytes). returns the header length.
+ */
+size_t simplehttp_websocket_frame_header(unsigned char opcode, uint64_t payload_len, unsigned char *out)
+{
+    int i;
+    
+    out[0] = 0x80 | (opcode & 0x0f);
+    if (payload_len < 126) {
+        out[1] = (unsigned char)payload_len;
+        return 2;
+    }
+    if (payload_len <= 0xffff) {
+        out[1] = 126;
+        out[2] = (unsigned char)(payload_len >> 8);
+        out[3] = (unsigned char)payload_len;
+        return 4;
+    }
+    out[1] = 127;
+    for (i = 0; i < 8; i++) {
+        out[2 + i] = (unsigned char)(payload_len >> (56 - i * 8));
+    }
+    return 10;
+}